@@ -3,5 +3,18 @@
 
 #include "numhop/Expression.h"
 #include "numhop/Helpfunctions.h"
+#include "numhop/NumberParsing.h"
+#include "numhop/ScriptReader.h"
+#include "numhop/Script.h"
+#include "numhop/JitExpression.h"
+#include "numhop/CodeEmitter.h"
+#include "numhop/Differentiation.h"
+#include "numhop/PreparedExpression.h"
+#include "numhop/TypedExpression.h"
+#include "numhop/ArrayEvaluation.h"
+#include "numhop/LookupTable.h"
+#include "numhop/TabulatedExpression.h"
+#include "numhop/FastMath.h"
+#include "numhop/CpuDispatch.h"
 
 #endif // NUMHOP_H
@@ -0,0 +1,16 @@
+#ifndef ARRAYEVALUATION_H
+#define ARRAYEVALUATION_H
+
+#include <vector>
+#include "Expression.h"
+
+namespace numhop {
+
+class Script;
+
+void evaluateElementWise(const Expression &expr, VariableStorage &rVariableStorage, std::vector<double> &rValues, bool &rEvalOK);
+void evaluateElementWise(const Script &script, VariableStorage &rVariableStorage, std::vector<double> &rValues, bool &rEvalOK);
+
+}
+
+#endif // ARRAYEVALUATION_H
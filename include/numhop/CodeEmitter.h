@@ -0,0 +1,58 @@
+#ifndef CODEEMITTER_H
+#define CODEEMITTER_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include "Expression.h"
+
+namespace numhop {
+
+class Script;
+
+//! @brief Generates standalone C source code from expressions and scripts
+//! @details The generated function has the signature double name(const double *in, double *out).
+//! Named values that are read before being assigned are inputs, assigned variables are outputs,
+//! the return value is the value of the last statement.
+class CCodeEmitter
+{
+public:
+    CCodeEmitter();
+
+    bool reserveNamedValue(const std::string &name, double value);
+
+    bool emitFunction(const std::string &functionName, const Expression &expr, std::string &rCode);
+    bool emitFunction(const std::string &functionName, const Script &script, std::string &rCode);
+    bool emitFunction(const std::string &functionName, const std::vector<const Expression*> &statements, std::string &rCode);
+
+    const std::vector<std::string> &inputNames() const;
+    const std::vector<std::string> &outputNames() const;
+
+    static std::string includes();
+
+private:
+    void collectVariables(const Expression &expr, std::map<std::string, bool> &rAssigned);
+    void addLocal(const std::string &name);
+    std::string emitExpression(const Expression &expr, int indent, bool &rOK);
+    std::string emitAssignment(const Expression &expr, int indent, bool &rOK);
+    std::string emitBinaryOperator(const Expression &expr, int indent, bool &rOK);
+    std::string emitConditional(const Expression &expr, int indent, bool &rOK);
+    std::string emitFunctionCall(const Expression &expr, int indent, bool &rOK);
+    std::string emitFold(const Expression &expr, int indent, bool &rOK);
+    std::string emitOperand(const Expression &expr, const Expression *pFollowing, int indent, bool &rOK);
+    std::string newTemporary();
+    std::string literal(double value) const;
+    void addLine(int indent, const std::string &line);
+
+    std::map<std::string, double> mReservedValues;
+    std::map<std::string, std::string> mLocalNames;
+    std::vector<std::string> mLocalOrder;
+    std::vector<std::string> mInputNames;
+    std::vector<std::string> mOutputNames;
+    std::string mBody;
+    size_t mNumTemporaries;
+};
+
+}
+
+#endif // CODEEMITTER_H
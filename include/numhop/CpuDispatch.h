@@ -0,0 +1,54 @@
+#ifndef CPUDISPATCH_H
+#define CPUDISPATCH_H
+
+#include <cstddef>
+#include "Expression.h"
+
+// On x86-64 with GCC or Clang the array kernels are compiled for each instruction set and selected at runtime.
+// AVX-512 includes fused multiply-add, it is disabled so that all levels give the same results.
+#if !defined(NUMHOP_NO_SIMD_DISPATCH) && (defined(__x86_64__) || defined(_M_X64)) && defined(__GNUC__)
+#define NUMHOP_SIMD_TARGETS
+#if defined(__clang__)
+#define NUMHOP_KERNEL_GENERIC
+#define NUMHOP_KERNEL_AVX2 __attribute__((target("avx2")))
+#define NUMHOP_KERNEL_AVX512 __attribute__((target("avx512f")))
+#else
+#define NUMHOP_KERNEL_GENERIC __attribute__((optimize("tree-vectorize")))
+#define NUMHOP_KERNEL_AVX2 __attribute__((target("avx2"), optimize("tree-vectorize")))
+#define NUMHOP_KERNEL_AVX512 __attribute__((target("avx512f"), optimize("tree-vectorize", "fp-contract=off")))
+#endif
+#else
+#define NUMHOP_KERNEL_GENERIC
+#endif
+
+namespace numhop {
+
+//! @brief The instruction sets used by the array kernels, in increasing order
+enum SimdLevelT {GenericSimdT, SSE2SimdT, AVX2SimdT, AVX512SimdT};
+
+SimdLevelT detectedSimdLevel();
+SimdLevelT simdLevel();
+bool setSimdLevel(SimdLevelT level);
+const char* simdLevelName(SimdLevelT level);
+
+typedef void(*ArrayArrayFunctionT)(const double *pA, const double *pB, size_t numValues, double *pOut);
+typedef void(*ArrayScalarFunctionT)(const double *pA, double b, size_t numValues, double *pOut);
+typedef void(*ScalarArrayFunctionT)(double a, const double *pB, size_t numValues, double *pOut);
+
+//! @brief The array kernels for one instruction set, the output may be one of the input arrays
+struct SimdKernels
+{
+    ArrayArrayFunctionT addArrays, subtractArrays, multiplyArrays, divideArrays;
+    ArrayScalarFunctionT addScalar, subtractScalar, multiplyScalar, divideScalar;
+    ScalarArrayFunctionT scalarSubtract, scalarDivide;
+    ArrayFunctionT exp, log, log10, sin, cos, tanh, atan;
+};
+
+const SimdKernels &simdKernels();
+
+// Implemented with the fast math functions, fills in the math kernels for an instruction set
+void selectFastMathKernels(SimdLevelT level, SimdKernels &rKernels);
+
+}
+
+#endif // CPUDISPATCH_H
@@ -0,0 +1,21 @@
+#ifndef DIFFERENTIATION_H
+#define DIFFERENTIATION_H
+
+#include <string>
+#include <vector>
+#include "Expression.h"
+
+namespace numhop {
+
+class Script;
+
+enum DifferentiationModeT {ForwardMode, ReverseMode};
+
+double evaluateWithGradient(const Expression &expr, VariableStorage &rVariableStorage, const std::vector<std::string> &variableNames,
+                            std::vector<double> &rGradient, bool &rEvalOK, DifferentiationModeT mode=ReverseMode);
+double evaluateWithGradient(const Script &script, VariableStorage &rVariableStorage, const std::vector<std::string> &variableNames,
+                            std::vector<double> &rGradient, bool &rEvalOK, DifferentiationModeT mode=ReverseMode);
+
+}
+
+#endif // DIFFERENTIATION_H
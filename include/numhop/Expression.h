@@ -5,58 +5,181 @@
 #include <list>
 #include <set>
 #include <vector>
+#include <map>
+#include <stdint.h>
 #include "VariableStorage.h"
 
 namespace numhop {
 
+class BinaryWriter;
+class BinaryReader;
+struct RegisteredFunction;
+struct PendingExpression;
+
 enum ExpressionOperatorT {AssignmentT, AdditionT, SubtractionT, MultiplicationT,
                           DivisionT, PowerT, LessThenT, GreaterThenT, OrT, AndT,
-                          ValueT, FunctionCallT, UndefinedT};
+                          ConditionalT, ValueT, FunctionCallT, UndefinedT};
+
+//! @brief How long chains of additions or multiplications are evaluated, see Expression::reassociateChains
+enum ChainEvaluationT {SequentialChainT, ReassociatedChainT, CompensatedChainT};
+//! @brief The default minimum number of terms or factors of a reassociated chain
+const size_t defaultMinChainLength = 8;
+
+//! @brief Values of shared subexpressions, reused during one evaluation of a script
+class EvaluationCache
+{
+public:
+    EvaluationCache();
+    void clear();
+    int addSlot(const std::set<std::string> &dependencies);
+    size_t numSlots() const;
+
+    void invalidateAll();
+    void invalidate(const std::string &variableName);
+    bool lookup(int slot, double &rValue) const;
+    void store(int slot, double value);
+
+    void write(BinaryWriter &rWriter) const;
+    bool read(BinaryReader &rReader);
+
+private:
+    std::vector<double> mValues;
+    std::vector<unsigned int> mGenerations;
+    unsigned int mGeneration;
+    std::map<std::string, std::vector<int> > mDependentSlots;
+};
 
 class Expression
 {
 public:
+    //! @brief The cheaper evaluation selected by reduceStrength()
+    enum ReductionT {NoReduction, IntegerPowerReduction, SquareRootReduction, ReciprocalSquareRootReduction, ReciprocalReduction};
+
     Expression();
     Expression(const Expression &other);
+    ~Expression();
     Expression(const std::string &exprString, ExpressionOperatorT op);
     Expression(const std::string &leftExprString, const std::string &rightExprString, ExpressionOperatorT op);
 
     Expression& operator= (const Expression &other);
+    void swap(Expression &other);
 
     bool empty() const;
     bool isValue() const;
     bool isNumericConstant() const;
     bool isNamedValue() const;
     bool isValid() const;
+    bool isConstant() const;
 
     const std::string &exprString() const;
     const std::string &leftExprString() const;
     const std::string &rightExprString() const;
     ExpressionOperatorT operatorType() const;
+    const std::list<Expression> &leftChildExpressions() const;
+    const std::list<Expression> &rightChildExpressions() const;
+    double numericConstantValue() const;
+    int functionId() const;
+    ChainEvaluationT chainEvaluation() const;
+    ReductionT reduction() const;
+    int reducedExponent() const;
+    double reducedReciprocal() const;
 
     double evaluate(VariableStorage &rVariableStorage, bool &rEvalOK) const;
+    double evaluate(VariableStorage &rVariableStorage, bool &rEvalOK, EvaluationCache *pCache) const;
     void extractNamedValues(std::set<std::string> &rNamedValues) const;
     void extractValidVariableNames(const VariableStorage &variableStorage, std::set<std::string> &rVariableNames) const;
     void replaceNamedValue(const std::string& oldName, const std::string& newName);
+    void reduceStrength(bool allowRoundingChanges=false);
+    size_t rewritePolynomials();
+    size_t reassociateChains(ChainEvaluationT chainEvaluation, size_t minChainLength=defaultMinChainLength);
+
+    uint64_t structuralHash() const;
+    bool isStructurallyEqual(const Expression &other) const;
+    bool isPure() const;
+    bool callsImpureFunction() const;
+    static size_t eliminateCommonSubexpressions(const std::vector<Expression*> &expressions, EvaluationCache &rCache);
 
     std::string print();
 
+    void write(BinaryWriter &rWriter) const;
+    bool read(BinaryReader &rReader, size_t numCacheSlots=0);
+
 protected:
+    friend struct PendingExpression;
+    struct EvaluationFrame;
+
     void commonConstructorCode();
+    void interpret(const std::string &exprString, ExpressionOperatorT op, std::vector<PendingExpression> &rPending);
+    void interpret(const std::string &leftExprString, const std::string &rightExprString, ExpressionOperatorT op, std::vector<PendingExpression> &rPending);
+    double evaluate(VariableStorage &rVariableStorage, bool &rEvalOK, EvaluationCache *pCache, size_t depth) const;
+    double evaluateNode(VariableStorage &rVariableStorage, bool &rEvalOK, EvaluationCache *pCache, size_t depth) const;
+    double evaluateChain(VariableStorage &rVariableStorage, bool &rEvalOK, EvaluationCache *pCache, size_t depth) const;
+    double evaluateIteratively(VariableStorage &rVariableStorage, bool &rEvalOK, EvaluationCache *pCache) const;
+    bool collectSharableSubexpressions(std::vector<Expression*> &rSubexpressions, bool &rHasNamedValues);
+    uint64_t structuralHash(std::map<const Expression*, uint64_t> &rHashes) const;
+    bool reducePower(const Expression &exponent, bool allowRoundingChanges);
+    double reducedPower(double base) const;
     void copyFromOther(const Expression &other);
+    void copyNodeFromOther(const Expression &other);
+    size_t rewritePolynomials(size_t depth);
+    void write(BinaryWriter &rWriter, const std::string &parentString, size_t &rParentPos) const;
+    bool read(BinaryReader &rReader, const std::string &parentString, size_t numCacheSlots, size_t depth);
 
     std::string mLeftExpressionString, mRightExpressionString;
     std::list<Expression> mLeftChildExpressions, mRightChildExpressions;
     bool mHadLeftOuterParanthesis, mHadRightOuterParanthesis;
     bool mIsNumericConstant, mIsNamedValue, mIsValid;
     int mFunctionId;
+    const RegisteredFunction *mpFunction;
     double mNumericConstantValue;
     ExpressionOperatorT mOperator;
+    ReductionT mReduction;
+    int mReducedExponent;
+    double mReducedReciprocal;
+    ChainEvaluationT mChainEvaluation;
+    int mCacheSlot;
 };
 
+//! @brief The maximum depth of an expression tree, deeper subexpressions are not interpreted and make the expression invalid
+//! @details Passes over the tree, such as print(), rewrites, saving and compilation, recurse once per level and use at most about
+//! 1.3 kB of call stack per level, so every pass over a tree at the limit fits in a 512 kB stack. Use PreparedExpression::prepare
+//! for expressions that are nested deeper.
+const size_t maxExpressionTreeDepth = 256;
+
 bool interpretExpressionStringRecursive(std::string exprString, std::list<Expression> &rExprList);
 bool interpretExpressionStringRecursive(std::string exprString, Expression &rExpr);
+bool interpretExpressionStringRecursive(const char *pExprString, size_t length, Expression &rExpr);
 std::vector<std::string> getRegisteredFunctionNames();
+int getFunctionId(const std::string &name, size_t numArgs);
+
+typedef double(*OneArgFunctionT)(double);
+typedef double(*TwoArgFunctionT)(double, double);
+typedef void(*ArrayFunctionT)(const double *pIn, size_t numValues, double *pOut);
+OneArgFunctionT getOneArgFunction(int functionId);
+TwoArgFunctionT getTwoArgFunction(int functionId);
+OneArgFunctionT getOneArgFunction(int functionId, bool fastMath);
+TwoArgFunctionT getTwoArgFunction(int functionId, bool fastMath);
+ArrayFunctionT getArrayFunction(int functionId, bool fastMath);
+
+//! @brief The maximum number of arguments of a registered function
+const size_t maxFunctionArguments = 16;
+
+typedef double(*NativeFunctionT)(const double *pArgs, size_t numArgs, void *pContext);
+
+//! @brief Base class for function objects that can be registered and called from expressions
+class NativeFunction
+{
+public:
+    virtual ~NativeFunction();
+    virtual double call(const double *pArgs, size_t numArgs) = 0;
+    virtual void callElementWise(const double *const *ppArgs, size_t numArgs, size_t numValues, double *pResult);
+};
+
+int registerFunction(const std::string &name, OneArgFunctionT pFunction);
+int registerFunction(const std::string &name, TwoArgFunctionT pFunction);
+int registerFunction(const std::string &name, size_t numArgs, NativeFunctionT pFunction, void *pContext=0);
+int registerFunction(const std::string &name, size_t numArgs, NativeFunction *pFunction);
+bool callFunctionElementWise(int functionId, const double *const *ppArgs, size_t numArgs, size_t numValues, double *pResult);
 
 }
 
@@ -0,0 +1,31 @@
+#ifndef FASTMATH_H
+#define FASTMATH_H
+
+#include <cstddef>
+#include "Expression.h"
+
+namespace numhop {
+
+// Approximations of built-in functions, used instead of the C library when fast math is enabled
+// in the variable storage. The error bounds (in units in the last place) are given for each function.
+// The array versions give the same results as the single value versions, the output may be the input array.
+double fastExp(double x);
+double fastLog(double x);
+double fastLog10(double x);
+double fastSin(double x);
+double fastCos(double x);
+double fastTanh(double x);
+double fastAtan(double x);
+double fastAtan2(double y, double x);
+
+void fastExpArray(const double *pIn, size_t numValues, double *pOut);
+void fastLogArray(const double *pIn, size_t numValues, double *pOut);
+void fastLog10Array(const double *pIn, size_t numValues, double *pOut);
+void fastSinArray(const double *pIn, size_t numValues, double *pOut);
+void fastCosArray(const double *pIn, size_t numValues, double *pOut);
+void fastTanhArray(const double *pIn, size_t numValues, double *pOut);
+void fastAtanArray(const double *pIn, size_t numValues, double *pOut);
+
+}
+
+#endif // FASTMATH_H
@@ -3,6 +3,7 @@
 
 #include <string>
 #include <list>
+#include <stdint.h>
 
 namespace numhop {
 
@@ -12,6 +13,7 @@ void stripLeadingTrailingWhitespaces(std::string &rString);
 bool stripLeadingTrailingParanthesis(std::string &rString, bool &rDidStrip);
 char stripInitialSign(std::string &rString);
 void stripInitialPlus(std::string &rString);
+uint64_t hashString(const char *pData, size_t size);
 
 template <typename ContainerT, typename KeyT>
 bool contains(const ContainerT& container, const KeyT& key)
@@ -0,0 +1,42 @@
+#ifndef JITEXPRESSION_H
+#define JITEXPRESSION_H
+
+#include <cstddef>
+#include "Expression.h"
+
+namespace numhop {
+
+//! @brief An expression compiled to native x86-64 machine code
+//! @details Variables are bound to fixed addresses in the variable storage when compiling, so the compiled code must
+//! only be evaluated with the same variable storage, and must be compiled again after VariableStorage::clearInternalVariables().
+//! If the expression can not be compiled (other architectures, or variables without direct access), the interpreter is used.
+//! Powers and divisions reduced by Expression::reduceStrength() are compiled to the reduced form, with the same results as the interpreter.
+class JitExpression
+{
+public:
+    JitExpression();
+    ~JitExpression();
+
+    bool compile(const Expression &expr, VariableStorage &rVariableStorage);
+    void clear();
+    bool isCompiled() const;
+    double evaluate(VariableStorage &rVariableStorage, bool &rEvalOK) const;
+
+    static bool isSupported();
+
+private:
+    // Not copyable, the object owns the executable memory
+    JitExpression(const JitExpression &other);
+    JitExpression& operator= (const JitExpression &other);
+
+    typedef double(*NativeFunctionT)();
+
+    Expression mExpression;
+    void *mpCode;
+    size_t mCodeSize;
+    NativeFunctionT mpFunction;
+};
+
+}
+
+#endif // JITEXPRESSION_H
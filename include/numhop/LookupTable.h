@@ -0,0 +1,57 @@
+#ifndef LOOKUPTABLE_H
+#define LOOKUPTABLE_H
+
+#include <string>
+#include <vector>
+#include "Expression.h"
+
+namespace numhop {
+
+//! @brief A one or two dimensional table with linear interpolation, called from expressions as a registered function
+//! @details Inputs outside of the breakpoints are clamped to the first or last breakpoint.
+//! Lookups through call() remember the last segment, so a registered table must not be evaluated from several threads at the same time.
+class LookupTable : public NativeFunction
+{
+public:
+    LookupTable();
+
+    bool setData(const std::vector<double> &breakpoints, const std::vector<double> &values);
+    bool setData(const std::vector<double> &firstBreakpoints, const std::vector<double> &secondBreakpoints, const std::vector<double> &values);
+    bool loadFromCsv(const char *pData, size_t size);
+    bool loadFromCsvFile(const std::string &filePath);
+    void clear();
+
+    size_t numDimensions() const;
+    bool isUniform(size_t dimension) const;
+    int registerAs(const std::string &name);
+
+    double lookup(double x) const;
+    double lookup(double x, size_t &rSegment) const;
+    double lookup(double x, double y) const;
+    double lookup(double x, double y, size_t &rFirstSegment, size_t &rSecondSegment) const;
+    void lookup(const double *pX, size_t numValues, double *pResult) const;
+    void lookup(const double *pX, const double *pY, size_t numValues, double *pResult) const;
+
+    double call(const double *pArgs, size_t numArgs);
+    void callElementWise(const double *const *ppArgs, size_t numArgs, size_t numValues, double *pResult);
+
+private:
+    struct Axis
+    {
+        std::vector<double> breakpoints;
+        double first, inverseStep;
+        bool isUniform;
+
+        bool set(const std::vector<double> &newBreakpoints);
+        void findSegment(double x, size_t &rSegment, double &rFraction) const;
+    };
+
+    Axis mAxes[2];
+    std::vector<double> mValues;
+    size_t mNumDimensions;
+    size_t mLastSegments[2];
+};
+
+}
+
+#endif // LOOKUPTABLE_H
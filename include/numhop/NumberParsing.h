@@ -0,0 +1,10 @@
+#ifndef NUMBERPARSING_H
+#define NUMBERPARSING_H
+
+namespace numhop {
+
+const char* parseDecimalNumber(const char *pBegin, const char *pEnd, double &rValue);
+
+}
+
+#endif // NUMBERPARSING_H
@@ -0,0 +1,74 @@
+#ifndef PREPAREDEXPRESSION_H
+#define PREPAREDEXPRESSION_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "Expression.h"
+
+namespace numhop {
+
+class Script;
+
+//! @brief The maximum nesting depth of parentheses and function calls when preparing from a string
+const size_t maxPreparedNestingDepth = 1000000;
+
+//! @brief An expression or script prepared for real-time evaluation
+//! @details All memory is allocated and all variables and functions are looked up when preparing.
+//! Evaluation never allocates, locks or throws. Variables are bound to their addresses in the variable storage,
+//! so the prepared expression must be prepared again after VariableStorage::clearInternalVariables().
+//! External variables must be accessible through ExternalVariableStorage::externalValuePointer().
+class PreparedExpression
+{
+public:
+    PreparedExpression();
+
+    bool prepare(const Expression &expr, VariableStorage &rVariableStorage);
+    bool prepare(const Script &script, VariableStorage &rVariableStorage);
+    bool prepare(const std::string &exprString, VariableStorage &rVariableStorage);
+    void clear();
+    bool isPrepared() const;
+
+    double evaluate(bool &rEvalOK) const;
+
+private:
+    enum OpCodeT {PushConstantOp, PushVariableOp, StoreOp, ReplaceOp, PopOp, AddOp, SubtractOp, MultiplyOp, DivideOp,
+                  PowerOp, LessThanOp, GreaterThanOp, OrOp, AndOp, CallOneArgOp, CallTwoArgOp, JumpIfFalseOp, JumpOp,
+                  ZeroAddOp, ZeroSubtractOp, ZeroOrOp};
+
+    struct Instruction
+    {
+        OpCodeT opCode;
+        union
+        {
+            double constant;
+            const double *pVariable;
+            double *pTarget;
+            OneArgFunctionT pOneArgFunction;
+            TwoArgFunctionT pTwoArgFunction;
+            size_t jumpTarget;
+        };
+    };
+
+    struct ParseFrame;
+
+    bool prepare(const std::vector<const Expression*> &statements, VariableStorage &rVariableStorage);
+    bool emit(const Expression &expr, VariableStorage &rVariableStorage);
+    bool compile(const std::string &exprString, VariableStorage &rVariableStorage);
+    void finishFactor(ParseFrame &rFrame);
+    void finishTerm(ParseFrame &rFrame);
+    void finishExpression(ParseFrame &rFrame);
+    void emitOperator(char op);
+    void emitZeroOperator(char op);
+    void emit(OpCodeT opCode);
+    void emitConstant(double value);
+
+    std::vector<Instruction> mInstructions;
+    mutable std::vector<double> mStack;
+    size_t mStackDepth, mMaxStackDepth;
+    bool mIsPrepared;
+};
+
+}
+
+#endif // PREPAREDEXPRESSION_H
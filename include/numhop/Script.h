@@ -0,0 +1,89 @@
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include "Expression.h"
+#include "ScriptReader.h"
+
+namespace numhop {
+
+//! @brief A statement in a script and its interpreted expression
+struct ScriptStatement
+{
+    StatementSpan span;
+    size_t lineNumber;
+    bool isValid;
+    bool isParsed;
+    uint64_t textHash;
+    Expression expression;
+};
+
+class Script
+{
+public:
+    Script();
+
+    bool interpret(const std::string &script, char commentChar, int numThreads=0);
+    bool interpretLazily(const std::string &script, char commentChar);
+    bool parseStatements(int numThreads=0) const;
+    bool update(const std::string &script, int numThreads=0);
+    size_t numReusedStatements() const;
+    void clear();
+
+    bool isValid() const;
+    size_t numStatements() const;
+    size_t numParsedStatements() const;
+    const ScriptStatement &statement(size_t i) const;
+    std::string statementString(size_t i) const;
+    const std::string &scriptString() const;
+
+    void reduceStrength(bool allowRoundingChanges=false);
+    size_t rewritePolynomials();
+    size_t reassociateChains(ChainEvaluationT chainEvaluation, size_t minChainLength=defaultMinChainLength);
+    size_t eliminateCommonSubexpressions();
+    double evaluate(VariableStorage &rVariableStorage, bool &rEvalOK) const;
+    double evaluateOutputs(const std::vector<std::string> &outputNames, VariableStorage &rVariableStorage, bool &rEvalOK) const;
+    std::vector<size_t> requiredStatements(const std::vector<std::string> &outputNames) const;
+
+    void save(std::vector<char> &rBuffer) const;
+    bool load(const char *pData, size_t size);
+    bool saveToFile(const std::string &filePath) const;
+    bool loadFromFile(const std::string &filePath);
+
+    void setCacheDirectory(const std::string &directory);
+    std::string cacheFilePath(const std::string &script, char commentChar) const;
+    bool wasLoadedFromCache() const;
+
+protected:
+    bool loadFromCache(const std::string &script, char commentChar);
+    void splitStatements(const std::string &script, char commentChar, bool lazy);
+    void parseStatement(size_t i) const;
+    void ensureParsed(size_t i) const;
+    bool updateChangedLines(const std::string &script);
+    void updateAllStatements(const std::string &script);
+    std::string statementText(size_t i) const;
+    const std::vector<size_t> &outputPlan(const std::vector<std::string> &outputNames) const;
+
+    std::string mScript;
+    // Statements of a lazily interpreted script are parsed at first use
+    mutable std::vector<ScriptStatement> mStatements;
+    std::vector<std::string> mInlinedStatements;
+    mutable EvaluationCache mCache;
+    mutable std::map<std::set<std::string>, std::vector<size_t> > mOutputPlans;
+    std::string mCacheDirectory;
+    char mCommentChar;
+    mutable bool mIsValid;
+    bool mWasLoadedFromCache;
+    bool mIsLazy;
+    bool mHasScriptFunctions;
+    size_t mNumReusedStatements;
+};
+
+int maxNumInterpretThreads();
+
+}
+
+#endif // SCRIPT_H
@@ -0,0 +1,70 @@
+#ifndef SCRIPTREADER_H
+#define SCRIPTREADER_H
+
+#include <string>
+#include <cstddef>
+
+namespace numhop {
+
+//! @brief A statement in a script, given as offset and length into the script text
+struct StatementSpan
+{
+    size_t offset;
+    size_t length;
+};
+
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    bool map(const std::string &filePath);
+    void unmap();
+
+    const char* data() const;
+    size_t size() const;
+
+private:
+    // Not copyable, the object owns the mapping
+    MappedFile(const MappedFile &other);
+    MappedFile& operator= (const MappedFile &other);
+
+    void *mpData;
+    size_t mSize;
+};
+
+class ScriptReader
+{
+public:
+    ScriptReader();
+    ScriptReader(const char *pData, size_t size, char commentChar);
+
+    void setBuffer(const char *pData, size_t size);
+    bool mapFile(const std::string &filePath);
+    void close();
+    void setCommentCharacter(char commentChar);
+
+    bool nextStatement(StatementSpan &rSpan);
+    void rewind();
+
+    const char* data() const;
+    size_t size() const;
+    const char* statementBegin(const StatementSpan &span) const;
+    std::string statementString(const StatementSpan &span) const;
+
+private:
+    // Not copyable, the reader may own a file mapping
+    ScriptReader(const ScriptReader &other);
+    ScriptReader& operator= (const ScriptReader &other);
+
+    const char *mpData;
+    size_t mSize;
+    size_t mPosition;
+    char mCommentChar;
+    MappedFile mMappedFile;
+};
+
+}
+
+#endif // SCRIPTREADER_H
@@ -0,0 +1,72 @@
+#ifndef SERIALIZATION_H
+#define SERIALIZATION_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+
+namespace numhop {
+
+//! @brief Writes the compact binary format, values are written little-endian or as variable length integers (LEB128),
+//! strings and functions are written as indices into tables that are placed before the data
+class BinaryWriter
+{
+public:
+    void writeUInt8(uint8_t value);
+    void writeUInt32(uint32_t value);
+    void writeUInt64(uint64_t value);
+    void writeVarUInt(uint64_t value);
+    void writeDouble(double value);
+    void writeString(const std::string &str);
+    void writeFunction(const std::string &name, size_t numArgs, int functionId);
+
+    void finish(const char magic[4], uint32_t version, std::vector<char> &rOutput) const;
+
+private:
+    struct FunctionEntry
+    {
+        uint32_t nameIndex;
+        uint32_t numArgs;
+        int32_t functionId;
+    };
+
+    uint32_t stringIndex(const std::string &str);
+    static void appendUInt32(std::vector<char> &rBuffer, uint32_t value);
+
+    std::vector<char> mData;
+    std::map<std::string, uint32_t> mStringIndexMap;
+    std::vector<const std::string*> mStrings;
+    std::map<std::pair<std::string, size_t>, uint32_t> mFunctionIndexMap;
+    std::vector<FunctionEntry> mFunctions;
+};
+
+//! @brief Reads the binary format written by the BinaryWriter, function ids are resolved against the registered functions
+class BinaryReader
+{
+public:
+    BinaryReader();
+
+    bool open(const char *pData, size_t size, const char magic[4], uint32_t version);
+    bool readUInt8(uint8_t &rValue);
+    bool readUInt32(uint32_t &rValue);
+    bool readUInt64(uint64_t &rValue);
+    bool readVarUInt(uint64_t &rValue);
+    bool readVarUInt(uint32_t &rValue);
+    bool readDouble(double &rValue);
+    bool readString(std::string &rStr);
+    bool readFunction(int &rFunctionId);
+    size_t remainingSize() const;
+
+private:
+    bool readBytes(char *pDestination, size_t size);
+
+    const char *mpData;
+    const char *mpEnd;
+    std::vector<std::string> mStrings;
+    std::vector<int> mFunctionIds;
+};
+
+}
+
+#endif // SERIALIZATION_H
@@ -0,0 +1,58 @@
+#ifndef TABULATEDEXPRESSION_H
+#define TABULATEDEXPRESSION_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "Expression.h"
+
+namespace numhop {
+
+//! @brief The default polynomial degree of each tabulated segment
+const size_t defaultTabulationDegree = 8;
+//! @brief The maximum number of segments, tabulation fails if the error bound is not reached with this many
+const size_t maxTabulationSegments = 16384;
+
+//! @brief A piecewise Chebyshev approximation of an expression of one variable, evaluated instead of the expression
+//! @details The range is split into uniform segments, so a value is found without searching. Other variables in the
+//! expression are read when tabulating, the approximation is not updated if they change.
+//! Outside of the tabulated range, or when another variable has changed, the expression itself is evaluated.
+class TabulatedExpression
+{
+public:
+    TabulatedExpression();
+
+    bool tabulate(const Expression &expr, const std::string &variableName, double lower, double upper, double maxError,
+                  VariableStorage &rVariableStorage, size_t degree=defaultTabulationDegree);
+    void clear();
+    bool isTabulated() const;
+
+    double approximate(double x) const;
+    double evaluate(VariableStorage &rVariableStorage, bool &rEvalOK) const;
+
+    const std::string &variableName() const;
+    size_t numSegments() const;
+    size_t degree() const;
+    double maxObservedError() const;
+    double measureSpeedup(VariableStorage &rVariableStorage, size_t numEvaluations=100000) const;
+
+private:
+    bool fitSegments(VariableStorage &rSampleStorage, size_t numSegments);
+    bool verifySegments(VariableStorage &rSampleStorage, double &rMaxError) const;
+    double exactValue(double x, VariableStorage &rSampleStorage, bool &rEvalOK) const;
+    bool hasTabulatedParameters(const VariableStorage &variableStorage) const;
+
+    Expression mExpression;
+    std::string mVariableName;
+    double mLower, mUpper, mInverseSegmentWidth;
+    size_t mNumSegments, mDegree;
+    double mMaxObservedError;
+    std::vector<double> mCoefficients;
+    // The other named values in the expression and their values when tabulating
+    std::vector<std::string> mParameterNames;
+    std::vector<double> mParameterValues;
+};
+
+}
+
+#endif // TABULATEDEXPRESSION_H
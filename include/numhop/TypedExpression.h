@@ -0,0 +1,100 @@
+#ifndef TYPEDEXPRESSION_H
+#define TYPEDEXPRESSION_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include "Expression.h"
+
+namespace numhop {
+
+class Script;
+
+template <typename ValueT>
+class TypedExternalVariableStorage
+{
+public:
+    virtual ~TypedExternalVariableStorage() {}
+
+    // Overload to find external variables
+    virtual ValueT externalValue(const std::string &name, bool &rFound) const = 0;
+
+    // Overload this to set your external value
+    // return true if success, false if not (then variable should be set locally)
+    virtual bool setExternalValue(const std::string &name, ValueT value) = 0;
+};
+
+//! @brief Variable storage for evaluation with a value type other than double
+template <typename ValueT>
+class TypedVariableStorage
+{
+public:
+    TypedVariableStorage();
+    bool reserveNamedValue(const std::string &name, ValueT value);
+    bool setVariable(const std::string &name, ValueT value, bool &rDidSetExternally);
+    ValueT value(const std::string &name, bool &rFound) const;
+    bool hasVariableName(const std::string &name) const;
+    bool isNameInternalValid(const std::string &name) const;
+    void setDisallowedInternalNameCharacters(const std::string &disallowed);
+
+    void setExternalStorage(TypedExternalVariableStorage<ValueT> *pExternalStorage);
+    void setParentStorage(TypedVariableStorage<ValueT> *pParentStorage);
+    void clearInternalVariables();
+
+private:
+    bool isReservedName(const std::string &name) const;
+
+    TypedExternalVariableStorage<ValueT> *mpExternalStorage;
+    TypedVariableStorage<ValueT> *mpParentStorage;
+    std::map<std::string, ValueT> mVariableMap;
+    std::map<std::string, ValueT> mReservedNameValueMap;
+    std::string mDisallowedInternalNameChars;
+};
+
+//! @brief An interpreted expression or script evaluated with float, double or long double values
+//! @details The expression tree from the shared parser is translated once, numeric constants are parsed again in the
+//! value type and built-in functions are bound to the matching <cmath> overloads. Instantiated for float, double and long double.
+template <typename ValueT>
+class TypedExpression
+{
+public:
+    typedef ValueT (*TypedOneArgFunctionT)(ValueT);
+    typedef ValueT (*TypedTwoArgFunctionT)(ValueT, ValueT);
+
+    TypedExpression();
+
+    bool prepare(const Expression &expr);
+    bool prepare(const Script &script);
+    void clear();
+    bool isPrepared() const;
+
+    ValueT evaluate(TypedVariableStorage<ValueT> &rVariableStorage, bool &rEvalOK) const;
+
+private:
+    struct Node
+    {
+        ExpressionOperatorT operatorType;
+        bool isNumericConstant, isNamedValue;
+        ValueT constant;
+        std::string name;
+        TypedOneArgFunctionT pOneArgFunction;
+        TypedTwoArgFunctionT pTwoArgFunction;
+        std::vector<size_t> leftChildren, rightChildren;
+    };
+
+    bool addNode(const Expression &expr, size_t &rIndex);
+    ValueT evaluateNode(size_t index, TypedVariableStorage<ValueT> &rVariableStorage, bool &rEvalOK) const;
+
+    std::vector<Node> mNodes;
+    std::vector<size_t> mStatements;
+    bool mIsPrepared;
+};
+
+typedef TypedVariableStorage<float> FloatVariableStorage;
+typedef TypedVariableStorage<long double> LongDoubleVariableStorage;
+typedef TypedExpression<float> FloatExpression;
+typedef TypedExpression<long double> LongDoubleExpression;
+
+}
+
+#endif // TYPEDEXPRESSION_H
@@ -3,6 +3,8 @@
 
 #include <string>
 #include <map>
+#include <vector>
+#include <cstddef>
 
 namespace numhop {
 
@@ -17,6 +19,18 @@ public:
     // Overload this to set your external value
     // return true if success, false if not (then variable should be set locally)
     virtual bool setExternalValue(std::string name, double value) = 0;
+
+    // Overload this to give direct access to your external values (optional)
+    // return a pointer that remains valid while the variable exists, or 0 if not supported
+    virtual double* externalValuePointer(const std::string &name);
+
+    // Overload this to give access to your external arrays (optional)
+    // return a pointer to the first element and set rSize, or 0 if there is no such array
+    virtual const double* externalArray(const std::string &name, size_t &rSize) const;
+
+    // Overload this to set your external array (optional)
+    // return true if success, false if not (then the array should be set locally)
+    virtual bool setExternalArray(const std::string &name, const std::vector<double> &values);
 };
 
 class VariableStorage
@@ -26,6 +40,11 @@ public:
     bool reserveNamedValue(const std::string &name, double value);
     bool setVariable(const std::string &name, double value, bool &rDidSetExternally);
     double value(const std::string &name, bool &rFound) const;
+    const double* valuePointer(const std::string &name) const;
+    double* variablePointer(const std::string &name);
+
+    bool setArray(const std::string &name, const std::vector<double> &values, bool &rDidSetExternally);
+    const double* array(const std::string &name, size_t &rSize) const;
 
     bool hasVariableName(const std::string &name) const;
     bool isNameInternalValid(const std::string &name) const;
@@ -36,12 +55,17 @@ public:
 
     void clearInternalVariables();
 
+    void setFastMath(bool fastMath);
+    bool isFastMath() const;
+
 private:
     ExternalVariableStorage *mpExternalStorage;
     VariableStorage *mpParentStorage;
     std::map<std::string, double> mVariableMap;
     std::map<std::string, double> mReservedNameVauleMap;
+    std::map<std::string, std::vector<double> > mArrayMap;
     std::string mDisallowedInternalNameChars;
+    bool mIsFastMath;
 };
 
 }
@@ -0,0 +1,668 @@
+#include "numhop/ArrayEvaluation.h"
+#include "numhop/CpuDispatch.h"
+#include "numhop/Script.h"
+#include "numhop/VariableStorage.h"
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <deque>
+#include <limits>
+#include <map>
+
+namespace numhop {
+
+namespace {
+
+//! @brief The number of elements evaluated at a time, so that temporary values stay in the cache
+const size_t blockSize = 1024;
+
+inline double boolify(const double v)
+{
+    if (v>0.5) {return 1.;} return 0.;
+}
+
+struct AddOperator { double operator()(double a, double b) const { return a+b; } };
+struct SubtractOperator { double operator()(double a, double b) const { return a-b; } };
+struct MultiplyOperator { double operator()(double a, double b) const { return a*b; } };
+struct DivideOperator { double operator()(double a, double b) const { return a/b; } };
+struct OrOperator { double operator()(double a, double b) const { return boolify(boolify(a)+boolify(b)); } };
+struct AndOperator { double operator()(double a, double b) const { return boolify(a)*boolify(b); } };
+struct PowerOperator { double operator()(double a, double b) const { return pow(a, b); } };
+struct LessThanOperator { double operator()(double a, double b) const { return double(a<b); } };
+struct GreaterThanOperator { double operator()(double a, double b) const { return double(a>b); } };
+struct FunctionOperator
+{
+    FunctionOperator(TwoArgFunctionT pFunction) : mpFunction(pFunction) {}
+    double operator()(double a, double b) const { return mpFunction(a, b); }
+    TwoArgFunctionT mpFunction;
+};
+
+//! @brief Combine a block of values with another, a single value is repeated for all elements
+//! @param[in,out] pA The left operand values, and the result
+//! @param[in,out] rAIsArray Indicates if the left operand, and the result, has one value per element
+//! @param[in] pB The right operand values
+//! @param[in] bIsArray Indicates if the right operand has one value per element
+//! @param[in] n The number of elements in the block
+//! @param[in] op The operator
+template <typename OperatorT>
+void combine(double *pA, bool &rAIsArray, const double *pB, const bool bIsArray, const size_t n, const OperatorT op)
+{
+    if (!rAIsArray && !bIsArray)
+    {
+        pA[0] = op(pA[0], pB[0]);
+    }
+    else if (!rAIsArray)
+    {
+        const double a = pA[0];
+        for (size_t i=0; i<n; ++i)
+        {
+            pA[i] = op(a, pB[i]);
+        }
+        rAIsArray = true;
+    }
+    else if (!bIsArray)
+    {
+        const double b = pB[0];
+        for (size_t i=0; i<n; ++i)
+        {
+            pA[i] = op(pA[i], b);
+        }
+    }
+    else
+    {
+        for (size_t i=0; i<n; ++i)
+        {
+            pA[i] = op(pA[i], pB[i]);
+        }
+    }
+}
+
+//! @brief Combine a block of values with another using the array kernels of the selected instruction set
+//! @param[in] pArrays The kernel for two arrays
+//! @param[in] pArrayScalar The kernel for an array and a single value
+//! @param[in] pScalarArray The kernel for a single value and an array, 0 for commutative operators
+//! @see combine
+template <typename OperatorT>
+void combine(double *pA, bool &rAIsArray, const double *pB, const bool bIsArray, const size_t n, const OperatorT op,
+             ArrayArrayFunctionT pArrays, ArrayScalarFunctionT pArrayScalar, ScalarArrayFunctionT pScalarArray)
+{
+    if (!rAIsArray && !bIsArray)
+    {
+        pA[0] = op(pA[0], pB[0]);
+    }
+    else if (!rAIsArray)
+    {
+        if (pScalarArray)
+        {
+            pScalarArray(pA[0], pB, n, pA);
+        }
+        else
+        {
+            pArrayScalar(pB, pA[0], n, pA);
+        }
+        rAIsArray = true;
+    }
+    else if (!bIsArray)
+    {
+        pArrayScalar(pA, pB[0], n, pA);
+    }
+    else
+    {
+        pArrays(pA, pB, n, pA);
+    }
+}
+
+enum ReductionT {NoReduction, SumReduction, MeanReduction, MinReduction, MaxReduction};
+
+ReductionT reductionType(const Expression &expr)
+{
+    if (expr.operatorType() != FunctionCallT || expr.rightChildExpressions().size() != 1)
+    {
+        return NoReduction;
+    }
+    const std::string &name = expr.leftExprString();
+    if (name == "sum")  { return SumReduction; }
+    if (name == "mean") { return MeanReduction; }
+    if (name == "min")  { return MinReduction; }
+    if (name == "max")  { return MaxReduction; }
+    return NoReduction;
+}
+
+//! @brief Merge the number of elements of an operand into the number of elements of an expression
+//! @returns False if two arrays of different size are combined
+bool mergeCount(const size_t count, const bool isArray, size_t &rCount, bool &rIsArray)
+{
+    if (isArray)
+    {
+        if (rIsArray && count != rCount)
+        {
+            return false;
+        }
+        rCount = count;
+        rIsArray = true;
+    }
+    return true;
+}
+
+//! @brief Evaluates expressions on arrays, block by block
+class ElementWiseEvaluator
+{
+public:
+    ElementWiseEvaluator(VariableStorage &rVariableStorage) : mrVariableStorage(rVariableStorage), mRangeSize(1) {}
+
+    bool evaluateStatement(const Expression &expr, std::vector<double> &rValues)
+    {
+        mScalarValues.clear();
+        mAssignedArrays.clear();
+
+        size_t count = 1;
+        bool isArray = false;
+        if (!expr.isValid() || !elementCount(expr, count, isArray))
+        {
+            return false;
+        }
+        if (!isArray)
+        {
+            count = 1;
+        }
+
+        // Evaluate block by block, a scalar result is repeated for all elements
+        rValues.resize(count);
+        mRangeSize = count;
+        for (size_t begin=0; begin<count; begin+=blockSize)
+        {
+            const size_t n = std::min(blockSize, count-begin);
+            bool blockIsArray;
+            if (!evaluateBlock(expr, begin, n, 0, blockIsArray))
+            {
+                return false;
+            }
+            const double *pBlock = buffer(0);
+            for (size_t i=0; i<n; ++i)
+            {
+                rValues[begin+i] = pBlock[blockIsArray ? i : 0];
+            }
+        }
+
+        // Arrays are assigned when the statement is complete
+        std::map<std::string, std::vector<double> >::const_iterator it;
+        for (it=mAssignedArrays.begin(); it!=mAssignedArrays.end(); ++it)
+        {
+            bool dummy;
+            if (!mrVariableStorage.setArray(it->first, it->second, dummy))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    double* buffer(const size_t depth)
+    {
+        while (mBuffers.size() <= depth)
+        {
+            mBuffers.push_back(std::vector<double>(blockSize));
+        }
+        return &mBuffers[depth][0];
+    }
+
+    //! @brief Find the number of elements of an expression
+    bool elementCount(const Expression &expr, size_t &rCount, bool &rIsArray)
+    {
+        rIsArray = false;
+        if (expr.isNumericConstant())
+        {
+            return true;
+        }
+        else if (expr.isNamedValue())
+        {
+            size_t size;
+            if (mrVariableStorage.array(expr.exprString(), size))
+            {
+                rCount = size;
+                rIsArray = true;
+            }
+            return true;
+        }
+        else if (reductionType(expr) != NoReduction)
+        {
+            size_t count = 1;
+            bool isArray;
+            return elementCount(expr.rightChildExpressions().front(), count, isArray);
+        }
+
+        // The assigned variable does not contribute, only the assigned value
+        const std::list<Expression> *children[] = {&expr.rightChildExpressions(), &expr.leftChildExpressions()};
+        const size_t numChildLists = (expr.operatorType() == AssignmentT) ? 1 : 2;
+        for (size_t c=0; c<numChildLists; ++c)
+        {
+            std::list<Expression>::const_iterator it;
+            for (it=children[c]->begin(); it!=children[c]->end(); ++it)
+            {
+                size_t count = 1;
+                bool isArray;
+                if (!elementCount(*it, count, isArray) || !mergeCount(count, isArray, rCount, rIsArray))
+                {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    //! @brief Evaluate a call to a function with any number of arguments into buffer(depth), all elements are passed in one call
+    bool evaluateFunctionBlock(const Expression &expr, const size_t begin, const size_t n, const size_t depth, bool &rIsArray)
+    {
+        const std::list<Expression> &args = expr.rightChildExpressions();
+        const size_t numArgs = args.size();
+        const double *ppArgs[maxFunctionArguments];
+        bool argIsArray[maxFunctionArguments];
+        if (numArgs > maxFunctionArguments)
+        {
+            return false;
+        }
+
+        // Each argument uses its own buffer, deeper ones are only used for temporaries
+        rIsArray = false;
+        size_t a=0;
+        std::list<Expression>::const_iterator it;
+        for (it=args.begin(); it!=args.end(); ++it, ++a)
+        {
+            if (!evaluateBlock(*it, begin, n, depth+a, argIsArray[a]))
+            {
+                return false;
+            }
+            rIsArray = rIsArray || argIsArray[a];
+        }
+
+        // Repeat single values, so that every argument has one value per element
+        const size_t numValues = rIsArray ? n : 1;
+        for (a=0; a<numArgs; ++a)
+        {
+            double *pArg = buffer(depth+a);
+            if (rIsArray && !argIsArray[a])
+            {
+                std::fill(pArg+1, pArg+n, pArg[0]);
+            }
+            ppArgs[a] = pArg;
+        }
+        double *pValues = buffer(depth+numArgs);
+        if (!callFunctionElementWise(expr.functionId(), ppArgs, numArgs, numValues, pValues))
+        {
+            return false;
+        }
+        std::copy(pValues, pValues+numValues, buffer(depth));
+        return true;
+    }
+
+    //! @brief Evaluate elements [begin, begin+n) of an expression into buffer(depth)
+    //! @details A single value is produced if the expression does not depend on arrays. When there is more than one block,
+    //! such values are evaluated once per statement, the way reductions are, so that scalar assignments are made once.
+    bool evaluateBlock(const Expression &expr, const size_t begin, const size_t n, const size_t depth, bool &rIsArray)
+    {
+        if (mRangeSize <= blockSize || expr.isNumericConstant())
+        {
+            return evaluateNodeBlock(expr, begin, n, depth, rIsArray);
+        }
+        std::map<const Expression*, double>::const_iterator cached = mScalarValues.find(&expr);
+        if (cached != mScalarValues.end())
+        {
+            buffer(depth)[0] = cached->second;
+            rIsArray = false;
+            return true;
+        }
+        if (!evaluateNodeBlock(expr, begin, n, depth, rIsArray))
+        {
+            return false;
+        }
+        if (!rIsArray)
+        {
+            mScalarValues[&expr] = buffer(depth)[0];
+        }
+        return true;
+    }
+
+    //! @brief Evaluate elements [begin, begin+n) of an expression into buffer(depth)
+    //! @details Deeper buffers are used for operands
+    bool evaluateNodeBlock(const Expression &expr, const size_t begin, const size_t n, const size_t depth, bool &rIsArray)
+    {
+        double *pResult = buffer(depth);
+        const ExpressionOperatorT op = expr.operatorType();
+        const std::list<Expression> &lhs = expr.leftChildExpressions();
+        const std::list<Expression> &rhs = expr.rightChildExpressions();
+        rIsArray = false;
+
+        if (expr.isNumericConstant())
+        {
+            pResult[0] = expr.numericConstantValue();
+            return true;
+        }
+        else if (expr.isNamedValue())
+        {
+            size_t size;
+            const double *pArray = mrVariableStorage.array(expr.exprString(), size);
+            if (pArray)
+            {
+                std::memcpy(pResult, pArray+begin, n*sizeof(double));
+                rIsArray = true;
+                return true;
+            }
+            bool found;
+            pResult[0] = mrVariableStorage.value(expr.exprString(), found);
+            return found;
+        }
+        else if (op == AssignmentT)
+        {
+            if (!evaluateBlock(rhs.front(), begin, n, depth, rIsArray))
+            {
+                return false;
+            }
+            if (rIsArray)
+            {
+                std::vector<double> &rAssigned = mAssignedArrays[expr.leftExprString()];
+                rAssigned.resize(mRangeSize);
+                std::memcpy(&rAssigned[begin], pResult, n*sizeof(double));
+                return true;
+            }
+            bool dummy;
+            return mrVariableStorage.setVariable(expr.leftExprString(), pResult[0], dummy);
+        }
+        else if (op == PowerT || op == LessThenT || op == GreaterThenT)
+        {
+            bool rightIsArray;
+            if (!evaluateBlock(lhs.front(), begin, n, depth, rIsArray) ||
+                !evaluateBlock(rhs.front(), begin, n, depth+1, rightIsArray))
+            {
+                return false;
+            }
+            const double *pRight = buffer(depth+1);
+            if (op == PowerT)
+            {
+                combine(pResult, rIsArray, pRight, rightIsArray, n, PowerOperator());
+            }
+            else if (op == LessThenT)
+            {
+                combine(pResult, rIsArray, pRight, rightIsArray, n, LessThanOperator());
+            }
+            else
+            {
+                combine(pResult, rIsArray, pRight, rightIsArray, n, GreaterThanOperator());
+            }
+            return true;
+        }
+        else if (op == ConditionalT)
+        {
+            std::list<Expression>::const_iterator it = rhs.begin();
+            bool conditionIsArray, trueIsArray, falseIsArray;
+            if (!evaluateBlock(*it, begin, n, depth, conditionIsArray))
+            {
+                return false;
+            }
+            const std::list<Expression>::const_iterator trueIt = ++it;
+            const std::list<Expression>::const_iterator falseIt = ++it;
+            if (!conditionIsArray)
+            {
+                // The same branch for all elements, only evaluate that one
+                return evaluateBlock((boolify(pResult[0]) < 0.5) ? *falseIt : *trueIt, begin, n, depth, rIsArray);
+            }
+            if (!evaluateBlock(*trueIt, begin, n, depth+1, trueIsArray) ||
+                !evaluateBlock(*falseIt, begin, n, depth+2, falseIsArray))
+            {
+                return false;
+            }
+            const double *pTrue = buffer(depth+1);
+            const double *pFalse = buffer(depth+2);
+            for (size_t i=0; i<n; ++i)
+            {
+                pResult[i] = (boolify(pResult[i]) < 0.5) ? pFalse[falseIsArray ? i : 0] : pTrue[trueIsArray ? i : 0];
+            }
+            rIsArray = true;
+            return true;
+        }
+        else if (op == FunctionCallT)
+        {
+            const ReductionT reduction = reductionType(expr);
+            if (reduction != NoReduction)
+            {
+                return reduce(expr, reduction, depth+1, pResult[0]);
+            }
+            const bool fastMath = mrVariableStorage.isFastMath();
+            OneArgFunctionT pOneArgFunction = (rhs.size() == 1) ? getOneArgFunction(expr.functionId(), fastMath) : 0;
+            TwoArgFunctionT pTwoArgFunction = (rhs.size() == 2) ? getTwoArgFunction(expr.functionId(), fastMath) : 0;
+            if (pOneArgFunction)
+            {
+                if (!evaluateBlock(rhs.front(), begin, n, depth, rIsArray))
+                {
+                    return false;
+                }
+                const size_t numValues = rIsArray ? n : 1;
+                ArrayFunctionT pArrayFunction = getArrayFunction(expr.functionId(), fastMath);
+                if (pArrayFunction)
+                {
+                    pArrayFunction(pResult, numValues, pResult);
+                    return true;
+                }
+                for (size_t i=0; i<numValues; ++i)
+                {
+                    pResult[i] = pOneArgFunction(pResult[i]);
+                }
+                return true;
+            }
+            else if (pTwoArgFunction)
+            {
+                bool secondIsArray;
+                if (!evaluateBlock(rhs.front(), begin, n, depth, rIsArray) ||
+                    !evaluateBlock(rhs.back(), begin, n, depth+1, secondIsArray))
+                {
+                    return false;
+                }
+                combine(pResult, rIsArray, buffer(depth+1), secondIsArray, n, FunctionOperator(pTwoArgFunction));
+                return true;
+            }
+            return evaluateFunctionBlock(expr, begin, n, depth, rIsArray);
+        }
+
+        // Fold the operands, starting from zero
+        pResult[0] = 0.;
+        if (rhs.empty())
+        {
+            return false;
+        }
+        const SimdKernels &kernels = simdKernels();
+        std::list<Expression>::const_iterator it;
+        for (it=rhs.begin(); it!=rhs.end(); ++it)
+        {
+            const ExpressionOperatorT optype = it->operatorType();
+            bool operandIsArray;
+            if (optype == UndefinedT || !evaluateBlock(*it, begin, n, depth+1, operandIsArray))
+            {
+                return false;
+            }
+            const double *pOperand = buffer(depth+1);
+            if (optype == AdditionT)
+            {
+                combine(pResult, rIsArray, pOperand, operandIsArray, n, AddOperator(), kernels.addArrays, kernels.addScalar, 0);
+            }
+            else if (optype == SubtractionT)
+            {
+                combine(pResult, rIsArray, pOperand, operandIsArray, n, SubtractOperator(),
+                        kernels.subtractArrays, kernels.subtractScalar, kernels.scalarSubtract);
+            }
+            else if (optype == MultiplicationT)
+            {
+                combine(pResult, rIsArray, pOperand, operandIsArray, n, MultiplyOperator(), kernels.multiplyArrays, kernels.multiplyScalar, 0);
+            }
+            else if (optype == DivisionT)
+            {
+                combine(pResult, rIsArray, pOperand, operandIsArray, n, DivideOperator(),
+                        kernels.divideArrays, kernels.divideScalar, kernels.scalarDivide);
+            }
+            else if (optype == OrT)
+            {
+                combine(pResult, rIsArray, pOperand, operandIsArray, n, OrOperator());
+            }
+            else if (optype == AndT)
+            {
+                combine(pResult, rIsArray, pOperand, operandIsArray, n, AndOperator());
+            }
+            else
+            {
+                std::memcpy(pResult, pOperand, (operandIsArray ? n : 1)*sizeof(double));
+                rIsArray = operandIsArray;
+            }
+        }
+        return true;
+    }
+
+    //! @brief Reduce all elements of the argument to a single value, once per statement
+    //! @details Sums are accumulated in four independent partial sums, so that the inner loop can be vectorized
+    bool reduce(const Expression &expr, const ReductionT reduction, const size_t depth, double &rValue)
+    {
+        std::map<const Expression*, double>::const_iterator cached = mScalarValues.find(&expr);
+        if (cached != mScalarValues.end())
+        {
+            rValue = cached->second;
+            return true;
+        }
+
+        const Expression &argument = expr.rightChildExpressions().front();
+        size_t count = 1;
+        bool isArray;
+        if (!elementCount(argument, count, isArray))
+        {
+            return false;
+        }
+        if (!isArray)
+        {
+            // The reduction of a single value is the value itself
+            bool dummy;
+            if (!evaluateBlock(argument, 0, 1, depth, dummy))
+            {
+                return false;
+            }
+            rValue = buffer(depth)[0];
+            mScalarValues[&expr] = rValue;
+            return true;
+        }
+
+        const size_t outerRangeSize = mRangeSize;
+        mRangeSize = count;
+        double partialSums[4] = {0., 0., 0., 0.};
+        double extreme = (count > 0) ? 0. : std::numeric_limits<double>::quiet_NaN();
+        for (size_t begin=0; begin<count; begin+=blockSize)
+        {
+            const size_t n = std::min(blockSize, count-begin);
+            bool blockIsArray;
+            if (!evaluateBlock(argument, begin, n, depth, blockIsArray))
+            {
+                mRangeSize = outerRangeSize;
+                return false;
+            }
+            const double *pBlock = buffer(depth);
+            if (!blockIsArray)
+            {
+                // A conditional with a constant condition may give one value for all elements
+                for (size_t i=1; i<n; ++i)
+                {
+                    buffer(depth)[i] = pBlock[0];
+                }
+            }
+            if (reduction == SumReduction || reduction == MeanReduction)
+            {
+                size_t i=0;
+                for (; i+4<=n; i+=4)
+                {
+                    partialSums[0] += pBlock[i];
+                    partialSums[1] += pBlock[i+1];
+                    partialSums[2] += pBlock[i+2];
+                    partialSums[3] += pBlock[i+3];
+                }
+                for (; i<n; ++i)
+                {
+                    partialSums[0] += pBlock[i];
+                }
+            }
+            else
+            {
+                // Same choice as std::min and std::max
+                size_t i=0;
+                if (begin == 0)
+                {
+                    extreme = pBlock[0];
+                    i = 1;
+                }
+                for (; i<n; ++i)
+                {
+                    if (reduction == MinReduction)
+                    {
+                        extreme = (pBlock[i] < extreme) ? pBlock[i] : extreme;
+                    }
+                    else
+                    {
+                        extreme = (extreme < pBlock[i]) ? pBlock[i] : extreme;
+                    }
+                }
+            }
+        }
+        mRangeSize = outerRangeSize;
+
+        const double sum = (partialSums[0]+partialSums[1]) + (partialSums[2]+partialSums[3]);
+        if (reduction == SumReduction)
+        {
+            rValue = sum;
+        }
+        else if (reduction == MeanReduction)
+        {
+            rValue = sum/double(count);
+        }
+        else
+        {
+            rValue = extreme;
+        }
+        mScalarValues[&expr] = rValue;
+        return true;
+    }
+
+    VariableStorage &mrVariableStorage;
+    std::deque<std::vector<double> > mBuffers;
+    std::map<const Expression*, double> mScalarValues;
+    std::map<std::string, std::vector<double> > mAssignedArrays;
+    size_t mRangeSize;
+};
+
+}
+
+//! @brief Evaluate an expression element-wise on array variables
+//! @details Every operator and built-in function is applied to each element, scalars are combined with all elements.
+//! The reductions sum(), mean(), min() and max() with one argument reduce an array to a single value.
+//! Arrays are evaluated in blocks, and assigned arrays are stored when the expression has been evaluated. Subexpressions that do
+//! not depend on arrays, including scalar assignments, are evaluated once.
+//! Both branches of a conditional are evaluated when the condition differs between elements.
+//! @param[in] expr The expression to evaluate
+//! @param[in,out] rVariableStorage The variable storage with array and scalar variables
+//! @param[out] rValues The value of each element, or a single value if the expression does not depend on arrays
+//! @param[out] rEvalOK Indicates whether evaluation was successful or not, false if arrays of different size are combined
+void evaluateElementWise(const Expression &expr, VariableStorage &rVariableStorage, std::vector<double> &rValues, bool &rEvalOK)
+{
+    ElementWiseEvaluator evaluator(rVariableStorage);
+    rEvalOK = evaluator.evaluateStatement(expr, rValues);
+}
+
+//! @brief Evaluate all statements in a script element-wise on array variables
+//! @param[in] script The interpreted script
+//! @param[in,out] rVariableStorage The variable storage with array and scalar variables
+//! @param[out] rValues The values of the last statement
+//! @param[out] rEvalOK Indicates whether evaluation was successful or not
+void evaluateElementWise(const Script &script, VariableStorage &rVariableStorage, std::vector<double> &rValues, bool &rEvalOK)
+{
+    ElementWiseEvaluator evaluator(rVariableStorage);
+    rValues.assign(1, 0.);
+    rEvalOK = true;
+    for (size_t i=0; i<script.numStatements() && rEvalOK; ++i)
+    {
+        rEvalOK = script.statement(i).isValid && evaluator.evaluateStatement(script.statement(i).expression, rValues);
+    }
+}
+
+}
@@ -0,0 +1,511 @@
+#include "numhop/CodeEmitter.h"
+#include "numhop/Script.h"
+#include <cstdio>
+#include <cmath>
+#include <algorithm>
+
+namespace numhop {
+
+namespace {
+
+//! @brief Check if an expression, or any of its child expressions, assigns a variable
+bool containsAssignment(const Expression &expr)
+{
+    if (expr.operatorType() == AssignmentT)
+    {
+        return true;
+    }
+    std::list<Expression>::const_iterator it;
+    for (it=expr.leftChildExpressions().begin(); it!=expr.leftChildExpressions().end(); ++it)
+    {
+        if (containsAssignment(*it))
+        {
+            return true;
+        }
+    }
+    for (it=expr.rightChildExpressions().begin(); it!=expr.rightChildExpressions().end(); ++it)
+    {
+        if (containsAssignment(*it))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+//! @brief Get the <math.h> function corresponding to a built-in function, min and max are generated inline
+std::string mathFunctionName(const std::string &name)
+{
+    const char* sameName[] = {"cos", "sin", "tan", "acos", "asin", "atan", "cosh", "sinh", "tanh",
+                              "exp", "log", "log10", "sqrt", "ceil", "floor", "atan2", "pow", "fmod"};
+    for (size_t i=0; i<sizeof(sameName)/sizeof(sameName[0]); ++i)
+    {
+        if (name == sameName[i])
+        {
+            return name;
+        }
+    }
+    if (name == "abs")
+    {
+        return "fabs";
+    }
+    return "";
+}
+
+std::string boolified(const std::string &value)
+{
+    return "("+value+" > 0.5 ? 1.0 : 0.0)";
+}
+
+}
+
+//! @brief Default constructor
+CCodeEmitter::CCodeEmitter()
+{
+    mNumTemporaries = 0;
+}
+
+//! @brief Reserve a value name, it will be emitted as a constant
+//! @param[in] name The name of the value
+//! @param[in] value The constant value
+//! @returns False if the name is already reserved
+bool CCodeEmitter::reserveNamedValue(const std::string &name, double value)
+{
+    return mReservedValues.insert(std::pair<std::string, double>(name, value)).second;
+}
+
+//! @brief Emit a C function evaluating an expression
+//! @param[in] functionName The name of the generated function
+//! @param[in] expr The expression
+//! @param[out] rCode The generated code is appended to this string
+//! @returns True if the code could be generated
+bool CCodeEmitter::emitFunction(const std::string &functionName, const Expression &expr, std::string &rCode)
+{
+    return emitFunction(functionName, std::vector<const Expression*>(1, &expr), rCode);
+}
+
+//! @brief Emit a C function evaluating all statements in a script
+//! @param[in] functionName The name of the generated function
+//! @param[in] script The interpreted script
+//! @param[out] rCode The generated code is appended to this string
+//! @returns True if the code could be generated
+bool CCodeEmitter::emitFunction(const std::string &functionName, const Script &script, std::string &rCode)
+{
+    std::vector<const Expression*> statements;
+    for (size_t i=0; i<script.numStatements(); ++i)
+    {
+        if (!script.statement(i).isValid)
+        {
+            return false;
+        }
+        statements.push_back(&script.statement(i).expression);
+    }
+    return emitFunction(functionName, statements, rCode);
+}
+
+//! @brief Emit a C function evaluating a list of statements in order
+//! @details The generated code performs the same floating point operations in the same order as Expression::evaluate,
+//! so it gives identical results as long as the host compiler does not reorder or contract them (no -ffast-math, -ffp-contract=off)
+//! @param[in] functionName The name of the generated function
+//! @param[in] statements The expressions to evaluate
+//! @param[out] rCode The generated code is appended to this string
+//! @returns True if the code could be generated
+bool CCodeEmitter::emitFunction(const std::string &functionName, const std::vector<const Expression*> &statements, std::string &rCode)
+{
+    mLocalNames.clear();
+    mLocalOrder.clear();
+    mInputNames.clear();
+    mOutputNames.clear();
+    mBody.clear();
+    mNumTemporaries = 0;
+
+    std::map<std::string, bool> assigned;
+    for (size_t i=0; i<statements.size(); ++i)
+    {
+        collectVariables(*statements[i], assigned);
+    }
+    std::map<std::string, bool>::iterator ait;
+    for (ait=assigned.begin(); ait!=assigned.end(); ++ait)
+    {
+        if (mReservedValues.find(ait->first) != mReservedValues.end())
+        {
+            return false;
+        }
+    }
+
+    bool isOK = true;
+    std::string result = "0.0";
+    for (size_t i=0; i<statements.size() && isOK; ++i)
+    {
+        result = emitExpression(*statements[i], 1, isOK);
+    }
+    if (!isOK)
+    {
+        return false;
+    }
+
+    char buff[64];
+    rCode += "double "+functionName+"(const double *in, double *out)\n{\n";
+    for (size_t i=0; i<mLocalOrder.size(); ++i)
+    {
+        const std::string &name = mLocalOrder[i];
+        std::vector<std::string>::iterator iit = std::find(mInputNames.begin(), mInputNames.end(), name);
+        if (iit != mInputNames.end())
+        {
+            std::sprintf(buff, " = in[%lu]; /* ", (unsigned long)(iit-mInputNames.begin()));
+            rCode += "    double "+mLocalNames[name]+buff+name+" */\n";
+        }
+        else
+        {
+            rCode += "    double "+mLocalNames[name]+" = 0.0; /* "+name+" */\n";
+        }
+    }
+    rCode += mBody;
+    if (mOutputNames.empty())
+    {
+        rCode += "    (void)out;\n";
+    }
+    for (size_t i=0; i<mOutputNames.size(); ++i)
+    {
+        std::sprintf(buff, "    out[%lu] = ", (unsigned long)i);
+        rCode += buff+mLocalNames[mOutputNames[i]]+"; /* "+mOutputNames[i]+" */\n";
+    }
+    rCode += "    return "+result+";\n}\n";
+    return true;
+}
+
+//! @brief Get the names of the input variables, in the order of the in array, from the last emitted function
+const std::vector<std::string> &CCodeEmitter::inputNames() const
+{
+    return mInputNames;
+}
+
+//! @brief Get the names of the assigned variables, in the order of the out array, from the last emitted function
+const std::vector<std::string> &CCodeEmitter::outputNames() const
+{
+    return mOutputNames;
+}
+
+//! @brief Get the include directives needed by the generated code
+std::string CCodeEmitter::includes()
+{
+    return "#include <math.h>\n";
+}
+
+//! @brief Find the variables in evaluation order, names read before being assigned become inputs
+void CCodeEmitter::collectVariables(const Expression &expr, std::map<std::string, bool> &rAssigned)
+{
+    if (expr.isNamedValue())
+    {
+        const std::string &name = expr.exprString();
+        if (mReservedValues.find(name) == mReservedValues.end() && mLocalNames.find(name) == mLocalNames.end())
+        {
+            addLocal(name);
+            mInputNames.push_back(name);
+        }
+        return;
+    }
+
+    std::list<Expression>::const_iterator it;
+    for (it=expr.leftChildExpressions().begin(); it!=expr.leftChildExpressions().end(); ++it)
+    {
+        collectVariables(*it, rAssigned);
+    }
+    for (it=expr.rightChildExpressions().begin(); it!=expr.rightChildExpressions().end(); ++it)
+    {
+        collectVariables(*it, rAssigned);
+    }
+
+    if (expr.operatorType() == AssignmentT)
+    {
+        const std::string &name = expr.leftExprString();
+        if (mLocalNames.find(name) == mLocalNames.end())
+        {
+            addLocal(name);
+        }
+        if (!rAssigned[name])
+        {
+            rAssigned[name] = true;
+            mOutputNames.push_back(name);
+        }
+    }
+}
+
+//! @brief Add a local C variable for a named value
+void CCodeEmitter::addLocal(const std::string &name)
+{
+    char buff[32];
+    std::sprintf(buff, "v%lu", (unsigned long)mLocalOrder.size());
+    mLocalNames[name] = buff;
+    mLocalOrder.push_back(name);
+}
+
+//! @brief Emit the code evaluating an expression
+//! @details Each kind of expression is emitted by its own function, so that the recursion over the tree uses little call stack
+//! @param[in] expr The expression
+//! @param[in] indent The indentation level of the generated lines
+//! @param[out] rOK Indicates whether code could be generated or not
+//! @returns A C literal, local variable or temporary holding the value of the expression
+std::string CCodeEmitter::emitExpression(const Expression &expr, int indent, bool &rOK)
+{
+    const ExpressionOperatorT op = expr.operatorType();
+    const std::list<Expression> &lhs = expr.leftChildExpressions();
+    const std::list<Expression> &rhs = expr.rightChildExpressions();
+
+    if (expr.isNumericConstant())
+    {
+        return literal(expr.numericConstantValue());
+    }
+    else if (expr.isNamedValue())
+    {
+        std::map<std::string, double>::const_iterator it = mReservedValues.find(expr.exprString());
+        if (it != mReservedValues.end())
+        {
+            return literal(it->second);
+        }
+        return mLocalNames[expr.exprString()];
+    }
+    else if (op == AssignmentT && rhs.size() == 1)
+    {
+        return emitAssignment(expr, indent, rOK);
+    }
+    else if ((op == PowerT || op == LessThenT || op == GreaterThenT) && lhs.size() == 1 && rhs.size() == 1)
+    {
+        return emitBinaryOperator(expr, indent, rOK);
+    }
+    else if (op == ConditionalT && rhs.size() == 3)
+    {
+        return emitConditional(expr, indent, rOK);
+    }
+    else if (op == FunctionCallT && (rhs.size() == 1 || rhs.size() == 2))
+    {
+        return emitFunctionCall(expr, indent, rOK);
+    }
+    else if (op != AssignmentT && op != PowerT && op != LessThenT && op != GreaterThenT && op != ConditionalT &&
+             op != FunctionCallT && op != UndefinedT && op != ValueT && !rhs.empty())
+    {
+        return emitFold(expr, indent, rOK);
+    }
+
+    rOK = false;
+    return "0.0";
+}
+
+//! @brief Emit an assignment of the value of the right hand side
+std::string CCodeEmitter::emitAssignment(const Expression &expr, int indent, bool &rOK)
+{
+    const std::string value = emitExpression(expr.rightChildExpressions().front(), indent, rOK);
+    const std::string &variable = mLocalNames[expr.leftExprString()];
+    addLine(indent, variable+" = "+value+";");
+    return variable;
+}
+
+//! @brief Emit a power or comparison
+std::string CCodeEmitter::emitBinaryOperator(const Expression &expr, int indent, bool &rOK)
+{
+    const Expression &left = expr.leftChildExpressions().front();
+    const Expression &right = expr.rightChildExpressions().front();
+    const std::string l = emitOperand(left, &right, indent, rOK);
+    const std::string r = emitExpression(right, indent, rOK);
+    const std::string result = newTemporary();
+    if (expr.operatorType() == PowerT)
+    {
+        addLine(indent, "const double "+result+" = pow("+l+", "+r+");");
+    }
+    else
+    {
+        addLine(indent, "const double "+result+" = ("+l+(expr.operatorType() == LessThenT ? " < " : " > ")+r+") ? 1.0 : 0.0;");
+    }
+    return result;
+}
+
+//! @brief Emit a conditional expression, only the selected branch is evaluated
+std::string CCodeEmitter::emitConditional(const Expression &expr, int indent, bool &rOK)
+{
+    std::list<Expression>::const_iterator it = expr.rightChildExpressions().begin();
+    const std::string condition = emitExpression(*it, indent, rOK);
+    const std::string result = newTemporary();
+    addLine(indent, "double "+result+";");
+    addLine(indent, "if ("+condition+" > 0.5)");
+    addLine(indent, "{");
+    const std::string trueValue = emitExpression(*(++it), indent+1, rOK);
+    addLine(indent+1, result+" = "+trueValue+";");
+    addLine(indent, "}");
+    addLine(indent, "else");
+    addLine(indent, "{");
+    const std::string falseValue = emitExpression(*(++it), indent+1, rOK);
+    addLine(indent+1, result+" = "+falseValue+";");
+    addLine(indent, "}");
+    return result;
+}
+
+//! @brief Emit a call to a built-in function with one or two arguments
+std::string CCodeEmitter::emitFunctionCall(const Expression &expr, int indent, bool &rOK)
+{
+    const std::list<Expression> &rhs = expr.rightChildExpressions();
+    const std::string &name = expr.leftExprString();
+    std::string call;
+    if (rhs.size() == 1)
+    {
+        const std::string function = mathFunctionName(name);
+        const std::string argument = emitExpression(rhs.front(), indent, rOK);
+        if (name == "sum" || name == "mean" || name == "min" || name == "max")
+        {
+            // The reduction of a scalar is the scalar itself
+            call = argument;
+        }
+        else
+        {
+            rOK = rOK && !function.empty();
+            call = function+"("+argument+")";
+        }
+    }
+    else
+    {
+        const std::string a = emitOperand(rhs.front(), &rhs.back(), indent, rOK);
+        const std::string b = emitExpression(rhs.back(), indent, rOK);
+        // min and max as std::min and std::max
+        if (name == "min")
+        {
+            call = "("+b+" < "+a+") ? "+b+" : "+a;
+        }
+        else if (name == "max")
+        {
+            call = "("+a+" < "+b+") ? "+b+" : "+a;
+        }
+        else
+        {
+            const std::string function = mathFunctionName(name);
+            rOK = rOK && !function.empty();
+            call = function+"("+a+", "+b+")";
+        }
+    }
+    const std::string result = newTemporary();
+    addLine(indent, "const double "+result+" = "+call+";");
+    return result;
+}
+
+//! @brief Emit a sum, product or logical expression, the child expressions are folded starting from zero
+std::string CCodeEmitter::emitFold(const Expression &expr, int indent, bool &rOK)
+{
+    const std::list<Expression> &rhs = expr.rightChildExpressions();
+    std::string value = "0.0";
+    std::list<Expression>::const_iterator it, next;
+    for (it=rhs.begin(); it!=rhs.end() && rOK; ++it)
+    {
+        next = it;
+        ++next;
+        const ExpressionOperatorT childOp = it->operatorType();
+        const std::string newValue = emitOperand(*it, (next != rhs.end()) ? &(*next) : 0, indent, rOK);
+        std::string operation;
+        if (childOp == AdditionT)
+        {
+            operation = value+" + "+newValue;
+        }
+        else if (childOp == SubtractionT)
+        {
+            operation = value+" - "+newValue;
+        }
+        else if (childOp == MultiplicationT)
+        {
+            operation = value+" * "+newValue;
+        }
+        else if (childOp == DivisionT)
+        {
+            operation = value+" / "+newValue;
+        }
+        else if (childOp == OrT)
+        {
+            operation = boolified("("+boolified(value)+" + "+boolified(newValue)+")");
+        }
+        else if (childOp == AndT)
+        {
+            operation = boolified(value)+" * "+boolified(newValue);
+        }
+        else if (childOp != UndefinedT)
+        {
+            value = newValue;
+            continue;
+        }
+        else
+        {
+            rOK = false;
+        }
+        value = newTemporary();
+        addLine(indent, "const double "+value+" = "+operation+";");
+    }
+    return value;
+}
+
+//! @brief Emit an operand that must keep its value while a following operand is evaluated
+//! @details A variable is copied to a temporary if the following operand may assign it
+std::string CCodeEmitter::emitOperand(const Expression &expr, const Expression *pFollowing, int indent, bool &rOK)
+{
+    std::string value = emitExpression(expr, indent, rOK);
+    if (pFollowing && value[0] == 'v' && containsAssignment(*pFollowing))
+    {
+        const std::string copy = newTemporary();
+        addLine(indent, "const double "+copy+" = "+value+";");
+        value = copy;
+    }
+    return value;
+}
+
+std::string CCodeEmitter::newTemporary()
+{
+    char buff[32];
+    std::sprintf(buff, "t%lu", (unsigned long)mNumTemporaries++);
+    return buff;
+}
+
+//! @brief Format a value as a C double literal that reads back to the exact same value
+std::string CCodeEmitter::literal(double value) const
+{
+    if (value != value)
+    {
+        return "(HUGE_VAL - HUGE_VAL)";
+    }
+    else if (value == HUGE_VAL)
+    {
+        return "HUGE_VAL";
+    }
+    else if (value == -HUGE_VAL)
+    {
+        return "(-HUGE_VAL)";
+    }
+
+    char buff[64];
+    std::sprintf(buff, "%.17g", value);
+    std::string str = buff;
+    // Use . as decimal separator regardless of the current locale
+    bool isInteger = true;
+    for (size_t i=0; i<str.size(); ++i)
+    {
+        if (str[i] == ',')
+        {
+            str[i] = '.';
+        }
+        if (str[i] == '.' || str[i] == 'e')
+        {
+            isInteger = false;
+        }
+    }
+    if (isInteger)
+    {
+        str += ".0";
+    }
+    if (str[0] == '-')
+    {
+        str = "("+str+")";
+    }
+    return str;
+}
+
+void CCodeEmitter::addLine(int indent, const std::string &line)
+{
+    mBody.append(4*indent, ' ');
+    mBody += line;
+    mBody += '\n';
+}
+
+}
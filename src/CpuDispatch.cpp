@@ -0,0 +1,213 @@
+#include "numhop/CpuDispatch.h"
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+namespace numhop {
+
+namespace {
+
+// The array kernels for one instruction set, the compiler vectorizes the loops for the target of the functions
+#define NUMHOP_ARITHMETIC_KERNELS(SUFFIX, TARGET) \
+TARGET void addArrays##SUFFIX(const double *pA, const double *pB, size_t n, double *pOut) { for (size_t i=0; i<n; ++i) { pOut[i] = pA[i] + pB[i]; } } \
+TARGET void subtractArrays##SUFFIX(const double *pA, const double *pB, size_t n, double *pOut) { for (size_t i=0; i<n; ++i) { pOut[i] = pA[i] - pB[i]; } } \
+TARGET void multiplyArrays##SUFFIX(const double *pA, const double *pB, size_t n, double *pOut) { for (size_t i=0; i<n; ++i) { pOut[i] = pA[i] * pB[i]; } } \
+TARGET void divideArrays##SUFFIX(const double *pA, const double *pB, size_t n, double *pOut) { for (size_t i=0; i<n; ++i) { pOut[i] = pA[i] / pB[i]; } } \
+TARGET void addScalar##SUFFIX(const double *pA, double b, size_t n, double *pOut) { for (size_t i=0; i<n; ++i) { pOut[i] = pA[i] + b; } } \
+TARGET void subtractScalar##SUFFIX(const double *pA, double b, size_t n, double *pOut) { for (size_t i=0; i<n; ++i) { pOut[i] = pA[i] - b; } } \
+TARGET void multiplyScalar##SUFFIX(const double *pA, double b, size_t n, double *pOut) { for (size_t i=0; i<n; ++i) { pOut[i] = pA[i] * b; } } \
+TARGET void divideScalar##SUFFIX(const double *pA, double b, size_t n, double *pOut) { for (size_t i=0; i<n; ++i) { pOut[i] = pA[i] / b; } } \
+TARGET void scalarSubtract##SUFFIX(double a, const double *pB, size_t n, double *pOut) { for (size_t i=0; i<n; ++i) { pOut[i] = a - pB[i]; } } \
+TARGET void scalarDivide##SUFFIX(double a, const double *pB, size_t n, double *pOut) { for (size_t i=0; i<n; ++i) { pOut[i] = a / pB[i]; } } \
+void selectArithmeticKernels##SUFFIX(SimdKernels &rKernels) \
+{ \
+    rKernels.addArrays = &addArrays##SUFFIX; \
+    rKernels.subtractArrays = &subtractArrays##SUFFIX; \
+    rKernels.multiplyArrays = &multiplyArrays##SUFFIX; \
+    rKernels.divideArrays = &divideArrays##SUFFIX; \
+    rKernels.addScalar = &addScalar##SUFFIX; \
+    rKernels.subtractScalar = &subtractScalar##SUFFIX; \
+    rKernels.multiplyScalar = &multiplyScalar##SUFFIX; \
+    rKernels.divideScalar = &divideScalar##SUFFIX; \
+    rKernels.scalarSubtract = &scalarSubtract##SUFFIX; \
+    rKernels.scalarDivide = &scalarDivide##SUFFIX; \
+}
+
+NUMHOP_ARITHMETIC_KERNELS(Generic, NUMHOP_KERNEL_GENERIC)
+#ifdef NUMHOP_SIMD_TARGETS
+NUMHOP_ARITHMETIC_KERNELS(AVX2, NUMHOP_KERNEL_AVX2)
+NUMHOP_ARITHMETIC_KERNELS(AVX512, NUMHOP_KERNEL_AVX512)
+#endif
+
+//! @brief Ask the processor and the operating system which instruction sets can be used
+SimdLevelT detectProcessorSimdLevel()
+{
+#if defined(__x86_64__) || defined(_M_X64)
+    unsigned int regs[4] = {0, 0, 0, 0};
+#if defined(_MSC_VER)
+    int msRegs[4];
+    __cpuidex(msRegs, 1, 0);
+    std::memcpy(regs, msRegs, sizeof(regs));
+#else
+    __cpuid_count(1, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+    // AVX requires that the operating system saves the YMM registers (OSXSAVE and XCR0 bits 1 and 2)
+    const bool hasAVX = (regs[2] & (1u << 27)) && (regs[2] & (1u << 28));
+    if (!hasAVX)
+    {
+        return SSE2SimdT;
+    }
+#if defined(_MSC_VER)
+    const unsigned long long xcr0 = _xgetbv(0);
+#else
+    unsigned int xcr0Low, xcr0High;
+    __asm__ __volatile__ ("xgetbv" : "=a"(xcr0Low), "=d"(xcr0High) : "c"(0));
+    const unsigned long long xcr0 = (static_cast<unsigned long long>(xcr0High) << 32) | xcr0Low;
+#endif
+    if ((xcr0 & 0x6) != 0x6)
+    {
+        return SSE2SimdT;
+    }
+
+#if defined(_MSC_VER)
+    __cpuidex(msRegs, 7, 0);
+    std::memcpy(regs, msRegs, sizeof(regs));
+#else
+    __cpuid_count(7, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+    // AVX-512 also requires the opmask and ZMM registers to be saved (XCR0 bits 5 to 7)
+    if ((regs[1] & (1u << 16)) && (xcr0 & 0xE0) == 0xE0)
+    {
+        return AVX512SimdT;
+    }
+    return (regs[1] & (1u << 5)) ? AVX2SimdT : SSE2SimdT;
+#else
+    return GenericSimdT;
+#endif
+}
+
+//! @brief The kernels of the highest level that is compiled in, and not above a given level
+void selectKernels(SimdLevelT level, SimdKernels &rKernels)
+{
+    selectArithmeticKernelsGeneric(rKernels);
+#ifdef NUMHOP_SIMD_TARGETS
+    if (level == AVX2SimdT)
+    {
+        selectArithmeticKernelsAVX2(rKernels);
+    }
+    else if (level == AVX512SimdT)
+    {
+        selectArithmeticKernelsAVX512(rKernels);
+    }
+#endif
+    selectFastMathKernels(level, rKernels);
+}
+
+//! @brief The level given by the environment variable NUMHOP_SIMD_LEVEL, or the detected level
+SimdLevelT initialSimdLevel()
+{
+    const SimdLevelT detected = detectedSimdLevel();
+    const char *pOverride = std::getenv("NUMHOP_SIMD_LEVEL");
+    if (pOverride)
+    {
+        const std::string name(pOverride);
+        for (int level=GenericSimdT; level<=int(detected); ++level)
+        {
+            if (name == simdLevelName(SimdLevelT(level)))
+            {
+                return SimdLevelT(level);
+            }
+        }
+    }
+    return detected;
+}
+
+struct SimdDispatch
+{
+    SimdDispatch()
+    {
+        level = initialSimdLevel();
+        selectKernels(level, kernels);
+    }
+
+    SimdLevelT level;
+    SimdKernels kernels;
+};
+
+//! @brief The dispatch table, selected at first use
+SimdDispatch& simdDispatch()
+{
+    static SimdDispatch dispatch;
+    return dispatch;
+}
+
+}
+
+//! @brief Returns the highest instruction set level supported by the processor that the library has kernels for
+//! @details On x86-64, AVX2 and AVX-512 kernels are available when built with GCC or Clang (unless NUMHOP_NO_SIMD_DISPATCH is defined).
+//! The generic kernels are compiled for the baseline of the build target, SSE2 on x86-64.
+SimdLevelT detectedSimdLevel()
+{
+    static const SimdLevelT processorLevel = detectProcessorSimdLevel();
+#ifdef NUMHOP_SIMD_TARGETS
+    return processorLevel;
+#else
+    return (processorLevel > SSE2SimdT) ? SSE2SimdT : processorLevel;
+#endif
+}
+
+//! @brief Returns the instruction set level of the array kernels in use
+//! @details The level is selected at first use. It is the detected level, unless the environment variable NUMHOP_SIMD_LEVEL
+//! is set to a lower level: generic, sse2, avx2 or avx512.
+SimdLevelT simdLevel()
+{
+    return simdDispatch().level;
+}
+
+//! @brief Select the array kernels of another instruction set level, for testing and benchmarking
+//! @details This must not be called while other threads evaluate expressions.
+//! @param[in] level The level, it must not be above the detected level
+//! @returns False if the level is not supported, the level is then not changed
+bool setSimdLevel(SimdLevelT level)
+{
+    if (level < GenericSimdT || level > detectedSimdLevel())
+    {
+        return false;
+    }
+    SimdDispatch &rDispatch = simdDispatch();
+    rDispatch.level = level;
+    selectKernels(level, rDispatch.kernels);
+    return true;
+}
+
+//! @brief Returns the name of an instruction set level, as used in the environment variable NUMHOP_SIMD_LEVEL
+const char* simdLevelName(SimdLevelT level)
+{
+    switch (level)
+    {
+    case SSE2SimdT:
+        return "sse2";
+    case AVX2SimdT:
+        return "avx2";
+    case AVX512SimdT:
+        return "avx512";
+    default:
+        return "generic";
+    }
+}
+
+//! @brief Returns the array kernels of the selected instruction set level
+const SimdKernels &simdKernels()
+{
+    return simdDispatch().kernels;
+}
+
+}
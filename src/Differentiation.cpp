@@ -0,0 +1,536 @@
+#include "numhop/Differentiation.h"
+#include "numhop/Script.h"
+#include "numhop/VariableStorage.h"
+#include <cmath>
+#include <map>
+
+namespace numhop {
+
+namespace {
+
+inline double boolify(const double v)
+{
+    if (v>0.5) {return 1.;} return 0.;
+}
+
+//! @brief Compute the derivative of a built-in single argument function
+//! @param[in] name The function name
+//! @param[in] x The argument
+//! @param[in] fx The function value at x
+//! @param[out] rOK False if the function is unknown
+double derivative(const std::string &name, double x, double fx, bool &rOK)
+{
+    rOK = true;
+    if (name == "cos")   { return -sin(x); }
+    if (name == "sin")   { return cos(x); }
+    if (name == "tan")   { return 1.+fx*fx; }
+    if (name == "acos")  { return -1./sqrt(1.-x*x); }
+    if (name == "asin")  { return 1./sqrt(1.-x*x); }
+    if (name == "atan")  { return 1./(1.+x*x); }
+    if (name == "cosh")  { return sinh(x); }
+    if (name == "sinh")  { return cosh(x); }
+    if (name == "tanh")  { return 1.-fx*fx; }
+    if (name == "exp")   { return fx; }
+    if (name == "log")   { return 1./x; }
+    if (name == "log10") { return 1./(x*log(10.)); }
+    if (name == "sqrt")  { return 0.5/fx; }
+    if (name == "ceil" || name == "floor") { return 0.; }
+    if (name == "abs")   { return (x > 0) ? 1. : ((x < 0) ? -1. : 0.); }
+    if (name == "sum" || name == "mean" || name == "min" || name == "max") { return 1.; }
+    rOK = false;
+    return 0.;
+}
+
+//! @brief Compute the partial derivatives of a power
+void powerDerivatives(double a, double b, double value, double &rDa, double &rDb)
+{
+    rDa = b*pow(a, b-1.);
+    rDb = value*log(a);
+}
+
+//! @brief Compute the partial derivatives of a built-in two argument function
+//! @param[in] name The function name
+//! @param[in] a The first argument
+//! @param[in] b The second argument
+//! @param[in] value The function value
+//! @param[out] rDa The partial derivative with respect to a
+//! @param[out] rDb The partial derivative with respect to b
+//! @param[out] rOK False if the function is unknown
+void derivatives(const std::string &name, double a, double b, double value, double &rDa, double &rDb, bool &rOK)
+{
+    rOK = true;
+    rDa = 0.;
+    rDb = 0.;
+    if (name == "atan2")
+    {
+        // atan2(y,x)
+        const double r2 = a*a+b*b;
+        rDa = b/r2;
+        rDb = -a/r2;
+    }
+    else if (name == "pow")
+    {
+        powerDerivatives(a, b, value, rDa, rDb);
+    }
+    else if (name == "fmod")
+    {
+        // fmod(a,b) = a - trunc(a/b)*b
+        const double q = a/b;
+        rDa = 1.;
+        rDb = -((q < 0) ? ceil(q) : floor(q));
+    }
+    else if (name == "min")
+    {
+        // Same choice as std::min
+        ((b < a) ? rDb : rDa) = 1.;
+    }
+    else if (name == "max")
+    {
+        // Same choice as std::max
+        ((a < b) ? rDb : rDa) = 1.;
+    }
+    else
+    {
+        rOK = false;
+    }
+}
+
+//! @brief A value with its derivatives with respect to all selected variables, an empty vector means constant
+struct DualNumber
+{
+    double value;
+    std::vector<double> derivatives;
+};
+
+//! @brief Forward mode differentiation, all derivatives are propagated with the values
+class ForwardContext
+{
+public:
+    typedef DualNumber NumberT;
+
+    ForwardContext(size_t numVariables) : mNumVariables(numVariables) {}
+
+    NumberT constant(double value) const
+    {
+        NumberT result;
+        result.value = value;
+        return result;
+    }
+
+    NumberT seed(double value, size_t variableIndex) const
+    {
+        NumberT result;
+        result.value = value;
+        result.derivatives.resize(mNumVariables, 0.);
+        result.derivatives[variableIndex] = 1.;
+        return result;
+    }
+
+    NumberT combine(double value, const NumberT &a, double da) const
+    {
+        NumberT result;
+        result.value = value;
+        if (!a.derivatives.empty())
+        {
+            result.derivatives.resize(mNumVariables, 0.);
+            accumulate(result, a, da);
+        }
+        return result;
+    }
+
+    NumberT combine(double value, const NumberT &a, double da, const NumberT &b, double db) const
+    {
+        NumberT result;
+        result.value = value;
+        if (!a.derivatives.empty() || !b.derivatives.empty())
+        {
+            result.derivatives.resize(mNumVariables, 0.);
+            accumulate(result, a, da);
+            accumulate(result, b, db);
+        }
+        return result;
+    }
+
+    void gradient(const NumberT &result, std::vector<double> &rGradient) const
+    {
+        rGradient = result.derivatives;
+        rGradient.resize(mNumVariables, 0.);
+    }
+
+private:
+    void accumulate(NumberT &rResult, const NumberT &a, double da) const
+    {
+        for (size_t i=0; i<a.derivatives.size(); ++i)
+        {
+            // Zero derivatives must not be polluted by undefined partial derivatives
+            if (a.derivatives[i] != 0.)
+            {
+                rResult.derivatives[i] += da*a.derivatives[i];
+            }
+        }
+    }
+
+    size_t mNumVariables;
+};
+
+//! @brief A value and its index on the tape, -1 means constant
+struct TapeNumber
+{
+    double value;
+    int index;
+};
+
+//! @brief Reverse mode differentiation, operations are recorded on a tape that is swept backwards once
+class ReverseContext
+{
+public:
+    typedef TapeNumber NumberT;
+
+    ReverseContext(size_t numVariables) : mSeedIndices(numVariables, -1) {}
+
+    NumberT constant(double value) const
+    {
+        NumberT result;
+        result.value = value;
+        result.index = -1;
+        return result;
+    }
+
+    NumberT seed(double value, size_t variableIndex)
+    {
+        if (mSeedIndices[variableIndex] < 0)
+        {
+            mSeedIndices[variableIndex] = record(-1, 0., -1, 0.);
+        }
+        NumberT result;
+        result.value = value;
+        result.index = mSeedIndices[variableIndex];
+        return result;
+    }
+
+    NumberT combine(double value, const NumberT &a, double da)
+    {
+        return combine(value, a, da, constant(0.), 0.);
+    }
+
+    NumberT combine(double value, const NumberT &a, double da, const NumberT &b, double db)
+    {
+        NumberT result;
+        result.value = value;
+        result.index = (a.index < 0 && b.index < 0) ? -1 : record(a.index, da, b.index, db);
+        return result;
+    }
+
+    void gradient(const NumberT &result, std::vector<double> &rGradient) const
+    {
+        rGradient.assign(mSeedIndices.size(), 0.);
+        if (result.index < 0)
+        {
+            return;
+        }
+        std::vector<double> adjoints(result.index+1, 0.);
+        adjoints[result.index] = 1.;
+        for (int i=result.index; i>=0; --i)
+        {
+            const TapeEntry &entry = mTape[i];
+            if (adjoints[i] != 0.)
+            {
+                if (entry.a >= 0)
+                {
+                    adjoints[entry.a] += adjoints[i]*entry.da;
+                }
+                if (entry.b >= 0)
+                {
+                    adjoints[entry.b] += adjoints[i]*entry.db;
+                }
+            }
+        }
+        for (size_t v=0; v<mSeedIndices.size(); ++v)
+        {
+            if (mSeedIndices[v] >= 0 && mSeedIndices[v] <= result.index)
+            {
+                rGradient[v] = adjoints[mSeedIndices[v]];
+            }
+        }
+    }
+
+private:
+    struct TapeEntry
+    {
+        int a, b;
+        double da, db;
+    };
+
+    int record(int a, double da, int b, double db)
+    {
+        TapeEntry entry = {a, b, da, db};
+        mTape.push_back(entry);
+        return int(mTape.size())-1;
+    }
+
+    std::vector<TapeEntry> mTape;
+    std::vector<int> mSeedIndices;
+};
+
+//! @brief Evaluates expressions like Expression::evaluate while propagating derivatives through a context
+template <typename ContextT>
+class DifferentiatingEvaluator
+{
+public:
+    typedef typename ContextT::NumberT NumberT;
+
+    DifferentiatingEvaluator(ContextT &rContext, VariableStorage &rVariableStorage, const std::vector<std::string> &variableNames) :
+        mrContext(rContext), mrVariableStorage(rVariableStorage), mrVariableNames(variableNames) {}
+
+    NumberT evaluate(const Expression &expr, bool &rEvalOK)
+    {
+        const ExpressionOperatorT op = expr.operatorType();
+        const std::list<Expression> &lhs = expr.leftChildExpressions();
+        const std::list<Expression> &rhs = expr.rightChildExpressions();
+        bool lhsOK=false, rhsOK=false;
+        NumberT value = mrContext.constant(0.);
+
+        if (expr.isNumericConstant())
+        {
+            rEvalOK = true;
+            return mrContext.constant(expr.numericConstantValue());
+        }
+        else if (expr.isNamedValue())
+        {
+            lhsOK = true;
+            value = variable(expr.exprString(), rhsOK);
+        }
+        else if (op == AssignmentT)
+        {
+            bool dummy;
+            value = evaluate(rhs.front(), rhsOK);
+            if (rhsOK)
+            {
+                lhsOK = mrVariableStorage.setVariable(expr.leftExprString(), value.value, dummy);
+                if (lhsOK)
+                {
+                    mAssigned[expr.leftExprString()] = value;
+                }
+            }
+        }
+        else if (op == PowerT)
+        {
+            NumberT base = evaluate(lhs.front(), lhsOK);
+            NumberT exp = evaluate(rhs.front(), rhsOK);
+            const double result = pow(base.value, exp.value);
+            double da, db;
+            powerDerivatives(base.value, exp.value, result, da, db);
+            value = mrContext.combine(result, base, da, exp, db);
+        }
+        else if (op == LessThenT || op == GreaterThenT)
+        {
+            // Piecewise constant, the derivative is zero
+            NumberT l = evaluate(lhs.front(), lhsOK);
+            NumberT r = evaluate(rhs.front(), rhsOK);
+            value = mrContext.constant((op == LessThenT) ? double(l.value<r.value) : double(l.value>r.value));
+        }
+        else if (op == ConditionalT)
+        {
+            std::list<Expression>::const_iterator it = rhs.begin();
+            NumberT condition = evaluate(*it, lhsOK);
+            if (lhsOK)
+            {
+                ++it;
+                if (boolify(condition.value) < 0.5)
+                {
+                    ++it;
+                }
+                value = evaluate(*it, rhsOK);
+            }
+        }
+        else if (op == FunctionCallT)
+        {
+            lhsOK = true;
+            value = callFunction(expr, rhsOK);
+        }
+        else
+        {
+            lhsOK = true;
+            std::list<Expression>::const_iterator it;
+            for (it=rhs.begin(); it!=rhs.end(); ++it)
+            {
+                const ExpressionOperatorT optype = it->operatorType();
+                NumberT newValue = evaluate(*it, rhsOK);
+                const double a = value.value;
+                const double b = newValue.value;
+                if (optype == AdditionT)
+                {
+                    value = mrContext.combine(a+b, value, 1., newValue, 1.);
+                }
+                else if (optype == SubtractionT)
+                {
+                    value = mrContext.combine(a-b, value, 1., newValue, -1.);
+                }
+                else if (optype == MultiplicationT)
+                {
+                    value = mrContext.combine(a*b, value, b, newValue, a);
+                }
+                else if (optype == DivisionT)
+                {
+                    value = mrContext.combine(a/b, value, 1./b, newValue, -a/(b*b));
+                }
+                else if (optype == OrT)
+                {
+                    value = mrContext.constant(boolify(boolify(a)+boolify(b)));
+                }
+                else if (optype == AndT)
+                {
+                    value = mrContext.constant(boolify(a)*boolify(b));
+                }
+                else if (optype != UndefinedT)
+                {
+                    value = newValue;
+                }
+                else
+                {
+                    rEvalOK = false;
+                    return value;
+                }
+                if (!rhsOK)
+                {
+                    rEvalOK = false;
+                    return value;
+                }
+            }
+        }
+
+        rEvalOK = (lhsOK && rhsOK);
+        return value;
+    }
+
+private:
+    NumberT variable(const std::string &name, bool &rOK)
+    {
+        double value = mrVariableStorage.value(name, rOK);
+        // Variables assigned during the evaluation carry the derivatives of their expressions
+        typename std::map<std::string, NumberT>::const_iterator it = mAssigned.find(name);
+        if (it != mAssigned.end())
+        {
+            return it->second;
+        }
+        for (size_t i=0; i<mrVariableNames.size(); ++i)
+        {
+            if (mrVariableNames[i] == name)
+            {
+                return mrContext.seed(value, i);
+            }
+        }
+        return mrContext.constant(value);
+    }
+
+    NumberT callFunction(const Expression &expr, bool &rOK)
+    {
+        const std::list<Expression> &args = expr.rightChildExpressions();
+        const std::string &name = expr.leftExprString();
+        rOK = false;
+        if (args.size() == 1)
+        {
+            OneArgFunctionT pFunction = getOneArgFunction(expr.functionId());
+            NumberT x = evaluate(args.front(), rOK);
+            if (rOK && pFunction)
+            {
+                const double fx = pFunction(x.value);
+                const double dx = derivative(name, x.value, fx, rOK);
+                return mrContext.combine(fx, x, dx);
+            }
+        }
+        else if (args.size() == 2)
+        {
+            TwoArgFunctionT pFunction = getTwoArgFunction(expr.functionId());
+            bool aOK, bOK;
+            NumberT a = evaluate(args.front(), aOK);
+            NumberT b = evaluate(args.back(), bOK);
+            if (aOK && bOK && pFunction)
+            {
+                const double value = pFunction(a.value, b.value);
+                double da, db;
+                derivatives(name, a.value, b.value, value, da, db, rOK);
+                return mrContext.combine(value, a, da, b, db);
+            }
+        }
+        rOK = false;
+        return mrContext.constant(0.);
+    }
+
+    ContextT &mrContext;
+    VariableStorage &mrVariableStorage;
+    const std::vector<std::string> &mrVariableNames;
+    std::map<std::string, NumberT> mAssigned;
+};
+
+template <typename ContextT>
+double evaluateStatements(const std::vector<const Expression*> &statements, VariableStorage &rVariableStorage,
+                          const std::vector<std::string> &variableNames, std::vector<double> &rGradient, bool &rEvalOK)
+{
+    ContextT context(variableNames.size());
+    DifferentiatingEvaluator<ContextT> evaluator(context, rVariableStorage, variableNames);
+    typename ContextT::NumberT value = context.constant(0.);
+    rEvalOK = true;
+    for (size_t i=0; i<statements.size() && rEvalOK; ++i)
+    {
+        value = evaluator.evaluate(*statements[i], rEvalOK);
+    }
+    context.gradient(value, rGradient);
+    return value.value;
+}
+
+double evaluateStatements(const std::vector<const Expression*> &statements, VariableStorage &rVariableStorage,
+                          const std::vector<std::string> &variableNames, std::vector<double> &rGradient, bool &rEvalOK, DifferentiationModeT mode)
+{
+    if (mode == ForwardMode)
+    {
+        return evaluateStatements<ForwardContext>(statements, rVariableStorage, variableNames, rGradient, rEvalOK);
+    }
+    return evaluateStatements<ReverseContext>(statements, rVariableStorage, variableNames, rGradient, rEvalOK);
+}
+
+}
+
+//! @brief Evaluate an expression and its gradient in a single pass
+//! @details Forward mode propagates dual numbers, reverse mode records the operations on a tape and sweeps it backwards.
+//! Reverse mode is cheaper when differentiating with respect to many variables. Comparisons, boolean operators, ceil and floor
+//! are piecewise constant and have zero derivative, only the taken branch of a conditional contributes.
+//! @param[in] expr The expression to evaluate
+//! @param[in,out] rVariableStorage The variable storage
+//! @param[in] variableNames The names of the variables to differentiate with respect to
+//! @param[out] rGradient The partial derivatives, in the same order as variableNames
+//! @param[out] rEvalOK Indicates whether evaluation was successful or not
+//! @param[in] mode Forward or reverse mode differentiation
+//! @return The value of the evaluated expression, identical to the value from Expression::evaluate
+double evaluateWithGradient(const Expression &expr, VariableStorage &rVariableStorage, const std::vector<std::string> &variableNames,
+                            std::vector<double> &rGradient, bool &rEvalOK, DifferentiationModeT mode)
+{
+    return evaluateStatements(std::vector<const Expression*>(1, &expr), rVariableStorage, variableNames, rGradient, rEvalOK, mode);
+}
+
+//! @brief Evaluate a script and the gradient of its last statement in a single pass
+//! @details Variables assigned in earlier statements carry their derivatives to the following statements
+//! @param[in] script The interpreted script
+//! @param[in,out] rVariableStorage The variable storage
+//! @param[in] variableNames The names of the variables to differentiate with respect to
+//! @param[out] rGradient The partial derivatives, in the same order as variableNames
+//! @param[out] rEvalOK Indicates whether evaluation was successful or not
+//! @param[in] mode Forward or reverse mode differentiation
+//! @return The value of the last statement, identical to the value from Script::evaluate
+double evaluateWithGradient(const Script &script, VariableStorage &rVariableStorage, const std::vector<std::string> &variableNames,
+                            std::vector<double> &rGradient, bool &rEvalOK, DifferentiationModeT mode)
+{
+    std::vector<const Expression*> statements;
+    for (size_t i=0; i<script.numStatements(); ++i)
+    {
+        if (!script.statement(i).isValid)
+        {
+            rEvalOK = false;
+            return 0.;
+        }
+        statements.push_back(&script.statement(i).expression);
+    }
+    return evaluateStatements(statements, rVariableStorage, variableNames, rGradient, rEvalOK, mode);
+}
+
+}
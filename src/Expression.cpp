@@ -1,15 +1,28 @@
 #include "numhop/Expression.h"
+#include "numhop/FastMath.h"
 #include "numhop/Helpfunctions.h"
+#include "numhop/NumberParsing.h"
+#include "numhop/Serialization.h"
 #include <cstdlib>
+#include <cstring>
 #include <cmath>
+#include <cfloat>
+#include <cstdio>
 #include <vector>
 #include <algorithm>
+#include <deque>
+#include <new>
 
 namespace numhop {
 
 const std::string allOperators="=+-*/^<>&|";
 const std::string operatorsNotAllowedAfterEqualSign="=*/^<>&|";
 const std::string operatorsNotPME="*/^<>&|";
+const int maxReducedIntegerExponent=32;
+const int maxPolynomialDegree=64;
+const int minEstrinDegree=8;
+// Deeper expressions are evaluated on an explicit stack, see Expression::evaluate
+const size_t maxRecursiveEvaluationDepth=64;
 
 // Internal help functions
 inline double boolify(const double v)
@@ -17,6 +30,23 @@ inline double boolify(const double v)
     if (v>0.5) {return 1.;} return 0.;
 }
 
+//! @brief Check if an expression with this operator folds its child expressions
+inline bool isFoldOperator(const ExpressionOperatorT op)
+{
+    return !(op == AssignmentT || op == PowerT || op == LessThenT || op == GreaterThenT ||
+             op == ConditionalT || op == FunctionCallT || op == ValueT || op == UndefinedT);
+}
+
+inline uint64_t hashCombine(uint64_t hash, uint64_t value)
+{
+    return (hash ^ (value + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2))) * 1099511628211ULL;
+}
+
+inline bool sameBits(double a, double b)
+{
+    return std::memcmp(&a, &b, sizeof(double)) == 0;
+}
+
 inline bool checkOperatorsNexttoEqualSign(size_t e, const std::string &expr)
 {
     if ( (int(e) < int(expr.size())-1) && contains(operatorsNotAllowedAfterEqualSign, expr[e+1]) )
@@ -73,9 +103,10 @@ bool fixMultiOperators(size_t e, std::string &expr)
 
 double decideIfNumericConstantOrNamedValue(const std::string &expr, bool &rIsNumericConstant, bool &rIsNamedValue)
 {
-    char* pEnd;
-    double value = strtod(expr.c_str(), &pEnd);
-    rIsNumericConstant = (pEnd != expr.c_str()) && (pEnd == expr.c_str()+expr.size());
+    double value;
+    const char* pBegin = expr.data();
+    const char* pEnd = parseDecimalNumber(pBegin, pBegin+expr.size(), value);
+    rIsNumericConstant = (pEnd != pBegin) && (pEnd == pBegin+expr.size());
     rIsNamedValue = !rIsNumericConstant;
     return value;
 }
@@ -123,7 +154,85 @@ bool expressionIsFunctionCall(std::string& expr)
     return false;
 }
 
-bool splitFunctionCallExpression(const std::string& expr, std::string& funcName, std::list<Expression>& args)
+//! @brief An expression that is added to the tree but not yet interpreted
+//! @details Expression trees are built from a work list of pending expressions instead of recursively,
+//! so that the parser itself does not need call stack for each nesting level
+struct PendingExpression
+{
+    Expression *pExpr;
+    std::string leftExprString, rightExprString;
+    ExpressionOperatorT op;
+    bool isTwoSided;
+    size_t depth;
+
+    void interpret(std::vector<PendingExpression> &rPending) const
+    {
+        if (isTwoSided)
+        {
+            pExpr->interpret(leftExprString, rightExprString, op, rPending);
+        }
+        else
+        {
+            pExpr->interpret(rightExprString, op, rPending);
+        }
+    }
+};
+
+//! @brief Add an expression with one expression string (rhs) to be interpreted later
+static void deferExpression(std::list<Expression> &rExprList, const std::string &exprString, ExpressionOperatorT op, std::vector<PendingExpression> &rPending)
+{
+    rExprList.push_back(Expression());
+    PendingExpression pending;
+    pending.pExpr = &rExprList.back();
+    pending.rightExprString = exprString;
+    pending.op = op;
+    pending.isTwoSided = false;
+    pending.depth = 0;
+    rPending.push_back(pending);
+}
+
+//! @brief Add an expression with two expression strings (lhs and rhs) to be interpreted later
+static void deferExpression(std::list<Expression> &rExprList, const std::string &leftExprString, const std::string &rightExprString, ExpressionOperatorT op, std::vector<PendingExpression> &rPending)
+{
+    deferExpression(rExprList, rightExprString, op, rPending);
+    rPending.back().leftExprString = leftExprString;
+    rPending.back().isTwoSided = true;
+}
+
+//! @brief Interpret pending expressions until the expression tree is complete
+//! @details Expressions deeper than maxExpressionTreeDepth are left invalid and not interpreted
+//! @param[in,out] rPending The pending expressions
+//! @param[in] parentDepth The depth in the tree of the parent of the pending expressions, the root has depth 1
+static void interpretPending(std::vector<PendingExpression> &rPending, const size_t parentDepth)
+{
+    for (size_t i=0; i<rPending.size(); ++i)
+    {
+        rPending[i].depth = parentDepth+1;
+    }
+    while (!rPending.empty())
+    {
+        PendingExpression pending;
+        pending.pExpr = rPending.back().pExpr;
+        pending.leftExprString.swap(rPending.back().leftExprString);
+        pending.rightExprString.swap(rPending.back().rightExprString);
+        pending.op = rPending.back().op;
+        pending.isTwoSided = rPending.back().isTwoSided;
+        pending.depth = rPending.back().depth;
+        rPending.pop_back();
+        if (pending.depth > maxExpressionTreeDepth)
+        {
+            continue;
+        }
+        const size_t numPending = rPending.size();
+        pending.interpret(rPending);
+        for (size_t i=numPending; i<rPending.size(); ++i)
+        {
+            rPending[i].depth = pending.depth+1;
+        }
+    }
+}
+
+bool splitFunctionCallExpression(const std::string& expr, std::string& funcName, std::list<Expression>& args, std::vector<PendingExpression> &rPending)
 {
     std::string::size_type arg_start = expr.find_first_of('(');
     std::string::size_type args_end = expr.find_last_of(')');
@@ -132,11 +241,22 @@ bool splitFunctionCallExpression(const std::string& expr, std::string& funcName,
 
     ++arg_start;
     while (arg_start < args_end) {
-        std::string::size_type arg_end = expr.find_first_of(',', arg_start);
-        if (arg_end == std::string::npos) {
-            arg_end = args_end;
+        // Find the next argument separator, ignoring , inside nested function calls or parenthesis
+        std::string::size_type arg_end = arg_start;
+        int nOpenParanthesis = 0;
+        for (; arg_end < args_end; ++arg_end) {
+            const char c = expr[arg_end];
+            if (c == '(') {
+                ++nOpenParanthesis;
+            }
+            else if (c == ')') {
+                --nOpenParanthesis;
+            }
+            else if (c == ',' && nOpenParanthesis == 0) {
+                break;
+            }
         }
-        args.push_back(Expression(expr.substr(arg_start, arg_end-arg_start), AdditionT));
+        deferExpression(args, expr.substr(arg_start, arg_end-arg_start), AdditionT, rPending);
         arg_start = arg_end+1;
     }
 
@@ -155,13 +275,40 @@ T max(T a, T b)
     return std::max(a,b);
 }
 
+//! @brief The reduction of a single value is the value itself, arrays are reduced by evaluateElementWise()
+template <typename T>
+T reduceScalar(T v)
+{
+    return v;
+}
+
+//! @brief A registered function, called through one of the function pointers
+struct RegisteredFunction
+{
+    std::string name;
+    size_t numArgs;
+    OneArgFunctionT pOneArgFunction;
+    TwoArgFunctionT pTwoArgFunction;
+    NativeFunctionT pNativeFunction;
+    void *pContext;
+    OneArgFunctionT pFastOneArgFunction;
+    TwoArgFunctionT pFastTwoArgFunction;
+    ArrayFunctionT pFastArrayFunction;
+    bool isPure;
+};
+
+double callNativeFunctionObject(const double *pArgs, size_t numArgs, void *pContext)
+{
+    return static_cast<NativeFunction*>(pContext)->call(pArgs, numArgs);
+}
+
 class FunctionHandler
 {
 public:
     typedef double(*onearg_function)(double);
     typedef double(*twoarg_function)(double, double);
 
-    FunctionHandler() : mIdCounter(0)
+    FunctionHandler()
     {
         // register single argument built-in math functions
         registerFunction("cos", static_cast<onearg_function>(&cos));
@@ -192,81 +339,184 @@ public:
         registerFunction("min", static_cast<twoarg_function>(&min<double>));
         registerFunction("max", static_cast<twoarg_function>(&max<double>));
 
+        // register reductions, they only reduce arrays in element-wise evaluation
+        registerFunction("sum", static_cast<onearg_function>(&reduceScalar<double>));
+        registerFunction("mean", static_cast<onearg_function>(&reduceScalar<double>));
+        registerFunction("min", static_cast<onearg_function>(&reduceScalar<double>));
+        registerFunction("max", static_cast<onearg_function>(&reduceScalar<double>));
+
+        // register the fast math approximations of built-in functions
+        setFastFunction("exp", &fastExp, &fastExpArray);
+        setFastFunction("log", &fastLog, &fastLogArray);
+        setFastFunction("log10", &fastLog10, &fastLog10Array);
+        setFastFunction("sin", &fastSin, &fastSinArray);
+        setFastFunction("cos", &fastCos, &fastCosArray);
+        setFastFunction("tanh", &fastTanh, &fastTanhArray);
+        setFastFunction("atan", &fastAtan, &fastAtanArray);
+        setFastFunction("atan2", &fastAtan2);
+
+        // The built-in functions have no side effects
+        for (size_t i=0; i<mFunctions.size(); ++i) {
+            mFunctions[i].isPure = true;
+        }
     }
 
     int registerFunction(const std::string& name, onearg_function funcPointer)
     {
-        int id = registerName(name);
-        mOneArgFuncs.insert(std::pair<size_t, onearg_function>(id, funcPointer));
-        return id;
+        RegisteredFunction function = newFunction(name, 1);
+        function.pOneArgFunction = funcPointer;
+        return registerFunction(function, funcPointer != 0);
     }
 
     int registerFunction(const std::string& name, twoarg_function funcPointer)
     {
-        int id = registerName(name);
-        mTwoArgFuncs.insert(std::pair<size_t, twoarg_function>(id, funcPointer));
-        return id;
+        RegisteredFunction function = newFunction(name, 2);
+        function.pTwoArgFunction = funcPointer;
+        return registerFunction(function, funcPointer != 0);
+    }
+
+    int registerFunction(const std::string& name, size_t numArgs, NativeFunctionT funcPointer, void *pContext)
+    {
+        RegisteredFunction function = newFunction(name, numArgs);
+        function.pNativeFunction = funcPointer;
+        function.pContext = pContext;
+        return registerFunction(function, funcPointer != 0);
     }
 
     int lookupFunctionId(const std::string& name, const size_t numArgs) const
     {
-        std::map<std::string, int>::const_iterator it = mNameIdMap.find(name);
-        int id = (it != mNameIdMap.end()) ? it->second : -1;
-        switch (numArgs) {
-        case 1 :
-            return contains(mOneArgFuncs, id) ? id : -1;
-        case 2 :
-            return contains(mTwoArgFuncs, id) ? id : -1;
-        default:
-            return -1;
-        }
+        std::map<std::pair<std::string, size_t>, int>::const_iterator it = mIdMap.find(std::make_pair(name, numArgs));
+        return (it != mIdMap.end()) ? it->second : -1;
+    }
+
+    const RegisteredFunction* function(const int id) const
+    {
+        return (id >= 0 && size_t(id) < mFunctions.size()) ? &mFunctions[id] : 0;
     }
 
-    double callFunction(const int id, const std::list<Expression>& args, VariableStorage &rVariableStorage, bool &rEvalOK)
+    //! @brief Call a function with evaluated arguments
+    //! @details The fast approximation of a built-in function is called if the variable storage uses fast math
+    double callFunction(const RegisteredFunction *pFunction, const double *pArgs, size_t numArgs, VariableStorage &rVariableStorage) const
     {
-        if (id >= 0) {
-            const size_t numArgs = args.size();
-            if (numArgs == 1) {
-                double arg1 = args.front().evaluate(rVariableStorage, rEvalOK);
-                return mOneArgFuncs[id](arg1);
+        if (pFunction->pOneArgFunction) {
+            if (pFunction->pFastOneArgFunction && rVariableStorage.isFastMath()) {
+                return pFunction->pFastOneArgFunction(pArgs[0]);
             }
-            else if (numArgs == 2) {
-                bool ok1,ok2;
-                double arg1 = args.front().evaluate(rVariableStorage, ok1);
-                double arg2 = (++args.begin())->evaluate(rVariableStorage, ok2);
-                rEvalOK = ok1 && ok2;
-                return mTwoArgFuncs[id](arg1, arg2);
+            return pFunction->pOneArgFunction(pArgs[0]);
+        }
+        else if (pFunction->pTwoArgFunction) {
+            if (pFunction->pFastTwoArgFunction && rVariableStorage.isFastMath()) {
+                return pFunction->pFastTwoArgFunction(pArgs[0], pArgs[1]);
             }
+            return pFunction->pTwoArgFunction(pArgs[0], pArgs[1]);
+        }
+        return pFunction->pNativeFunction(pArgs, numArgs, pFunction->pContext);
+    }
+
+    onearg_function oneArgFunction(const int id, const bool fastMath) const
+    {
+        const RegisteredFunction *pFunction = function(id);
+        if (pFunction && fastMath && pFunction->pFastOneArgFunction) {
+            return pFunction->pFastOneArgFunction;
+        }
+        return pFunction ? pFunction->pOneArgFunction : 0;
+    }
+
+    twoarg_function twoArgFunction(const int id, const bool fastMath) const
+    {
+        const RegisteredFunction *pFunction = function(id);
+        if (pFunction && fastMath && pFunction->pFastTwoArgFunction) {
+            return pFunction->pFastTwoArgFunction;
         }
-        rEvalOK=false;
-        return -1;
+        return pFunction ? pFunction->pTwoArgFunction : 0;
+    }
+
+    ArrayFunctionT arrayFunction(const int id, const bool fastMath) const
+    {
+        const RegisteredFunction *pFunction = function(id);
+        return (pFunction && fastMath) ? pFunction->pFastArrayFunction : 0;
     }
 
     std::vector<std::string> registeredFunctionNames() const
     {
+        // The map is sorted on names, functions with several number of arguments are listed once
         std::vector<std::string> names;
-        names.reserve(mNameIdMap.size());
-        std::map<std::string, int>::const_iterator it;
-        for (it=mNameIdMap.begin(); it!=mNameIdMap.end(); ++it) {
-            names.push_back(it->first);
+        std::map<std::pair<std::string, size_t>, int>::const_iterator it;
+        for (it=mIdMap.begin(); it!=mIdMap.end(); ++it) {
+            if (names.empty() || names.back() != it->first.first) {
+                names.push_back(it->first.first);
+            }
         }
         return names;
     }
 
 protected:
-    int registerName(const std::string& name)
+    static RegisteredFunction newFunction(const std::string& name, size_t numArgs)
+    {
+        RegisteredFunction function;
+        function.name = name;
+        function.numArgs = numArgs;
+        function.pOneArgFunction = 0;
+        function.pTwoArgFunction = 0;
+        function.pNativeFunction = 0;
+        function.pContext = 0;
+        function.pFastOneArgFunction = 0;
+        function.pFastTwoArgFunction = 0;
+        function.pFastArrayFunction = 0;
+        function.isPure = false;
+        return function;
+    }
+
+    //! @brief Add a fast approximation to a built-in function
+    void setFastFunction(const std::string& name, onearg_function funcPointer, ArrayFunctionT arrayFuncPointer)
+    {
+        RegisteredFunction &rFunction = mFunctions[lookupFunctionId(name, 1)];
+        rFunction.pFastOneArgFunction = funcPointer;
+        rFunction.pFastArrayFunction = arrayFuncPointer;
+    }
+
+    void setFastFunction(const std::string& name, twoarg_function funcPointer)
+    {
+        mFunctions[lookupFunctionId(name, 2)].pFastTwoArgFunction = funcPointer;
+    }
+
+    int registerFunction(const RegisteredFunction& function, bool hasFunctionPointer)
     {
-        mNameIdMap.insert(std::pair<std::string, size_t>(name, mIdCounter));
-        return mIdCounter++;
+        // The name must be possible to call, "if" is reserved for conditional expressions
+        const std::string &name = function.name;
+        if (!hasFunctionPointer || function.numArgs < 1 || function.numArgs > maxFunctionArguments ||
+            name.empty() || !isalpha(name[0]) || std::find_if(name.begin(), name.end(), notAlphaNum) != name.end() || name == "if") {
+            return -1;
+        }
+
+        // Built-in names can not be registered again, with any number of arguments, since rewrites recognize them by name
+        std::map<std::pair<std::string, size_t>, int>::const_iterator builtIn = mIdMap.lower_bound(std::make_pair(name, size_t(0)));
+        for (; builtIn != mIdMap.end() && builtIn->first.first == name; ++builtIn) {
+            if (mFunctions[builtIn->second].isPure) {
+                return -1;
+            }
+        }
+
+        // Registering the same name and number of arguments again replaces the function
+        const std::pair<std::string, size_t> key(name, function.numArgs);
+        std::map<std::pair<std::string, size_t>, int>::const_iterator it = mIdMap.find(key);
+        if (it != mIdMap.end()) {
+            mFunctions[it->second] = function;
+            return it->second;
+        }
+        mFunctions.push_back(function);
+        const int id = int(mFunctions.size()-1);
+        mIdMap.insert(std::make_pair(key, id));
+        return id;
     }
 
-    int mIdCounter;
-    std::map<std::string, int> mNameIdMap;
-    std::map<int, onearg_function> mOneArgFuncs;
-    std::map<int, twoarg_function> mTwoArgFuncs;
-    //! @todo Maybe better to use vectors for faster "constant" lookup
+    // A deque keeps the address of each function when more are registered
+    std::deque<RegisteredFunction> mFunctions;
+    std::map<std::pair<std::string, size_t>, int> mIdMap;
 };
 
+// Built-in functions are registered during static initialization, user functions by registerFunction().
+// Functions must not be registered while expressions are interpreted or evaluated in other threads.
 static FunctionHandler gFunctionHandler;
 
 
@@ -274,8 +524,9 @@ static FunctionHandler gFunctionHandler;
 //! @param[in] exprString The expression string to process
 //! @param[in] evalOperators A string with the operators to search for
 //! @param[out] rExprList The resulting expression list (Empty if nothing found)
+//! @param[in,out] rPending The expressions in the list that remain to be interpreted
 //! @returns False if some error occurred else true
-bool branchExpressionOnOperator(std::string exprString, const std::string &evalOperators, std::list<Expression> &rExprList)
+bool branchExpressionOnOperator(std::string exprString, const std::string &evalOperators, std::list<Expression> &rExprList, std::vector<PendingExpression> &rPending)
 {
     bool hadParanthesis;
     removeAllWhitespaces(exprString);
@@ -398,19 +649,19 @@ bool branchExpressionOnOperator(std::string exprString, const std::string &evalO
                 char op = left[0];
                 if (op == '-')
                 {
-                    rExprList.push_back(Expression(left.substr(1), SubtractionT));
+                    deferExpression(rExprList, left.substr(1), SubtractionT, rPending);
                 }
                 else if (op == '+')
                 {
-                    rExprList.push_back(Expression(left.substr(1), AdditionT));
+                    deferExpression(rExprList, left.substr(1), AdditionT, rPending);
                 }
                 else if (op == '|')
                 {
-                    rExprList.push_back(Expression(left.substr(1), OrT));
+                    deferExpression(rExprList, left.substr(1), OrT, rPending);
                 }
                 else
                 {
-                    rExprList.push_back(Expression(left, AdditionT));
+                    deferExpression(rExprList, left, AdditionT, rPending);
                 }
             }
         }
@@ -422,19 +673,19 @@ bool branchExpressionOnOperator(std::string exprString, const std::string &evalO
                 char op = left[0];
                 if (op == '/')
                 {
-                    rExprList.push_back(Expression(left.substr(1), DivisionT));
+                    deferExpression(rExprList, left.substr(1), DivisionT, rPending);
                 }
                 else if (op == '*')
                 {
-                    rExprList.push_back(Expression(left.substr(1), MultiplicationT));
+                    deferExpression(rExprList, left.substr(1), MultiplicationT, rPending);
                 }
                 else if (op == '&')
                 {
-                    rExprList.push_back(Expression(left.substr(1), AndT));
+                    deferExpression(rExprList, left.substr(1), AndT, rPending);
                 }
                 else
                 {
-                    rExprList.push_back(Expression(left, AdditionT));
+                    deferExpression(rExprList, left, AdditionT, rPending);
                 }
             }
         }
@@ -447,19 +698,19 @@ bool branchExpressionOnOperator(std::string exprString, const std::string &evalO
                 char op = right[0];
                 if (op == '=')
                 {
-                    rExprList.push_back(Expression(left, right.substr(1), AssignmentT));
+                    deferExpression(rExprList, left, right.substr(1), AssignmentT, rPending);
                 }
                 else if (op == '^')
                 {
-                    rExprList.push_back(Expression(left, right.substr(1), PowerT));
+                    deferExpression(rExprList, left, right.substr(1), PowerT, rPending);
                 }
                 else if (op == '<')
                 {
-                    rExprList.push_back(Expression(left, right.substr(1), LessThenT));
+                    deferExpression(rExprList, left, right.substr(1), LessThenT, rPending);
                 }
                 else
                 {
-                    rExprList.push_back(Expression(left, right.substr(1), GreaterThenT));
+                    deferExpression(rExprList, left, right.substr(1), GreaterThenT, rPending);
                 }
             }
             else
@@ -474,30 +725,32 @@ bool branchExpressionOnOperator(std::string exprString, const std::string &evalO
     return true;
 }
 
-//! @brief Process an expression string recursively to build an expression tree
+//! @brief Process an expression string to build the branches of an expression tree
 //! @param[in] exprString The expression string to process
 //! @param[out] rExprList A list of the resulting expression branches
-bool interpretExpressionStringRecursive(std::string exprString, std::list<Expression> &rExprList)
+//! @param[in,out] rPending The branches that remain to be interpreted
+static bool interpretExpressionString(std::string exprString, std::list<Expression> &rExprList, std::vector<PendingExpression> &rPending)
 {
     bool branchOK;
-    branchOK = branchExpressionOnOperator(exprString, "=", rExprList);
+    branchOK = branchExpressionOnOperator(exprString, "=", rExprList, rPending);
     if (branchOK && rExprList.empty())
     {
-        branchOK = branchExpressionOnOperator(exprString, "+-|", rExprList);
+        branchOK = branchExpressionOnOperator(exprString, "+-|", rExprList, rPending);
         if (branchOK && rExprList.empty())
         {
-            branchOK = branchExpressionOnOperator(exprString, "*/&", rExprList);
+            branchOK = branchExpressionOnOperator(exprString, "*/&", rExprList, rPending);
             if (branchOK && rExprList.empty())
             {
-                branchOK = branchExpressionOnOperator(exprString, "^<>", rExprList);
+                branchOK = branchExpressionOnOperator(exprString, "^<>", rExprList, rPending);
                 if (branchOK && rExprList.empty())
                 {
                     // This must be a value or a function call
                     const bool isFuncCall = expressionIsFunctionCall(exprString);
                     if (isFuncCall) {
-                        rExprList.push_back(Expression(exprString, FunctionCallT));
+                        deferExpression(rExprList, exprString, FunctionCallT, rPending);
                     }
                     else {
+                        // Values are interpreted at once, the parent expression takes over a single value
                         rExprList.push_back(Expression(exprString, ValueT));
                     }
                 }
@@ -507,12 +760,48 @@ bool interpretExpressionStringRecursive(std::string exprString, std::list<Expres
     return branchOK;
 }
 
-//! @brief Process an expression string recursively to build an expression tree
+//! @brief Process an expression string to build the branches of an expression tree
+//! @param[in] exprString The expression string to process
+//! @param[out] rExprList A list of the resulting expression branches
+bool interpretExpressionStringRecursive(std::string exprString, std::list<Expression> &rExprList)
+{
+    std::vector<PendingExpression> pending;
+    const bool branchOK = interpretExpressionString(exprString, rExprList, pending);
+    interpretPending(pending, 0);
+    return branchOK;
+}
+
+//! @brief Process an expression string to build an expression tree
+//! @details Subexpressions deeper than maxExpressionTreeDepth in the tree are invalid
 //! @param[in] exprString The expression string to process
 //! @param[out] rExpr The resulting expression tree
 bool interpretExpressionStringRecursive(std::string exprString, Expression &rExpr)
 {
-    rExpr = Expression(exprString, AdditionT);
+    Expression expr(exprString, AdditionT);
+    rExpr.swap(expr);
+    return rExpr.isValid();
+}
+
+//! @brief Process an expression string (not null terminated) to build an expression tree
+//! @details Use this to interpret statement spans from a ScriptReader directly, without first copying them into strings
+//! @param[in] pExprString Pointer to the first character of the expression
+//! @param[in] length The length of the expression
+//! @param[out] rExpr The resulting expression tree
+bool interpretExpressionStringRecursive(const char *pExprString, size_t length, Expression &rExpr)
+{
+    // Copy once while removing white spaces
+    std::string exprString;
+    exprString.reserve(length);
+    for (size_t i=0; i<length; ++i)
+    {
+        const char c = pExprString[i];
+        if (c != ' ' && c != '\t')
+        {
+            exprString.push_back(c);
+        }
+    }
+    Expression expr(exprString, AdditionT);
+    rExpr.swap(expr);
     return rExpr.isValid();
 }
 
@@ -528,10 +817,46 @@ Expression::Expression(const Expression &other)
     copyFromOther(other);
 }
 
+//! @brief Destructor
+Expression::~Expression()
+{
+    // The tree is taken apart with a work list instead of recursively, deep trees must not overflow the call stack
+    std::list<Expression> expressions;
+    expressions.splice(expressions.end(), mLeftChildExpressions);
+    expressions.splice(expressions.end(), mRightChildExpressions);
+    while (!expressions.empty())
+    {
+        Expression &rExpr = expressions.front();
+        expressions.splice(expressions.end(), rExpr.mLeftChildExpressions);
+        expressions.splice(expressions.end(), rExpr.mRightChildExpressions);
+        expressions.pop_front();
+    }
+}
+
 //! @brief Constructor taking one expression string (rhs)
 Expression::Expression(const std::string &exprString, ExpressionOperatorT op)
 {
     commonConstructorCode();
+    std::vector<PendingExpression> pending;
+    interpret(exprString, op, pending);
+    interpretPending(pending, 1);
+}
+
+//! @brief Constructor taking two expression strings (lhs and rhs)
+Expression::Expression(const std::string &leftExprString, const std::string &rightExprString, ExpressionOperatorT op)
+{
+    commonConstructorCode();
+    std::vector<PendingExpression> pending;
+    interpret(leftExprString, rightExprString, op, pending);
+    interpretPending(pending, 1);
+}
+
+//! @brief Interpret one expression string (rhs), child expressions are added to the pending work list
+//! @param[in] exprString The expression string
+//! @param[in] op The operator of this expression
+//! @param[in,out] rPending The work list of expressions that remain to be interpreted
+void Expression::interpret(const std::string &exprString, ExpressionOperatorT op, std::vector<PendingExpression> &rPending)
+{
     mRightExpressionString = exprString;
     removeAllWhitespaces(mRightExpressionString);
     stripLeadingTrailingParanthesis(mRightExpressionString, mHadRightOuterParanthesis);
@@ -547,15 +872,21 @@ Expression::Expression(const std::string &exprString, ExpressionOperatorT op)
     }
     else if (mOperator == FunctionCallT)
     {
-        mIsValid = splitFunctionCallExpression(mRightExpressionString, mLeftExpressionString, mRightChildExpressions);
-        if (mIsValid) {
+        mIsValid = splitFunctionCallExpression(mRightExpressionString, mLeftExpressionString, mRightChildExpressions, rPending);
+        if (mIsValid && mLeftExpressionString == "if") {
+            // The conditional if(condition, true_expr, false_expr) is not a function, it must only evaluate the taken branch
+            mOperator = ConditionalT;
+            mIsValid = (mRightChildExpressions.size() == 3);
+        }
+        else if (mIsValid) {
             mFunctionId = gFunctionHandler.lookupFunctionId(mLeftExpressionString, mRightChildExpressions.size());
+            mpFunction = gFunctionHandler.function(mFunctionId);
             mIsValid = (mFunctionId >= 0);
         }
     }
     else
     {
-        mIsValid = interpretExpressionStringRecursive(mRightExpressionString, mRightChildExpressions);
+        mIsValid = interpretExpressionString(mRightExpressionString, mRightChildExpressions, rPending);
         // If child expression is a value, then move the value into this expression
         if (mRightChildExpressions.size() == 1 && mRightChildExpressions.front().operatorType()==ValueT)
         {
@@ -574,10 +905,13 @@ Expression::Expression(const std::string &exprString, ExpressionOperatorT op)
     }
 }
 
-//! @brief Constructor taking two expression strings (lhs and rhs)
-Expression::Expression(const std::string &leftExprString, const std::string &rightExprString, ExpressionOperatorT op)
+//! @brief Interpret two expression strings (lhs and rhs), child expressions are added to the pending work list
+//! @param[in] leftExprString The left hand side expression string
+//! @param[in] rightExprString The right hand side expression string
+//! @param[in] op The operator of this expression
+//! @param[in,out] rPending The work list of expressions that remain to be interpreted
+void Expression::interpret(const std::string &leftExprString, const std::string &rightExprString, ExpressionOperatorT op, std::vector<PendingExpression> &rPending)
 {
-    commonConstructorCode();
     mLeftExpressionString = leftExprString;
     removeAllWhitespaces(mLeftExpressionString);
     stripLeadingTrailingParanthesis(mLeftExpressionString, mHadLeftOuterParanthesis);
@@ -588,12 +922,12 @@ Expression::Expression(const std::string &leftExprString, const std::string &rig
 
     if (mOperator == AssignmentT)
     {
-        mRightChildExpressions.push_back(Expression(mRightExpressionString, AdditionT));
+        deferExpression(mRightChildExpressions, mRightExpressionString, AdditionT, rPending);
     }
     else
     {
-        mLeftChildExpressions.push_back(Expression(mLeftExpressionString, AdditionT));
-        mRightChildExpressions.push_back(Expression(mRightExpressionString, AdditionT));
+        deferExpression(mLeftChildExpressions, mLeftExpressionString, AdditionT, rPending);
+        deferExpression(mRightChildExpressions, mRightExpressionString, AdditionT, rPending);
     }
     mIsValid = true;
 }
@@ -614,6 +948,29 @@ Expression &Expression::operator=(const Expression &other)
     return *this;
 }
 
+//! @brief Exchange the contents of two expressions without copying the expression trees
+void Expression::swap(Expression &other)
+{
+    std::swap(mOperator, other.mOperator);
+    std::swap(mHadLeftOuterParanthesis, other.mHadLeftOuterParanthesis);
+    std::swap(mHadRightOuterParanthesis, other.mHadRightOuterParanthesis);
+    mLeftChildExpressions.swap(other.mLeftChildExpressions);
+    mRightChildExpressions.swap(other.mRightChildExpressions);
+    mLeftExpressionString.swap(other.mLeftExpressionString);
+    mRightExpressionString.swap(other.mRightExpressionString);
+    std::swap(mIsNumericConstant, other.mIsNumericConstant);
+    std::swap(mIsNamedValue, other.mIsNamedValue);
+    std::swap(mNumericConstantValue, other.mNumericConstantValue);
+    std::swap(mFunctionId, other.mFunctionId);
+    std::swap(mpFunction, other.mpFunction);
+    std::swap(mIsValid, other.mIsValid);
+    std::swap(mReduction, other.mReduction);
+    std::swap(mReducedExponent, other.mReducedExponent);
+    std::swap(mReducedReciprocal, other.mReducedReciprocal);
+    std::swap(mChainEvaluation, other.mChainEvaluation);
+    std::swap(mCacheSlot, other.mCacheSlot);
+}
+
 //! @brief Check if this expression is empty
 bool Expression::empty() const
 {
@@ -645,28 +1002,28 @@ bool Expression::isNamedValue() const
     return mIsNamedValue;
 }
 
-//! @brief Recursively check if an expression tree is valid after interpretation
+//! @brief Check if all expressions in the tree are valid after interpretation
 bool Expression::isValid() const
 {
-    if (!mIsValid)
-    {
-        return false;
-    }
-
-    std::list<Expression>::const_iterator it;
-    for (it=mLeftChildExpressions.begin(); it!=mLeftChildExpressions.end(); ++it)
+    // The tree is walked with an explicit stack, deeply nested expressions must not overflow the call stack
+    std::vector<const Expression*> expressions(1, this);
+    while (!expressions.empty())
     {
-        if (!it->isValid())
+        const Expression *pExpr = expressions.back();
+        expressions.pop_back();
+        if (!pExpr->mIsValid)
         {
             return false;
         }
-    }
 
-    for (it=mRightChildExpressions.begin(); it!=mRightChildExpressions.end(); ++it)
-    {
-        if (!it->isValid())
+        std::list<Expression>::const_iterator it;
+        for (it=pExpr->mLeftChildExpressions.begin(); it!=pExpr->mLeftChildExpressions.end(); ++it)
         {
-            return false;
+            expressions.push_back(&*it);
+        }
+        for (it=pExpr->mRightChildExpressions.begin(); it!=pExpr->mRightChildExpressions.end(); ++it)
+        {
+            expressions.push_back(&*it);
         }
     }
 
@@ -697,14 +1054,195 @@ ExpressionOperatorT Expression::operatorType() const
     return mOperator;
 }
 
+//! @brief Returns the left hand side child expressions
+const std::list<Expression> &Expression::leftChildExpressions() const
+{
+    return mLeftChildExpressions;
+}
+
+//! @brief Returns the right hand side child expressions
+const std::list<Expression> &Expression::rightChildExpressions() const
+{
+    return mRightChildExpressions;
+}
+
+//! @brief Returns the numeric constant value (only valid if this is a numeric constant)
+double Expression::numericConstantValue() const
+{
+    return mNumericConstantValue;
+}
+
+//! @brief Returns the function id (only valid for function calls)
+int Expression::functionId() const
+{
+    return mFunctionId;
+}
+
+//! @brief Returns how this chain of additions or multiplications is evaluated
+//! @see reassociateChains
+ChainEvaluationT Expression::chainEvaluation() const
+{
+    return mChainEvaluation;
+}
+
+//! @brief Returns the cheaper evaluation selected by reduceStrength() for this power or division
+Expression::ReductionT Expression::reduction() const
+{
+    return mReduction;
+}
+
+//! @brief Returns the constant exponent of a power with IntegerPowerReduction
+int Expression::reducedExponent() const
+{
+    return mReducedExponent;
+}
+
+//! @brief Returns the reciprocal of the constant divisor of a division with ReciprocalReduction
+double Expression::reducedReciprocal() const
+{
+    return mReducedReciprocal;
+}
+
+//! @brief Fold the value of a term or factor into the value of a sum or product
+//! @param[in] optype The operator of the term or factor
+//! @param[in] newValue The value of the term or factor
+//! @param[in,out] rValue The value of the sum or product
+//! @returns False if the operator is undefined
+inline bool foldValue(const ExpressionOperatorT optype, const double newValue, double &rValue)
+{
+    if (optype == AdditionT )
+    {
+        rValue += newValue;
+    }
+    else if (optype == SubtractionT)
+    {
+        rValue -= newValue;
+    }
+    else if (optype == MultiplicationT)
+    {
+        rValue *= newValue;
+    }
+    else if (optype == DivisionT)
+    {
+        rValue /= newValue;
+    }
+    else if (optype == OrT)
+    {
+        rValue = boolify(boolify(rValue)+boolify(newValue));
+    }
+    else if (optype == AndT)
+    {
+        rValue = boolify(rValue)*boolify(newValue);
+    }
+    else if (optype != UndefinedT)
+    {
+        rValue = newValue;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+//! @brief Add a term with Neumaier summation, the lost low order bits of each addition are accumulated separately
+//! @details Once the sum is infinite or NaN there are no low order bits, and the compensation would only turn infinity into NaN
+inline void addCompensated(const double term, double &rSum, double &rCompensation)
+{
+    const double newSum = rSum + term;
+    if (newSum-newSum == 0)
+    {
+        rCompensation += (fabs(rSum) >= fabs(term)) ? (rSum - newSum) + term : (term - newSum) + rSum;
+    }
+    rSum = newSum;
+}
+
+//! @brief Returns the result of a Neumaier summation, the compensation is only added if it is finite
+inline double compensatedSum(const double sum, const double compensation)
+{
+    return (compensation-compensation == 0) ? sum + compensation : sum;
+}
+
+//! @brief Accumulate the i:th term or factor of a reassociated chain round-robin in four partial results
+inline void accumulatePartial(const double v, const ExpressionOperatorT optype, const bool isSum, const size_t i, double *pPartial)
+{
+    double &rPartial = pPartial[i & 3];
+    if (!isSum)
+    {
+        rPartial *= v;
+    }
+    else if (optype == SubtractionT)
+    {
+        rPartial -= v;
+    }
+    else
+    {
+        rPartial += v;
+    }
+}
+
+//! @brief Combine the four partial results of a reassociated chain
+inline double combinePartials(const double *pPartial, const bool isSum)
+{
+    return isSum ? (pPartial[0]+pPartial[1]) + (pPartial[2]+pPartial[3]) : (pPartial[0]*pPartial[1]) * (pPartial[2]*pPartial[3]);
+}
+
 //! @brief Evaluate the expression
 //! @param[in,out] rVariableStorage The variable storage to use for setting or getting variables or named values
 //! @param[out] rEvalOK Indicates whether evaluation was successful or not
 //! @return The value of the evaluated expression
 double Expression::evaluate(VariableStorage &rVariableStorage, bool &rEvalOK) const
+{
+    return evaluate(rVariableStorage, rEvalOK, 0, 0);
+}
+
+//! @brief Evaluate the expression, reusing values of shared subexpressions
+//! @param[in,out] rVariableStorage The variable storage to use for setting or getting variables or named values
+//! @param[out] rEvalOK Indicates whether evaluation was successful or not
+//! @param[in,out] pCache The cache for subexpressions given slots by eliminateCommonSubexpressions(), may be 0
+//! @return The value of the evaluated expression
+double Expression::evaluate(VariableStorage &rVariableStorage, bool &rEvalOK, EvaluationCache *pCache) const
+{
+    return evaluate(rVariableStorage, rEvalOK, pCache, 0);
+}
+
+//! @brief Evaluate the expression at some nesting depth
+//! @details Expressions are evaluated recursively, which is fastest, down to maxRecursiveEvaluationDepth levels.
+//! Deeper expressions are evaluated on an explicit stack, so the use of the call stack is bounded for any nesting depth.
+//! @param[in,out] rVariableStorage The variable storage to use for setting or getting variables or named values
+//! @param[out] rEvalOK Indicates whether evaluation was successful or not
+//! @param[in,out] pCache The cache for subexpressions given slots by eliminateCommonSubexpressions(), may be 0
+//! @param[in] depth The nesting depth of this expression in the evaluated expression
+//! @return The value of the evaluated expression
+double Expression::evaluate(VariableStorage &rVariableStorage, bool &rEvalOK, EvaluationCache *pCache, size_t depth) const
+{
+    if (depth >= maxRecursiveEvaluationDepth)
+    {
+        return evaluateIteratively(rVariableStorage, rEvalOK, pCache);
+    }
+    if (pCache && mCacheSlot >= 0)
+    {
+        double value;
+        if (pCache->lookup(mCacheSlot, value))
+        {
+            rEvalOK = true;
+            return value;
+        }
+        value = evaluateNode(rVariableStorage, rEvalOK, pCache, depth);
+        if (rEvalOK)
+        {
+            pCache->store(mCacheSlot, value);
+        }
+        return value;
+    }
+    return evaluateNode(rVariableStorage, rEvalOK, pCache, depth);
+}
+
+double Expression::evaluateNode(VariableStorage &rVariableStorage, bool &rEvalOK, EvaluationCache *pCache, size_t depth) const
 {
     bool lhsOK=false,rhsOK=false;
     double value=0;
+    ++depth;
 
     // If this is a numeric constant value, then return it
     if (mIsNumericConstant)
@@ -723,75 +1261,110 @@ double Expression::evaluate(VariableStorage &rVariableStorage, bool &rEvalOK) co
     {
         // Try to assign variable
         bool dummy;
-        value = mRightChildExpressions.front().evaluate(rVariableStorage, rhsOK);
+        value = mRightChildExpressions.front().evaluate(rVariableStorage, rhsOK, pCache, depth);
         if (rhsOK)
         {
            lhsOK = rVariableStorage.setVariable(mLeftExpressionString, value, dummy);
+           if (pCache)
+           {
+               // Shared subexpressions depending on the variable must be evaluated again
+               pCache->invalidate(mLeftExpressionString);
+           }
         }
     }
     else if (mOperator == PowerT)
     {
         // Evaluate both sides
-        double base = mLeftChildExpressions.front().evaluate(rVariableStorage, lhsOK);
-        double exp = mRightChildExpressions.front().evaluate(rVariableStorage, rhsOK);
-        value = pow(base,exp);
+        double base = mLeftChildExpressions.front().evaluate(rVariableStorage, lhsOK, pCache, depth);
+        if (mReduction != NoReduction)
+        {
+            // The exponent is constant
+            rhsOK = true;
+            value = reducedPower(base);
+        }
+        else
+        {
+            double exp = mRightChildExpressions.front().evaluate(rVariableStorage, rhsOK, pCache, depth);
+            value = pow(base,exp);
+        }
     }
     else if (mOperator == LessThenT)
     {
         // Evaluate both sides
-        double l = mLeftChildExpressions.front().evaluate(rVariableStorage, lhsOK);
-        double r = mRightChildExpressions.front().evaluate(rVariableStorage, rhsOK);
+        double l = mLeftChildExpressions.front().evaluate(rVariableStorage, lhsOK, pCache, depth);
+        double r = mRightChildExpressions.front().evaluate(rVariableStorage, rhsOK, pCache, depth);
         value = double(l<r);
     }
     else if (mOperator == GreaterThenT)
     {
         // Evaluate both sides
-        double l = mLeftChildExpressions.front().evaluate(rVariableStorage, lhsOK);
-        double r = mRightChildExpressions.front().evaluate(rVariableStorage, rhsOK);
+        double l = mLeftChildExpressions.front().evaluate(rVariableStorage, lhsOK, pCache, depth);
+        double r = mRightChildExpressions.front().evaluate(rVariableStorage, rhsOK, pCache, depth);
         value = double(l>r);
     }
-    else if (mOperator == FunctionCallT)
+    else if (mOperator == ConditionalT)
     {
-        lhsOK=true;
-        value = gFunctionHandler.callFunction(mFunctionId, mRightChildExpressions, rVariableStorage, rhsOK);
+        // Evaluate the condition, then only the selected branch
+        std::list<Expression>::const_iterator it = mRightChildExpressions.begin();
+        double condition = it->evaluate(rVariableStorage, lhsOK, pCache, depth);
+        if (lhsOK)
+        {
+            ++it;
+            if (boolify(condition) < 0.5)
+            {
+                ++it;
+            }
+            value = it->evaluate(rVariableStorage, rhsOK, pCache, depth);
+        }
     }
-    else
+    else if (mOperator == FunctionCallT)
     {
         lhsOK=true;
-        std::list<Expression>::const_iterator it;
-        for (it=mRightChildExpressions.begin(); it!=mRightChildExpressions.end(); ++it)
+        if (mReduction != NoReduction)
         {
-            ExpressionOperatorT optype = it->operatorType();
-            double newValue = it->evaluate(rVariableStorage, rhsOK);
-            if (optype == AdditionT )
-            {
-                value += newValue;
-            }
-            else if (optype == SubtractionT)
+            // pow with constant exponent
+            value = reducedPower(mRightChildExpressions.front().evaluate(rVariableStorage, rhsOK, pCache, depth));
+        }
+        else if (mpFunction)
+        {
+            // The arguments are evaluated into a fixed buffer
+            double args[maxFunctionArguments];
+            size_t numArgs = 0;
+            rhsOK = true;
+            std::list<Expression>::const_iterator it;
+            for (it=mRightChildExpressions.begin(); it!=mRightChildExpressions.end() && numArgs<mpFunction->numArgs; ++it)
             {
-                value -= newValue;
+                bool argOK;
+                args[numArgs++] = it->evaluate(rVariableStorage, argOK, pCache, depth);
+                rhsOK = rhsOK && argOK;
             }
-            else if (optype == MultiplicationT)
-            {
-                value *= newValue;
-            }
-            else if (optype == DivisionT)
-            {
-                value /= newValue;
-            }
-            else if (optype == OrT)
-            {
-                value = boolify(boolify(value)+boolify(newValue));
-            }
-            else if (optype == AndT)
-            {
-                value = boolify(value)*boolify(newValue);
-            }
-            else if (optype != UndefinedT)
+            value = gFunctionHandler.callFunction(mpFunction, args, numArgs, rVariableStorage);
+        }
+        else
+        {
+            value = -1;
+        }
+    }
+    else if (mChainEvaluation != SequentialChainT)
+    {
+        lhsOK=true;
+        value = evaluateChain(rVariableStorage, rhsOK, pCache, depth);
+    }
+    else
+    {
+        lhsOK=true;
+        std::list<Expression>::const_iterator it;
+        for (it=mRightChildExpressions.begin(); it!=mRightChildExpressions.end(); ++it)
+        {
+            if (it->mReduction == ReciprocalReduction)
             {
-                value = newValue;
+                // Division by constant
+                value *= it->mReducedReciprocal;
+                rhsOK = true;
+                continue;
             }
-            else
+            double newValue = it->evaluate(rVariableStorage, rhsOK, pCache, depth);
+            if (!foldValue(it->operatorType(), newValue, value))
             {
                 rEvalOK=false;
                 return value;
@@ -809,7 +1382,431 @@ double Expression::evaluate(VariableStorage &rVariableStorage, bool &rEvalOK) co
     return value;
 }
 
+//! @brief Evaluate a chain of additions or multiplications, as selected by reassociateChains()
+double Expression::evaluateChain(VariableStorage &rVariableStorage, bool &rEvalOK, EvaluationCache *pCache, size_t depth) const
+{
+    rEvalOK = true;
+    const bool isSum = ((++mRightChildExpressions.begin())->operatorType() != MultiplicationT);
+    std::list<Expression>::const_iterator it;
+    if (isSum && mChainEvaluation == CompensatedChainT)
+    {
+        double sum = 0., compensation = 0.;
+        for (it=mRightChildExpressions.begin(); it!=mRightChildExpressions.end(); ++it)
+        {
+            const double term = it->evaluate(rVariableStorage, rEvalOK, pCache, depth);
+            if (!rEvalOK)
+            {
+                return sum;
+            }
+            addCompensated((it->operatorType() == SubtractionT) ? -term : term, sum, compensation);
+        }
+        return compensatedSum(sum, compensation);
+    }
+
+    double partial[4];
+    const double initial = isSum ? 0. : 1.;
+    partial[0] = partial[1] = partial[2] = partial[3] = initial;
+    size_t i = 0;
+    for (it=mRightChildExpressions.begin(); it!=mRightChildExpressions.end(); ++it, ++i)
+    {
+        const double v = it->evaluate(rVariableStorage, rEvalOK, pCache, depth);
+        if (!rEvalOK)
+        {
+            return partial[0];
+        }
+        accumulatePartial(v, it->operatorType(), isSum, i, partial);
+    }
+    return combinePartials(partial, isSum);
+}
+
+//! @brief A stack keeping its first elements in place, so that shallow evaluations do not allocate memory
+//! @details The element type must not need to be destroyed
+template <typename T, size_t N>
+class WorkStack
+{
+public:
+    WorkStack() : mSize(0) {}
+
+    bool empty() const
+    {
+        return mSize == 0;
+    }
+
+    size_t size() const
+    {
+        return mSize;
+    }
+
+    T &operator[](size_t i)
+    {
+        return (i < N) ? reinterpret_cast<T*>(mElements.storage)[i] : mMoreElements[i-N];
+    }
+
+    T &back()
+    {
+        return (*this)[mSize-1];
+    }
+
+    void push_back(const T &element)
+    {
+        push_back() = element;
+    }
+
+    //! @brief Add an element, elements kept in place are default initialized
+    T &push_back()
+    {
+        if (mSize < N)
+        {
+            new (reinterpret_cast<T*>(mElements.storage)+mSize) T;
+        }
+        else
+        {
+            mMoreElements.resize(mSize-N+1);
+        }
+        ++mSize;
+        return back();
+    }
+
+    void pop_back()
+    {
+        if (mSize > N)
+        {
+            mMoreElements.pop_back();
+        }
+        --mSize;
+    }
+
+private:
+    union
+    {
+        char storage[N*sizeof(T)];
+        double alignment;
+        void *pointerAlignment;
+    } mElements;
+    std::vector<T> mMoreElements;
+    size_t mSize;
+};
+
+typedef WorkStack<double, maxFunctionArguments> ArgumentStack;
+
+//! @brief The evaluation state of one expression, kept on an explicit stack instead of the call stack
+struct Expression::EvaluationFrame
+{
+    //! @brief What the frame does with the value of the next evaluated child expression
+    enum KindT {EnterKind, AssignmentKind, LeftOperandKind, RightOperandKind, ConditionKind, BranchKind, ReducedPowerKind,
+                ArgumentKind, ChainTermKind, TermKind};
+
+    void init(const Expression *pExpression)
+    {
+        pExpr = pExpression;
+        value = 0;
+        numTerms = 0;
+        kind = EnterKind;
+        rhsOK = false;
+    }
+
+    const Expression *resume(double &rValue, bool &rEvalOK, VariableStorage &rVariableStorage, EvaluationCache *pCache, ArgumentStack &rArguments);
+    const Expression *nextArgument(double &rValue, bool &rEvalOK, VariableStorage &rVariableStorage, ArgumentStack &rArguments);
+    const Expression *nextTerm(double &rValue, bool &rEvalOK);
+    const Expression *nextChainTerm(double &rValue, bool &rEvalOK);
+
+    const Expression *pExpr;
+    std::list<Expression>::const_iterator child;
+    double value;
+    double partial[4];
+    size_t firstArgument, numTerms;
+    KindT kind;
+    bool isSum, lhsOK, rhsOK;
+};
+
+//! @brief Continue evaluating the expression of this frame
+//! @param[in,out] rValue The value of the last evaluated child expression, or the value of this expression when done
+//! @param[in,out] rEvalOK Indicates whether the last child expression, or this expression when done, evaluated successfully
+//! @param[in,out] rVariableStorage The variable storage to use for setting or getting variables or named values
+//! @param[in,out] pCache The cache for shared subexpressions, may be 0
+//! @param[in,out] rArguments The evaluated arguments of pending function calls
+//! @returns The child expression to evaluate next, or 0 when this expression is evaluated
+const Expression *Expression::EvaluationFrame::resume(double &rValue, bool &rEvalOK, VariableStorage &rVariableStorage, EvaluationCache *pCache, ArgumentStack &rArguments)
+{
+    const Expression &expr = *pExpr;
+    switch (kind)
+    {
+    case EnterKind :
+        // Values are evaluated without a frame
+        if (expr.mOperator == AssignmentT)
+        {
+            kind = AssignmentKind;
+            return &expr.mRightChildExpressions.front();
+        }
+        else if (expr.mOperator == PowerT || expr.mOperator == LessThenT || expr.mOperator == GreaterThenT)
+        {
+            // Evaluate both sides
+            kind = LeftOperandKind;
+            return &expr.mLeftChildExpressions.front();
+        }
+        else if (expr.mOperator == ConditionalT)
+        {
+            // Evaluate the condition, then only the selected branch
+            kind = ConditionKind;
+            child = expr.mRightChildExpressions.begin();
+            return &*child;
+        }
+        else if (expr.mOperator == FunctionCallT)
+        {
+            if (expr.mReduction != NoReduction)
+            {
+                // pow with constant exponent
+                kind = ReducedPowerKind;
+                return &expr.mRightChildExpressions.front();
+            }
+            else if (!expr.mpFunction)
+            {
+                rValue = -1;
+                rEvalOK = false;
+                return 0;
+            }
+            // The arguments are evaluated onto the argument stack
+            kind = ArgumentKind;
+            firstArgument = rArguments.size();
+            child = expr.mRightChildExpressions.begin();
+            rhsOK = true;
+            return nextArgument(rValue, rEvalOK, rVariableStorage, rArguments);
+        }
+        else if (expr.mChainEvaluation != SequentialChainT)
+        {
+            kind = ChainTermKind;
+            isSum = ((++expr.mRightChildExpressions.begin())->operatorType() != MultiplicationT);
+            partial[0] = partial[1] = partial[2] = partial[3] = isSum ? 0. : 1.;
+            child = expr.mRightChildExpressions.begin();
+            return &*child;
+        }
+        kind = TermKind;
+        child = expr.mRightChildExpressions.begin();
+        return nextTerm(rValue, rEvalOK);
+
+    case AssignmentKind :
+        // Try to assign variable
+        if (rEvalOK)
+        {
+            bool dummy;
+            rEvalOK = rVariableStorage.setVariable(expr.mLeftExpressionString, rValue, dummy);
+            if (pCache)
+            {
+                // Shared subexpressions depending on the variable must be evaluated again
+                pCache->invalidate(expr.mLeftExpressionString);
+            }
+        }
+        return 0;
+
+    case LeftOperandKind :
+        value = rValue;
+        lhsOK = rEvalOK;
+        if (expr.mReduction != NoReduction)
+        {
+            // The exponent is constant
+            rValue = expr.reducedPower(value);
+            return 0;
+        }
+        kind = RightOperandKind;
+        return &expr.mRightChildExpressions.front();
+
+    case RightOperandKind :
+        if (expr.mOperator == PowerT)
+        {
+            rValue = pow(value, rValue);
+        }
+        else
+        {
+            rValue = (expr.mOperator == LessThenT) ? double(value<rValue) : double(value>rValue);
+        }
+        rEvalOK = lhsOK && rEvalOK;
+        return 0;
+
+    case ConditionKind :
+        if (!rEvalOK)
+        {
+            rValue = 0;
+            return 0;
+        }
+        ++child;
+        if (boolify(rValue) < 0.5)
+        {
+            ++child;
+        }
+        kind = BranchKind;
+        return &*child;
+
+    case BranchKind :
+        return 0;
+
+    case ReducedPowerKind :
+        rValue = expr.reducedPower(rValue);
+        return 0;
+
+    case ArgumentKind :
+        rArguments.push_back(rValue);
+        rhsOK = rhsOK && rEvalOK;
+        ++child;
+        return nextArgument(rValue, rEvalOK, rVariableStorage, rArguments);
+
+    case ChainTermKind :
+        return nextChainTerm(rValue, rEvalOK);
+
+    case TermKind :
+        if (!foldValue(child->operatorType(), rValue, value))
+        {
+            rEvalOK = false;
+        }
+        // If evaluation error in child expression, abort and return false
+        if (!rEvalOK)
+        {
+            rValue = value;
+            return 0;
+        }
+        rhsOK = true;
+        ++child;
+        return nextTerm(rValue, rEvalOK);
+    }
+    return 0;
+}
+
+//! @brief Evaluate the next argument of a function call, or call the function when all arguments are evaluated
+const Expression *Expression::EvaluationFrame::nextArgument(double &rValue, bool &rEvalOK, VariableStorage &rVariableStorage, ArgumentStack &rArguments)
+{
+    const RegisteredFunction *pFunction = pExpr->mpFunction;
+    const size_t numArgs = rArguments.size()-firstArgument;
+    if (child != pExpr->mRightChildExpressions.end() && numArgs < pFunction->numArgs)
+    {
+        return &*child;
+    }
+
+    double args[maxFunctionArguments];
+    for (size_t i=0; i<numArgs; ++i)
+    {
+        args[i] = rArguments[firstArgument+i];
+    }
+    for (size_t i=0; i<numArgs; ++i)
+    {
+        rArguments.pop_back();
+    }
+    rValue = gFunctionHandler.callFunction(pFunction, args, numArgs, rVariableStorage);
+    rEvalOK = rhsOK;
+    return 0;
+}
+
+//! @brief Find the next term or factor to evaluate, or return the folded value when all are evaluated
+const Expression *Expression::EvaluationFrame::nextTerm(double &rValue, bool &rEvalOK)
+{
+    for (; child!=pExpr->mRightChildExpressions.end(); ++child)
+    {
+        if (child->mReduction != ReciprocalReduction)
+        {
+            return &*child;
+        }
+        // Division by constant
+        value *= child->mReducedReciprocal;
+        rhsOK = true;
+    }
+    rValue = value;
+    rEvalOK = rhsOK;
+    return 0;
+}
+
+//! @brief Accumulate an evaluated term or factor of a chain selected by reassociateChains(), and find the next one
+const Expression *Expression::EvaluationFrame::nextChainTerm(double &rValue, bool &rEvalOK)
+{
+    // Compensated sums keep the sum in partial[0] and the compensation in partial[1]
+    const bool isCompensated = (isSum && pExpr->mChainEvaluation == CompensatedChainT);
+    if (!rEvalOK)
+    {
+        rValue = partial[0];
+        return 0;
+    }
+
+    const ExpressionOperatorT optype = child->operatorType();
+    if (isCompensated)
+    {
+        addCompensated((optype == SubtractionT) ? -rValue : rValue, partial[0], partial[1]);
+    }
+    else
+    {
+        accumulatePartial(rValue, optype, isSum, numTerms, partial);
+    }
+    ++numTerms;
+    ++child;
+
+    if (child != pExpr->mRightChildExpressions.end())
+    {
+        return &*child;
+    }
+    rValue = isCompensated ? compensatedSum(partial[0], partial[1]) : combinePartials(partial, isSum);
+    return 0;
+}
+
+//! @brief Evaluate the expression on an explicit stack, the nesting depth is not limited by the call stack
+//! @param[in,out] rVariableStorage The variable storage to use for setting or getting variables or named values
+//! @param[out] rEvalOK Indicates whether evaluation was successful or not
+//! @param[in,out] pCache The cache for subexpressions given slots by eliminateCommonSubexpressions(), may be 0
+//! @return The value of the evaluated expression
+double Expression::evaluateIteratively(VariableStorage &rVariableStorage, bool &rEvalOK, EvaluationCache *pCache) const
+{
+    WorkStack<EvaluationFrame, maxRecursiveEvaluationDepth> frames;
+    ArgumentStack arguments;
+    double value = 0;
+    rEvalOK = false;
+    const Expression *pNext = this;
+    while (true)
+    {
+        if (pNext)
+        {
+            // Values and cached shared subexpressions are evaluated at once, other expressions get a frame
+            if (pCache && pNext->mCacheSlot >= 0 && pCache->lookup(pNext->mCacheSlot, value))
+            {
+                rEvalOK = true;
+            }
+            else if (pNext->mIsNumericConstant || pNext->mIsNamedValue)
+            {
+                if (pNext->mIsNumericConstant)
+                {
+                    value = pNext->mNumericConstantValue;
+                    rEvalOK = true;
+                }
+                else
+                {
+                    // Lookup named value or variable in the variable storage instead
+                    value = rVariableStorage.value(pNext->mRightExpressionString, rEvalOK);
+                }
+                if (pCache && pNext->mCacheSlot >= 0 && rEvalOK)
+                {
+                    pCache->store(pNext->mCacheSlot, value);
+                }
+            }
+            else
+            {
+                frames.push_back().init(pNext);
+            }
+        }
+        if (frames.empty())
+        {
+            return value;
+        }
+
+        EvaluationFrame &rFrame = frames.back();
+        pNext = rFrame.resume(value, rEvalOK, rVariableStorage, pCache, arguments);
+        if (!pNext)
+        {
+            // The value is returned to the parent expression
+            if (pCache && rFrame.pExpr->mCacheSlot >= 0 && rEvalOK)
+            {
+                pCache->store(rFrame.pExpr->mCacheSlot, value);
+            }
+            frames.pop_back();
+        }
+    }
+}
+
 //! @brief Extract all named values from expression
+//! @details For conditional expressions, named values from all branches are included (not only the branch that would be taken)
 //! @param[out] rNamedValues All named values (including constants such as pi and invalid variable names)
 void Expression::extractNamedValues(std::set<std::string> &rNamedValues) const
 {
@@ -871,119 +1868,1137 @@ void Expression::replaceNamedValue(const std::string &oldName, const std::string
     }
 }
 
-//! @brief Prints the expression (as it will be evaluated) to a string
-std::string Expression::print()
+//! @brief Check if the expression is constant, it does not depend on or assign any variables
+bool Expression::isConstant() const
 {
-    std::string fullexp;
-
-    if (mOperator == AssignmentT)
+    if (mIsNumericConstant)
     {
-        std::string r = mRightChildExpressions.front().print();
-        if (mHadRightOuterParanthesis)
-        {
-            r="("+r+")";
-        }
-        fullexp = mLeftExpressionString+"="+r;
+        return true;
     }
-    else if (mOperator == PowerT)
+    if (mIsNamedValue || mOperator == AssignmentT || mOperator == UndefinedT || !mIsValid ||
+        (mOperator == FunctionCallT && !(mpFunction && mpFunction->isPure)))
     {
-        std::string l = mLeftChildExpressions.front().print();
-        std::string r = mRightChildExpressions.front().print();
-        if (mHadLeftOuterParanthesis)
-        {
-            l="("+l+")";
-        }
-        if (mHadRightOuterParanthesis)
-        {
-            r="("+r+")";
-        }
-        fullexp = l+"^"+r;
+        return false;
     }
-    else if (mOperator == LessThenT)
+    std::list<Expression>::const_iterator it;
+    for (it=mLeftChildExpressions.begin(); it!=mLeftChildExpressions.end(); ++it)
     {
-        std::string l = mLeftChildExpressions.front().print();
-        std::string r = mRightChildExpressions.front().print();
-        if (mHadLeftOuterParanthesis)
-        {
-            l="("+l+")";
-        }
-        if (mHadRightOuterParanthesis)
+        if (!it->isConstant())
         {
-            r="("+r+")";
+            return false;
         }
-        fullexp = l+"<"+r;
     }
-    else if (mOperator == GreaterThenT)
+    for (it=mRightChildExpressions.begin(); it!=mRightChildExpressions.end(); ++it)
     {
-        std::string l = mLeftChildExpressions.front().print();
-        std::string r = mRightChildExpressions.front().print();
-        if (mHadLeftOuterParanthesis)
-        {
-            l="("+l+")";
-        }
-        if (mHadRightOuterParanthesis)
+        if (!it->isConstant())
         {
-            r="("+r+")";
+            return false;
         }
-        fullexp = l+">"+r;
     }
-    else if (mOperator == FunctionCallT)
+    return !(mLeftChildExpressions.empty() && mRightChildExpressions.empty());
+}
+
+//! @brief Replace expensive operations with cheaper equivalents
+//! @details Powers with constant exponent 0, 1, 2, -1 and 0.5 (also through pow()) are evaluated with multiplication,
+//! reciprocal or sqrt, and division by a constant power of two with multiplication by the exact reciprocal.
+//! These give correctly rounded results, which may differ from the last bit of pow() in some math libraries.
+//! Other small integer exponents, the exponent -0.5 and division by any constant are only rewritten if rounding changes are allowed.
+//! The printed expression is not changed.
+//! @param[in] allowRoundingChanges Allow rewrites that may change the rounding of the result
+void Expression::reduceStrength(bool allowRoundingChanges)
+{
+    std::list<Expression>::iterator it;
+    for (it=mLeftChildExpressions.begin(); it!=mLeftChildExpressions.end(); ++it)
     {
-        fullexp = mLeftExpressionString+'(';
-        std::list<Expression>::iterator it;
-        for (it=mRightChildExpressions.begin(); it!=mRightChildExpressions.end(); ++it) {
-            fullexp += it->print();
+        it->reduceStrength(allowRoundingChanges);
+    }
+    for (it=mRightChildExpressions.begin(); it!=mRightChildExpressions.end(); ++it)
+    {
+        it->reduceStrength(allowRoundingChanges);
+    }
+
+    mReduction = NoReduction;
+    if (mOperator == PowerT && mRightChildExpressions.size() == 1)
+    {
+        reducePower(mRightChildExpressions.front(), allowRoundingChanges);
+    }
+    else if (mOperator == FunctionCallT && mLeftExpressionString == "pow" && mRightChildExpressions.size() == 2)
+    {
+        reducePower(mRightChildExpressions.back(), allowRoundingChanges);
+    }
+    else if (mOperator == DivisionT && isConstant())
+    {
+        bool isOK;
+        VariableStorage noVariables;
+        const double divisor = evaluate(noVariables, isOK);
+        const double reciprocal = 1./divisor;
+        int exponent;
+        const double mantissa = frexp(divisor, &exponent);
+        // The reciprocal of a power of two is exact, unless it is subnormal or overflows
+        const bool isExact = (fabs(mantissa) == 0.5) && (fabs(reciprocal) >= DBL_MIN) && (fabs(reciprocal) <= DBL_MAX);
+        if (isOK && (isExact || (allowRoundingChanges && reciprocal == reciprocal)))
+        {
+            mReduction = ReciprocalReduction;
+            mReducedReciprocal = reciprocal;
+        }
+    }
+}
+
+static std::string printed(const Expression &expr)
+{
+    Expression copy(expr);
+    return copy.print();
+}
+
+static bool containsNamedValue(const Expression &expr, const std::string &name)
+{
+    std::set<std::string> names;
+    expr.extractNamedValues(names);
+    return contains(names, name);
+}
+
+//! @brief Check if an expression is a named value, or a named value raised to a constant non-negative integer
+//! @param[in] expr The expression
+//! @param[out] rName The name
+//! @param[out] rDegree The exponent
+static bool isMonomial(const Expression &expr, std::string &rName, int &rDegree)
+{
+    if (expr.isNamedValue())
+    {
+        rName = expr.rightExprString();
+        rDegree = 1;
+        return true;
+    }
+    const std::list<Expression> &children = expr.rightChildExpressions();
+    if (expr.isValue() || children.size() != 1 || children.front().operatorType() != PowerT)
+    {
+        return false;
+    }
+    const Expression &base = children.front().leftChildExpressions().front();
+    const Expression &exponent = children.front().rightChildExpressions().front();
+    if (!base.isNamedValue() || !exponent.isNumericConstant())
+    {
+        return false;
+    }
+    const double value = exponent.numericConstantValue();
+    if (value < 0 || value > maxPolynomialDegree || value != floor(value))
+    {
+        return false;
+    }
+    rName = base.rightExprString();
+    rDegree = int(value);
+    return true;
+}
+
+//! @brief Check if a term of a sum is a product of factors, optionally divided by factors
+static bool isProductTerm(const Expression &term)
+{
+    const std::list<Expression> &factors = term.rightChildExpressions();
+    if (term.isValue() || !term.leftChildExpressions().empty() || factors.size() < 2 || factors.front().operatorType() != AdditionT)
+    {
+        return false;
+    }
+    std::list<Expression>::const_iterator it;
+    for (it=++factors.begin(); it!=factors.end(); ++it)
+    {
+        if (it->operatorType() != MultiplicationT && it->operatorType() != DivisionT)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+//! @brief Find the first variable raised to a constant integer power of at least two in the terms of a sum
+//! @returns The variable name, or an empty string
+static std::string findPolynomialVariable(const std::list<Expression> &terms)
+{
+    std::string name;
+    int degree;
+    std::list<Expression>::const_iterator it, fit;
+    for (it=terms.begin(); it!=terms.end(); ++it)
+    {
+        if (isMonomial(*it, name, degree) && degree >= 2)
+        {
+            return name;
+        }
+        if (isProductTerm(*it))
+        {
+            for (fit=it->rightChildExpressions().begin(); fit!=it->rightChildExpressions().end(); ++fit)
+            {
+                if (fit->operatorType() != DivisionT && isMonomial(*fit, name, degree) && degree >= 2)
+                {
+                    return name;
+                }
+            }
+        }
+    }
+    return "";
+}
+
+//! @brief Split a term of a sum into a coefficient and a power of a variable
+//! @param[in] term The term
+//! @param[in] name The variable name
+//! @param[out] rCoefficient The coefficient, that does not depend on the variable, empty if it is one
+//! @param[out] rDegree The power of the variable
+//! @returns False if the term is not a coefficient times a power of the variable
+static bool splitPolynomialTerm(const Expression &term, const std::string &name, std::string &rCoefficient, int &rDegree)
+{
+    rCoefficient.clear();
+    rDegree = 0;
+    std::string monomialName;
+    int degree;
+    if (isMonomial(term, monomialName, degree) && monomialName == name)
+    {
+        rDegree = degree;
+        return true;
+    }
+    if (!containsNamedValue(term, name))
+    {
+        rCoefficient = printed(term);
+        return true;
+    }
+    if (!isProductTerm(term))
+    {
+        return false;
+    }
+
+    std::list<Expression>::const_iterator it;
+    for (it=term.rightChildExpressions().begin(); it!=term.rightChildExpressions().end(); ++it)
+    {
+        const bool isDivisor = (it->operatorType() == DivisionT);
+        if (!isDivisor && isMonomial(*it, monomialName, degree) && monomialName == name)
+        {
+            rDegree += degree;
+        }
+        else if (!containsNamedValue(*it, name))
+        {
+            rCoefficient += isDivisor ? "/" : "*";
+            rCoefficient += printed(*it);
+        }
+        else
+        {
+            return false;
+        }
+    }
+    if (!rCoefficient.empty())
+    {
+        rCoefficient = (rCoefficient[0] == '/') ? "1"+rCoefficient : rCoefficient.substr(1);
+    }
+    return true;
+}
+
+//! @brief Check if a term of a sum is a power of a variable times an expression that depends on the variable
+static bool isFactoredTerm(const Expression &term, const std::string &name)
+{
+    if (!isProductTerm(term))
+    {
+        return false;
+    }
+    std::string monomialName;
+    int degree;
+    std::list<Expression>::const_iterator it;
+    for (it=term.rightChildExpressions().begin(); it!=term.rightChildExpressions().end(); ++it)
+    {
+        if (it->operatorType() != DivisionT && isMonomial(*it, monomialName, degree) && monomialName == name)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+//! @brief Enclose a polynomial term in parenthesis unless it is a product or already enclosed
+static std::string enclosedTerm(const std::string &term)
+{
+    if (term.find_first_of("+-") == std::string::npos)
+    {
+        return term;
+    }
+    std::string stripped = term;
+    bool didStrip;
+    stripLeadingTrailingParanthesis(stripped, didStrip);
+    return didStrip ? term : "("+term+")";
+}
+
+//! @brief Multiply a power of the variable by a polynomial term, leaving out a factor one
+static std::string timesPower(const std::string &power, const std::string &term)
+{
+    return (term == "1") ? power : power+"*"+enclosedTerm(term);
+}
+
+//! @brief Add a power of the variable times a polynomial term to another term, a negative product is subtracted
+static std::string plusTimesPower(const std::string &low, const std::string &power, const std::string &high)
+{
+    if (!high.empty() && high[0] == '-' && high.find_first_of("+-", 1) == std::string::npos)
+    {
+        return low+"-"+timesPower(power, high.substr(1));
+    }
+    return low.empty() ? timesPower(power, high) : low+"+"+timesPower(power, high);
+}
+
+static std::string variablePower(const std::string &name, int degree)
+{
+    if (degree == 1)
+    {
+        return name;
+    }
+    char buff[16];
+    std::sprintf(buff, "^%d", degree);
+    return name+buff;
+}
+
+//! @brief Write a polynomial in Horner form, c0+x*(c1+x*(c2+x*c3)), or in Estrin form, c0+x*c1+x^2*(c2+x*c3), if the degree is high
+//! and at most half of the coefficients are missing
+//! @param[in] name The variable name
+//! @param[in] coefficients The coefficient of each power of the variable
+static std::string polynomialString(const std::string &name, const std::map<int, std::string> &coefficients)
+{
+    const int degree = coefficients.rbegin()->first;
+    if (degree >= minEstrinDegree && 2*int(coefficients.size()) > degree)
+    {
+        // Pairs of terms are combined with increasing powers of two of the variable, missing coefficients are left out
+        std::vector<std::string> terms(degree+1);
+        std::map<int, std::string>::const_iterator it;
+        for (it=coefficients.begin(); it!=coefficients.end(); ++it)
+        {
+            terms[it->first] = it->second;
+        }
+        for (int powerOfTwo=1; terms.size() > 1; powerOfTwo*=2)
+        {
+            const std::string power = variablePower(name, powerOfTwo);
+            std::vector<std::string> combined;
+            for (size_t i=0; i<terms.size(); i+=2)
+            {
+                const std::string &low = terms[i];
+                const std::string high = (i+1 < terms.size()) ? terms[i+1] : std::string();
+                if (high.empty())
+                {
+                    combined.push_back(low);
+                }
+                else
+                {
+                    combined.push_back(plusTimesPower(low, power, high));
+                }
+            }
+            terms.swap(combined);
+        }
+        return terms.front();
+    }
+
+    std::map<int, std::string>::const_reverse_iterator it = coefficients.rbegin();
+    std::string horner = it->second;
+    int previousDegree = it->first;
+    for (++it; it!=coefficients.rend(); ++it)
+    {
+        horner = plusTimesPower(it->second, variablePower(name, previousDegree-it->first), horner);
+        previousDegree = it->first;
+    }
+    if (previousDegree > 0)
+    {
+        horner = plusTimesPower("", variablePower(name, previousDegree), horner);
+    }
+    return horner;
+}
+
+//! @brief Rewrite the polynomial terms of a sum in Horner or Estrin form
+//! @param[in] terms The terms of the sum
+//! @param[out] rRewritten The rewritten sum, with the terms that are not part of the polynomial last
+//! @returns False if the sum does not contain a polynomial worth rewriting
+static bool rewritePolynomialSum(const std::list<Expression> &terms, std::string &rRewritten)
+{
+    std::list<Expression>::const_iterator it;
+    for (it=terms.begin(); it!=terms.end(); ++it)
+    {
+        if (it->operatorType() != AdditionT && it->operatorType() != SubtractionT)
+        {
+            return false;
+        }
+    }
+    const std::string name = findPolynomialVariable(terms);
+    if (name.empty())
+    {
+        return false;
+    }
+
+    std::map<int, std::string> coefficients;
+    std::string otherTerms;
+    for (it=terms.begin(); it!=terms.end(); ++it)
+    {
+        const char sign = (it->operatorType() == SubtractionT) ? '-' : '+';
+        std::string coefficient;
+        int degree;
+        if (splitPolynomialTerm(*it, name, coefficient, degree))
+        {
+            std::string &rSum = coefficients[degree];
+            rSum += sign;
+            rSum += coefficient.empty() ? "1" : coefficient;
+        }
+        else if (isFactoredTerm(*it, name))
+        {
+            // Already in Horner or Estrin form
+            return false;
+        }
+        else
+        {
+            otherTerms += sign;
+            otherTerms += printed(*it);
+        }
+    }
+
+    // At least two powers of the variable are needed to save any operations
+    if (coefficients.empty() || coefficients.size() - (coefficients.begin()->first == 0 ? 1 : 0) < 2)
+    {
+        return false;
+    }
+    std::map<int, std::string>::iterator cit;
+    for (cit=coefficients.begin(); cit!=coefficients.end(); ++cit)
+    {
+        stripInitialPlus(cit->second);
+    }
+    rRewritten = polynomialString(name, coefficients)+otherTerms;
+    return true;
+}
+
+//! @brief Rewrite polynomials in one variable in Horner form, or Estrin form for high degrees
+//! @details In sums such as a0+a1*x+a2*x^2+a3*x^3 the terms that are coefficients times constant non-negative integer powers
+//! of the first variable raised to a power of at least two are collected into a0+x*(a1+x*(a2+x*a3)), so that no powers are evaluated.
+//! From degree 8, the Estrin form a0+x*a1+x^2*(a2+x*a3)+... gives more independent operations, use eliminateCommonSubexpressions()
+//! and reduceStrength() to evaluate the powers of the variable once and without pow(). The coefficients may be expressions that do not
+//! depend on the variable, other terms of the sum are added after the polynomial. Sums with assignments or calls to user functions are
+//! not rewritten since that changes the order of their side effects, so the result differs from the original by rounding only.
+//! The printed expression shows the rewritten form, call this before reduceStrength(). Invalid expressions are not rewritten.
+//! @returns The number of rewritten polynomials
+size_t Expression::rewritePolynomials()
+{
+    return rewritePolynomials(1);
+}
+
+//! @brief Rewrite polynomials in an expression at a given depth in the tree, the rewritten tree must not exceed maxExpressionTreeDepth
+size_t Expression::rewritePolynomials(size_t depth)
+{
+    size_t numRewritten = 0;
+    if (!mIsValid)
+    {
+        return numRewritten;
+    }
+    std::list<Expression>::iterator it;
+    for (it=mLeftChildExpressions.begin(); it!=mLeftChildExpressions.end(); ++it)
+    {
+        numRewritten += it->rewritePolynomials(depth+1);
+    }
+    for (it=mRightChildExpressions.begin(); it!=mRightChildExpressions.end(); ++it)
+    {
+        numRewritten += it->rewritePolynomials(depth+1);
+    }
+
+    std::string rewritten;
+    if (isFoldOperator(mOperator) && !isValue() && mLeftChildExpressions.empty() && mRightChildExpressions.size() >= 2 &&
+        isPure() && rewritePolynomialSum(mRightChildExpressions, rewritten))
+    {
+        Expression polynomial;
+        std::vector<PendingExpression> pending;
+        polynomial.interpret(rewritten, mOperator, pending);
+        interpretPending(pending, depth);
+        if (polynomial.isValid())
+        {
+            polynomial.mHadRightOuterParanthesis = polynomial.mHadRightOuterParanthesis || mHadRightOuterParanthesis;
+            *this = polynomial;
+            ++numRewritten;
+        }
+    }
+    return numRewritten;
+}
+
+//! @brief Evaluate long chains of additions or multiplications with independent partial results
+//! @details By default the terms of a sum, or the factors of a product, are accumulated from left to right, so each operation
+//! has to wait for the previous one. Reassociated chains are accumulated round-robin in four partial results that are combined
+//! at the end, which lets the processor overlap the operations. Compensated chains sum the terms with Neumaier summation,
+//! which keeps the rounding error of each addition, so that the result is accurate even if terms cancel. Products are
+//! reassociated in both modes. Reassociation changes the rounding of the result. JitExpression uses the same partial results,
+//! and leaves compensated sums to the interpreter, other evaluators (PreparedExpression, element-wise) are not affected.
+//! @param[in] chainEvaluation The evaluation of chains, SequentialChainT restores left to right evaluation
+//! @param[in] minChainLength The minimum number of terms or factors of a chain that is not evaluated from left to right
+//! @returns The number of chains that are not evaluated from left to right
+size_t Expression::reassociateChains(ChainEvaluationT chainEvaluation, size_t minChainLength)
+{
+    size_t numChains = 0;
+    std::list<Expression>::iterator it;
+    for (it=mLeftChildExpressions.begin(); it!=mLeftChildExpressions.end(); ++it)
+    {
+        numChains += it->reassociateChains(chainEvaluation, minChainLength);
+    }
+    for (it=mRightChildExpressions.begin(); it!=mRightChildExpressions.end(); ++it)
+    {
+        numChains += it->reassociateChains(chainEvaluation, minChainLength);
+    }
+
+    mChainEvaluation = SequentialChainT;
+    if (chainEvaluation == SequentialChainT || !isFoldOperator(mOperator) || isValue() ||
+        mRightChildExpressions.size() < std::max(minChainLength, size_t(2)))
+    {
+        return numChains;
+    }
+    // Either a sum, or a product where the first factor is added to zero
+    const bool isSum = ((++mRightChildExpressions.begin())->operatorType() != MultiplicationT);
+    for (it=mRightChildExpressions.begin(); it!=mRightChildExpressions.end(); ++it)
+    {
+        const ExpressionOperatorT optype = it->operatorType();
+        const bool isFirst = (it == mRightChildExpressions.begin());
+        if (isSum ? (optype != AdditionT && optype != SubtractionT) : (optype != (isFirst ? AdditionT : MultiplicationT)))
+        {
+            return numChains;
+        }
+    }
+    mChainEvaluation = chainEvaluation;
+    return numChains+1;
+}
+
+//! @brief Compute a hash of the structure of the expression
+//! @details Structurally equal expressions, that always evaluate to the same value, have the same hash
+uint64_t Expression::structuralHash() const
+{
+    std::map<const Expression*, uint64_t> hashes;
+    return structuralHash(hashes);
+}
+
+//! @brief Check if two expressions have the same structure and therefore always evaluate to the same value
+//! @param[in] other The expression to compare with
+bool Expression::isStructurallyEqual(const Expression &other) const
+{
+    if (mIsNumericConstant || other.mIsNumericConstant)
+    {
+        return (mIsNumericConstant == other.mIsNumericConstant) && sameBits(mNumericConstantValue, other.mNumericConstantValue);
+    }
+    if (mIsNamedValue || other.mIsNamedValue)
+    {
+        return (mIsNamedValue == other.mIsNamedValue) && (mRightExpressionString == other.mRightExpressionString);
+    }
+    const bool isFold = isFoldOperator(mOperator);
+    if (isFold != isFoldOperator(other.mOperator) || (!isFold && mOperator != other.mOperator) ||
+        mReduction != other.mReduction || mChainEvaluation != other.mChainEvaluation || mFunctionId != other.mFunctionId ||
+        mLeftChildExpressions.size() != other.mLeftChildExpressions.size() ||
+        mRightChildExpressions.size() != other.mRightChildExpressions.size())
+    {
+        return false;
+    }
+    if (mOperator == AssignmentT && mLeftExpressionString != other.mLeftExpressionString)
+    {
+        return false;
+    }
+    std::list<Expression>::const_iterator it, oit;
+    for (it=mLeftChildExpressions.begin(), oit=other.mLeftChildExpressions.begin(); it!=mLeftChildExpressions.end(); ++it, ++oit)
+    {
+        if (!it->isStructurallyEqual(*oit))
+        {
+            return false;
+        }
+    }
+    for (it=mRightChildExpressions.begin(), oit=other.mRightChildExpressions.begin(); it!=mRightChildExpressions.end(); ++it, ++oit)
+    {
+        // The operator of a child decides how it is combined in a fold
+        if ((isFold && it->mOperator != oit->mOperator) || !it->isStructurallyEqual(*oit))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+//! @brief Check if the expression is free of side effects, it does not assign any variables
+bool Expression::isPure() const
+{
+    if (mOperator == AssignmentT || !mIsValid || (mOperator == FunctionCallT && !(mpFunction && mpFunction->isPure)))
+    {
+        return false;
+    }
+    std::list<Expression>::const_iterator it;
+    for (it=mLeftChildExpressions.begin(); it!=mLeftChildExpressions.end(); ++it)
+    {
+        if (!it->isPure())
+        {
+            return false;
+        }
+    }
+    for (it=mRightChildExpressions.begin(); it!=mRightChildExpressions.end(); ++it)
+    {
+        if (!it->isPure())
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+//! @brief Check if the expression calls a function that is not pure, such as a registered native function
+//! @details Unlike isPure(), assignments are not considered, only the effects that can not be seen from the expression itself
+bool Expression::callsImpureFunction() const
+{
+    if (mOperator == FunctionCallT && !(mpFunction && mpFunction->isPure))
+    {
+        return true;
+    }
+    std::list<Expression>::const_iterator it;
+    for (it=mLeftChildExpressions.begin(); it!=mLeftChildExpressions.end(); ++it)
+    {
+        if (it->callsImpureFunction())
+        {
+            return true;
+        }
+    }
+    for (it=mRightChildExpressions.begin(); it!=mRightChildExpressions.end(); ++it)
+    {
+        if (it->callsImpureFunction())
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+//! @brief Find pure subexpressions that occur more than once and give them shared cache slots
+//! @details Each shared subexpression is evaluated once and then reused from the cache, until a variable it depends on is assigned.
+//! Evaluate the expressions with the cache to make use of this.
+//! @param[in,out] expressions The expressions to search, previous cache slots are removed
+//! @param[in,out] rCache The cache, slots for the shared subexpressions are added
+//! @returns The number of shared subexpressions
+size_t Expression::eliminateCommonSubexpressions(const std::vector<Expression*> &expressions, EvaluationCache &rCache)
+{
+    std::vector<Expression*> subexpressions;
+    for (size_t i=0; i<expressions.size(); ++i)
+    {
+        bool hasNamedValues;
+        expressions[i]->collectSharableSubexpressions(subexpressions, hasNamedValues);
+    }
+
+    // Group structurally equal subexpressions, the hash is only used to find candidates
+    std::map<const Expression*, uint64_t> hashes;
+    std::map<uint64_t, std::vector<std::vector<Expression*> > > groups;
+    for (size_t i=0; i<subexpressions.size(); ++i)
+    {
+        Expression *pExpr = subexpressions[i];
+        std::vector<std::vector<Expression*> > &candidates = groups[pExpr->structuralHash(hashes)];
+        size_t g=0;
+        while (g<candidates.size() && !candidates[g].front()->isStructurallyEqual(*pExpr))
+        {
+            ++g;
+        }
+        if (g == candidates.size())
+        {
+            candidates.push_back(std::vector<Expression*>());
+        }
+        candidates[g].push_back(pExpr);
+    }
+
+    size_t numShared = 0;
+    std::map<uint64_t, std::vector<std::vector<Expression*> > >::iterator it;
+    for (it=groups.begin(); it!=groups.end(); ++it)
+    {
+        for (size_t g=0; g<it->second.size(); ++g)
+        {
+            std::vector<Expression*> &group = it->second[g];
+            if (group.size() > 1)
+            {
+                std::set<std::string> dependencies;
+                group.front()->extractNamedValues(dependencies);
+                const int slot = rCache.addSlot(dependencies);
+                for (size_t i=0; i<group.size(); ++i)
+                {
+                    group[i]->mCacheSlot = slot;
+                }
+                ++numShared;
+            }
+        }
+    }
+    return numShared;
+}
+
+//! @brief Prints the expression (as it will be evaluated) to a string
+std::string Expression::print()
+{
+    std::string fullexp;
+
+    if (mOperator == AssignmentT)
+    {
+        std::string r = mRightChildExpressions.front().print();
+        if (mHadRightOuterParanthesis)
+        {
+            r="("+r+")";
+        }
+        fullexp = mLeftExpressionString+"="+r;
+    }
+    else if (mOperator == PowerT)
+    {
+        std::string l = mLeftChildExpressions.front().print();
+        std::string r = mRightChildExpressions.front().print();
+        if (mHadLeftOuterParanthesis)
+        {
+            l="("+l+")";
+        }
+        if (mHadRightOuterParanthesis)
+        {
+            r="("+r+")";
+        }
+        fullexp = l+"^"+r;
+    }
+    else if (mOperator == LessThenT)
+    {
+        std::string l = mLeftChildExpressions.front().print();
+        std::string r = mRightChildExpressions.front().print();
+        if (mHadLeftOuterParanthesis)
+        {
+            l="("+l+")";
+        }
+        if (mHadRightOuterParanthesis)
+        {
+            r="("+r+")";
+        }
+        fullexp = l+"<"+r;
+    }
+    else if (mOperator == GreaterThenT)
+    {
+        std::string l = mLeftChildExpressions.front().print();
+        std::string r = mRightChildExpressions.front().print();
+        if (mHadLeftOuterParanthesis)
+        {
+            l="("+l+")";
+        }
+        if (mHadRightOuterParanthesis)
+        {
+            r="("+r+")";
+        }
+        fullexp = l+">"+r;
+    }
+    else if (mOperator == FunctionCallT || mOperator == ConditionalT)
+    {
+        fullexp = mLeftExpressionString+'(';
+        std::list<Expression>::iterator it;
+        for (it=mRightChildExpressions.begin(); it!=mRightChildExpressions.end(); ++it) {
+            fullexp += it->print();
             fullexp += ',';
         }
-        fullexp[fullexp.size()-1] = ')';
+        fullexp[fullexp.size()-1] = ')';
+    }
+    else if (isValue())
+    {
+        fullexp = mRightExpressionString;
+        if (mHadRightOuterParanthesis)
+        {
+            fullexp = "("+fullexp+")";
+        }
+    }
+    else
+    {
+        std::list<Expression>::iterator it;
+        for (it=mRightChildExpressions.begin(); it!=mRightChildExpressions.end(); ++it)
+        {
+            ExpressionOperatorT optype = it->operatorType();
+            if (optype == AdditionT)
+            {
+                fullexp += "+";
+            }
+            else if (optype == SubtractionT)
+            {
+                fullexp += "-";
+            }
+            else if (optype == MultiplicationT)
+            {
+                fullexp += "*";
+            }
+            else if (optype == DivisionT)
+            {
+                fullexp += "/";
+            }
+            else if (optype == OrT)
+            {
+                fullexp += "|";
+            }
+            else if (optype == AndT)
+            {
+                fullexp += "&";
+            }
+            fullexp += it->print();
+        }
+        stripInitialPlus(fullexp);
+        if (mHadRightOuterParanthesis)
+        {
+            fullexp = "("+fullexp+")";
+        }
+    }
+    return fullexp;
+}
+
+//! @brief Write the expression tree in binary form
+//! @param[in,out] rWriter The binary writer
+void Expression::write(BinaryWriter &rWriter) const
+{
+    size_t pos=0;
+    write(rWriter, std::string(), pos);
+}
+
+//! @brief Read an expression tree that was written in binary form
+//! @param[in,out] rReader The binary reader
+//! @param[in] numCacheSlots The number of slots of the cache that the expression is evaluated with, for shared subexpressions
+//! @returns False if the data was invalid
+bool Expression::read(BinaryReader &rReader, size_t numCacheSlots)
+{
+    return read(rReader, std::string(), numCacheSlots, 1);
+}
+
+// Help function for writing expression strings, most child expression strings are parts of the parent expression string,
+// then only the position and length is written
+void writeExpressionString(BinaryWriter &rWriter, const std::string &str, size_t pos)
+{
+    if (pos != std::string::npos)
+    {
+        rWriter.writeVarUInt(pos);
+        rWriter.writeVarUInt(str.size());
+    }
+    else
+    {
+        rWriter.writeString(str);
+    }
+}
+
+bool readExpressionString(BinaryReader &rReader, const std::string &parentString, bool isPartOfParent, std::string &rStr)
+{
+    if (isPartOfParent)
+    {
+        uint32_t pos, length;
+        if (!rReader.readVarUInt(pos) || !rReader.readVarUInt(length) || pos > parentString.size() || length > parentString.size()-pos)
+        {
+            return false;
+        }
+        rStr.assign(parentString, pos, length);
+        return true;
+    }
+    return rReader.readString(rStr);
+}
+
+//! @brief Write the expression tree in binary form
+//! @param[in,out] rWriter The binary writer
+//! @param[in] parentString The parent expression string that this expression was interpreted from
+//! @param[in,out] rParentPos The position in the parent string to search from, updated to after this expression
+void Expression::write(BinaryWriter &rWriter, const std::string &parentString, size_t &rParentPos) const
+{
+    // Any matching part will do, it does not have to be the exact location that the expression was interpreted from
+    const size_t leftPos = parentString.find(mLeftExpressionString, rParentPos);
+    const size_t rightPos = parentString.find(mRightExpressionString, rParentPos);
+    if (leftPos != std::string::npos)
+    {
+        rParentPos = leftPos + mLeftExpressionString.size();
+    }
+    if (rightPos != std::string::npos)
+    {
+        rParentPos = std::max(rParentPos, rightPos + mRightExpressionString.size());
+    }
+
+    // Rewrites made after interpretation are written as optional attributes, flagged in an extra byte
+    const uint8_t attributes = uint8_t(mReduction != NoReduction) | uint8_t((mCacheSlot >= 0) << 1) |
+                               uint8_t((mChainEvaluation != SequentialChainT) << 2);
+    const uint8_t flags = uint8_t(mHadLeftOuterParanthesis) | uint8_t(mHadRightOuterParanthesis << 1) | uint8_t(mIsNumericConstant << 2) |
+                          uint8_t(mIsNamedValue << 3) | uint8_t(mIsValid << 4) | uint8_t((leftPos != std::string::npos) << 5) |
+                          uint8_t((rightPos != std::string::npos) << 6) | uint8_t((attributes != 0) << 7);
+    rWriter.writeUInt8(uint8_t(mOperator));
+    rWriter.writeUInt8(flags);
+    writeExpressionString(rWriter, mLeftExpressionString, leftPos);
+    writeExpressionString(rWriter, mRightExpressionString, rightPos);
+    if (mOperator == FunctionCallT)
+    {
+        rWriter.writeFunction(mLeftExpressionString, mRightChildExpressions.size(), mFunctionId);
+    }
+    if (mIsNumericConstant)
+    {
+        rWriter.writeDouble(mNumericConstantValue);
+    }
+    if (attributes != 0)
+    {
+        rWriter.writeUInt8(attributes);
+    }
+    if (mReduction != NoReduction)
+    {
+        rWriter.writeUInt8(uint8_t(mReduction));
+        rWriter.writeUInt8(uint8_t(mReducedExponent + maxReducedIntegerExponent));
+        rWriter.writeDouble(mReducedReciprocal);
+    }
+    if (mCacheSlot >= 0)
+    {
+        rWriter.writeVarUInt(uint64_t(mCacheSlot));
+    }
+    if (mChainEvaluation != SequentialChainT)
+    {
+        rWriter.writeUInt8(uint8_t(mChainEvaluation));
+    }
+
+    std::list<Expression>::const_iterator it;
+    size_t pos=0;
+    rWriter.writeVarUInt(mLeftChildExpressions.size());
+    for (it=mLeftChildExpressions.begin(); it!=mLeftChildExpressions.end(); ++it)
+    {
+        it->write(rWriter, mLeftExpressionString, pos);
+    }
+    pos=0;
+    rWriter.writeVarUInt(mRightChildExpressions.size());
+    for (it=mRightChildExpressions.begin(); it!=mRightChildExpressions.end(); ++it)
+    {
+        it->write(rWriter, mRightExpressionString, pos);
+    }
+}
+
+//! @brief Read an expression tree that was written in binary form
+//! @param[in,out] rReader The binary reader
+//! @param[in] parentString The parent expression string
+//! @param[in] numCacheSlots The number of slots of the cache that the expression is evaluated with
+//! @param[in] depth The depth of the expression in the tree, the root has depth 1
+//! @returns False if the data was invalid or deeper than maxExpressionTreeDepth
+bool Expression::read(BinaryReader &rReader, const std::string &parentString, size_t numCacheSlots, size_t depth)
+{
+    commonConstructorCode();
+    mLeftChildExpressions.clear();
+    mRightChildExpressions.clear();
+    if (depth > maxExpressionTreeDepth)
+    {
+        return false;
+    }
+
+    uint8_t op, flags;
+    if (!rReader.readUInt8(op) || !rReader.readUInt8(flags) || op > UndefinedT ||
+        !readExpressionString(rReader, parentString, (flags & 32) != 0, mLeftExpressionString) ||
+        !readExpressionString(rReader, parentString, (flags & 64) != 0, mRightExpressionString))
+    {
+        return false;
+    }
+    mOperator = ExpressionOperatorT(op);
+    mHadLeftOuterParanthesis = (flags & 1) != 0;
+    mHadRightOuterParanthesis = (flags & 2) != 0;
+    mIsNumericConstant = (flags & 4) != 0;
+    mIsNamedValue = (flags & 8) != 0;
+    mIsValid = (flags & 16) != 0;
+    if (mOperator == FunctionCallT)
+    {
+        if (!rReader.readFunction(mFunctionId))
+        {
+            return false;
+        }
+        mpFunction = gFunctionHandler.function(mFunctionId);
     }
-    else if (isValue())
+    if (mIsNumericConstant && !rReader.readDouble(mNumericConstantValue))
     {
-        fullexp = mRightExpressionString;
-        if (mHadRightOuterParanthesis)
+        return false;
+    }
+    uint8_t attributes = 0;
+    if ((flags & 128) != 0 && !rReader.readUInt8(attributes))
+    {
+        return false;
+    }
+    if ((attributes & 1) != 0)
+    {
+        uint8_t reduction, exponent;
+        if (!rReader.readUInt8(reduction) || !rReader.readUInt8(exponent) || !rReader.readDouble(mReducedReciprocal) ||
+            reduction > ReciprocalReduction || exponent > 2*maxReducedIntegerExponent)
         {
-            fullexp = "("+fullexp+")";
+            return false;
+        }
+        mReduction = ReductionT(reduction);
+        mReducedExponent = int(exponent) - maxReducedIntegerExponent;
+    }
+    if ((attributes & 2) != 0)
+    {
+        uint32_t slot;
+        if (!rReader.readVarUInt(slot) || slot >= numCacheSlots)
+        {
+            return false;
+        }
+        mCacheSlot = int(slot);
+    }
+    if ((attributes & 4) != 0)
+    {
+        uint8_t chainEvaluation;
+        if (!rReader.readUInt8(chainEvaluation) || chainEvaluation > CompensatedChainT)
+        {
+            return false;
+        }
+        mChainEvaluation = ChainEvaluationT(chainEvaluation);
+    }
+
+    // A child needs at least 6 bytes, check the count before allocating
+    uint32_t numChildren;
+    if (!rReader.readVarUInt(numChildren) || numChildren > rReader.remainingSize()/6)
+    {
+        return false;
+    }
+    for (uint32_t i=0; i<numChildren; ++i)
+    {
+        mLeftChildExpressions.push_back(Expression());
+        if (!mLeftChildExpressions.back().read(rReader, mLeftExpressionString, numCacheSlots, depth+1))
+        {
+            return false;
+        }
+    }
+    if (!rReader.readVarUInt(numChildren) || numChildren > rReader.remainingSize()/6)
+    {
+        return false;
+    }
+    for (uint32_t i=0; i<numChildren; ++i)
+    {
+        mRightChildExpressions.push_back(Expression());
+        if (!mRightChildExpressions.back().read(rReader, mRightExpressionString, numCacheSlots, depth+1))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+//! @brief Select a cheaper evaluation of a power with constant exponent
+//! @param[in] exponent The exponent expression
+//! @param[in] allowRoundingChanges Allow rewrites that may change the rounding of the result
+//! @returns True if the power could be reduced
+bool Expression::reducePower(const Expression &exponent, bool allowRoundingChanges)
+{
+    if (!exponent.isConstant())
+    {
+        return false;
+    }
+    bool isOK;
+    VariableStorage noVariables;
+    const double value = exponent.evaluate(noVariables, isOK);
+    if (!isOK)
+    {
+        return false;
+    }
+    if (value == 0.5)
+    {
+        mReduction = SquareRootReduction;
+    }
+    else if (value == -0.5 && allowRoundingChanges)
+    {
+        mReduction = ReciprocalSquareRootReduction;
+    }
+    else if (value == floor(value) && fabs(value) <= maxReducedIntegerExponent)
+    {
+        mReducedExponent = int(value);
+        if (allowRoundingChanges || (mReducedExponent >= -1 && mReducedExponent <= 2))
+        {
+            mReduction = IntegerPowerReduction;
+        }
+    }
+    return mReduction != NoReduction;
+}
+
+//! @brief Evaluate a reduced power
+//! @param[in] base The value of the base
+//! @returns The base raised to the constant exponent
+double Expression::reducedPower(double base) const
+{
+    if (mReduction == SquareRootReduction)
+    {
+        // Same as pow() for -inf and -0
+        return (base == -HUGE_VAL) ? HUGE_VAL : sqrt(base)+0.;
+    }
+    else if (mReduction == ReciprocalSquareRootReduction)
+    {
+        return (base == -HUGE_VAL) ? 0. : 1./(sqrt(base)+0.);
+    }
+
+    // Exponentiation by squaring
+    unsigned int n = (mReducedExponent < 0) ? -mReducedExponent : mReducedExponent;
+    double result = 1.;
+    bool isFirst = true;
+    double factor = base;
+    while (n > 0)
+    {
+        if (n & 1u)
+        {
+            result = isFirst ? factor : result*factor;
+            isFirst = false;
+        }
+        n >>= 1;
+        if (n > 0)
+        {
+            factor *= factor;
         }
     }
+    return (mReducedExponent < 0) ? 1./result : result;
+}
+
+//! @brief Remove cache slots and collect the subexpressions that could be shared, children before parents
+//! @details Leaves and constant subexpressions are cheap to evaluate and are not collected
+//! @param[out] rSubexpressions The subexpressions that are pure and depend on named values
+//! @param[out] rHasNamedValues Indicates whether this expression depends on any named value
+//! @returns True if this expression is pure
+bool Expression::collectSharableSubexpressions(std::vector<Expression*> &rSubexpressions, bool &rHasNamedValues)
+{
+    mCacheSlot = -1;
+    bool isPure = mIsValid && (mOperator != AssignmentT) && (mOperator != FunctionCallT || (mpFunction && mpFunction->isPure));
+    rHasNamedValues = mIsNamedValue;
+    std::list<Expression>::iterator it;
+    for (it=mLeftChildExpressions.begin(); it!=mLeftChildExpressions.end(); ++it)
+    {
+        bool childHasNamedValues;
+        isPure = it->collectSharableSubexpressions(rSubexpressions, childHasNamedValues) && isPure;
+        rHasNamedValues = rHasNamedValues || childHasNamedValues;
+    }
+    for (it=mRightChildExpressions.begin(); it!=mRightChildExpressions.end(); ++it)
+    {
+        bool childHasNamedValues;
+        isPure = it->collectSharableSubexpressions(rSubexpressions, childHasNamedValues) && isPure;
+        rHasNamedValues = rHasNamedValues || childHasNamedValues;
+    }
+    if (isPure && rHasNamedValues && !mIsNamedValue && !mIsNumericConstant)
+    {
+        rSubexpressions.push_back(this);
+    }
+    return isPure;
+}
+
+//! @brief Compute the structural hash, memorizing the hashes of all subexpressions
+uint64_t Expression::structuralHash(std::map<const Expression*, uint64_t> &rHashes) const
+{
+    std::map<const Expression*, uint64_t>::const_iterator found = rHashes.find(this);
+    if (found != rHashes.end())
+    {
+        return found->second;
+    }
+
+    uint64_t hash = 14695981039346656037ULL;
+    if (mIsNumericConstant)
+    {
+        uint64_t bits;
+        std::memcpy(&bits, &mNumericConstantValue, sizeof(bits));
+        hash = hashCombine(hash, bits);
+    }
+    else if (mIsNamedValue)
+    {
+        hash = hashCombine(hash+1, hashString(mRightExpressionString.data(), mRightExpressionString.size()));
+    }
     else
     {
-        std::list<Expression>::iterator it;
+        const bool isFold = isFoldOperator(mOperator);
+        hash = hashCombine(hash+2, isFold ? uint64_t(UndefinedT)+1 : uint64_t(mOperator));
+        hash = hashCombine(hash, uint64_t(mReduction));
+        hash = hashCombine(hash, uint64_t(mChainEvaluation));
+        hash = hashCombine(hash, uint64_t(int64_t(mFunctionId)));
+        if (mOperator == AssignmentT)
+        {
+            hash = hashCombine(hash, hashString(mLeftExpressionString.data(), mLeftExpressionString.size()));
+        }
+        std::list<Expression>::const_iterator it;
+        for (it=mLeftChildExpressions.begin(); it!=mLeftChildExpressions.end(); ++it)
+        {
+            hash = hashCombine(hash, it->structuralHash(rHashes));
+        }
         for (it=mRightChildExpressions.begin(); it!=mRightChildExpressions.end(); ++it)
         {
-            ExpressionOperatorT optype = it->operatorType();
-            if (optype == AdditionT)
-            {
-                fullexp += "+";
-            }
-            else if (optype == SubtractionT)
-            {
-                fullexp += "-";
-            }
-            else if (optype == MultiplicationT)
-            {
-                fullexp += "*";
-            }
-            else if (optype == DivisionT)
-            {
-                fullexp += "/";
-            }
-            else if (optype == OrT)
-            {
-                fullexp += "|";
-            }
-            else if (optype == AndT)
+            if (isFold)
             {
-                fullexp += "&";
+                hash = hashCombine(hash, uint64_t(it->mOperator));
             }
-            fullexp += it->print();
-        }
-        stripInitialPlus(fullexp);
-        if (mHadRightOuterParanthesis)
-        {
-            fullexp = "("+fullexp+")";
+            hash = hashCombine(hash, it->structuralHash(rHashes));
         }
     }
-    return fullexp;
+    rHashes[this] = hash;
+    return hash;
 }
 
 void Expression::commonConstructorCode()
@@ -995,25 +3010,71 @@ void Expression::commonConstructorCode()
     mIsNamedValue = false;
     mIsValid = false;
     mFunctionId = -1;
+    mpFunction = 0;
     mNumericConstantValue = 0;
+    mReduction = NoReduction;
+    mReducedExponent = 0;
+    mReducedReciprocal = 0;
+    mChainEvaluation = SequentialChainT;
+    mCacheSlot = -1;
 }
 
 //! @brief Copy from other expression (help function for assignment and copy constructor)
 //! @param[in] other The expression to copy from
 void Expression::copyFromOther(const Expression &other)
+{
+    copyNodeFromOther(other);
+    mLeftChildExpressions.clear();
+    mRightChildExpressions.clear();
+
+    // Child expressions are copied with a work list instead of recursively, deep trees must not overflow the call stack
+    std::vector<std::pair<const Expression*, Expression*> > expressions;
+    if (!other.mLeftChildExpressions.empty() || !other.mRightChildExpressions.empty())
+    {
+        expressions.push_back(std::make_pair(&other, this));
+    }
+    while (!expressions.empty())
+    {
+        const Expression &from = *expressions.back().first;
+        Expression &rTo = *expressions.back().second;
+        expressions.pop_back();
+
+        std::list<Expression>::const_iterator it;
+        for (it=from.mLeftChildExpressions.begin(); it!=from.mLeftChildExpressions.end(); ++it)
+        {
+            rTo.mLeftChildExpressions.push_back(Expression());
+            rTo.mLeftChildExpressions.back().copyNodeFromOther(*it);
+            expressions.push_back(std::make_pair(&*it, &rTo.mLeftChildExpressions.back()));
+        }
+        for (it=from.mRightChildExpressions.begin(); it!=from.mRightChildExpressions.end(); ++it)
+        {
+            rTo.mRightChildExpressions.push_back(Expression());
+            rTo.mRightChildExpressions.back().copyNodeFromOther(*it);
+            expressions.push_back(std::make_pair(&*it, &rTo.mRightChildExpressions.back()));
+        }
+    }
+}
+
+//! @brief Copy everything but the child expressions from other expression
+//! @param[in] other The expression to copy from
+void Expression::copyNodeFromOther(const Expression &other)
 {
     mOperator = other.mOperator;
     mHadLeftOuterParanthesis = other.mHadLeftOuterParanthesis;
     mHadRightOuterParanthesis = other.mHadRightOuterParanthesis;
-    mLeftChildExpressions = other.mLeftChildExpressions;
-    mRightChildExpressions = other.mRightChildExpressions;
     mLeftExpressionString = other.mLeftExpressionString;
     mRightExpressionString = other.mRightExpressionString;
     mIsNumericConstant = other.mIsNumericConstant;
     mIsNamedValue = other.mIsNamedValue;
     mNumericConstantValue = other.mNumericConstantValue;
     mFunctionId = other.mFunctionId;
+    mpFunction = other.mpFunction;
     mIsValid = other.mIsValid;
+    mReduction = other.mReduction;
+    mReducedExponent = other.mReducedExponent;
+    mReducedReciprocal = other.mReducedReciprocal;
+    mChainEvaluation = other.mChainEvaluation;
+    mCacheSlot = other.mCacheSlot;
 }
 
 std::vector<std::string> getRegisteredFunctionNames()
@@ -1021,4 +3082,291 @@ std::vector<std::string> getRegisteredFunctionNames()
     return gFunctionHandler.registeredFunctionNames();
 }
 
+//! @brief Lookup the id of a registered function
+//! @param[in] name The function name
+//! @param[in] numArgs The number of function arguments
+//! @returns The function id, or -1 if no such function exists
+int getFunctionId(const std::string &name, size_t numArgs)
+{
+    return gFunctionHandler.lookupFunctionId(name, numArgs);
+}
+
+//! @brief Register a single argument function, that can be called from expressions
+//! @details Registering a function with the same name and number of arguments again replaces it. The names of built-in functions can not be registered.
+//! Functions must be registered before expressions using them are interpreted, and not while expressions are interpreted or evaluated in other threads.
+//! User functions are assumed to have side effects, they are never treated as constant or shared subexpressions.
+//! @param[in] name The function name, alphanumeric starting with a letter
+//! @param[in] pFunction The function
+//! @returns The function id, or -1 if the name is invalid or used by a built-in function
+int registerFunction(const std::string &name, OneArgFunctionT pFunction)
+{
+    return gFunctionHandler.registerFunction(name, pFunction);
+}
+
+//! @brief Register a two argument function, that can be called from expressions
+//! @param[in] name The function name, alphanumeric starting with a letter
+//! @param[in] pFunction The function
+//! @returns The function id, or -1 if the name is invalid
+int registerFunction(const std::string &name, TwoArgFunctionT pFunction)
+{
+    return gFunctionHandler.registerFunction(name, pFunction);
+}
+
+//! @brief Register a function with any number of arguments and a context pointer
+//! @param[in] name The function name, alphanumeric starting with a letter
+//! @param[in] numArgs The number of arguments, at most maxFunctionArguments
+//! @param[in] pFunction The function, called with the argument values, the number of arguments and the context pointer
+//! @param[in] pContext The context pointer, passed to the function in each call
+//! @returns The function id, or -1 if the name or number of arguments is invalid
+int registerFunction(const std::string &name, size_t numArgs, NativeFunctionT pFunction, void *pContext)
+{
+    return gFunctionHandler.registerFunction(name, numArgs, pFunction, pContext);
+}
+
+//! @brief Register a function object with any number of arguments
+//! @param[in] name The function name, alphanumeric starting with a letter
+//! @param[in] numArgs The number of arguments, at most maxFunctionArguments
+//! @param[in] pFunction The function object, it must exist as long as expressions using it are evaluated
+//! @returns The function id, or -1 if the name or number of arguments is invalid
+int registerFunction(const std::string &name, size_t numArgs, NativeFunction *pFunction)
+{
+    return pFunction ? gFunctionHandler.registerFunction(name, numArgs, &callNativeFunctionObject, pFunction) : -1;
+}
+
+//! @brief Lookup a registered single argument function
+//! @param[in] functionId The function id
+//! @returns The function pointer, or 0 if no such function exists
+OneArgFunctionT getOneArgFunction(int functionId)
+{
+    return gFunctionHandler.oneArgFunction(functionId, false);
+}
+
+//! @brief Lookup a registered two argument function
+//! @param[in] functionId The function id
+//! @returns The function pointer, or 0 if no such function exists
+TwoArgFunctionT getTwoArgFunction(int functionId)
+{
+    return gFunctionHandler.twoArgFunction(functionId, false);
+}
+
+//! @brief Lookup a registered single argument function, or its fast approximation
+//! @param[in] functionId The function id
+//! @param[in] fastMath Return the fast approximation of a built-in function, if there is one
+//! @returns The function pointer, or 0 if no such function exists
+OneArgFunctionT getOneArgFunction(int functionId, bool fastMath)
+{
+    return gFunctionHandler.oneArgFunction(functionId, fastMath);
+}
+
+//! @brief Lookup a registered two argument function, or its fast approximation
+//! @param[in] functionId The function id
+//! @param[in] fastMath Return the fast approximation of a built-in function, if there is one
+//! @returns The function pointer, or 0 if no such function exists
+TwoArgFunctionT getTwoArgFunction(int functionId, bool fastMath)
+{
+    return gFunctionHandler.twoArgFunction(functionId, fastMath);
+}
+
+//! @brief Lookup the array version of the fast approximation of a built-in single argument function
+//! @param[in] functionId The function id
+//! @param[in] fastMath Indicates if fast math is used, else there is no array function
+//! @returns The function pointer, or 0 if there is no such function
+ArrayFunctionT getArrayFunction(int functionId, bool fastMath)
+{
+    return gFunctionHandler.arrayFunction(functionId, fastMath);
+}
+
+//! @brief Call a registered function for arrays of arguments
+//! @param[in] functionId The function id
+//! @param[in] ppArgs One array of numValues values per argument
+//! @param[in] numArgs The number of arguments, it must match the function
+//! @param[in] numValues The number of values in each argument array
+//! @param[out] pResult The numValues results
+//! @returns False if no such function exists
+bool callFunctionElementWise(int functionId, const double *const *ppArgs, size_t numArgs, size_t numValues, double *pResult)
+{
+    const RegisteredFunction *pFunction = gFunctionHandler.function(functionId);
+    if (!pFunction || numArgs != pFunction->numArgs) {
+        return false;
+    }
+    if (pFunction->pNativeFunction == &callNativeFunctionObject) {
+        static_cast<NativeFunction*>(pFunction->pContext)->callElementWise(ppArgs, numArgs, numValues, pResult);
+        return true;
+    }
+    double values[maxFunctionArguments];
+    for (size_t i=0; i<numValues; ++i) {
+        for (size_t a=0; a<numArgs; ++a) {
+            values[a] = ppArgs[a][i];
+        }
+        if (pFunction->pOneArgFunction) {
+            pResult[i] = pFunction->pOneArgFunction(values[0]);
+        }
+        else if (pFunction->pTwoArgFunction) {
+            pResult[i] = pFunction->pTwoArgFunction(values[0], values[1]);
+        }
+        else {
+            pResult[i] = pFunction->pNativeFunction(values, numArgs, pFunction->pContext);
+        }
+    }
+    return true;
+}
+
+NativeFunction::~NativeFunction()
+{
+
+}
+
+//! @brief Evaluate the function for arrays of arguments, override this to process all values at once
+//! @param[in] ppArgs One array of numValues values per argument
+//! @param[in] numArgs The number of arguments
+//! @param[in] numValues The number of values in each argument array
+//! @param[out] pResult The numValues results
+void NativeFunction::callElementWise(const double *const *ppArgs, size_t numArgs, size_t numValues, double *pResult)
+{
+    double values[maxFunctionArguments];
+    for (size_t i=0; i<numValues; ++i) {
+        for (size_t a=0; a<numArgs && a<maxFunctionArguments; ++a) {
+            values[a] = ppArgs[a][i];
+        }
+        pResult[i] = call(values, numArgs);
+    }
+}
+
+//! @brief Default constructor
+EvaluationCache::EvaluationCache()
+{
+    mGeneration = 1;
+}
+
+//! @brief Remove all slots
+void EvaluationCache::clear()
+{
+    mValues.clear();
+    mGenerations.clear();
+    mDependentSlots.clear();
+    mGeneration = 1;
+}
+
+//! @brief Add a slot for a shared subexpression
+//! @param[in] dependencies The names of the named values the subexpression depends on
+//! @returns The slot index
+int EvaluationCache::addSlot(const std::set<std::string> &dependencies)
+{
+    const int slot = int(mValues.size());
+    mValues.push_back(0.);
+    mGenerations.push_back(0);
+    std::set<std::string>::const_iterator it;
+    for (it=dependencies.begin(); it!=dependencies.end(); ++it)
+    {
+        mDependentSlots[*it].push_back(slot);
+    }
+    return slot;
+}
+
+//! @brief Returns the number of slots
+size_t EvaluationCache::numSlots() const
+{
+    return mValues.size();
+}
+
+//! @brief Invalidate all cached values, call before each evaluation
+void EvaluationCache::invalidateAll()
+{
+    ++mGeneration;
+    if (mGeneration == 0)
+    {
+        std::fill(mGenerations.begin(), mGenerations.end(), 0u);
+        mGeneration = 1;
+    }
+}
+
+//! @brief Invalidate the cached values depending on a variable
+//! @param[in] variableName The name of the variable that has changed
+void EvaluationCache::invalidate(const std::string &variableName)
+{
+    std::map<std::string, std::vector<int> >::const_iterator it = mDependentSlots.find(variableName);
+    if (it != mDependentSlots.end())
+    {
+        for (size_t i=0; i<it->second.size(); ++i)
+        {
+            mGenerations[it->second[i]] = 0;
+        }
+    }
+}
+
+//! @brief Lookup a cached value
+//! @param[in] slot The slot index
+//! @param[out] rValue The cached value, if valid
+//! @returns True if the cached value is valid
+bool EvaluationCache::lookup(int slot, double &rValue) const
+{
+    if (mGenerations[slot] == mGeneration)
+    {
+        rValue = mValues[slot];
+        return true;
+    }
+    return false;
+}
+
+//! @brief Store a value in the cache
+//! @param[in] slot The slot index
+//! @param[in] value The value to store
+void EvaluationCache::store(int slot, double value)
+{
+    mValues[slot] = value;
+    mGenerations[slot] = mGeneration;
+}
+
+//! @brief Write the slots and their dependencies in binary form, the cached values are not written
+//! @param[in,out] rWriter The binary writer
+void EvaluationCache::write(BinaryWriter &rWriter) const
+{
+    rWriter.writeVarUInt(mValues.size());
+    rWriter.writeVarUInt(mDependentSlots.size());
+    std::map<std::string, std::vector<int> >::const_iterator it;
+    for (it=mDependentSlots.begin(); it!=mDependentSlots.end(); ++it)
+    {
+        rWriter.writeString(it->first);
+        rWriter.writeVarUInt(it->second.size());
+        for (size_t i=0; i<it->second.size(); ++i)
+        {
+            rWriter.writeVarUInt(uint64_t(it->second[i]));
+        }
+    }
+}
+
+//! @brief Read slots that were written in binary form, all cached values are invalid after reading
+//! @param[in,out] rReader The binary reader
+//! @returns False if the data was invalid, the cache is then cleared
+bool EvaluationCache::read(BinaryReader &rReader)
+{
+    clear();
+    uint32_t numSlots, numNames;
+    bool ok = rReader.readVarUInt(numSlots) && rReader.readVarUInt(numNames) && numSlots <= rReader.remainingSize() &&
+              numNames <= rReader.remainingSize();
+    if (ok)
+    {
+        mValues.resize(numSlots, 0.);
+        mGenerations.resize(numSlots, 0u);
+    }
+    for (uint32_t n=0; ok && n<numNames; ++n)
+    {
+        std::string name;
+        uint32_t numDependent;
+        ok = rReader.readString(name) && rReader.readVarUInt(numDependent) && numDependent <= numSlots;
+        std::vector<int> &rSlots = mDependentSlots[name];
+        for (uint32_t i=0; ok && i<numDependent; ++i)
+        {
+            uint32_t slot;
+            ok = rReader.readVarUInt(slot) && slot < numSlots;
+            rSlots.push_back(int(slot));
+        }
+    }
+    if (!ok)
+    {
+        clear();
+    }
+    return ok;
+}
+
 }
@@ -0,0 +1,378 @@
+#include "numhop/FastMath.h"
+#include "numhop/CpuDispatch.h"
+#include <cmath>
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <stdint.h>
+
+#if defined(NUMHOP_SIMD_TARGETS) && defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#endif
+
+namespace numhop {
+
+namespace {
+
+// Adding and subtracting 1.5*2^52 rounds to the nearest integer, which is also found in the low bits of the sum
+const double roundingShift = 6755399441055744.0;
+
+const double log2e = 1.44269504088896338700;
+const double ln2Hi = 6.93147180369123816490e-01;  // The upper bits of ln(2), multiples are exact
+const double ln2Lo = 1.90821492927058770002e-10;
+const double invLn10 = 0.43429448190325182765;
+const double sqrt2 = 1.41421356237309504880;
+
+const double twoOverPi = 6.36619772367581382433e-01;
+const double pio2_1 = 1.57079632673412561417e+00;  // The first 33 bits of pi/2, multiples are exact
+const double pio2_2 = 6.07710050630396597660e-11;  // The next 33 bits
+const double pio2_3 = 2.02226624871116645580e-21;  // The next 33 bits
+const double pio2_3t = 8.47842766036889956997e-32; // The rest
+const double pio2 = 1.57079632679489661923;
+const double pio6 = 0.52359877559829887308;
+const double pi = 3.14159265358979323846;
+const double sqrt3 = 1.73205080756887729353;
+const double tanPio12 = 0.26794919243112270647;
+
+//! @brief Above this magnitude sin and cos use the C library, the simple range reduction loses accuracy
+const double maxFastTrigArgument = 1e5;
+
+inline uint64_t doubleToBits(const double d)
+{
+    uint64_t bits;
+    std::memcpy(&bits, &d, sizeof(bits));
+    return bits;
+}
+
+inline double bitsToDouble(const uint64_t bits)
+{
+    double d;
+    std::memcpy(&d, &bits, sizeof(d));
+    return d;
+}
+
+inline double withSignOf(const double magnitude, const double sign)
+{
+    return bitsToDouble((doubleToBits(magnitude) & 0x7FFFFFFFFFFFFFFFULL) | (doubleToBits(sign) & 0x8000000000000000ULL));
+}
+
+//! @brief Multiply by 2^n in two steps, so that results in the subnormal range are rounded once
+//! @param[in] v The value
+//! @param[in] n The exponent, from -1077 to 1025
+inline double scaleByPowerOfTwo(const double v, const int n)
+{
+    const int n1 = n/2;
+    const int n2 = n-n1;
+    return v * bitsToDouble(uint64_t(n1+1023) << 52) * bitsToDouble(uint64_t(n2+1023) << 52);
+}
+
+//! @brief e^r - 1 for |r| <= ln(2)/2, a Taylor polynomial of degree 13
+inline double expm1Polynomial(const double r)
+{
+    return r*(1. + r*(1./2. + r*(1./6. + r*(1./24. + r*(1./120. + r*(1./720. + r*(1./5040. + r*(1./40320. +
+           r*(1./362880. + r*(1./3628800. + r*(1./39916800. + r*(1./479001600. + r*(1./6227020800.)))))))))))));
+}
+
+//! @brief Split x into n*ln(2) + r with integer n and |r| <= ln(2)/2, x is clamped so that n fits scaleByPowerOfTwo()
+inline double reduceExp(double x, int &rN)
+{
+    x = (x > 710.) ? 710. : ((x < -746.) ? -746. : x);
+    const double shifted = x*log2e + roundingShift;
+    const double k = shifted - roundingShift;
+    rN = int(int32_t(uint32_t(doubleToBits(shifted))));
+    return (x - k*ln2Hi) - k*ln2Lo;
+}
+
+inline double expCore(const double x)
+{
+    int n;
+    const double r = reduceExp(x, n);
+    const double result = scaleByPowerOfTwo(1. + expm1Polynomial(r), n);
+    return (x == x) ? result : x;
+}
+
+//! @brief e^x - 1, accurate also for small x
+inline double expm1Core(const double x)
+{
+    int n;
+    const double r = reduceExp(x, n);
+    const double p = expm1Polynomial(r);
+    return (n == 0) ? p : scaleByPowerOfTwo(1. + p, n) - 1.;
+}
+
+inline double logCore(double x)
+{
+    // Scale subnormal numbers to the normal range
+    const bool isSubnormal = (x < std::numeric_limits<double>::min());
+    const double scaled = isSubnormal ? x*18014398509481984. : x;  // 2^54
+    const uint64_t bits = doubleToBits(scaled);
+    int e = int((bits >> 52) & 0x7FF) - 1023 - (isSubnormal ? 54 : 0);
+    double m = bitsToDouble((bits & 0x000FFFFFFFFFFFFFULL) | 0x3FF0000000000000ULL);
+    if (m > sqrt2)
+    {
+        m *= 0.5;
+        ++e;
+    }
+
+    // log(m) = 2*atanh(f), the series in f^2 converges fast for m in [sqrt(2)/2, sqrt(2)]
+    const double f = (m-1.)/(m+1.);
+    const double s = f*f;
+    const double series = s*(1./3. + s*(1./5. + s*(1./7. + s*(1./9. + s*(1./11. + s*(1./13. + s*(1./15. +
+                          s*(1./17. + s*(1./19. + s*(1./21.))))))))));
+    const double logM = 2.*f + 2.*f*series;
+    const double ed = double(e);
+    const double result = ed*ln2Hi + (ed*ln2Lo + logM);
+
+    if (!(x > 0.))
+    {
+        return (x == 0.) ? -std::numeric_limits<double>::infinity() : std::numeric_limits<double>::quiet_NaN();
+    }
+    return (x == std::numeric_limits<double>::infinity()) ? x : result;
+}
+
+//! @brief Split x into k*pi/2 + r with |r| <= pi/4, valid for |x| up to maxFastTrigArgument
+inline double reduceQuadrant(const double x, int &rQuadrant)
+{
+    const double shifted = x*twoOverPi + roundingShift;
+    const double k = shifted - roundingShift;
+    rQuadrant = int(uint32_t(doubleToBits(shifted)) & 3);
+    return ((x - k*pio2_1) - k*pio2_2) - k*pio2_3 - k*pio2_3t;
+}
+
+//! @brief sin(r) for |r| <= pi/4, a Taylor polynomial of degree 15
+inline double sinPolynomial(const double r)
+{
+    const double r2 = r*r;
+    return r + r*r2*(-1./6. + r2*(1./120. + r2*(-1./5040. + r2*(1./362880. + r2*(-1./39916800. + r2*(1./6227020800. +
+           r2*(-1./1307674368000.)))))));
+}
+
+//! @brief cos(r) for |r| <= pi/4, a Taylor polynomial of degree 16
+inline double cosPolynomial(const double r)
+{
+    const double r2 = r*r;
+    return 1. - 0.5*r2 + r2*r2*(1./24. + r2*(-1./720. + r2*(1./40320. + r2*(-1./3628800. + r2*(1./479001600. +
+           r2*(-1./87178291200. + r2*(1./20922789888000.)))))));
+}
+
+//! @brief sin(x) for |x| <= maxFastTrigArgument, the phase is 0 for sin and 1 for cos
+inline double sinCore(const double x, const int phase)
+{
+    int quadrant;
+    const double r = reduceQuadrant(x, quadrant);
+    quadrant += phase;
+    const double s = sinPolynomial(r);
+    const double c = cosPolynomial(r);
+    const double v = (quadrant & 1) ? c : s;
+    return (quadrant & 2) ? -v : v;
+}
+
+//! @brief atan(t) for |t| <= tan(pi/12), a Taylor polynomial of degree 25
+inline double atanPolynomial(const double t)
+{
+    const double t2 = t*t;
+    return t + t*t2*(-1./3. + t2*(1./5. + t2*(-1./7. + t2*(1./9. + t2*(-1./11. + t2*(1./13. + t2*(-1./15. +
+           t2*(1./17. + t2*(-1./19. + t2*(1./21. + t2*(-1./23. + t2*(1./25.))))))))))));
+}
+
+inline double atanCore(const double x)
+{
+    // atan(a) = pi/2 - atan(1/a) and atan(a) = pi/6 + atan((a*sqrt(3)-1)/(a+sqrt(3))) reduce the argument
+    double a = std::fabs(x);
+    const bool isInverted = (a > 1.);
+    a = isInverted ? 1./a : a;
+    const bool isShifted = (a > tanPio12);
+    const double t = isShifted ? (a*sqrt3 - 1.)/(a + sqrt3) : a;
+    double result = atanPolynomial(t);
+    result = isShifted ? pio6 + result : result;
+    result = isInverted ? pio2 - result : result;
+    return withSignOf(result, x);
+}
+
+inline double tanhCore(const double x)
+{
+    // tanh saturates to 1 long before 2|x| overflows exp
+    const double a = std::fabs(x);
+    const double em1 = expm1Core(2.*((a > 20.) ? 20. : a));
+    const double result = em1/(em1 + 2.);
+    return (x == x) ? withSignOf(result, x) : x;
+}
+
+}
+
+//! @brief e^x, at most 1.5 ulp error
+double fastExp(double x)
+{
+    return expCore(x);
+}
+
+//! @brief Natural logarithm, at most 2 ulp error
+double fastLog(double x)
+{
+    return logCore(x);
+}
+
+//! @brief Base 10 logarithm, at most 3 ulp error
+double fastLog10(double x)
+{
+    return logCore(x)*invLn10;
+}
+
+//! @brief Sine, at most 2 ulp error for |x| <= 100 and 3 ulp for |x| <= 1e5 (the C library is used for larger values)
+double fastSin(double x)
+{
+    if (std::fabs(x) > maxFastTrigArgument)
+    {
+        return std::sin(x);
+    }
+    return sinCore(x, 0);
+}
+
+//! @brief Cosine, at most 2 ulp error for |x| <= 100 and 3 ulp for |x| <= 1e5 (the C library is used for larger values)
+double fastCos(double x)
+{
+    if (std::fabs(x) > maxFastTrigArgument)
+    {
+        return std::cos(x);
+    }
+    return sinCore(x, 1);
+}
+
+//! @brief Hyperbolic tangent, at most 4 ulp error
+double fastTanh(double x)
+{
+    return tanhCore(x);
+}
+
+//! @brief Arc tangent, at most 3 ulp error
+double fastAtan(double x)
+{
+    return atanCore(x);
+}
+
+//! @brief Arc tangent of y/x using the signs to determine the quadrant, at most 4 ulp error
+//! @details Zero, infinite and NaN arguments use the C library
+double fastAtan2(double y, double x)
+{
+    const double ax = std::fabs(x);
+    const double ay = std::fabs(y);
+    if (!(ax > 0. && ay > 0. && ax < std::numeric_limits<double>::infinity() && ay < std::numeric_limits<double>::infinity()))
+    {
+        return std::atan2(y, x);
+    }
+    double a = (ay <= ax) ? atanCore(ay/ax) : pio2 - atanCore(ax/ay);
+    a = (x < 0.) ? pi - a : a;
+    return withSignOf(a, y);
+}
+
+// The math kernels for one instruction set, selected by selectFastMathKernels()
+// Sine and cosine are processed in chunks, so that the result may be written to the input array,
+// large values are computed again by the C library in a second pass
+#define NUMHOP_FAST_MATH_KERNELS(SUFFIX, TARGET) \
+TARGET void expArray##SUFFIX(const double *pIn, size_t n, double *pOut) { for (size_t i=0; i<n; ++i) { pOut[i] = expCore(pIn[i]); } } \
+TARGET void logArray##SUFFIX(const double *pIn, size_t n, double *pOut) { for (size_t i=0; i<n; ++i) { pOut[i] = logCore(pIn[i]); } } \
+TARGET void log10Array##SUFFIX(const double *pIn, size_t n, double *pOut) { for (size_t i=0; i<n; ++i) { pOut[i] = logCore(pIn[i])*invLn10; } } \
+TARGET void trigArray##SUFFIX(const double *pIn, size_t n, double *pOut, const int phase, double (*pLibraryFunction)(double)) \
+{ \
+    const size_t chunkSize = 64; \
+    double chunk[chunkSize]; \
+    for (size_t begin=0; begin<n; begin+=chunkSize) \
+    { \
+        const size_t m = std::min(chunkSize, n-begin); \
+        std::copy(pIn+begin, pIn+begin+m, chunk); \
+        for (size_t i=0; i<m; ++i) { pOut[begin+i] = sinCore(chunk[i], phase); } \
+        for (size_t i=0; i<m; ++i) { if (std::fabs(chunk[i]) > maxFastTrigArgument) { pOut[begin+i] = pLibraryFunction(chunk[i]); } } \
+    } \
+} \
+TARGET void sinArray##SUFFIX(const double *pIn, size_t n, double *pOut) { trigArray##SUFFIX(pIn, n, pOut, 0, &std::sin); } \
+TARGET void cosArray##SUFFIX(const double *pIn, size_t n, double *pOut) { trigArray##SUFFIX(pIn, n, pOut, 1, &std::cos); } \
+TARGET void tanhArray##SUFFIX(const double *pIn, size_t n, double *pOut) { for (size_t i=0; i<n; ++i) { pOut[i] = tanhCore(pIn[i]); } } \
+TARGET void atanArray##SUFFIX(const double *pIn, size_t n, double *pOut) { for (size_t i=0; i<n; ++i) { pOut[i] = atanCore(pIn[i]); } } \
+void selectFastMathKernels##SUFFIX(SimdKernels &rKernels) \
+{ \
+    rKernels.exp = &expArray##SUFFIX; \
+    rKernels.log = &logArray##SUFFIX; \
+    rKernels.log10 = &log10Array##SUFFIX; \
+    rKernels.sin = &sinArray##SUFFIX; \
+    rKernels.cos = &cosArray##SUFFIX; \
+    rKernels.tanh = &tanhArray##SUFFIX; \
+    rKernels.atan = &atanArray##SUFFIX; \
+}
+
+namespace {
+NUMHOP_FAST_MATH_KERNELS(Generic, NUMHOP_KERNEL_GENERIC)
+#ifdef NUMHOP_SIMD_TARGETS
+NUMHOP_FAST_MATH_KERNELS(AVX2, NUMHOP_KERNEL_AVX2)
+NUMHOP_FAST_MATH_KERNELS(AVX512, NUMHOP_KERNEL_AVX512)
+#endif
+}
+
+//! @brief Fill in the fast math array kernels compiled for an instruction set level
+//! @details The kernels give the same results on all levels, the fused multiply-add instructions are not used
+void selectFastMathKernels(SimdLevelT level, SimdKernels &rKernels)
+{
+    selectFastMathKernelsGeneric(rKernels);
+#ifdef NUMHOP_SIMD_TARGETS
+    if (level == AVX2SimdT)
+    {
+        selectFastMathKernelsAVX2(rKernels);
+    }
+    else if (level == AVX512SimdT)
+    {
+        selectFastMathKernelsAVX512(rKernels);
+    }
+#else
+    (void)level;
+#endif
+}
+
+//! @brief e^x for all values of an array
+//! @see fastExp
+void fastExpArray(const double *pIn, size_t numValues, double *pOut)
+{
+    simdKernels().exp(pIn, numValues, pOut);
+}
+
+//! @brief Natural logarithm for all values of an array
+//! @see fastLog
+void fastLogArray(const double *pIn, size_t numValues, double *pOut)
+{
+    simdKernels().log(pIn, numValues, pOut);
+}
+
+//! @brief Base 10 logarithm for all values of an array
+//! @see fastLog10
+void fastLog10Array(const double *pIn, size_t numValues, double *pOut)
+{
+    simdKernels().log10(pIn, numValues, pOut);
+}
+
+//! @brief Sine for all values of an array
+//! @see fastSin
+void fastSinArray(const double *pIn, size_t numValues, double *pOut)
+{
+    simdKernels().sin(pIn, numValues, pOut);
+}
+
+//! @brief Cosine for all values of an array
+//! @see fastCos
+void fastCosArray(const double *pIn, size_t numValues, double *pOut)
+{
+    simdKernels().cos(pIn, numValues, pOut);
+}
+
+//! @brief Hyperbolic tangent for all values of an array
+//! @see fastTanh
+void fastTanhArray(const double *pIn, size_t numValues, double *pOut)
+{
+    simdKernels().tanh(pIn, numValues, pOut);
+}
+
+//! @brief Arc tangent for all values of an array
+//! @see fastAtan
+void fastAtanArray(const double *pIn, size_t numValues, double *pOut)
+{
+    simdKernels().atan(pIn, numValues, pOut);
+}
+
+}
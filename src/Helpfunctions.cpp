@@ -1,4 +1,5 @@
 #include "numhop/Helpfunctions.h"
+#include "numhop/ScriptReader.h"
 
 using namespace std;
 namespace numhop {
@@ -9,50 +10,11 @@ namespace numhop {
 //! @param[out] rScriptExpressions The list of expression lines
 void extractExpressionRows(const string &script, const char &commentChar, list<string> &rScriptExpressions)
 {
-    size_t s=0, e;
-    for (e=0; e<script.size(); ++e)
+    ScriptReader reader(script.data(), script.size(), commentChar);
+    StatementSpan span;
+    while (reader.nextStatement(span))
     {
-        const char &c = script[e];
-        bool foundSeparator = (c == '\n' || c == '\r' || c == ';' || c == commentChar);
-        bool foundEOS = (e+1 == script.size());
-        if (foundSeparator || foundEOS)
-        {
-            // Handle end of string, we need to read the last char
-            if (foundEOS && !foundSeparator)
-            {
-                ++e;
-            }
-
-            if (s<script.size() && (e-s)>0)
-            {
-                string part = script.substr(s,e-s);
-                stripLeadingTrailingWhitespaces(part);
-                if (!part.empty())
-                {
-                    rScriptExpressions.push_back(part);
-                }
-            }
-
-            // If comment skip to after next newline
-            if (c == commentChar)
-            {
-                for (; e<script.size(); ++e)
-                {
-                    const char &cc = script[e];
-                    if (cc == '\n' || cc == '\r')
-                    {
-                        // Advance (start) one step from the found \n character
-                        s=e+1;
-                        break;
-                    }
-                }
-            }
-            else
-            {
-                // Advance (start) one step from the found ; or \n character
-                s = e+1;
-            }
-        }
+        rScriptExpressions.push_back(reader.statementString(span));
     }
 }
 
@@ -60,27 +22,29 @@ void extractExpressionRows(const string &script, const char &commentChar, list<s
 //! @param[in,out] rString The string to process
 void stripLeadingTrailingWhitespaces(string &rString)
 {
-    while (!rString.empty() && (rString[0] == ' ' || rString[0] == '\t'))
-    {
-        rString.erase(0,1);
-    }
-    while (!rString.empty() && (rString[rString.size()-1] == ' ' || rString[rString.size()-1] == '\t'))
+    const string::size_type last = rString.find_last_not_of(" \t");
+    if (last == string::npos)
     {
-        rString.erase(rString.size()-1);
+        rString.clear();
+        return;
     }
+    rString.erase(last+1);
+    rString.erase(0, rString.find_first_not_of(" \t"));
 }
 
 //! @brief Remove all white spaces (space, tab) from a string
 //! @param[in,out] rString The string to process
 void removeAllWhitespaces(string &rString)
 {
+    size_t n=0;
     for (size_t i=0; i<rString.size(); ++i)
     {
-        if (rString[i] == ' ' || rString[i] == '\t')
+        if (rString[i] != ' ' && rString[i] != '\t')
         {
-            rString.erase(i,1);
+            rString[n++] = rString[i];
         }
     }
+    rString.erase(n);
 }
 
 //! @brief Strip leading and trailing parenthesis ( ) from a string
@@ -161,4 +125,19 @@ void stripInitialPlus(string &rString)
     }
 }
 
+//! @brief Compute a 64-bit hash (FNV-1a) of a character sequence
+//! @param[in] pData Pointer to the first character
+//! @param[in] size The number of characters
+//! @returns The hash value
+uint64_t hashString(const char *pData, size_t size)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i=0; i<size; ++i)
+    {
+        hash ^= uint64_t(static_cast<unsigned char>(pData[i]));
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
 }
@@ -0,0 +1,650 @@
+#include "numhop/JitExpression.h"
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+
+#if !defined(NUMHOP_NO_JIT) && (defined(__x86_64__) || defined(_M_X64))
+#define NUMHOP_JIT_X64
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+#endif
+
+namespace numhop {
+
+#ifdef NUMHOP_JIT_X64
+
+// Internal code generation
+namespace {
+
+const unsigned char rax = 0;
+const unsigned char xmm0 = 0;
+const unsigned char xmm1 = 1;
+const unsigned char rbp = 5;
+
+// SSE2 scalar double opcodes (prefix F2 0F)
+const unsigned char addsd = 0x58;
+const unsigned char mulsd = 0x59;
+const unsigned char subsd = 0x5C;
+const unsigned char divsd = 0x5E;
+
+// The compare predicate for cmpsd, less than (ordered, false for NaN)
+const unsigned char cmpLessThan = 1;
+
+//! @brief A power with exponent 0.5 reduced to a square root, the same as Expression::evaluate
+double reducedSquareRoot(double base)
+{
+    return (base == -HUGE_VAL) ? HUGE_VAL : sqrt(base)+0.;
+}
+
+//! @brief A power with exponent -0.5 reduced to a reciprocal square root, the same as Expression::evaluate
+double reducedReciprocalSquareRoot(double base)
+{
+    return (base == -HUGE_VAL) ? 0. : 1./(sqrt(base)+0.);
+}
+
+#if defined(_WIN32)
+// The Windows x64 calling convention needs 32 bytes shadow space for called functions
+const int32_t shadowSpace = 32;
+#else
+const int32_t shadowSpace = 0;
+#endif
+
+//! @brief Emits x86-64 machine code for expressions, every expression leaves its result in xmm0
+//! @details Intermediate values are kept in stack slots below rbp, since called functions may change all xmm registers.
+//! The generated code does the same floating point operations in the same order as Expression::evaluate
+class CodeGenerator
+{
+public:
+    CodeGenerator() : mMaxSlots(0) {}
+
+    bool generate(const Expression &expr, VariableStorage &rVariableStorage)
+    {
+        // push rbp; mov rbp, rsp; sub rsp, frameSize
+        emit(0x55);
+        emit(0x48); emit(0x89); emit(0xE5);
+        emit(0x48); emit(0x81); emit(0xEC);
+        const size_t frameSizePos = mCode.size();
+        emitUInt32(0);
+
+        if (!generateExpression(expr, rVariableStorage, 0))
+        {
+            return false;
+        }
+
+        // mov rsp, rbp; pop rbp; ret
+        emit(0x48); emit(0x89); emit(0xEC);
+        emit(0x5D);
+        emit(0xC3);
+
+        // Keep the stack 16 byte aligned for function calls
+        const uint32_t frameSize = uint32_t(((8*mMaxSlots + 15) / 16) * 16 + shadowSpace);
+        std::memcpy(&mCode[frameSizePos], &frameSize, 4);
+        return true;
+    }
+
+    const std::vector<unsigned char> &code() const
+    {
+        return mCode;
+    }
+
+private:
+    bool generateExpression(const Expression &expr, VariableStorage &rVariableStorage, int slot)
+    {
+        mMaxSlots = std::max(mMaxSlots, slot+1);
+        const ExpressionOperatorT op = expr.operatorType();
+        const std::list<Expression> &lhs = expr.leftChildExpressions();
+        const std::list<Expression> &rhs = expr.rightChildExpressions();
+
+        if (expr.isNumericConstant())
+        {
+            loadConstant(xmm0, expr.numericConstantValue());
+        }
+        else if (expr.isNamedValue())
+        {
+            const double *pValue = rVariableStorage.valuePointer(expr.exprString());
+            if (!pValue)
+            {
+                return false;
+            }
+            // mov rax, pValue; movsd xmm0, [rax]
+            loadAddress(pValue);
+            emit(0xF2); emit(0x0F); emit(0x10); emit(0x00);
+        }
+        else if (op == AssignmentT)
+        {
+            double *pValue = rVariableStorage.variablePointer(expr.leftExprString());
+            if (!pValue || rhs.size() != 1 || !generateExpression(rhs.front(), rVariableStorage, slot))
+            {
+                return false;
+            }
+            // mov rax, pValue; movsd [rax], xmm0
+            loadAddress(pValue);
+            emit(0xF2); emit(0x0F); emit(0x11); emit(0x00);
+        }
+        else if (op == PowerT && expr.reduction() != Expression::NoReduction)
+        {
+            // The exponent is constant and is not evaluated
+            if (lhs.size() != 1 || !generateExpression(lhs.front(), rVariableStorage, slot))
+            {
+                return false;
+            }
+            generateReducedPower(expr);
+        }
+        else if (op == PowerT || op == LessThenT || op == GreaterThenT)
+        {
+            if (lhs.size() != 1 || rhs.size() != 1 || !generateBinaryOperands(lhs.front(), rhs.front(), rVariableStorage, slot))
+            {
+                return false;
+            }
+            if (op == PowerT)
+            {
+                callFunction(reinterpret_cast<const void*>(static_cast<TwoArgFunctionT>(&pow)));
+            }
+            else if (op == LessThenT)
+            {
+                // xmm0 = (l<r) ? 1 : 0
+                compareLessThan(xmm0, xmm1);
+                maskToOne(xmm0);
+            }
+            else
+            {
+                // xmm0 = (r<l) ? 1 : 0
+                compareLessThan(xmm1, xmm0);
+                maskToOne(xmm1);
+            }
+        }
+        else if (op == ConditionalT)
+        {
+            if (rhs.size() != 3)
+            {
+                return false;
+            }
+            std::list<Expression>::const_iterator it = rhs.begin();
+            if (!generateExpression(*it, rVariableStorage, slot))
+            {
+                return false;
+            }
+            // if !(condition > 0.5) goto false branch, NaN takes the false branch
+            loadConstant(xmm1, 0.5);
+            emit(0x66); emit(0x0F); emit(0x2E); emit(modRM(3, xmm0, xmm1));
+            emit(0x0F); emit(0x86);
+            const size_t falseJumpPos = mCode.size();
+            emitUInt32(0);
+            if (!generateExpression(*(++it), rVariableStorage, slot))
+            {
+                return false;
+            }
+            emit(0xE9);
+            const size_t endJumpPos = mCode.size();
+            emitUInt32(0);
+            patchJump(falseJumpPos);
+            if (!generateExpression(*(++it), rVariableStorage, slot))
+            {
+                return false;
+            }
+            patchJump(endJumpPos);
+        }
+        else if (op == FunctionCallT)
+        {
+            if (expr.reduction() != Expression::NoReduction)
+            {
+                // pow with constant exponent
+                if (rhs.size() != 2 || !generateExpression(rhs.front(), rVariableStorage, slot))
+                {
+                    return false;
+                }
+                generateReducedPower(expr);
+            }
+            else if (rhs.size() == 1)
+            {
+                OneArgFunctionT pFunction = getOneArgFunction(expr.functionId(), rVariableStorage.isFastMath());
+                if (!pFunction || !generateExpression(rhs.front(), rVariableStorage, slot))
+                {
+                    return false;
+                }
+                callFunction(reinterpret_cast<const void*>(pFunction));
+            }
+            else if (rhs.size() == 2)
+            {
+                TwoArgFunctionT pFunction = getTwoArgFunction(expr.functionId(), rVariableStorage.isFastMath());
+                if (!pFunction || !generateBinaryOperands(rhs.front(), rhs.back(), rVariableStorage, slot))
+                {
+                    return false;
+                }
+                callFunction(reinterpret_cast<const void*>(pFunction));
+            }
+            else
+            {
+                return false;
+            }
+        }
+        else if (expr.chainEvaluation() != SequentialChainT)
+        {
+            return generateChain(expr, rVariableStorage, slot);
+        }
+        else if (op != UndefinedT && op != ValueT && !rhs.empty())
+        {
+            // Fold the child expressions into the value in this slot, starting from zero
+            loadConstant(xmm0, 0.);
+            storeSlot(slot);
+            std::list<Expression>::const_iterator it;
+            for (it=rhs.begin(); it!=rhs.end(); ++it)
+            {
+                if (it->reduction() == Expression::ReciprocalReduction)
+                {
+                    // Division by constant, value = value * reciprocal
+                    loadSlot(xmm0, slot);
+                    loadConstant(xmm1, it->reducedReciprocal());
+                    sseOperation(mulsd, xmm0, xmm1);
+                    storeSlot(slot);
+                    continue;
+                }
+                const ExpressionOperatorT childOp = it->operatorType();
+                if (childOp == UndefinedT || !generateExpression(*it, rVariableStorage, slot+1))
+                {
+                    return false;
+                }
+                if (childOp == AdditionT || childOp == SubtractionT || childOp == MultiplicationT || childOp == DivisionT)
+                {
+                    // value = value op newValue
+                    movsd(xmm1, xmm0);
+                    loadSlot(xmm0, slot);
+                    const unsigned char opcodes[] = {addsd, subsd, mulsd, divsd};
+                    sseOperation(opcodes[childOp-AdditionT], xmm0, xmm1);
+                }
+                else if (childOp == OrT)
+                {
+                    // value = boolify(boolify(value)+boolify(newValue))
+                    boolify();
+                    storeSlot(slot+1);
+                    loadSlot(xmm0, slot);
+                    boolify();
+                    loadSlot(xmm1, slot+1);
+                    sseOperation(addsd, xmm0, xmm1);
+                    boolify();
+                }
+                else if (childOp == AndT)
+                {
+                    // value = boolify(value)*boolify(newValue)
+                    boolify();
+                    storeSlot(slot+1);
+                    loadSlot(xmm0, slot);
+                    boolify();
+                    loadSlot(xmm1, slot+1);
+                    sseOperation(mulsd, xmm0, xmm1);
+                }
+                // else value = newValue, already in xmm0
+                storeSlot(slot);
+            }
+        }
+        else
+        {
+            return false;
+        }
+        return true;
+    }
+
+    //! @brief Accumulate a reassociated chain of additions or multiplications round-robin in four slots
+    //! @details The partial results are combined in the same order as Expression::evaluate, compensated sums are not supported
+    bool generateChain(const Expression &expr, VariableStorage &rVariableStorage, int slot)
+    {
+        const std::list<Expression> &rhs = expr.rightChildExpressions();
+        const bool isSum = ((++rhs.begin())->operatorType() != MultiplicationT);
+        if (isSum && expr.chainEvaluation() == CompensatedChainT)
+        {
+            return false;
+        }
+        loadConstant(xmm0, isSum ? 0. : 1.);
+        for (int i=0; i<4; ++i)
+        {
+            storeSlot(slot+i);
+        }
+        int i = 0;
+        std::list<Expression>::const_iterator it;
+        for (it=rhs.begin(); it!=rhs.end(); ++it, ++i)
+        {
+            if (!generateExpression(*it, rVariableStorage, slot+4))
+            {
+                return false;
+            }
+            movsd(xmm1, xmm0);
+            loadSlot(xmm0, slot+(i & 3));
+            sseOperation(isSum ? ((it->operatorType() == SubtractionT) ? subsd : addsd) : mulsd, xmm0, xmm1);
+            storeSlot(slot+(i & 3));
+        }
+        const unsigned char combine = isSum ? addsd : mulsd;
+        loadSlot(xmm0, slot+2);
+        loadSlot(xmm1, slot+3);
+        sseOperation(combine, xmm0, xmm1);
+        storeSlot(slot+2);
+        loadSlot(xmm0, slot);
+        loadSlot(xmm1, slot+1);
+        sseOperation(combine, xmm0, xmm1);
+        loadSlot(xmm1, slot+2);
+        sseOperation(combine, xmm0, xmm1);
+        return true;
+    }
+
+    //! @brief Raise the base in xmm0 to the constant exponent of a power reduced by Expression::reduceStrength
+    //! @details Integer exponents are unrolled to the same multiplications as the exponentiation by squaring in Expression::evaluate
+    void generateReducedPower(const Expression &expr)
+    {
+        if (expr.reduction() == Expression::SquareRootReduction)
+        {
+            callFunction(reinterpret_cast<const void*>(&reducedSquareRoot));
+            return;
+        }
+        else if (expr.reduction() == Expression::ReciprocalSquareRootReduction)
+        {
+            callFunction(reinterpret_cast<const void*>(&reducedReciprocalSquareRoot));
+            return;
+        }
+
+        // xmm0 is the factor and xmm1 the result
+        const int exponent = expr.reducedExponent();
+        unsigned int n = (exponent < 0) ? -exponent : exponent;
+        bool isFirst = true;
+        loadConstant(xmm1, 1.);
+        while (n > 0)
+        {
+            if (n & 1u)
+            {
+                if (isFirst)
+                {
+                    movsd(xmm1, xmm0);
+                }
+                else
+                {
+                    sseOperation(mulsd, xmm1, xmm0);
+                }
+                isFirst = false;
+            }
+            n >>= 1;
+            if (n > 0)
+            {
+                sseOperation(mulsd, xmm0, xmm0);
+            }
+        }
+        if (exponent < 0)
+        {
+            loadConstant(xmm0, 1.);
+            sseOperation(divsd, xmm0, xmm1);
+        }
+        else
+        {
+            movsd(xmm0, xmm1);
+        }
+    }
+
+    //! @brief Evaluate two operands, the first ends up in xmm0 and the second in xmm1
+    bool generateBinaryOperands(const Expression &first, const Expression &second, VariableStorage &rVariableStorage, int slot)
+    {
+        if (!generateExpression(first, rVariableStorage, slot))
+        {
+            return false;
+        }
+        storeSlot(slot);
+        if (!generateExpression(second, rVariableStorage, slot+1))
+        {
+            return false;
+        }
+        movsd(xmm1, xmm0);
+        loadSlot(xmm0, slot);
+        return true;
+    }
+
+    //! @brief xmm0 = (xmm0 > 0.5) ? 1 : 0
+    void boolify()
+    {
+        loadConstant(xmm1, 0.5);
+        compareLessThan(xmm1, xmm0);
+        maskToOne(xmm1);
+    }
+
+    //! @brief dst = (dst < src) ? all ones : 0
+    void compareLessThan(unsigned char dst, unsigned char src)
+    {
+        emit(0xF2); emit(0x0F); emit(0xC2); emit(modRM(3, dst, src)); emit(cmpLessThan);
+    }
+
+    //! @brief xmm0 = mask & 1.0, the mask is in the given register
+    void maskToOne(unsigned char maskRegister)
+    {
+        if (maskRegister != xmm0)
+        {
+            // movapd xmm0, xmm1
+            emit(0x66); emit(0x0F); emit(0x28); emit(modRM(3, xmm0, maskRegister));
+        }
+        loadConstant(xmm1, 1.);
+        // andpd xmm0, xmm1
+        emit(0x66); emit(0x0F); emit(0x54); emit(modRM(3, xmm0, xmm1));
+    }
+
+    void sseOperation(unsigned char opcode, unsigned char dst, unsigned char src)
+    {
+        emit(0xF2); emit(0x0F); emit(opcode); emit(modRM(3, dst, src));
+    }
+
+    void movsd(unsigned char dst, unsigned char src)
+    {
+        emit(0xF2); emit(0x0F); emit(0x10); emit(modRM(3, dst, src));
+    }
+
+    void loadConstant(unsigned char xmm, double value)
+    {
+        uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        // mov rax, imm64; movq xmm, rax
+        emit(0x48); emit(0xB8); emitUInt64(bits);
+        emit(0x66); emit(0x48); emit(0x0F); emit(0x6E); emit(modRM(3, xmm, rax));
+    }
+
+    void loadAddress(const void *pAddress)
+    {
+        // mov rax, imm64
+        emit(0x48); emit(0xB8); emitUInt64(uint64_t(reinterpret_cast<uintptr_t>(pAddress)));
+    }
+
+    void callFunction(const void *pFunction)
+    {
+        // mov rax, imm64; call rax
+        loadAddress(pFunction);
+        emit(0xFF); emit(0xD0);
+    }
+
+    void loadSlot(unsigned char xmm, int slot)
+    {
+        // movsd xmm, [rbp-8*(slot+1)]
+        emit(0xF2); emit(0x0F); emit(0x10); emit(modRM(2, xmm, rbp)); emitUInt32(uint32_t(-8*(slot+1)));
+    }
+
+    void storeSlot(int slot)
+    {
+        // movsd [rbp-8*(slot+1)], xmm0
+        emit(0xF2); emit(0x0F); emit(0x11); emit(modRM(2, xmm0, rbp)); emitUInt32(uint32_t(-8*(slot+1)));
+    }
+
+    void patchJump(size_t pos)
+    {
+        const uint32_t offset = uint32_t(mCode.size() - (pos+4));
+        std::memcpy(&mCode[pos], &offset, 4);
+    }
+
+    static unsigned char modRM(unsigned char mod, unsigned char reg, unsigned char rm)
+    {
+        return (unsigned char)((mod << 6) | (reg << 3) | rm);
+    }
+
+    void emit(unsigned char byte)
+    {
+        mCode.push_back(byte);
+    }
+
+    void emitUInt32(uint32_t value)
+    {
+        for (int i=0; i<4; ++i)
+        {
+            emit((unsigned char)(value >> (8*i)));
+        }
+    }
+
+    void emitUInt64(uint64_t value)
+    {
+        emitUInt32(uint32_t(value));
+        emitUInt32(uint32_t(value >> 32));
+    }
+
+    std::vector<unsigned char> mCode;
+    int mMaxSlots;
+};
+
+void *allocateExecutableMemory(const std::vector<unsigned char> &code)
+{
+#if defined(_WIN32)
+    void *pMemory = VirtualAlloc(0, code.size(), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (!pMemory)
+    {
+        return 0;
+    }
+    std::memcpy(pMemory, &code[0], code.size());
+    DWORD oldProtection;
+    if (!VirtualProtect(pMemory, code.size(), PAGE_EXECUTE_READ, &oldProtection))
+    {
+        VirtualFree(pMemory, 0, MEM_RELEASE);
+        return 0;
+    }
+    FlushInstructionCache(GetCurrentProcess(), pMemory, code.size());
+    return pMemory;
+#else
+    void *pMemory = mmap(0, code.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pMemory == MAP_FAILED)
+    {
+        return 0;
+    }
+    std::memcpy(pMemory, &code[0], code.size());
+    // Never writable and executable at the same time
+    if (mprotect(pMemory, code.size(), PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(pMemory, code.size());
+        return 0;
+    }
+    return pMemory;
+#endif
+}
+
+void freeExecutableMemory(void *pMemory, size_t size)
+{
+#if defined(_WIN32)
+    (void)size;
+    VirtualFree(pMemory, 0, MEM_RELEASE);
+#else
+    munmap(pMemory, size);
+#endif
+}
+
+}
+
+#endif
+
+//! @brief Default constructor
+JitExpression::JitExpression()
+{
+    mpCode = 0;
+    mCodeSize = 0;
+    mpFunction = 0;
+}
+
+JitExpression::~JitExpression()
+{
+    clear();
+}
+
+//! @brief Compile an expression to native code
+//! @details Named values are bound to their addresses in the variable storage, internal variables that are assigned are created.
+//! @param[in] expr The expression to compile, a copy is kept for evaluation with the interpreter if compilation fails
+//! @param[in,out] rVariableStorage The variable storage to bind variables to
+//! @returns True if the expression was compiled, false if the interpreter will be used
+bool JitExpression::compile(const Expression &expr, VariableStorage &rVariableStorage)
+{
+    clear();
+    mExpression = expr;
+#ifdef NUMHOP_JIT_X64
+    if (!expr.isValid())
+    {
+        return false;
+    }
+    CodeGenerator generator;
+    if (!generator.generate(expr, rVariableStorage))
+    {
+        return false;
+    }
+    mpCode = allocateExecutableMemory(generator.code());
+    if (mpCode)
+    {
+        mCodeSize = generator.code().size();
+        std::memcpy(&mpFunction, &mpCode, sizeof(mpFunction));
+    }
+    return mpCode != 0;
+#else
+    (void)rVariableStorage;
+    return false;
+#endif
+}
+
+//! @brief Release the compiled code and the expression
+void JitExpression::clear()
+{
+#ifdef NUMHOP_JIT_X64
+    if (mpCode)
+    {
+        freeExecutableMemory(mpCode, mCodeSize);
+    }
+#endif
+    mpCode = 0;
+    mCodeSize = 0;
+    mpFunction = 0;
+    mExpression = Expression();
+}
+
+//! @brief Check if the expression was compiled to native code
+bool JitExpression::isCompiled() const
+{
+    return mpFunction != 0;
+}
+
+//! @brief Evaluate the expression, using native code if compiled, else using the interpreter
+//! @param[in,out] rVariableStorage The variable storage, must be the same as when compiling
+//! @param[out] rEvalOK Indicates whether evaluation was successful or not
+//! @return The value of the evaluated expression
+double JitExpression::evaluate(VariableStorage &rVariableStorage, bool &rEvalOK) const
+{
+    if (mpFunction)
+    {
+        rEvalOK = true;
+        return mpFunction();
+    }
+    return mExpression.evaluate(rVariableStorage, rEvalOK);
+}
+
+//! @brief Check if native compilation is supported on this architecture
+bool JitExpression::isSupported()
+{
+#ifdef NUMHOP_JIT_X64
+    return true;
+#else
+    return false;
+#endif
+}
+
+}
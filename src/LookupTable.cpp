@@ -0,0 +1,430 @@
+#include "numhop/LookupTable.h"
+#include "numhop/NumberParsing.h"
+#include "numhop/ScriptReader.h"
+#include <cmath>
+#include <algorithm>
+#include <limits>
+
+namespace numhop {
+
+namespace {
+
+//! @brief Breakpoints that deviate less than this, relative to the step, from a uniform grid use the direct index computation
+const double uniformTolerance = 1e-9;
+
+//! @brief Linear interpolation that is exact at both end points
+inline double interpolate(const double a, const double b, const double t)
+{
+    return (1.-t)*a + t*b;
+}
+
+inline double notANumber()
+{
+    return std::numeric_limits<double>::quiet_NaN();
+}
+
+inline bool isBlank(const char c)
+{
+    return (c == ' ') || (c == '\t') || (c == '\r');
+}
+
+//! @brief Parse one line of comma or semicolon separated numbers
+//! @param[in] pBegin The first character of the line
+//! @param[in] pEnd One past the last character of the line
+//! @param[out] rFields The parsed numbers
+//! @param[out] rFirstIsEmpty True if the first field is empty, no other field may be empty
+//! @returns False if a field is not a number
+bool parseCsvLine(const char *pBegin, const char *pEnd, std::vector<double> &rFields, bool &rFirstIsEmpty)
+{
+    rFields.clear();
+    rFirstIsEmpty = false;
+    const char *p = pBegin;
+    while (true)
+    {
+        while (p < pEnd && isBlank(*p))
+        {
+            ++p;
+        }
+        if (p == pEnd || *p == ',' || *p == ';')
+        {
+            if (!rFields.empty() || rFirstIsEmpty)
+            {
+                return false;
+            }
+            rFirstIsEmpty = true;
+        }
+        else
+        {
+            double value;
+            const char *pNumberEnd = parseDecimalNumber(p, pEnd, value);
+            if (pNumberEnd == p)
+            {
+                return false;
+            }
+            rFields.push_back(value);
+            p = pNumberEnd;
+            while (p < pEnd && isBlank(*p))
+            {
+                ++p;
+            }
+        }
+
+        if (p == pEnd)
+        {
+            return true;
+        }
+        else if (*p != ',' && *p != ';')
+        {
+            return false;
+        }
+        ++p;
+    }
+}
+
+}
+
+//! @brief Set the breakpoints of an axis, they must be finite and strictly increasing
+bool LookupTable::Axis::set(const std::vector<double> &newBreakpoints)
+{
+    const size_t numBreakpoints = newBreakpoints.size();
+    if (numBreakpoints < 2)
+    {
+        return false;
+    }
+    for (size_t i=0; i<numBreakpoints; ++i)
+    {
+        if (newBreakpoints[i]-newBreakpoints[i] != 0 || (i > 0 && !(newBreakpoints[i] > newBreakpoints[i-1])))
+        {
+            return false;
+        }
+    }
+
+    breakpoints = newBreakpoints;
+    first = breakpoints.front();
+    const double step = (breakpoints.back()-first)/double(numBreakpoints-1);
+    inverseStep = 1./step;
+    isUniform = true;
+    for (size_t i=1; i<numBreakpoints-1 && isUniform; ++i)
+    {
+        isUniform = (std::fabs(breakpoints[i] - (first + double(i)*step)) <= uniformTolerance*step);
+    }
+    return true;
+}
+
+//! @brief Find the segment containing a value
+//! @details The segment is computed directly on a uniform grid. Otherwise the given segment and the next one are tried first,
+//! which is the common case for slowly changing inputs, before falling back to a binary search.
+//! @param[in] x The value, it is clamped to the first and last breakpoint
+//! @param[in,out] rSegment The segment to try first, and the segment containing x
+//! @param[out] rFraction The position of x within the segment, from 0 to 1 (NaN if x is NaN)
+void LookupTable::Axis::findSegment(double x, size_t &rSegment, double &rFraction) const
+{
+    const double *pBreakpoints = &breakpoints[0];
+    const size_t last = breakpoints.size()-1;
+    if (!(x > pBreakpoints[0]))
+    {
+        rSegment = 0;
+        rFraction = (x == x) ? 0. : x;
+        return;
+    }
+    else if (x >= pBreakpoints[last])
+    {
+        rSegment = last-1;
+        rFraction = 1.;
+        return;
+    }
+
+    size_t k;
+    if (isUniform)
+    {
+        k = std::min(size_t((x-first)*inverseStep), last-1);
+        // Rounding may give the neighbouring segment
+        if (x < pBreakpoints[k])
+        {
+            --k;
+        }
+        else if (x >= pBreakpoints[k+1])
+        {
+            ++k;
+        }
+    }
+    else
+    {
+        k = (rSegment < last) ? rSegment : 0;
+        if (x < pBreakpoints[k] || x >= pBreakpoints[k+1])
+        {
+            if (x >= pBreakpoints[k+1] && k+2 <= last && x < pBreakpoints[k+2])
+            {
+                ++k;
+            }
+            else
+            {
+                k = size_t(std::upper_bound(pBreakpoints+1, pBreakpoints+last, x) - pBreakpoints) - 1;
+            }
+        }
+    }
+    rSegment = k;
+    rFraction = (x - pBreakpoints[k])/(pBreakpoints[k+1] - pBreakpoints[k]);
+}
+
+//! @brief Default constructor, the table is empty
+LookupTable::LookupTable()
+{
+    clear();
+}
+
+//! @brief Set the data of a one dimensional table
+//! @param[in] breakpoints The strictly increasing input values, at least two
+//! @param[in] values The output value at each breakpoint
+//! @returns False if the data is invalid, the table is then empty
+bool LookupTable::setData(const std::vector<double> &breakpoints, const std::vector<double> &values)
+{
+    clear();
+    if (values.size() != breakpoints.size() || !mAxes[0].set(breakpoints))
+    {
+        clear();
+        return false;
+    }
+    mValues = values;
+    mNumDimensions = 1;
+    return true;
+}
+
+//! @brief Set the data of a two dimensional table
+//! @param[in] firstBreakpoints The strictly increasing values of the first input, at least two
+//! @param[in] secondBreakpoints The strictly increasing values of the second input, at least two
+//! @param[in] values The output values, the value at (firstBreakpoints[i], secondBreakpoints[j]) is at index i*secondBreakpoints.size()+j
+//! @returns False if the data is invalid, the table is then empty
+bool LookupTable::setData(const std::vector<double> &firstBreakpoints, const std::vector<double> &secondBreakpoints, const std::vector<double> &values)
+{
+    clear();
+    if (values.size() != firstBreakpoints.size()*secondBreakpoints.size() || !mAxes[0].set(firstBreakpoints) || !mAxes[1].set(secondBreakpoints))
+    {
+        clear();
+        return false;
+    }
+    mValues = values;
+    mNumDimensions = 2;
+    return true;
+}
+
+//! @brief Load a table from comma (or semicolon) separated values
+//! @details A one dimensional table has two numbers on each line, the breakpoint and the value.
+//! A two dimensional table starts with an empty field followed by the breakpoints of the second input,
+//! each following line has a breakpoint of the first input followed by the values.
+//! Empty lines and lines starting with # are ignored. Numbers are parsed independently of the current locale.
+//! @param[in] pData The text
+//! @param[in] size The size of the text
+//! @returns False if the text is not a valid table, the table is then empty
+bool LookupTable::loadFromCsv(const char *pData, size_t size)
+{
+    clear();
+    const char *p = pData;
+    const char *pEnd = pData+size;
+    bool isTwoDimensional = false, isFirstLine = true;
+    std::vector<double> fields, firstBreakpoints, secondBreakpoints, values;
+    while (p < pEnd)
+    {
+        const char *pLineEnd = std::find(p, pEnd, '\n');
+        const char *pText = p;
+        p = (pLineEnd < pEnd) ? pLineEnd+1 : pEnd;
+        while (pText < pLineEnd && isBlank(*pText))
+        {
+            ++pText;
+        }
+        if (pText == pLineEnd || *pText == '#')
+        {
+            continue;
+        }
+
+        bool firstIsEmpty;
+        if (!parseCsvLine(pText, pLineEnd, fields, firstIsEmpty))
+        {
+            return false;
+        }
+        if (isFirstLine && firstIsEmpty)
+        {
+            isTwoDimensional = true;
+            secondBreakpoints = fields;
+        }
+        else if (firstIsEmpty || fields.size() != (isTwoDimensional ? secondBreakpoints.size()+1 : 2))
+        {
+            return false;
+        }
+        else
+        {
+            firstBreakpoints.push_back(fields[0]);
+            values.insert(values.end(), fields.begin()+1, fields.end());
+        }
+        isFirstLine = false;
+    }
+
+    if (isTwoDimensional)
+    {
+        return setData(firstBreakpoints, secondBreakpoints, values);
+    }
+    return setData(firstBreakpoints, values);
+}
+
+//! @brief Load a table from a file with comma separated values
+//! @param[in] filePath The file path
+//! @returns False if the file could not be read or is not a valid table
+//! @see loadFromCsv
+bool LookupTable::loadFromCsvFile(const std::string &filePath)
+{
+    MappedFile file;
+    if (!file.map(filePath))
+    {
+        clear();
+        return false;
+    }
+    return loadFromCsv(file.data(), file.size());
+}
+
+//! @brief Remove all data
+void LookupTable::clear()
+{
+    for (size_t d=0; d<2; ++d)
+    {
+        mAxes[d].breakpoints.clear();
+        mAxes[d].first = 0;
+        mAxes[d].inverseStep = 0;
+        mAxes[d].isUniform = false;
+        mLastSegments[d] = 0;
+    }
+    mValues.clear();
+    mNumDimensions = 0;
+}
+
+//! @brief Returns the number of inputs, 0 if the table is empty
+size_t LookupTable::numDimensions() const
+{
+    return mNumDimensions;
+}
+
+//! @brief Check if the breakpoints of an input are uniformly spaced, then segments are found without searching
+//! @param[in] dimension The input, 0 or 1
+bool LookupTable::isUniform(size_t dimension) const
+{
+    return (dimension < mNumDimensions) && mAxes[dimension].isUniform;
+}
+
+//! @brief Register the table as a function, with one argument per input
+//! @details The table must outlive the expressions using it, register it again if the number of inputs changes.
+//! @param[in] name The function name
+//! @returns The function id, or -1 if the table is empty or the name is invalid
+int LookupTable::registerAs(const std::string &name)
+{
+    return (mNumDimensions > 0) ? registerFunction(name, mNumDimensions, this) : -1;
+}
+
+//! @brief Interpolate a one dimensional table
+//! @returns The interpolated value, NaN if the table is not one dimensional
+double LookupTable::lookup(double x) const
+{
+    size_t segment=0;
+    return lookup(x, segment);
+}
+
+//! @brief Interpolate a one dimensional table, starting the search at a given segment
+//! @param[in] x The input
+//! @param[in,out] rSegment The segment to try first, and the segment that was used
+//! @returns The interpolated value, NaN if the table is not one dimensional
+double LookupTable::lookup(double x, size_t &rSegment) const
+{
+    if (mNumDimensions != 1)
+    {
+        return notANumber();
+    }
+    double t;
+    mAxes[0].findSegment(x, rSegment, t);
+    return interpolate(mValues[rSegment], mValues[rSegment+1], t);
+}
+
+//! @brief Interpolate a two dimensional table
+//! @returns The interpolated value, NaN if the table is not two dimensional
+double LookupTable::lookup(double x, double y) const
+{
+    size_t firstSegment=0, secondSegment=0;
+    return lookup(x, y, firstSegment, secondSegment);
+}
+
+//! @brief Interpolate a two dimensional table, starting the search at given segments
+//! @param[in] x The first input
+//! @param[in] y The second input
+//! @param[in,out] rFirstSegment The segment of the first input to try first, and the segment that was used
+//! @param[in,out] rSecondSegment The segment of the second input to try first, and the segment that was used
+//! @returns The interpolated value, NaN if the table is not two dimensional
+double LookupTable::lookup(double x, double y, size_t &rFirstSegment, size_t &rSecondSegment) const
+{
+    if (mNumDimensions != 2)
+    {
+        return notANumber();
+    }
+    double t, u;
+    mAxes[0].findSegment(x, rFirstSegment, t);
+    mAxes[1].findSegment(y, rSecondSegment, u);
+    const size_t numColumns = mAxes[1].breakpoints.size();
+    const double *pRow = &mValues[rFirstSegment*numColumns + rSecondSegment];
+    return interpolate(interpolate(pRow[0], pRow[1], u), interpolate(pRow[numColumns], pRow[numColumns+1], u), t);
+}
+
+//! @brief Interpolate a one dimensional table for many inputs, each search starts at the segment of the previous input
+//! @param[in] pX The inputs
+//! @param[in] numValues The number of inputs
+//! @param[out] pResult The interpolated values
+void LookupTable::lookup(const double *pX, size_t numValues, double *pResult) const
+{
+    size_t segment=0;
+    for (size_t i=0; i<numValues; ++i)
+    {
+        pResult[i] = lookup(pX[i], segment);
+    }
+}
+
+//! @brief Interpolate a two dimensional table for many inputs, each search starts at the segments of the previous inputs
+//! @param[in] pX The first inputs
+//! @param[in] pY The second inputs
+//! @param[in] numValues The number of inputs
+//! @param[out] pResult The interpolated values
+void LookupTable::lookup(const double *pX, const double *pY, size_t numValues, double *pResult) const
+{
+    size_t firstSegment=0, secondSegment=0;
+    for (size_t i=0; i<numValues; ++i)
+    {
+        pResult[i] = lookup(pX[i], pY[i], firstSegment, secondSegment);
+    }
+}
+
+//! @brief Interpolate the table when called from an expression, the search starts at the segment of the previous call
+double LookupTable::call(const double *pArgs, size_t numArgs)
+{
+    if (numArgs == 1)
+    {
+        return lookup(pArgs[0], mLastSegments[0]);
+    }
+    else if (numArgs == 2)
+    {
+        return lookup(pArgs[0], pArgs[1], mLastSegments[0], mLastSegments[1]);
+    }
+    return notANumber();
+}
+
+//! @brief Interpolate the table for arrays of inputs in element-wise evaluation
+void LookupTable::callElementWise(const double *const *ppArgs, size_t numArgs, size_t numValues, double *pResult)
+{
+    if (numArgs == 1)
+    {
+        lookup(ppArgs[0], numValues, pResult);
+    }
+    else if (numArgs == 2)
+    {
+        lookup(ppArgs[0], ppArgs[1], numValues, pResult);
+    }
+    else
+    {
+        NativeFunction::callElementWise(ppArgs, numArgs, numValues, pResult);
+    }
+}
+
+}
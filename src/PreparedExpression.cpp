@@ -0,0 +1,784 @@
+#include "numhop/PreparedExpression.h"
+#include "numhop/Script.h"
+#include "numhop/NumberParsing.h"
+#include <cmath>
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+namespace numhop {
+
+namespace {
+
+inline bool isWhitespace(const char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+inline bool isOperatorCharacter(const char c)
+{
+    return c != 0 && std::strchr("=+-*/^<>&|", c) != 0;
+}
+
+inline const char* skipWhitespaces(const char *p, const char *pEnd)
+{
+    while (p < pEnd && isWhitespace(*p))
+    {
+        ++p;
+    }
+    return p;
+}
+
+//! @brief Check if the next non whitespace character is an operator, two operators are not allowed next to each other
+inline bool nextIsOperator(const char *p, const char *pEnd)
+{
+    p = skipWhitespaces(p, pEnd);
+    return p < pEnd && isOperatorCharacter(*p);
+}
+
+enum FrameKindT {TopFrame, ParenthesisFrame, FunctionFrame, ConditionalFrame};
+
+}
+
+//! @brief The parser state for one level of parentheses or function call arguments
+struct PreparedExpression::ParseFrame
+{
+    ParseFrame(FrameKindT frameKind) : kind(frameKind), numArgs(0), jumpIndex(0), branchDepth(0)
+    {
+        resetExpression();
+    }
+
+    void resetExpression()
+    {
+        pAssignTarget = 0;
+        isAtStart = true;
+        leadingSign = 0;
+        isSumActive = false;
+        sumOperator = 0;
+        isProductActive = false;
+        productOperator = 0;
+        powerOperator = 0;
+    }
+
+    FrameKindT kind;
+    std::string functionName;
+    size_t numArgs, jumpIndex, branchDepth;
+
+    double *pAssignTarget;
+    bool isAtStart;
+    char leadingSign;
+    bool isSumActive;
+    char sumOperator;
+    bool isProductActive;
+    char productOperator;
+    char powerOperator;
+};
+
+//! @brief Default constructor
+PreparedExpression::PreparedExpression()
+{
+    mStackDepth = 0;
+    mMaxStackDepth = 0;
+    mIsPrepared = false;
+}
+
+//! @brief Prepare an expression for evaluation
+//! @details Named values are bound to their addresses in the variable storage, internal variables that are assigned are created.
+//! @param[in] expr The expression to prepare
+//! @param[in,out] rVariableStorage The variable storage to bind variables to
+//! @returns True if the expression could be prepared, all named values must exist and be accessible through pointers
+bool PreparedExpression::prepare(const Expression &expr, VariableStorage &rVariableStorage)
+{
+    return prepare(std::vector<const Expression*>(1, &expr), rVariableStorage);
+}
+
+//! @brief Prepare all statements in a script for evaluation in order
+//! @param[in] script The interpreted script
+//! @param[in,out] rVariableStorage The variable storage to bind variables to
+//! @returns True if all statements could be prepared
+bool PreparedExpression::prepare(const Script &script, VariableStorage &rVariableStorage)
+{
+    std::vector<const Expression*> statements;
+    for (size_t i=0; i<script.numStatements(); ++i)
+    {
+        if (!script.statement(i).isValid)
+        {
+            clear();
+            return false;
+        }
+        statements.push_back(&script.statement(i).expression);
+    }
+    return prepare(statements, rVariableStorage);
+}
+
+//! @brief Prepare an expression string for evaluation, without building an expression tree
+//! @details The string is parsed in a single pass, without recursion, so deeply nested expressions (up to maxPreparedNestingDepth levels)
+//! can be prepared on threads with small stacks. Evaluation gives the same result as Expression::evaluate of the interpreted expression.
+//! @param[in] exprString The expression string
+//! @param[in,out] rVariableStorage The variable storage to bind variables to
+//! @returns True if the expression could be parsed and prepared
+bool PreparedExpression::prepare(const std::string &exprString, VariableStorage &rVariableStorage)
+{
+    clear();
+    if (!compile(exprString, rVariableStorage))
+    {
+        clear();
+        return false;
+    }
+    mStack.resize(mMaxStackDepth);
+    mIsPrepared = true;
+    return true;
+}
+
+//! @brief Release the prepared program
+void PreparedExpression::clear()
+{
+    mInstructions.clear();
+    mStack.clear();
+    mStackDepth = 0;
+    mMaxStackDepth = 0;
+    mIsPrepared = false;
+}
+
+//! @brief Check if the expression was prepared successfully
+bool PreparedExpression::isPrepared() const
+{
+    return mIsPrepared;
+}
+
+//! @brief Evaluate the prepared expression, without allocating memory
+//! @details The result is identical to Expression::evaluate. The same prepared expression must not be evaluated from several threads at the same time.
+//! @param[out] rEvalOK Indicates whether evaluation was successful or not, false if not prepared
+//! @return The value of the expression, or the last statement
+double PreparedExpression::evaluate(bool &rEvalOK) const
+{
+    rEvalOK = mIsPrepared;
+    if (!mIsPrepared)
+    {
+        return 0.;
+    }
+
+    // pTop points to the value at the top of the stack
+    double *pTop = &mStack[0]-1;
+    const Instruction *pInstructions = &mInstructions[0];
+    const size_t numInstructions = mInstructions.size();
+    for (size_t i=0; i<numInstructions; ++i)
+    {
+        const Instruction &instruction = pInstructions[i];
+        switch (instruction.opCode)
+        {
+        case PushConstantOp:
+            *(++pTop) = instruction.constant;
+            break;
+        case PushVariableOp:
+            *(++pTop) = *instruction.pVariable;
+            break;
+        case StoreOp:
+            *instruction.pTarget = *pTop;
+            break;
+        case ReplaceOp:
+            --pTop;
+            *pTop = *(pTop+1);
+            break;
+        case PopOp:
+            --pTop;
+            break;
+        case AddOp:
+            --pTop;
+            *pTop += *(pTop+1);
+            break;
+        case SubtractOp:
+            --pTop;
+            *pTop -= *(pTop+1);
+            break;
+        case MultiplyOp:
+            --pTop;
+            *pTop *= *(pTop+1);
+            break;
+        case DivideOp:
+            --pTop;
+            *pTop /= *(pTop+1);
+            break;
+        case PowerOp:
+            --pTop;
+            *pTop = pow(*pTop, *(pTop+1));
+            break;
+        case LessThanOp:
+            --pTop;
+            *pTop = double(*pTop < *(pTop+1));
+            break;
+        case GreaterThanOp:
+            --pTop;
+            *pTop = double(*pTop > *(pTop+1));
+            break;
+        case OrOp:
+            --pTop;
+            *pTop = (((*pTop > 0.5) ? 1. : 0.) + ((*(pTop+1) > 0.5) ? 1. : 0.) > 0.5) ? 1. : 0.;
+            break;
+        case AndOp:
+            --pTop;
+            *pTop = ((*pTop > 0.5) ? 1. : 0.) * ((*(pTop+1) > 0.5) ? 1. : 0.);
+            break;
+        case CallOneArgOp:
+            *pTop = instruction.pOneArgFunction(*pTop);
+            break;
+        case CallTwoArgOp:
+            --pTop;
+            *pTop = instruction.pTwoArgFunction(*pTop, *(pTop+1));
+            break;
+        case JumpIfFalseOp:
+            // Jump to the instruction before the target, the loop increments i
+            if (!(*(pTop--) > 0.5))
+            {
+                i = instruction.jumpTarget-1;
+            }
+            break;
+        case JumpOp:
+            i = instruction.jumpTarget-1;
+            break;
+        case ZeroAddOp:
+            *pTop = 0. + *pTop;
+            break;
+        case ZeroSubtractOp:
+            *pTop = 0. - *pTop;
+            break;
+        case ZeroOrOp:
+            *pTop = (((*pTop > 0.5) ? 1. : 0.) > 0.5) ? 1. : 0.;
+            break;
+        }
+    }
+    return *pTop;
+}
+
+bool PreparedExpression::prepare(const std::vector<const Expression*> &statements, VariableStorage &rVariableStorage)
+{
+    clear();
+    bool isOK = true;
+    if (statements.empty())
+    {
+        emitConstant(0.);
+    }
+    for (size_t i=0; i<statements.size() && isOK; ++i)
+    {
+        if (i > 0)
+        {
+            emit(PopOp);
+        }
+        isOK = statements[i]->isValid() && emit(*statements[i], rVariableStorage);
+    }
+    if (!isOK)
+    {
+        clear();
+        return false;
+    }
+    mStack.resize(mMaxStackDepth);
+    mIsPrepared = true;
+    return true;
+}
+
+//! @brief Emit the instructions evaluating an expression, leaving its value on the stack
+//! @details The instructions do the same floating point operations in the same order as Expression::evaluate
+bool PreparedExpression::emit(const Expression &expr, VariableStorage &rVariableStorage)
+{
+    const ExpressionOperatorT op = expr.operatorType();
+    const std::list<Expression> &lhs = expr.leftChildExpressions();
+    const std::list<Expression> &rhs = expr.rightChildExpressions();
+
+    if (expr.isNumericConstant())
+    {
+        emitConstant(expr.numericConstantValue());
+    }
+    else if (expr.isNamedValue())
+    {
+        const double *pValue = rVariableStorage.valuePointer(expr.exprString());
+        if (!pValue)
+        {
+            return false;
+        }
+        emit(PushVariableOp);
+        mInstructions.back().pVariable = pValue;
+    }
+    else if (op == AssignmentT)
+    {
+        double *pValue = rVariableStorage.variablePointer(expr.leftExprString());
+        if (!pValue || rhs.size() != 1 || !emit(rhs.front(), rVariableStorage))
+        {
+            return false;
+        }
+        emit(StoreOp);
+        mInstructions.back().pTarget = pValue;
+    }
+    else if (op == PowerT || op == LessThenT || op == GreaterThenT)
+    {
+        if (lhs.size() != 1 || rhs.size() != 1 || !emit(lhs.front(), rVariableStorage) || !emit(rhs.front(), rVariableStorage))
+        {
+            return false;
+        }
+        emit((op == PowerT) ? PowerOp : ((op == LessThenT) ? LessThanOp : GreaterThanOp));
+    }
+    else if (op == ConditionalT)
+    {
+        if (rhs.size() != 3)
+        {
+            return false;
+        }
+        std::list<Expression>::const_iterator it = rhs.begin();
+        if (!emit(*it, rVariableStorage))
+        {
+            return false;
+        }
+        emit(JumpIfFalseOp);
+        const size_t falseJump = mInstructions.size()-1;
+        const size_t branchDepth = mStackDepth;
+        if (!emit(*(++it), rVariableStorage))
+        {
+            return false;
+        }
+        emit(JumpOp);
+        const size_t endJump = mInstructions.size()-1;
+        mInstructions[falseJump].jumpTarget = mInstructions.size();
+        mStackDepth = branchDepth;
+        if (!emit(*(++it), rVariableStorage))
+        {
+            return false;
+        }
+        mInstructions[endJump].jumpTarget = mInstructions.size();
+    }
+    else if (op == FunctionCallT)
+    {
+        if (rhs.size() == 1)
+        {
+            OneArgFunctionT pFunction = getOneArgFunction(expr.functionId(), rVariableStorage.isFastMath());
+            if (!pFunction || !emit(rhs.front(), rVariableStorage))
+            {
+                return false;
+            }
+            emit(CallOneArgOp);
+            mInstructions.back().pOneArgFunction = pFunction;
+        }
+        else if (rhs.size() == 2)
+        {
+            TwoArgFunctionT pFunction = getTwoArgFunction(expr.functionId(), rVariableStorage.isFastMath());
+            if (!pFunction || !emit(rhs.front(), rVariableStorage) || !emit(rhs.back(), rVariableStorage))
+            {
+                return false;
+            }
+            emit(CallTwoArgOp);
+            mInstructions.back().pTwoArgFunction = pFunction;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    else if (op != UndefinedT && op != ValueT && !rhs.empty())
+    {
+        // Fold the child expressions into a value starting from zero
+        emitConstant(0.);
+        std::list<Expression>::const_iterator it;
+        for (it=rhs.begin(); it!=rhs.end(); ++it)
+        {
+            const ExpressionOperatorT childOp = it->operatorType();
+            if (childOp == UndefinedT || !emit(*it, rVariableStorage))
+            {
+                return false;
+            }
+            switch (childOp)
+            {
+            case AdditionT:       emit(AddOp); break;
+            case SubtractionT:    emit(SubtractOp); break;
+            case MultiplicationT: emit(MultiplyOp); break;
+            case DivisionT:       emit(DivideOp); break;
+            case OrT:             emit(OrOp); break;
+            case AndT:            emit(AndOp); break;
+            default:              emit(ReplaceOp); break;
+            }
+        }
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+void PreparedExpression::emit(OpCodeT opCode)
+{
+    Instruction instruction;
+    instruction.opCode = opCode;
+    instruction.jumpTarget = 0;
+    mInstructions.push_back(instruction);
+
+    // Track the stack depth to allocate the stack when preparing
+    switch (opCode)
+    {
+    case PushConstantOp:
+    case PushVariableOp:
+        ++mStackDepth;
+        break;
+    case StoreOp:
+    case CallOneArgOp:
+    case JumpOp:
+    case ZeroAddOp:
+    case ZeroSubtractOp:
+    case ZeroOrOp:
+        break;
+    default:
+        --mStackDepth;
+        break;
+    }
+    mMaxStackDepth = std::max(mMaxStackDepth, mStackDepth);
+}
+
+void PreparedExpression::emitConstant(double value)
+{
+    emit(PushConstantOp);
+    mInstructions.back().constant = value;
+}
+
+//! @brief Parse an expression string into instructions, using an explicit stack of parse frames instead of recursion
+//! @details The instructions mirror the expression tree built by interpretExpressionStringRecursive: a sum or product with
+//! operators is folded starting from zero, "^", "<" and ">" take two operands and only one of them is allowed per factor
+bool PreparedExpression::compile(const std::string &exprString, VariableStorage &rVariableStorage)
+{
+    std::vector<ParseFrame> frames;
+    frames.push_back(ParseFrame(TopFrame));
+    const char *p = exprString.data();
+    const char *pEnd = p+exprString.size();
+    bool expectOperand = true;
+    std::string token;
+    while (true)
+    {
+        p = skipWhitespaces(p, pEnd);
+        ParseFrame &rFrame = frames.back();
+        if (expectOperand)
+        {
+            if (p == pEnd)
+            {
+                return false;
+            }
+            const char c = *p;
+            if (c == '(')
+            {
+                if (frames.size() >= maxPreparedNestingDepth)
+                {
+                    return false;
+                }
+                rFrame.isAtStart = false;
+                frames.push_back(ParseFrame(ParenthesisFrame));
+                ++p;
+            }
+            else if ((c == '+' || c == '-' || c == '|') && rFrame.isAtStart)
+            {
+                // Leading sign, multiple signs are compressed into one
+                bool isNegative = false;
+                if (c == '|')
+                {
+                    ++p;
+                }
+                while (c != '|' && p < pEnd && (*p == '+' || *p == '-' || isWhitespace(*p)))
+                {
+                    isNegative = (*p == '-') ? !isNegative : isNegative;
+                    ++p;
+                }
+                rFrame.leadingSign = (c == '|') ? '|' : (isNegative ? '-' : '+');
+                rFrame.isAtStart = false;
+                if (nextIsOperator(p, pEnd))
+                {
+                    return false;
+                }
+            }
+            else if (isOperatorCharacter(c) || c == ')' || c == ',')
+            {
+                return false;
+            }
+            else
+            {
+                // Read a value or name, + and - are part of exponential notation after a digit and e
+                token.clear();
+                while (p < pEnd)
+                {
+                    const char t = *p;
+                    const size_t n = token.size();
+                    if (isWhitespace(t))
+                    {
+                        ++p;
+                        continue;
+                    }
+                    if (t == '(' || t == ')' || t == ',' ||
+                        (isOperatorCharacter(t) && !((t == '+' || t == '-') && n > 1 && (token[n-1] == 'e' || token[n-1] == 'E') && isdigit(token[n-2]))))
+                    {
+                        break;
+                    }
+                    token.push_back(t);
+                    ++p;
+                }
+
+                p = skipWhitespaces(p, pEnd);
+                if (p < pEnd && *p == '(')
+                {
+                    // Function call or conditional, the name must be alphanumeric and start with a letter
+                    for (size_t i=0; i<token.size(); ++i)
+                    {
+                        if (!isalnum(token[i]) || (i == 0 && !isalpha(token[i])))
+                        {
+                            return false;
+                        }
+                    }
+                    if (frames.size() >= maxPreparedNestingDepth)
+                    {
+                        return false;
+                    }
+                    rFrame.isAtStart = false;
+                    frames.push_back(ParseFrame((token == "if") ? ConditionalFrame : FunctionFrame));
+                    frames.back().functionName = token;
+                    ++p;
+                }
+                else if (p < pEnd && *p == '=' && rFrame.isAtStart && !rFrame.pAssignTarget)
+                {
+                    // Assignment, only one per expression
+                    rFrame.pAssignTarget = rVariableStorage.variablePointer(token);
+                    ++p;
+                    p = skipWhitespaces(p, pEnd);
+                    if (!rFrame.pAssignTarget || (p < pEnd && std::strchr("=*/^<>&|", *p)))
+                    {
+                        return false;
+                    }
+                }
+                else
+                {
+                    double value;
+                    const char *pNumberEnd = parseDecimalNumber(token.data(), token.data()+token.size(), value);
+                    if (!token.empty() && pNumberEnd == token.data()+token.size())
+                    {
+                        emitConstant(value);
+                    }
+                    else
+                    {
+                        const double *pValue = rVariableStorage.valuePointer(token);
+                        if (!pValue)
+                        {
+                            return false;
+                        }
+                        emit(PushVariableOp);
+                        mInstructions.back().pVariable = pValue;
+                    }
+                    rFrame.isAtStart = false;
+                    expectOperand = false;
+                }
+            }
+        }
+        else if (p == pEnd)
+        {
+            if (frames.size() != 1)
+            {
+                return false;
+            }
+            finishExpression(rFrame);
+            return true;
+        }
+        else
+        {
+            const char c = *p;
+            expectOperand = true;
+            if (c == '+' || c == '-' || c == '|')
+            {
+                bool isNegative = false;
+                if (c == '|')
+                {
+                    ++p;
+                }
+                while (c != '|' && p < pEnd && (*p == '+' || *p == '-' || isWhitespace(*p)))
+                {
+                    isNegative = (*p == '-') ? !isNegative : isNegative;
+                    ++p;
+                }
+                finishTerm(rFrame);
+                if (!rFrame.isSumActive)
+                {
+                    emitZeroOperator(rFrame.leadingSign ? rFrame.leadingSign : '+');
+                    rFrame.isSumActive = true;
+                }
+                else
+                {
+                    emitOperator(rFrame.sumOperator);
+                }
+                rFrame.sumOperator = (c == '|') ? '|' : (isNegative ? '-' : '+');
+            }
+            else if (c == '*' || c == '/' || c == '&')
+            {
+                ++p;
+                finishFactor(rFrame);
+                if (!rFrame.isProductActive)
+                {
+                    emit(ZeroAddOp);
+                    rFrame.isProductActive = true;
+                }
+                else
+                {
+                    emitOperator(rFrame.productOperator);
+                }
+                rFrame.productOperator = c;
+            }
+            else if (c == '^' || c == '<' || c == '>')
+            {
+                if (rFrame.powerOperator)
+                {
+                    return false;
+                }
+                ++p;
+                rFrame.powerOperator = c;
+            }
+            else if (c == ')' && rFrame.kind != TopFrame)
+            {
+                ++p;
+                finishExpression(rFrame);
+                ++rFrame.numArgs;
+                if (rFrame.kind == FunctionFrame)
+                {
+                    const int id = getFunctionId(rFrame.functionName, rFrame.numArgs);
+                    const bool fastMath = rVariableStorage.isFastMath();
+                    if (rFrame.numArgs == 1 && getOneArgFunction(id, fastMath))
+                    {
+                        emit(CallOneArgOp);
+                        mInstructions.back().pOneArgFunction = getOneArgFunction(id, fastMath);
+                    }
+                    else if (rFrame.numArgs == 2 && getTwoArgFunction(id, fastMath))
+                    {
+                        emit(CallTwoArgOp);
+                        mInstructions.back().pTwoArgFunction = getTwoArgFunction(id, fastMath);
+                    }
+                    else
+                    {
+                        return false;
+                    }
+                }
+                else if (rFrame.kind == ConditionalFrame)
+                {
+                    if (rFrame.numArgs != 3)
+                    {
+                        return false;
+                    }
+                    mInstructions[rFrame.jumpIndex].jumpTarget = mInstructions.size();
+                }
+                frames.pop_back();
+                expectOperand = false;
+                continue;
+            }
+            else if (c == ',' && (rFrame.kind == FunctionFrame || rFrame.kind == ConditionalFrame))
+            {
+                ++p;
+                finishExpression(rFrame);
+                rFrame.resetExpression();
+                ++rFrame.numArgs;
+                if (rFrame.kind == ConditionalFrame)
+                {
+                    if (rFrame.numArgs == 1)
+                    {
+                        // Skip the true branch if the condition is false
+                        emit(JumpIfFalseOp);
+                        rFrame.jumpIndex = mInstructions.size()-1;
+                        rFrame.branchDepth = mStackDepth;
+                    }
+                    else if (rFrame.numArgs == 2)
+                    {
+                        // Skip the false branch after the true branch
+                        emit(JumpOp);
+                        mInstructions[rFrame.jumpIndex].jumpTarget = mInstructions.size();
+                        rFrame.jumpIndex = mInstructions.size()-1;
+                        mStackDepth = rFrame.branchDepth;
+                    }
+                    else
+                    {
+                        return false;
+                    }
+                }
+                continue;
+            }
+            else
+            {
+                return false;
+            }
+
+            if (nextIsOperator(p, pEnd))
+            {
+                return false;
+            }
+        }
+    }
+}
+
+//! @brief Apply a pending "^", "<" or ">" when both operands have been emitted
+void PreparedExpression::finishFactor(ParseFrame &rFrame)
+{
+    if (rFrame.powerOperator)
+    {
+        emitOperator(rFrame.powerOperator);
+        rFrame.powerOperator = 0;
+    }
+}
+
+//! @brief Apply the pending product operator when the last factor of a term has been emitted
+void PreparedExpression::finishTerm(ParseFrame &rFrame)
+{
+    finishFactor(rFrame);
+    if (rFrame.isProductActive)
+    {
+        emitOperator(rFrame.productOperator);
+        rFrame.isProductActive = false;
+    }
+}
+
+//! @brief Apply the pending sum operator and assignment when the last term of an expression has been emitted
+void PreparedExpression::finishExpression(ParseFrame &rFrame)
+{
+    finishTerm(rFrame);
+    if (rFrame.isSumActive)
+    {
+        emitOperator(rFrame.sumOperator);
+    }
+    else if (rFrame.leadingSign)
+    {
+        emitZeroOperator(rFrame.leadingSign);
+    }
+    if (rFrame.pAssignTarget)
+    {
+        emit(StoreOp);
+        mInstructions.back().pTarget = rFrame.pAssignTarget;
+    }
+}
+
+void PreparedExpression::emitOperator(char op)
+{
+    switch (op)
+    {
+    case '+': emit(AddOp); break;
+    case '-': emit(SubtractOp); break;
+    case '*': emit(MultiplyOp); break;
+    case '/': emit(DivideOp); break;
+    case '|': emit(OrOp); break;
+    case '&': emit(AndOp); break;
+    case '^': emit(PowerOp); break;
+    case '<': emit(LessThanOp); break;
+    default:  emit(GreaterThanOp); break;
+    }
+}
+
+//! @brief Emit the first operation of a fold starting from zero
+void PreparedExpression::emitZeroOperator(char op)
+{
+    if (op == '-')
+    {
+        emit(ZeroSubtractOp);
+    }
+    else if (op == '|')
+    {
+        emit(ZeroOrOp);
+    }
+    else
+    {
+        emit(ZeroAddOp);
+    }
+}
+
+}
@@ -0,0 +1,1216 @@
+#include "numhop/Script.h"
+#include "numhop/Helpfunctions.h"
+#include "numhop/Serialization.h"
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+#include <algorithm>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace numhop {
+
+namespace {
+
+// The binary format identifier and version, bump the version when the format or ExpressionOperatorT changes
+const char binaryFormatMagic[4] = {'N','H','O','P'};
+const uint32_t binaryFormatVersion = 4;
+
+//! @brief Count the number of line breaks (LF, CRLF or CR) in a part of a string
+//! @param[in] str The string
+//! @param[in] begin The first index to check
+//! @param[in] end One past the last index to check
+size_t countLineBreaks(const std::string &str, size_t begin, size_t end)
+{
+    size_t n=0;
+    for (size_t i=begin; i<end; ++i)
+    {
+        if (str[i] == '\n' || (str[i] == '\r' && (i+1 == str.size() || str[i+1] != '\n')))
+        {
+            ++n;
+        }
+    }
+    return n;
+}
+
+// Expanded statements longer than this are treated as invalid, nested script functions can grow exponentially
+const size_t maxInlinedStatementLength = 1000000;
+
+//! @brief A function defined in a script as name(a,b,...)=body, inlined into the statements that call it
+//! @details The parameters in the body are replaced by placeholders, see parameterPlaceholder
+struct ScriptFunction
+{
+    std::string name;
+    std::vector<std::string> parameters;
+    std::string body;
+};
+
+//! @brief Returns the placeholder of the i:th parameter in the body of a script function, such as $0
+//! @details No name can begin with $, so variables used in a function body can not be confused with the parameters of other
+//! functions when the body is inlined into them
+std::string parameterPlaceholder(const size_t i)
+{
+    char placeholder[8];
+    std::sprintf(placeholder, "$%u", unsigned(i));
+    return placeholder;
+}
+
+//! @brief Check if a character separates names in an expression
+bool isNameDelimiter(const char c)
+{
+    return (c != '\0') && (std::strchr("=+-*/^<>&|(),", c) != 0);
+}
+
+//! @brief Check if a string is a valid function or parameter name
+bool isScriptFunctionName(const std::string &name)
+{
+    if (name.empty() || !isalpha(name[0]) || name == "if")
+    {
+        return false;
+    }
+    for (size_t i=1; i<name.size(); ++i)
+    {
+        if (!isalnum(name[i]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+//! @brief Find the parenthesis closing the one opened at a given position
+//! @returns The index of the closing parenthesis, or npos if it is missing
+size_t findClosingParanthesis(const std::string &str, size_t open)
+{
+    size_t numOpen=0;
+    for (size_t i=open; i<str.size(); ++i)
+    {
+        if (str[i] == '(')
+        {
+            ++numOpen;
+        }
+        else if (str[i] == ')' && --numOpen == 0)
+        {
+            return i;
+        }
+    }
+    return std::string::npos;
+}
+
+//! @brief Split the comma separated arguments between two parenthesis, ignoring commas inside nested parenthesis
+void splitArguments(const std::string &str, size_t open, size_t close, std::vector<std::string> &rArguments)
+{
+    size_t begin=open+1, numOpen=0;
+    for (size_t i=open+1; i<=close; ++i)
+    {
+        const char c = str[i];
+        if (c == '(')
+        {
+            ++numOpen;
+        }
+        else if (c == ')' && numOpen > 0)
+        {
+            --numOpen;
+        }
+        else if ((c == ',' && numOpen == 0) || i == close)
+        {
+            rArguments.push_back(str.substr(begin, i-begin));
+            begin = i+1;
+        }
+    }
+}
+
+//! @brief Enclose an inlined expression in parenthesis unless it is a single value or already enclosed
+std::string enclosed(const std::string &expr)
+{
+    if (expr.find_first_of("=+-*/^<>&|") == std::string::npos)
+    {
+        return expr;
+    }
+    std::string stripped = expr;
+    bool didStrip;
+    stripLeadingTrailingParanthesis(stripped, didStrip);
+    return didStrip ? expr : "("+expr+")";
+}
+
+//! @brief Check if a statement defines a script function, name(a,b,...)=body
+//! @param[in] statement The statement with all whitespaces removed
+//! @param[out] rFunction The function, if the statement is a valid definition
+//! @param[out] rIsValid True if the definition is valid
+//! @returns True if the statement is a function definition (valid or not)
+bool parseScriptFunction(const std::string &statement, ScriptFunction &rFunction, bool &rIsValid)
+{
+    rIsValid = false;
+    const size_t open = statement.find('(');
+    const size_t equal = statement.find('=');
+    if (open == std::string::npos || equal == std::string::npos || open > equal || !isScriptFunctionName(statement.substr(0, open)))
+    {
+        return false;
+    }
+
+    rFunction.name = statement.substr(0, open);
+    rFunction.parameters.clear();
+    const size_t close = findClosingParanthesis(statement, open);
+    if (close == std::string::npos || close+1 != equal || equal+1 == statement.size() ||
+        statement.find('=', equal+1) != std::string::npos)
+    {
+        return true;
+    }
+    splitArguments(statement, open, close, rFunction.parameters);
+    if (rFunction.parameters.size() > maxFunctionArguments)
+    {
+        return true;
+    }
+    for (size_t i=0; i<rFunction.parameters.size(); ++i)
+    {
+        if (!isScriptFunctionName(rFunction.parameters[i]) ||
+            std::find(rFunction.parameters.begin(), rFunction.parameters.begin()+i, rFunction.parameters[i]) != rFunction.parameters.begin()+i)
+        {
+            return true;
+        }
+    }
+    rFunction.body = statement.substr(equal+1);
+    rIsValid = (rFunction.body.find('$') == std::string::npos);
+    return true;
+}
+
+//! @brief Replace each of some names in an expression by a value, in one pass so that names in the values are kept
+//! @param[in] expr The expression with all whitespaces removed
+//! @param[in] names The names to replace
+//! @param[in] values The value of each name
+std::string substituteNames(const std::string &expr, const std::vector<std::string> &names, const std::vector<std::string> &values)
+{
+    std::string substituted;
+    size_t i=0;
+    while (i<expr.size())
+    {
+        size_t end=i;
+        while (end<expr.size() && !isNameDelimiter(expr[end]))
+        {
+            ++end;
+        }
+        if (end == i)
+        {
+            substituted.push_back(expr[i++]);
+            continue;
+        }
+        const std::vector<std::string>::const_iterator it = std::find(names.begin(), names.end(), expr.substr(i, end-i));
+        if (it != names.end())
+        {
+            substituted.append(values[it-names.begin()]);
+        }
+        else
+        {
+            substituted.append(expr, i, end-i);
+        }
+        i = end;
+    }
+    return substituted;
+}
+
+//! @brief Returns the placeholders of a number of parameters
+std::vector<std::string> placeholders(const size_t numParameters)
+{
+    std::vector<std::string> names(numParameters);
+    for (size_t i=0; i<numParameters; ++i)
+    {
+        names[i] = parameterPlaceholder(i);
+    }
+    return names;
+}
+
+//! @brief Replace calls to script functions by their bodies, with the arguments substituted for the parameters
+//! @details Function bodies are already expanded when defined, so a function can only call functions defined before it
+//! @param[in] expr The expression with all whitespaces removed
+//! @param[in] functions The functions defined so far, later definitions take precedence
+//! @param[out] rExpanded The expanded expression
+//! @returns False if the expanded expression would be too long
+bool inlineScriptFunctions(const std::string &expr, const std::vector<ScriptFunction> &functions, std::string &rExpanded)
+{
+    if (functions.empty())
+    {
+        rExpanded = expr;
+        return true;
+    }
+    rExpanded.clear();
+    size_t i=0;
+    while (i<expr.size())
+    {
+        if (isNameDelimiter(expr[i]))
+        {
+            rExpanded.push_back(expr[i++]);
+            continue;
+        }
+
+        size_t end=i;
+        while (end<expr.size() && !isNameDelimiter(expr[end]))
+        {
+            ++end;
+        }
+        const std::string name = expr.substr(i, end-i);
+        const size_t close = (end<expr.size() && expr[end] == '(') ? findClosingParanthesis(expr, end) : std::string::npos;
+        std::vector<std::string> arguments;
+        if (close != std::string::npos)
+        {
+            splitArguments(expr, end, close, arguments);
+        }
+
+        const ScriptFunction *pFunction=0;
+        for (size_t f=functions.size(); f>0 && close != std::string::npos; --f)
+        {
+            if (functions[f-1].name == name && functions[f-1].parameters.size() == arguments.size())
+            {
+                pFunction = &functions[f-1];
+                break;
+            }
+        }
+        if (!pFunction)
+        {
+            rExpanded.append(name);
+            i = end;
+            continue;
+        }
+
+        std::vector<std::string> values(arguments.size());
+        for (size_t a=0; a<arguments.size(); ++a)
+        {
+            std::string expandedArgument;
+            if (!inlineScriptFunctions(arguments[a], functions, expandedArgument))
+            {
+                return false;
+            }
+            values[a] = enclosed(expandedArgument);
+        }
+
+        rExpanded.append(enclosed(substituteNames(pFunction->body, placeholders(values.size()), values)));
+        if (rExpanded.size() > maxInlinedStatementLength)
+        {
+            return false;
+        }
+        i = close+1;
+    }
+    return true;
+}
+
+//! @brief Collect the names of all variables assigned in an expression, including assignments nested in subexpressions
+void extractAssignedNames(const Expression &expr, std::set<std::string> &rAssignedNames)
+{
+    if (expr.operatorType() == AssignmentT)
+    {
+        rAssignedNames.insert(expr.leftExprString());
+    }
+    std::list<Expression>::const_iterator it;
+    for (it=expr.leftChildExpressions().begin(); it!=expr.leftChildExpressions().end(); ++it)
+    {
+        extractAssignedNames(*it, rAssignedNames);
+    }
+    for (it=expr.rightChildExpressions().begin(); it!=expr.rightChildExpressions().end(); ++it)
+    {
+        extractAssignedNames(*it, rAssignedNames);
+    }
+}
+
+//! @brief Find the named values read and assigned in a statement from its tokens, without parsing it
+//! @details The read names may include more than the parsed statement would give, which only makes the result conservative.
+//! @param[in] text The statement with all whitespaces removed
+//! @param[out] rAssignedName The variable assigned by the statement as a whole, if any
+//! @param[out] rAssignedNames All assigned variables
+//! @param[out] rReadNames The named values that may be read
+//! @returns False if the statement calls a function, it must then be parsed to know if the function is pure
+bool scanStatementNames(const std::string &text, std::string &rAssignedName, std::set<std::string> &rAssignedNames, std::set<std::string> &rReadNames)
+{
+    size_t b=0;
+    while (b < text.size())
+    {
+        size_t e=b;
+        while (e < text.size() && !isNameDelimiter(text[e]))
+        {
+            ++e;
+        }
+        const char next = (e < text.size()) ? text[e] : '\0';
+        if (e > b)
+        {
+            const std::string name = text.substr(b, e-b);
+            const bool isNumber = (isdigit(name[0]) || name[0] == '.') && name.find_first_not_of("0123456789.eE") == std::string::npos;
+            if (next == '(')
+            {
+                return false;
+            }
+            else if (next == '=')
+            {
+                rAssignedNames.insert(name);
+                if (b == 0)
+                {
+                    rAssignedName = name;
+                }
+            }
+            else if (!isNumber)
+            {
+                rReadNames.insert(name);
+            }
+        }
+        b = e+1;
+    }
+    return true;
+}
+
+//! @brief Check a statement without building its expression tree, only some errors are found
+//! @details The statement must not be empty, and it should not begin or end with an operator that needs an operand there
+bool isWellFormedStatement(const std::string &text)
+{
+    return !text.empty() && !contains(std::string("=*/^<>&"), text[0]) && !contains(std::string("=+-*/^<>&|"), text[text.size()-1]);
+}
+
+//! @brief Check if a character ends a line
+bool isLineBreak(const char c)
+{
+    return (c == '\n') || (c == '\r');
+}
+
+//! @brief Move a statement into another, the expression tree is not copied
+void moveStatement(ScriptStatement &rFrom, ScriptStatement &rTo)
+{
+    rTo.span = rFrom.span;
+    rTo.lineNumber = rFrom.lineNumber;
+    rTo.isValid = rFrom.isValid;
+    rTo.isParsed = rFrom.isParsed;
+    rTo.textHash = rFrom.textHash;
+    rTo.expression.swap(rFrom.expression);
+}
+
+//! @brief Returns the text of a statement as it is parsed
+//! @param[in] script The script text
+//! @param[in] span The statement in the script
+//! @param[in] inlined The statement with script functions inlined, or empty if it does not call any
+std::string parsedStatementText(const std::string &script, const StatementSpan &span, const std::string &inlined)
+{
+    if (!inlined.empty())
+    {
+        return inlined;
+    }
+    std::string text = script.substr(span.offset, span.length);
+    removeAllWhitespaces(text);
+    return text;
+}
+
+}
+
+//! @brief Default constructor
+Script::Script()
+{
+    mCommentChar = '#';
+    mIsValid = true;
+    mWasLoadedFromCache = false;
+    mIsLazy = false;
+    mHasScriptFunctions = false;
+    mNumReusedStatements = 0;
+}
+
+//! @brief Split a script into statements and interpret them, in parallel if supported
+//! @details The statements are interpreted independently, on multiple threads if the library was built with OpenMP.
+//! The statements are kept in source order, check each statement for interpretation errors.
+//! A statement of the form name(a,b)=a*b+1 defines a function, it is not kept as a statement but inlined into the calls
+//! with a matching number of arguments in the statements after it. Script functions take precedence over built-in functions.
+//! @param[in] script The script
+//! @param[in] commentChar The comment character (the rest of such lines are ignored)
+//! @param[in] numThreads The maximum number of threads to use, 0 means use all available
+//! @returns True if all statements were interpreted successfully, else false
+bool Script::interpret(const std::string &script, char commentChar, int numThreads)
+{
+    clear();
+    if (loadFromCache(script, commentChar))
+    {
+        return mIsValid;
+    }
+
+    splitStatements(script, commentChar, false);
+    parseStatements(numThreads);
+
+    if (!mCacheDirectory.empty())
+    {
+        saveToFile(cacheFilePath(script, commentChar));
+    }
+    return mIsValid;
+}
+
+//! @brief Split a script into statements without building their expression trees, each statement is parsed at first use
+//! @details Statements are only checked for operators without operands at load time, so
+//! loading scales with the size of the script text rather than with the work of parsing it. A statement is parsed when it
+//! is accessed with statement(), or when evaluated. Statements that evaluateOutputs() does not need are never parsed.
+//! Call parseStatements() to parse all statements and report all errors at once. Until then isValid() and the isValid
+//! flag of an unparsed statement only reflect the cheap checks, the parser decides when the statement is parsed.
+//! The script must not be evaluated from several threads before all statements are parsed.
+//! A cached binary form is used if available, but a lazily interpreted script is not saved to the cache.
+//! @param[in] script The script
+//! @param[in] commentChar The comment character (the rest of such lines are ignored)
+//! @returns False if a statement failed the cheap checks
+bool Script::interpretLazily(const std::string &script, char commentChar)
+{
+    clear();
+    if (loadFromCache(script, commentChar))
+    {
+        return mIsValid;
+    }
+    mIsLazy = true;
+    splitStatements(script, commentChar, true);
+    return mIsValid;
+}
+
+//! @brief Parse all statements that have not been parsed yet, in parallel if supported
+//! @param[in] numThreads The maximum number of threads to use, 0 means use all available
+//! @returns True if all statements were interpreted successfully, else false
+bool Script::parseStatements(int numThreads) const
+{
+    // Every thread only writes to its own statements
+    const long numStatements = long(mStatements.size());
+    if (numThreads <= 0)
+    {
+        numThreads = maxNumInterpretThreads();
+    }
+    int numInvalid = 0;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 16) num_threads(numThreads) if(numStatements > 64 && numThreads > 1) reduction(+:numInvalid)
+#endif
+    for (long i=0; i<numStatements; ++i)
+    {
+        if (!mStatements[i].isParsed)
+        {
+            parseStatement(size_t(i));
+        }
+        if (!mStatements[i].isValid)
+        {
+            ++numInvalid;
+        }
+    }
+    mIsValid = (numInvalid == 0);
+    return mIsValid;
+}
+
+//! @brief Interpret an edited version of the script, statements whose text did not change are not parsed again
+//! @details Reused statements keep their expression trees, including rewrites such as reduceStrength() and shared
+//! subexpressions; changed statements are parsed as interpreted, call the rewrites again to apply them to these.
+//! Only the lines between the first and the last difference are split again, unless the script defines script functions.
+//! Then all statements are split and matched by a hash of their text, with the functions inlined.
+//! Changed statements are parsed now, unless the script was interpreted lazily. The output plans of evaluateOutputs()
+//! are kept if the statements are the same and in the same order, as after editing comments or whitespace.
+//! @param[in] script The edited script, the comment character is not changed
+//! @param[in] numThreads The maximum number of threads to use for parsing, 0 means use all available
+//! @returns True if all statements were interpreted successfully, else false
+bool Script::update(const std::string &script, int numThreads)
+{
+    if (script == mScript)
+    {
+        mNumReusedStatements = mStatements.size();
+        return mIsValid;
+    }
+
+    mWasLoadedFromCache = false;
+    if (mHasScriptFunctions || !updateChangedLines(script))
+    {
+        updateAllStatements(script);
+    }
+
+    if (!mIsLazy)
+    {
+        return parseStatements(numThreads);
+    }
+    mIsValid = true;
+    for (size_t i=0; i<mStatements.size(); ++i)
+    {
+        mIsValid = mIsValid && mStatements[i].isValid;
+    }
+    return mIsValid;
+}
+
+//! @brief Split only the lines from the first to the last difference between the current and an edited script
+//! @details Statements do not span lines, so the statements before and after the changed lines are kept as they are,
+//! only moved in the text. This requires that the script does not define script functions.
+//! @param[in] script The edited script
+//! @returns False if the changed lines define a script function, nothing is changed then
+bool Script::updateChangedLines(const std::string &script)
+{
+    const size_t oldSize = mScript.size(), newSize = script.size(), minSize = std::min(oldSize, newSize);
+    const size_t blockSize = 64;
+    size_t prefix = 0;
+    while (prefix+blockSize <= minSize && std::memcmp(mScript.data()+prefix, script.data()+prefix, blockSize) == 0)
+    {
+        prefix += blockSize;
+    }
+    while (prefix < minSize && mScript[prefix] == script[prefix])
+    {
+        ++prefix;
+    }
+    size_t suffix = 0;
+    while (suffix+blockSize <= minSize-prefix &&
+           std::memcmp(mScript.data()+oldSize-suffix-blockSize, script.data()+newSize-suffix-blockSize, blockSize) == 0)
+    {
+        suffix += blockSize;
+    }
+    while (suffix < minSize-prefix && mScript[oldSize-1-suffix] == script[newSize-1-suffix])
+    {
+        ++suffix;
+    }
+
+    // The changed lines are from the start of the line of the first difference, to after the first line break in the common end
+    // A \r before the changed lines is included, it is only a line break of its own if not followed by \n
+    size_t begin = prefix;
+    while (begin > 0 && (!isLineBreak(script[begin-1]) || (begin == prefix && script[begin-1] == '\r')))
+    {
+        --begin;
+    }
+    size_t oldEnd = oldSize-suffix;
+    while (oldEnd < oldSize && !isLineBreak(mScript[oldEnd]))
+    {
+        ++oldEnd;
+    }
+    oldEnd = std::min(oldEnd+1, oldSize);
+    const size_t newEnd = newSize-(oldSize-oldEnd);
+
+    // Split the changed lines of the edited script
+    ScriptReader reader(script.data()+begin, newEnd-begin, mCommentChar);
+    StatementSpan span;
+    std::vector<ScriptStatement> changed;
+    size_t first = 0;
+    while (first < mStatements.size() && mStatements[first].span.offset < begin)
+    {
+        ++first;
+    }
+    size_t lineNumber = (first > 0) ? mStatements[first-1].lineNumber : 1;
+    size_t lastOffset = (first > 0) ? mStatements[first-1].span.offset : 0;
+    while (reader.nextStatement(span))
+    {
+        span.offset += begin;
+        lineNumber += countLineBreaks(script, lastOffset, span.offset);
+        lastOffset = span.offset;
+
+        std::string text = script.substr(span.offset, span.length);
+        removeAllWhitespaces(text);
+        ScriptFunction function;
+        bool isValidDefinition;
+        if (parseScriptFunction(text, function, isValidDefinition))
+        {
+            return false;
+        }
+        changed.push_back(ScriptStatement());
+        ScriptStatement &rStatement = changed.back();
+        rStatement.span = span;
+        rStatement.lineNumber = lineNumber;
+        rStatement.isValid = mIsLazy && isWellFormedStatement(text);
+        rStatement.isParsed = false;
+        rStatement.textHash = hashString(text.data(), text.size());
+    }
+
+    // Reuse the changed statements whose text is the same, such as after editing comments or whitespace
+    size_t last = first;
+    while (last < mStatements.size() && mStatements[last].span.offset < oldEnd)
+    {
+        ++last;
+    }
+    bool isSameOrder = (changed.size() == last-first);
+    size_t numReused = mStatements.size()-(last-first);
+    for (size_t i=0; i<changed.size(); ++i)
+    {
+        size_t j = first;
+        while (j < last && !(mStatements[j].textHash == changed[i].textHash && mStatements[j].isParsed && statementText(j) ==
+                             parsedStatementText(script, changed[i].span, std::string())))
+        {
+            ++j;
+        }
+        if (j < last)
+        {
+            changed[i].isValid = mStatements[j].isValid;
+            changed[i].isParsed = true;
+            changed[i].expression.swap(mStatements[j].expression);
+            mStatements[j].isParsed = false;
+            ++numReused;
+        }
+        isSameOrder = isSameOrder && (j == first+i);
+    }
+
+    // Move the statements after the changed lines, the expression trees are not copied
+    const size_t oldNumBreaks = countLineBreaks(mScript, begin, oldEnd), newNumBreaks = countLineBreaks(script, begin, newEnd);
+    for (size_t j=last; j<mStatements.size(); ++j)
+    {
+        mStatements[j].span.offset = mStatements[j].span.offset+newSize-oldSize;
+        mStatements[j].lineNumber = mStatements[j].lineNumber+newNumBreaks-oldNumBreaks;
+    }
+    if (changed.size() == last-first)
+    {
+        for (size_t i=0; i<changed.size(); ++i)
+        {
+            moveStatement(changed[i], mStatements[first+i]);
+        }
+    }
+    else
+    {
+        std::vector<ScriptStatement> statements(mStatements.size()-(last-first)+changed.size());
+        for (size_t j=0; j<first; ++j)
+        {
+            moveStatement(mStatements[j], statements[j]);
+        }
+        for (size_t i=0; i<changed.size(); ++i)
+        {
+            moveStatement(changed[i], statements[first+i]);
+        }
+        for (size_t j=last; j<mStatements.size(); ++j)
+        {
+            moveStatement(mStatements[j], statements[j-last+first+changed.size()]);
+        }
+        mStatements.swap(statements);
+    }
+
+    mScript = script;
+    mInlinedStatements.resize(mStatements.size());
+    mNumReusedStatements = numReused;
+    if (!isSameOrder)
+    {
+        mOutputPlans.clear();
+    }
+    return true;
+}
+
+//! @brief Split all statements of an edited script, and reuse the previous statements with the same text
+//! @details Statements are matched by a hash of their text, with script functions inlined and whitespaces removed
+//! @param[in] script The edited script
+void Script::updateAllStatements(const std::string &script)
+{
+    std::string previousScript;
+    std::vector<ScriptStatement> previousStatements;
+    std::vector<std::string> previousInlined;
+    previousScript.swap(mScript);
+    previousStatements.swap(mStatements);
+    previousInlined.swap(mInlinedStatements);
+    std::multimap<uint64_t, size_t> previousByHash;
+    for (size_t i=0; i<previousStatements.size(); ++i)
+    {
+        if (previousStatements[i].isParsed)
+        {
+            previousByHash.insert(std::make_pair(previousStatements[i].textHash, i));
+        }
+    }
+
+    mIsValid = true;
+    mHasScriptFunctions = false;
+    splitStatements(script, mCommentChar, mIsLazy);
+
+    // Each previous statement is moved to at most one new statement with the same text
+    bool isSameOrder = (mStatements.size() == previousStatements.size());
+    mNumReusedStatements = 0;
+    for (size_t i=0; i<mStatements.size(); ++i)
+    {
+        ScriptStatement &rStatement = mStatements[i];
+        std::pair<std::multimap<uint64_t, size_t>::iterator, std::multimap<uint64_t, size_t>::iterator> range = previousByHash.equal_range(rStatement.textHash);
+        std::multimap<uint64_t, size_t>::iterator it = range.first;
+        while (it != range.second && parsedStatementText(previousScript, previousStatements[it->second].span, (it->second < previousInlined.size()) ?
+                                                         previousInlined[it->second] : std::string()) != statementText(i))
+        {
+            ++it;
+        }
+        if (it == range.second)
+        {
+            isSameOrder = false;
+            continue;
+        }
+        ScriptStatement &rPrevious = previousStatements[it->second];
+        rStatement.isValid = rPrevious.isValid;
+        rStatement.isParsed = true;
+        rStatement.expression.swap(rPrevious.expression);
+        isSameOrder = isSameOrder && (it->second == i);
+        previousByHash.erase(it);
+        ++mNumReusedStatements;
+    }
+    if (!isSameOrder)
+    {
+        mOutputPlans.clear();
+    }
+}
+
+//! @brief Returns the number of statements that were reused by the last update()
+size_t Script::numReusedStatements() const
+{
+    return mNumReusedStatements;
+}
+
+//! @brief Load the binary form of a script from the cache directory, if there is one
+//! @returns True if the script was loaded, else the script is cleared
+bool Script::loadFromCache(const std::string &script, char commentChar)
+{
+    // The script text is stored in the cache file so a hash collision can not give a wrong result
+    if (!mCacheDirectory.empty())
+    {
+        const std::string cacheFile = cacheFilePath(script, commentChar);
+        if (loadFromFile(cacheFile) && mScript == script && mCommentChar == commentChar)
+        {
+            mWasLoadedFromCache = true;
+            return true;
+        }
+        clear();
+    }
+    return false;
+}
+
+//! @brief Split a script into statements and inline script functions, the statements are not parsed
+//! @param[in] script The script
+//! @param[in] commentChar The comment character
+//! @param[in] lazy Make the cheap checks of isWellFormedStatement now, else all statements are invalid until parsed
+void Script::splitStatements(const std::string &script, char commentChar, bool lazy)
+{
+    mScript = script;
+    mCommentChar = commentChar;
+
+    // Split into statements, function definitions are collected and inlined into the statements that follow them
+    ScriptReader reader(mScript.data(), mScript.size(), commentChar);
+    StatementSpan span;
+    size_t lineNumber=1, lastOffset=0;
+    std::vector<ScriptFunction> functions;
+    while (reader.nextStatement(span))
+    {
+        lineNumber += countLineBreaks(mScript, lastOffset, span.offset);
+        lastOffset = span.offset;
+
+        std::string text = reader.statementString(span);
+        removeAllWhitespaces(text);
+        ScriptFunction function;
+        bool isValidDefinition;
+        const bool isDefinition = parseScriptFunction(text, function, isValidDefinition);
+        mHasScriptFunctions = mHasScriptFunctions || isDefinition;
+        std::string expanded;
+        // The parameters are replaced before inlining, so that they can not capture the variables of called functions
+        if (isValidDefinition &&
+            inlineScriptFunctions(substituteNames(function.body, function.parameters, placeholders(function.parameters.size())), functions, expanded))
+        {
+            function.body = expanded;
+            functions.push_back(function);
+            continue;
+        }
+        const bool isInlined = !isDefinition && inlineScriptFunctions(text, functions, expanded);
+
+        mStatements.push_back(ScriptStatement());
+        ScriptStatement &rStatement = mStatements.back();
+        rStatement.span = span;
+        rStatement.lineNumber = lineNumber;
+        rStatement.isValid = isInlined && lazy && isWellFormedStatement(expanded);
+        rStatement.isParsed = !isInlined;
+        rStatement.textHash = isInlined ? hashString(expanded.data(), expanded.size()) : hashString(text.data(), text.size());
+        mInlinedStatements.push_back(isInlined && expanded != text ? expanded : std::string());
+        mIsValid = mIsValid && rStatement.isValid;
+    }
+}
+
+//! @brief Build the expression tree of a statement
+void Script::parseStatement(size_t i) const
+{
+    ScriptStatement &rStatement = mStatements[i];
+    if (!mInlinedStatements[i].empty())
+    {
+        rStatement.isValid = interpretExpressionStringRecursive(mInlinedStatements[i], rStatement.expression);
+    }
+    else
+    {
+        rStatement.isValid = interpretExpressionStringRecursive(mScript.data()+rStatement.span.offset, rStatement.span.length, rStatement.expression);
+    }
+    rStatement.isParsed = true;
+}
+
+//! @brief Parse a statement of a lazily interpreted script if it has not been parsed yet
+void Script::ensureParsed(size_t i) const
+{
+    if (!mStatements[i].isParsed)
+    {
+        parseStatement(i);
+        mIsValid = mIsValid && mStatements[i].isValid;
+    }
+}
+
+//! @brief Clear the script and all statements
+void Script::clear()
+{
+    mScript.clear();
+    mStatements.clear();
+    mInlinedStatements.clear();
+    mCache.clear();
+    mOutputPlans.clear();
+    mCommentChar = '#';
+    mIsValid = true;
+    mWasLoadedFromCache = false;
+    mIsLazy = false;
+    mHasScriptFunctions = false;
+    mNumReusedStatements = 0;
+}
+
+//! @brief Check if all statements were interpreted successfully
+//! @details For a lazily interpreted script, only the statements parsed so far have been fully checked
+bool Script::isValid() const
+{
+    return mIsValid;
+}
+
+//! @brief Returns the number of statements in the script
+size_t Script::numStatements() const
+{
+    return mStatements.size();
+}
+
+//! @brief Returns the number of statements with a built expression tree, less than numStatements() for a lazily interpreted script
+size_t Script::numParsedStatements() const
+{
+    size_t numParsed = 0;
+    for (size_t i=0; i<mStatements.size(); ++i)
+    {
+        numParsed += mStatements[i].isParsed ? 1 : 0;
+    }
+    return numParsed;
+}
+
+//! @brief Returns a statement, it is parsed first if the script was interpreted lazily
+//! @param[in] i The statement index, in source order
+const ScriptStatement &Script::statement(size_t i) const
+{
+    ensureParsed(i);
+    return mStatements[i];
+}
+
+//! @brief Returns the text of a statement
+//! @param[in] i The statement index, in source order
+std::string Script::statementString(size_t i) const
+{
+    const StatementSpan &span = mStatements[i].span;
+    return mScript.substr(span.offset, span.length);
+}
+
+//! @brief Returns the text of a statement as it is parsed, with script functions inlined and all whitespaces removed
+std::string Script::statementText(size_t i) const
+{
+    return parsedStatementText(mScript, mStatements[i].span, (i < mInlinedStatements.size()) ? mInlinedStatements[i] : std::string());
+}
+
+//! @brief Returns the script text
+const std::string &Script::scriptString() const
+{
+    return mScript;
+}
+
+//! @brief Replace expensive operations with cheaper equivalents in all statements
+//! @param[in] allowRoundingChanges Allow rewrites that may change the rounding of the result
+//! @see Expression::reduceStrength
+void Script::reduceStrength(bool allowRoundingChanges)
+{
+    parseStatements();
+    for (size_t i=0; i<mStatements.size(); ++i)
+    {
+        mStatements[i].expression.reduceStrength(allowRoundingChanges);
+    }
+}
+
+//! @brief Rewrite polynomials in Horner or Estrin form in all statements
+//! @returns The number of rewritten polynomials
+//! @see Expression::rewritePolynomials
+size_t Script::rewritePolynomials()
+{
+    parseStatements();
+    size_t numRewritten = 0;
+    for (size_t i=0; i<mStatements.size(); ++i)
+    {
+        numRewritten += mStatements[i].expression.rewritePolynomials();
+    }
+    return numRewritten;
+}
+
+//! @brief Select the evaluation of long chains of additions or multiplications in all statements
+//! @returns The number of chains that are not evaluated from left to right
+//! @see Expression::reassociateChains
+size_t Script::reassociateChains(ChainEvaluationT chainEvaluation, size_t minChainLength)
+{
+    parseStatements();
+    size_t numChains = 0;
+    for (size_t i=0; i<mStatements.size(); ++i)
+    {
+        numChains += mStatements[i].expression.reassociateChains(chainEvaluation, minChainLength);
+    }
+    return numChains;
+}
+
+//! @brief Share the values of subexpressions that occur more than once, within and across statements
+//! @details Shared subexpressions are evaluated once per evaluation of the script, and again after an assignment to a variable they depend on.
+//! Evaluating the same script from several threads at the same time is not supported after this.
+//! @returns The number of shared subexpressions
+size_t Script::eliminateCommonSubexpressions()
+{
+    parseStatements();
+    std::vector<Expression*> expressions;
+    for (size_t i=0; i<mStatements.size(); ++i)
+    {
+        if (mStatements[i].isValid)
+        {
+            expressions.push_back(&mStatements[i].expression);
+        }
+    }
+    mCache.clear();
+    return Expression::eliminateCommonSubexpressions(expressions, mCache);
+}
+
+//! @brief Evaluate all statements in order
+//! @param[in,out] rVariableStorage The variable storage to use for setting or getting variables or named values
+//! @param[out] rEvalOK Indicates whether evaluation was successful or not, evaluation stops at the first error
+//! @return The value of the last evaluated statement
+double Script::evaluate(VariableStorage &rVariableStorage, bool &rEvalOK) const
+{
+    double value=0;
+    rEvalOK = true;
+    EvaluationCache *pCache = 0;
+    if (mCache.numSlots() > 0)
+    {
+        pCache = &mCache;
+        pCache->invalidateAll();
+    }
+    for (size_t i=0; i<mStatements.size() && rEvalOK; ++i)
+    {
+        ensureParsed(i);
+        rEvalOK = mStatements[i].isValid;
+        if (rEvalOK)
+        {
+            value = mStatements[i].expression.evaluate(rVariableStorage, rEvalOK, pCache);
+        }
+    }
+    return value;
+}
+
+//! @brief Evaluate only the statements that the requested outputs depend on
+//! @details Statements that assign variables that are neither requested nor read by a required statement are skipped, such as
+//! assignments to temporaries used only for other outputs. Statements without an assignment are skipped unless they call a
+//! function that is not pure, invalid statements are always kept so that evaluation fails as with evaluate().
+//! Assignments nested in subexpressions, such as a in y=(a=x)^2, are also taken into account.
+//! The plan of required statements is computed on the first call for a set of outputs and reused after that,
+//! so this must not be called from several threads at the same time.
+//! @param[in] outputNames The names of the requested output variables
+//! @param[in,out] rVariableStorage The variable storage to use for setting or getting variables or named values
+//! @param[out] rEvalOK Indicates whether evaluation was successful or not, evaluation stops at the first error
+//! @return The value of the last evaluated statement
+double Script::evaluateOutputs(const std::vector<std::string> &outputNames, VariableStorage &rVariableStorage, bool &rEvalOK) const
+{
+    const std::vector<size_t> &plan = outputPlan(outputNames);
+    double value=0;
+    rEvalOK = true;
+    EvaluationCache *pCache = 0;
+    if (mCache.numSlots() > 0)
+    {
+        pCache = &mCache;
+        pCache->invalidateAll();
+    }
+    for (size_t i=0; i<plan.size() && rEvalOK; ++i)
+    {
+        ensureParsed(plan[i]);
+        const ScriptStatement &statement = mStatements[plan[i]];
+        rEvalOK = statement.isValid;
+        if (rEvalOK)
+        {
+            value = statement.expression.evaluate(rVariableStorage, rEvalOK, pCache);
+        }
+    }
+    return value;
+}
+
+//! @brief Returns the indices of the statements evaluated by evaluateOutputs(), in source order
+//! @param[in] outputNames The names of the requested output variables
+std::vector<size_t> Script::requiredStatements(const std::vector<std::string> &outputNames) const
+{
+    return outputPlan(outputNames);
+}
+
+//! @brief Find the statements that the requested outputs depend on, going backwards from the last statement
+//! @details A required assignment is the last one to its variable before the statements that read it, so the variable is not
+//! needed by statements before it, only the named values it reads are.
+const std::vector<size_t> &Script::outputPlan(const std::vector<std::string> &outputNames) const
+{
+    const std::set<std::string> outputs(outputNames.begin(), outputNames.end());
+    std::map<std::set<std::string>, std::vector<size_t> >::const_iterator found = mOutputPlans.find(outputs);
+    if (found != mOutputPlans.end())
+    {
+        return found->second;
+    }
+
+    std::set<std::string> needed = outputs;
+    std::vector<size_t> plan;
+    for (size_t i=mStatements.size(); i-- > 0;)
+    {
+        // Statements that have not been parsed yet are only tokenized, unless they call functions that may not be pure
+        std::string assignedName;
+        std::set<std::string> assigned, read;
+        bool isRequired = false;
+        if (mStatements[i].isParsed || !mStatements[i].isValid || !scanStatementNames(statementText(i), assignedName, assigned, read))
+        {
+            // A statement is a single term, which is the assignment for statements of the form name = value
+            const Expression &expr = statement(i).expression;
+            const Expression *pAssignment = 0;
+            if (expr.rightChildExpressions().size() == 1 && expr.rightChildExpressions().front().operatorType() == AssignmentT &&
+                expr.rightChildExpressions().front().rightChildExpressions().size() == 1)
+            {
+                pAssignment = &expr.rightChildExpressions().front();
+                assignedName = pAssignment->leftExprString();
+            }
+            (pAssignment ? pAssignment->rightChildExpressions().front() : expr).extractNamedValues(read);
+            extractAssignedNames(expr, assigned);
+            isRequired = !mStatements[i].isValid || expr.callsImpureFunction();
+        }
+        for (std::set<std::string>::const_iterator it=assigned.begin(); it!=assigned.end() && !isRequired; ++it)
+        {
+            isRequired = contains(needed, *it);
+        }
+        if (isRequired)
+        {
+            plan.push_back(i);
+            // Only the top level assignment is certain to happen, nested ones may be in a branch that is not taken
+            needed.erase(assignedName);
+            needed.insert(read.begin(), read.end());
+        }
+    }
+    std::reverse(plan.begin(), plan.end());
+    return mOutputPlans[outputs] = plan;
+}
+
+//! @brief Save the interpreted script in a compact binary form
+//! @details The binary form contains the script text, the statements, a symbol table and a function table.
+//! Rewrites of the statements and shared subexpressions are kept.
+//! Loading it is much faster than interpreting the script again.
+//! @param[out] rBuffer The binary data
+void Script::save(std::vector<char> &rBuffer) const
+{
+    parseStatements();
+    BinaryWriter writer;
+    writer.writeString(mScript);
+    writer.writeUInt8(uint8_t(mCommentChar));
+    mCache.write(writer);
+    writer.writeVarUInt(mStatements.size());
+    for (size_t i=0; i<mStatements.size(); ++i)
+    {
+        const ScriptStatement &statement = mStatements[i];
+        writer.writeVarUInt(statement.span.offset);
+        writer.writeVarUInt(statement.span.length);
+        writer.writeVarUInt(statement.lineNumber);
+        writer.writeUInt8(statement.isValid);
+        statement.expression.write(writer);
+    }
+    writer.finish(binaryFormatMagic, binaryFormatVersion, rBuffer);
+}
+
+//! @brief Load a script that was saved in binary form
+//! @param[in] pData Pointer to the binary data (it is not needed after loading)
+//! @param[in] size The size of the data
+//! @returns False if the data is invalid, of another format version or refers to unknown functions. Data with calls to functions
+//! that were unknown when it was saved, but are registered now, is also rejected so that the script is interpreted again.
+bool Script::load(const char *pData, size_t size)
+{
+    clear();
+    BinaryReader reader;
+    uint8_t commentChar;
+    uint32_t numStatements;
+    bool ok = reader.open(pData, size, binaryFormatMagic, binaryFormatVersion) && reader.readString(mScript) &&
+              reader.readUInt8(commentChar) && mCache.read(reader) && reader.readVarUInt(numStatements) &&
+              numStatements <= reader.remainingSize()/10;
+    if (ok)
+    {
+        mCommentChar = char(commentChar);
+        mStatements.resize(numStatements);
+    }
+    for (size_t i=0; ok && i<mStatements.size(); ++i)
+    {
+        ScriptStatement &rStatement = mStatements[i];
+        uint64_t offset, length, lineNumber;
+        uint8_t isValid;
+        ok = reader.readVarUInt(offset) && reader.readVarUInt(length) && reader.readVarUInt(lineNumber) && reader.readUInt8(isValid) &&
+             (offset <= mScript.size()) && (length <= mScript.size()-offset) && rStatement.expression.read(reader, mCache.numSlots());
+        rStatement.span.offset = size_t(offset);
+        rStatement.span.length = size_t(length);
+        rStatement.lineNumber = size_t(lineNumber);
+        rStatement.isValid = (isValid != 0);
+        rStatement.isParsed = true;
+        mIsValid = mIsValid && rStatement.isValid;
+    }
+    // The inlined statement texts are not saved, they are split again by the next update()
+    mHasScriptFunctions = true;
+    for (size_t i=0; ok && i<mStatements.size(); ++i)
+    {
+        const std::string text = statementText(i);
+        mStatements[i].textHash = hashString(text.data(), text.size());
+    }
+    if (!ok)
+    {
+        clear();
+    }
+    return ok;
+}
+
+//! @brief Save the interpreted script in binary form to a file
+//! @param[in] filePath The file path
+//! @returns True if the file was written
+bool Script::saveToFile(const std::string &filePath) const
+{
+    std::vector<char> buffer;
+    save(buffer);
+    std::FILE *pFile = std::fopen(filePath.c_str(), "wb");
+    if (!pFile)
+    {
+        return false;
+    }
+    const bool ok = (std::fwrite(&buffer[0], 1, buffer.size(), pFile) == buffer.size());
+    return (std::fclose(pFile) == 0) && ok;
+}
+
+//! @brief Load a script that was saved in binary form to a file, the file is memory mapped while loading
+//! @param[in] filePath The file path
+//! @returns False if the file could not be read or is invalid
+bool Script::loadFromFile(const std::string &filePath)
+{
+    MappedFile file;
+    if (!file.map(filePath))
+    {
+        clear();
+        return false;
+    }
+    return load(file.data(), file.size());
+}
+
+//! @brief Set a directory for caching interpreted scripts in binary form, an empty string disables the cache
+//! @details When a script is interpreted, the cache is checked first. Cache files are keyed by a hash of the script text.
+//! @param[in] directory The cache directory, it must exist
+void Script::setCacheDirectory(const std::string &directory)
+{
+    mCacheDirectory = directory;
+}
+
+//! @brief Returns the cache file path for a script
+//! @param[in] script The script text
+//! @param[in] commentChar The comment character
+std::string Script::cacheFilePath(const std::string &script, char commentChar) const
+{
+    const uint64_t hash = hashString(script.data(), script.size()) ^ uint64_t(static_cast<unsigned char>(commentChar));
+    char name[64];
+    std::sprintf(name, "numhop_%08lx%08lx_v%u.nhb", static_cast<unsigned long>(hash >> 32),
+                 static_cast<unsigned long>(hash & 0xFFFFFFFFu), static_cast<unsigned>(binaryFormatVersion));
+    if (mCacheDirectory.empty())
+    {
+        return name;
+    }
+    const char last = mCacheDirectory[mCacheDirectory.size()-1];
+    return (last == '/' || last == '\\') ? mCacheDirectory+name : mCacheDirectory+"/"+name;
+}
+
+//! @brief Check if the last interpreted script was loaded from the cache
+bool Script::wasLoadedFromCache() const
+{
+    return mWasLoadedFromCache;
+}
+
+//! @brief Returns the maximum number of threads used when interpreting scripts, 1 if built without OpenMP
+int maxNumInterpretThreads()
+{
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+}
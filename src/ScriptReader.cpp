@@ -0,0 +1,260 @@
+#include "numhop/ScriptReader.h"
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace numhop {
+
+//! @brief Default constructor, nothing is mapped
+MappedFile::MappedFile()
+{
+    mpData = 0;
+    mSize = 0;
+}
+
+MappedFile::~MappedFile()
+{
+    unmap();
+}
+
+//! @brief Memory map a file (read only)
+//! @param[in] filePath The path to the file
+//! @returns True if the file could be mapped (or is empty), else false
+bool MappedFile::map(const std::string &filePath)
+{
+    unmap();
+#if defined(_WIN32)
+    HANDLE file = CreateFileA(filePath.c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize))
+    {
+        CloseHandle(file);
+        return false;
+    }
+    if (fileSize.QuadPart > 0)
+    {
+        HANDLE mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+        if (mapping)
+        {
+            mpData = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            // The view keeps the mapping alive
+            CloseHandle(mapping);
+        }
+    }
+    CloseHandle(file);
+    if (fileSize.QuadPart > 0 && !mpData)
+    {
+        return false;
+    }
+    mSize = size_t(fileSize.QuadPart);
+#else
+    int fd = open(filePath.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat fileStatus;
+    if (fstat(fd, &fileStatus) != 0)
+    {
+        ::close(fd);
+        return false;
+    }
+    if (fileStatus.st_size > 0)
+    {
+        void *pMapped = mmap(0, size_t(fileStatus.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (pMapped == MAP_FAILED)
+        {
+            ::close(fd);
+            return false;
+        }
+        mpData = pMapped;
+    }
+    // The mapping remains valid after the file is closed
+    ::close(fd);
+    mSize = size_t(fileStatus.st_size);
+#endif
+    return true;
+}
+
+//! @brief Unmap the file (if mapped)
+void MappedFile::unmap()
+{
+    if (mpData)
+    {
+#if defined(_WIN32)
+        UnmapViewOfFile(mpData);
+#else
+        munmap(mpData, mSize);
+#endif
+        mpData = 0;
+    }
+    mSize = 0;
+}
+
+//! @brief Returns a pointer to the mapped data (null if the file is empty or not mapped)
+const char *MappedFile::data() const
+{
+    return static_cast<const char*>(mpData);
+}
+
+//! @brief Returns the size of the mapped file
+size_t MappedFile::size() const
+{
+    return mSize;
+}
+
+//! @brief Default constructor, the reader is empty until a buffer or file is set
+ScriptReader::ScriptReader()
+{
+    mpData = 0;
+    mSize = 0;
+    mPosition = 0;
+    mCommentChar = '#';
+}
+
+//! @brief Constructor reading from a caller provided buffer
+//! @param[in] pData Pointer to the script text, must remain valid while the reader is used
+//! @param[in] size The size of the script text
+//! @param[in] commentChar The comment character (the rest of such lines are ignored)
+ScriptReader::ScriptReader(const char *pData, size_t size, char commentChar)
+{
+    mCommentChar = commentChar;
+    setBuffer(pData, size);
+}
+
+//! @brief Read from a caller provided buffer (no copy is made)
+//! @param[in] pData Pointer to the script text, must remain valid while the reader is used
+//! @param[in] size The size of the script text
+void ScriptReader::setBuffer(const char *pData, size_t size)
+{
+    mMappedFile.unmap();
+    mpData = pData;
+    mSize = size;
+    mPosition = 0;
+}
+
+//! @brief Memory map a script file and read from it
+//! @param[in] filePath The path to the file
+//! @returns True if the file could be mapped (or is empty), else false
+bool ScriptReader::mapFile(const std::string &filePath)
+{
+    setBuffer(0, 0);
+    if (!mMappedFile.map(filePath))
+    {
+        return false;
+    }
+    mpData = mMappedFile.data();
+    mSize = mMappedFile.size();
+    return true;
+}
+
+//! @brief Close the reader, unmapping any mapped file
+void ScriptReader::close()
+{
+    setBuffer(0, 0);
+}
+
+//! @brief Set the comment character
+//! @param[in] commentChar The comment character (the rest of such lines are ignored)
+void ScriptReader::setCommentCharacter(char commentChar)
+{
+    mCommentChar = commentChar;
+}
+
+//! @brief Find the next statement, statements are separated by ; \n or \r, comments and empty statements are skipped
+//! @param[out] rSpan The span of the statement, without leading and trailing white spaces
+//! @returns True if a statement was found, false at the end of the script
+bool ScriptReader::nextStatement(StatementSpan &rSpan)
+{
+    while (mPosition < mSize)
+    {
+        size_t s = mPosition, e = mPosition;
+        for (; e<mSize; ++e)
+        {
+            const char c = mpData[e];
+            if (c == '\n' || c == '\r' || c == ';' || c == mCommentChar)
+            {
+                break;
+            }
+        }
+
+        // Advance one step from the found ; or \n character, or skip to after the next newline if this is a comment
+        mPosition = e+1;
+        if (e<mSize && mpData[e] == mCommentChar)
+        {
+            for (; mPosition<mSize; ++mPosition)
+            {
+                const char c = mpData[mPosition];
+                if (c == '\n' || c == '\r')
+                {
+                    ++mPosition;
+                    break;
+                }
+            }
+        }
+
+        // Strip leading and trailing white spaces
+        while (s<e && (mpData[s] == ' ' || mpData[s] == '\t'))
+        {
+            ++s;
+        }
+        while (e>s && (mpData[e-1] == ' ' || mpData[e-1] == '\t'))
+        {
+            --e;
+        }
+        if (e>s)
+        {
+            rSpan.offset = s;
+            rSpan.length = e-s;
+            return true;
+        }
+    }
+    return false;
+}
+
+//! @brief Restart reading from the beginning of the script
+void ScriptReader::rewind()
+{
+    mPosition = 0;
+}
+
+//! @brief Returns a pointer to the script text
+const char *ScriptReader::data() const
+{
+    return mpData;
+}
+
+//! @brief Returns the size of the script text
+size_t ScriptReader::size() const
+{
+    return mSize;
+}
+
+//! @brief Returns a pointer to the first character of a statement
+//! @param[in] span The statement span
+const char *ScriptReader::statementBegin(const StatementSpan &span) const
+{
+    return mpData+span.offset;
+}
+
+//! @brief Returns a copy of a statement as a string
+//! @param[in] span The statement span
+std::string ScriptReader::statementString(const StatementSpan &span) const
+{
+    return std::string(mpData+span.offset, span.length);
+}
+
+}
@@ -0,0 +1,311 @@
+#include "numhop/Serialization.h"
+#include "numhop/Expression.h"
+#include <cstring>
+
+namespace numhop {
+
+//! @brief Write an unsigned 8-bit value
+void BinaryWriter::writeUInt8(uint8_t value)
+{
+    mData.push_back(char(value));
+}
+
+//! @brief Write an unsigned 32-bit value
+void BinaryWriter::writeUInt32(uint32_t value)
+{
+    appendUInt32(mData, value);
+}
+
+//! @brief Write an unsigned 64-bit value
+void BinaryWriter::writeUInt64(uint64_t value)
+{
+    appendUInt32(mData, uint32_t(value & 0xFFFFFFFFu));
+    appendUInt32(mData, uint32_t(value >> 32));
+}
+
+//! @brief Write an unsigned integer value using as few bytes as possible, 7 bits per byte
+void BinaryWriter::writeVarUInt(uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        mData.push_back(char((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    mData.push_back(char(value));
+}
+
+//! @brief Write a double value (its bit pattern)
+void BinaryWriter::writeDouble(double value)
+{
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    writeUInt64(bits);
+}
+
+//! @brief Write a string, as an index into the string table
+void BinaryWriter::writeString(const std::string &str)
+{
+    writeVarUInt(stringIndex(str));
+}
+
+//! @brief Write a function reference, as an index into the function table
+//! @param[in] name The function name
+//! @param[in] numArgs The number of function arguments
+//! @param[in] functionId The function id (or -1 if the function is unknown)
+void BinaryWriter::writeFunction(const std::string &name, size_t numArgs, int functionId)
+{
+    const std::pair<std::string, size_t> key(name, numArgs);
+    std::map<std::pair<std::string, size_t>, uint32_t>::iterator it = mFunctionIndexMap.find(key);
+    if (it == mFunctionIndexMap.end())
+    {
+        FunctionEntry entry;
+        entry.nameIndex = stringIndex(name);
+        entry.numArgs = uint32_t(numArgs);
+        entry.functionId = int32_t(functionId);
+        it = mFunctionIndexMap.insert(std::make_pair(key, uint32_t(mFunctions.size()))).first;
+        mFunctions.push_back(entry);
+    }
+    writeVarUInt(it->second);
+}
+
+//! @brief Assemble the output, header and tables followed by the written data
+//! @param[in] magic Four characters identifying the content
+//! @param[in] version The format version
+//! @param[out] rOutput The output buffer
+void BinaryWriter::finish(const char magic[4], uint32_t version, std::vector<char> &rOutput) const
+{
+    rOutput.clear();
+    rOutput.insert(rOutput.end(), magic, magic+4);
+    appendUInt32(rOutput, version);
+
+    appendUInt32(rOutput, uint32_t(mStrings.size()));
+    for (size_t i=0; i<mStrings.size(); ++i)
+    {
+        appendUInt32(rOutput, uint32_t(mStrings[i]->size()));
+        rOutput.insert(rOutput.end(), mStrings[i]->begin(), mStrings[i]->end());
+    }
+
+    appendUInt32(rOutput, uint32_t(mFunctions.size()));
+    for (size_t i=0; i<mFunctions.size(); ++i)
+    {
+        appendUInt32(rOutput, mFunctions[i].nameIndex);
+        appendUInt32(rOutput, mFunctions[i].numArgs);
+        appendUInt32(rOutput, uint32_t(mFunctions[i].functionId));
+    }
+
+    rOutput.insert(rOutput.end(), mData.begin(), mData.end());
+}
+
+uint32_t BinaryWriter::stringIndex(const std::string &str)
+{
+    std::map<std::string, uint32_t>::iterator it = mStringIndexMap.find(str);
+    if (it == mStringIndexMap.end())
+    {
+        it = mStringIndexMap.insert(std::pair<std::string, uint32_t>(str, uint32_t(mStrings.size()))).first;
+        // Map keys are never moved, so pointing to them is safe
+        mStrings.push_back(&it->first);
+    }
+    return it->second;
+}
+
+void BinaryWriter::appendUInt32(std::vector<char> &rBuffer, uint32_t value)
+{
+    for (int i=0; i<4; ++i)
+    {
+        rBuffer.push_back(char((value >> (8*i)) & 0xFF));
+    }
+}
+
+//! @brief Default constructor
+BinaryReader::BinaryReader()
+{
+    mpData = 0;
+    mpEnd = 0;
+}
+
+//! @brief Open a buffer for reading, reads and checks the header and the tables
+//! @param[in] pData Pointer to the data, must remain valid while reading
+//! @param[in] size The size of the data
+//! @param[in] magic The expected four identifying characters
+//! @param[in] version The expected format version
+//! @returns False if the header does not match, if a function in the function table can not be found, or if a function
+//! that was unknown when the data was written is registered now
+bool BinaryReader::open(const char *pData, size_t size, const char magic[4], uint32_t version)
+{
+    mpData = pData;
+    mpEnd = pData+size;
+    mStrings.clear();
+    mFunctionIds.clear();
+
+    uint32_t fileVersion, numStrings, numFunctions;
+    if (size < 8 || std::memcmp(pData, magic, 4) != 0)
+    {
+        return false;
+    }
+    mpData += 4;
+    if (!readUInt32(fileVersion) || fileVersion != version)
+    {
+        return false;
+    }
+
+    if (!readUInt32(numStrings) || numStrings > remainingSize()/4)
+    {
+        return false;
+    }
+    mStrings.resize(numStrings);
+    for (uint32_t i=0; i<numStrings; ++i)
+    {
+        uint32_t length;
+        if (!readUInt32(length) || length > remainingSize())
+        {
+            return false;
+        }
+        mStrings[i].assign(mpData, length);
+        mpData += length;
+    }
+
+    if (!readUInt32(numFunctions) || numFunctions > remainingSize()/12)
+    {
+        return false;
+    }
+    mFunctionIds.resize(numFunctions);
+    for (uint32_t i=0; i<numFunctions; ++i)
+    {
+        uint32_t nameIndex, numArgs, functionId;
+        if (!readUInt32(nameIndex) || !readUInt32(numArgs) || !readUInt32(functionId) || nameIndex >= numStrings)
+        {
+            return false;
+        }
+        // Resolve the function again, the id may have changed if functions were registered in another order.
+        // The data is stale if a function is not registered any more, or if it was unknown when written but is registered now.
+        mFunctionIds[i] = getFunctionId(mStrings[nameIndex], numArgs);
+        if ((int32_t(functionId) >= 0) != (mFunctionIds[i] >= 0))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+//! @brief Read an unsigned 8-bit value
+bool BinaryReader::readUInt8(uint8_t &rValue)
+{
+    if (mpData == mpEnd)
+    {
+        return false;
+    }
+    rValue = uint8_t(*mpData++);
+    return true;
+}
+
+//! @brief Read an unsigned 32-bit value
+bool BinaryReader::readUInt32(uint32_t &rValue)
+{
+    unsigned char bytes[4];
+    if (!readBytes(reinterpret_cast<char*>(bytes), 4))
+    {
+        return false;
+    }
+    rValue = uint32_t(bytes[0]) | (uint32_t(bytes[1]) << 8) | (uint32_t(bytes[2]) << 16) | (uint32_t(bytes[3]) << 24);
+    return true;
+}
+
+//! @brief Read an unsigned 64-bit value
+bool BinaryReader::readUInt64(uint64_t &rValue)
+{
+    uint32_t low, high;
+    if (!readUInt32(low) || !readUInt32(high))
+    {
+        return false;
+    }
+    rValue = uint64_t(low) | (uint64_t(high) << 32);
+    return true;
+}
+
+//! @brief Read a variable length unsigned integer value
+bool BinaryReader::readVarUInt(uint64_t &rValue)
+{
+    rValue = 0;
+    for (int shift=0; shift<64; shift+=7)
+    {
+        uint8_t byte;
+        if (!readUInt8(byte))
+        {
+            return false;
+        }
+        rValue |= uint64_t(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+//! @brief Read a variable length unsigned integer value, that must fit in 32 bits
+bool BinaryReader::readVarUInt(uint32_t &rValue)
+{
+    uint64_t value;
+    if (!readVarUInt(value) || value > 0xFFFFFFFFu)
+    {
+        return false;
+    }
+    rValue = uint32_t(value);
+    return true;
+}
+
+//! @brief Read a double value
+bool BinaryReader::readDouble(double &rValue)
+{
+    uint64_t bits;
+    if (!readUInt64(bits))
+    {
+        return false;
+    }
+    std::memcpy(&rValue, &bits, sizeof(bits));
+    return true;
+}
+
+//! @brief Read a string (given by its index in the string table)
+bool BinaryReader::readString(std::string &rStr)
+{
+    uint32_t index;
+    if (!readVarUInt(index) || index >= mStrings.size())
+    {
+        return false;
+    }
+    rStr = mStrings[index];
+    return true;
+}
+
+//! @brief Read a function reference (given by its index in the function table)
+//! @param[out] rFunctionId The currently registered id of the function (or -1 if it was unknown when written)
+bool BinaryReader::readFunction(int &rFunctionId)
+{
+    uint32_t index;
+    if (!readVarUInt(index) || index >= mFunctionIds.size())
+    {
+        return false;
+    }
+    rFunctionId = mFunctionIds[index];
+    return true;
+}
+
+//! @brief Returns the number of bytes left to read
+size_t BinaryReader::remainingSize() const
+{
+    return size_t(mpEnd-mpData);
+}
+
+bool BinaryReader::readBytes(char *pDestination, size_t size)
+{
+    if (remainingSize() < size)
+    {
+        return false;
+    }
+    std::memcpy(pDestination, mpData, size);
+    mpData += size;
+    return true;
+}
+
+}
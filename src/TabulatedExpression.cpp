@@ -0,0 +1,349 @@
+#include "numhop/TabulatedExpression.h"
+#include "numhop/VariableStorage.h"
+#include <cmath>
+#include <ctime>
+#include <algorithm>
+#include <set>
+
+namespace numhop {
+
+namespace {
+
+const double pi = 3.14159265358979323846;
+
+//! @brief The maximum polynomial degree of each segment
+const size_t maxTabulationDegree = 32;
+
+//! @brief Evaluate a Chebyshev series with the Clenshaw recurrence, the first coefficient is already halved
+//! @param[in] pCoefficients The degree+1 coefficients
+//! @param[in] degree The degree
+//! @param[in] t The position within the segment, from -1 to 1
+inline double clenshaw(const double *pCoefficients, const size_t degree, const double t)
+{
+    const double twoT = 2.*t;
+    double b1=0, b2=0;
+    for (size_t j=degree; j>0; --j)
+    {
+        const double b0 = twoT*b1 - b2 + pCoefficients[j];
+        b2 = b1;
+        b1 = b0;
+    }
+    return t*b1 - b2 + pCoefficients[0];
+}
+
+//! @brief Keeps the value of the tabulated variable, other variables are read from the storage of the application
+class SampledVariable : public ExternalVariableStorage
+{
+public:
+    SampledVariable(const std::string &name, const VariableStorage &variableStorage) : mName(name), mValue(0), mVariableStorage(variableStorage) {}
+
+    double externalValue(std::string name, bool &rFound) const
+    {
+        if (name == mName)
+        {
+            rFound = true;
+            return mValue;
+        }
+        return mVariableStorage.value(name, rFound);
+    }
+
+    bool setExternalValue(std::string name, double value)
+    {
+        if (name == mName)
+        {
+            mValue = value;
+            return true;
+        }
+        return false;
+    }
+
+private:
+    const std::string &mName;
+    double mValue;
+    const VariableStorage &mVariableStorage;
+};
+
+}
+
+//! @brief Default constructor, nothing is tabulated
+TabulatedExpression::TabulatedExpression()
+{
+    clear();
+}
+
+//! @brief Tabulate an expression of one variable to a given error bound
+//! @details The range is split into 1, 2, 4, ... uniform segments until the error, checked at points between the
+//! interpolation nodes, is within the bound. The variable is set in a temporary storage while tabulating, the variable storage is not changed.
+//! @param[in] expr The expression, it must not assign variables or call user registered functions
+//! @param[in] variableName The free variable
+//! @param[in] lower The lower bound of the range
+//! @param[in] upper The upper bound of the range
+//! @param[in] maxError The maximum absolute error
+//! @param[in] rVariableStorage The variable storage with the other named values in the expression, they must be defined
+//! @param[in] degree The polynomial degree of each segment, 1 to 32
+//! @returns False if the expression is not finite in the range or the error bound could not be reached
+bool TabulatedExpression::tabulate(const Expression &expr, const std::string &variableName, double lower, double upper, double maxError,
+                                   VariableStorage &rVariableStorage, size_t degree)
+{
+    clear();
+    if (!expr.isValid() || !expr.isPure() || variableName.empty() || !(lower < upper) || (upper-lower)-(upper-lower) != 0 ||
+        !(maxError > 0) || degree < 1 || degree > maxTabulationDegree)
+    {
+        return false;
+    }
+
+    // The approximation is only valid for the current values of the other named values
+    std::set<std::string> names;
+    expr.extractNamedValues(names);
+    names.erase(variableName);
+    std::set<std::string>::const_iterator it;
+    for (it=names.begin(); it!=names.end(); ++it)
+    {
+        bool found;
+        mParameterValues.push_back(rVariableStorage.value(*it, found));
+        mParameterNames.push_back(*it);
+        if (!found)
+        {
+            clear();
+            return false;
+        }
+    }
+
+    mExpression = expr;
+    mVariableName = variableName;
+    mLower = lower;
+    mUpper = upper;
+    mDegree = degree;
+
+    SampledVariable sampledVariable(mVariableName, rVariableStorage);
+    VariableStorage samples;
+    samples.setExternalStorage(&sampledVariable);
+    for (size_t numSegments=1; numSegments<=maxTabulationSegments; numSegments*=2)
+    {
+        if (!fitSegments(samples, numSegments))
+        {
+            break;
+        }
+        double error;
+        if (!verifySegments(samples, error))
+        {
+            break;
+        }
+        else if (error <= maxError)
+        {
+            mMaxObservedError = error;
+            return true;
+        }
+    }
+    clear();
+    return false;
+}
+
+//! @brief Remove the tabulation
+void TabulatedExpression::clear()
+{
+    mExpression = Expression();
+    mVariableName.clear();
+    mLower = 0;
+    mUpper = 0;
+    mInverseSegmentWidth = 0;
+    mNumSegments = 0;
+    mDegree = 0;
+    mMaxObservedError = 0;
+    mCoefficients.clear();
+    mParameterNames.clear();
+    mParameterValues.clear();
+}
+
+//! @brief Check if an expression has been tabulated
+bool TabulatedExpression::isTabulated() const
+{
+    return mNumSegments > 0;
+}
+
+//! @brief Evaluate the approximation
+//! @param[in] x The value of the variable, it should be within the tabulated range
+double TabulatedExpression::approximate(double x) const
+{
+    const double s = (x - mLower)*mInverseSegmentWidth;
+    size_t k = (s > 0) ? size_t(std::min(s, double(mNumSegments-1))) : 0;
+    return clenshaw(&mCoefficients[k*(mDegree+1)], mDegree, 2.*(s-double(k)) - 1.);
+}
+
+//! @brief Evaluate the approximation for the value of the variable, or the expression if it is outside of the range
+//! @details The expression is also evaluated if any other named value in it differs from when it was tabulated
+//! @param[in,out] rVariableStorage The variable storage
+//! @param[out] rEvalOK Indicates whether evaluation was successful or not
+double TabulatedExpression::evaluate(VariableStorage &rVariableStorage, bool &rEvalOK) const
+{
+    rEvalOK = isTabulated();
+    const double x = rEvalOK ? rVariableStorage.value(mVariableName, rEvalOK) : 0.;
+    if (!rEvalOK)
+    {
+        return 0;
+    }
+    else if (x >= mLower && x <= mUpper && hasTabulatedParameters(rVariableStorage))
+    {
+        return approximate(x);
+    }
+    return mExpression.evaluate(rVariableStorage, rEvalOK);
+}
+
+//! @brief Returns the name of the tabulated variable
+const std::string &TabulatedExpression::variableName() const
+{
+    return mVariableName;
+}
+
+//! @brief Returns the number of uniform segments
+size_t TabulatedExpression::numSegments() const
+{
+    return mNumSegments;
+}
+
+//! @brief Returns the polynomial degree of each segment
+size_t TabulatedExpression::degree() const
+{
+    return mDegree;
+}
+
+//! @brief Returns the maximum absolute error observed when the tabulation was verified
+double TabulatedExpression::maxObservedError() const
+{
+    return mMaxObservedError;
+}
+
+//! @brief Measure how many times faster the approximation is than evaluating the expression
+//! @details Both are evaluated for the same values of the variable spread over the range, including the lookup of the variable.
+//! The variable storage is not changed.
+//! @param[in] rVariableStorage The variable storage with the other variables in the expression
+//! @param[in] numEvaluations The number of evaluations of each, more give a more accurate result
+//! @returns The ratio of the evaluation times, 0 if nothing is tabulated
+double TabulatedExpression::measureSpeedup(VariableStorage &rVariableStorage, size_t numEvaluations) const
+{
+    if (!isTabulated() || numEvaluations == 0)
+    {
+        return 0;
+    }
+    SampledVariable sampledVariable(mVariableName, rVariableStorage);
+    VariableStorage samples;
+    samples.setExternalStorage(&sampledVariable);
+    std::vector<double> values(numEvaluations);
+    for (size_t i=0; i<numEvaluations; ++i)
+    {
+        // A golden ratio sequence visits the segments in a scattered order
+        const double position = std::fmod(double(i)*0.6180339887498949, 1.);
+        values[i] = mLower + (mUpper-mLower)*position;
+    }
+
+    bool ok, external;
+    volatile double sink = 0;
+    std::clock_t start = std::clock();
+    for (size_t i=0; i<numEvaluations; ++i)
+    {
+        samples.setVariable(mVariableName, values[i], external);
+        sink = sink + mExpression.evaluate(samples, ok);
+    }
+    const double expressionTime = double(std::clock()-start);
+    start = std::clock();
+    for (size_t i=0; i<numEvaluations; ++i)
+    {
+        samples.setVariable(mVariableName, values[i], external);
+        sink = sink + evaluate(samples, ok);
+    }
+    const double tableTime = double(std::clock()-start);
+    return expressionTime/std::max(tableTime, 1.);
+}
+
+//! @brief Fit a Chebyshev series to each segment, sampled at the Chebyshev nodes
+//! @returns False if the expression is not finite at some node
+bool TabulatedExpression::fitSegments(VariableStorage &rSampleStorage, size_t numSegments)
+{
+    const size_t numNodes = mDegree+1;
+    const double width = (mUpper-mLower)/double(numSegments);
+    std::vector<double> nodes(numNodes), samples(numNodes);
+    for (size_t k=0; k<numNodes; ++k)
+    {
+        nodes[k] = std::cos(pi*(double(k)+0.5)/double(numNodes));
+    }
+
+    mNumSegments = numSegments;
+    mInverseSegmentWidth = double(numSegments)/(mUpper-mLower);
+    mCoefficients.assign(numSegments*numNodes, 0.);
+    for (size_t s=0; s<numSegments; ++s)
+    {
+        const double middle = mLower + (double(s)+0.5)*width;
+        for (size_t k=0; k<numNodes; ++k)
+        {
+            bool ok;
+            samples[k] = exactValue(middle + 0.5*width*nodes[k], rSampleStorage, ok);
+            if (!ok || samples[k]-samples[k] != 0)
+            {
+                mNumSegments = 0;
+                return false;
+            }
+        }
+        double *pCoefficients = &mCoefficients[s*numNodes];
+        for (size_t j=0; j<numNodes; ++j)
+        {
+            double sum = 0;
+            for (size_t k=0; k<numNodes; ++k)
+            {
+                sum += samples[k]*std::cos(pi*double(j)*(double(k)+0.5)/double(numNodes));
+            }
+            pCoefficients[j] = 2.*sum/double(numNodes);
+        }
+        pCoefficients[0] *= 0.5;
+    }
+    return true;
+}
+
+//! @brief Compare the approximation with the expression at uniformly spaced points in each segment, including the end points
+//! @param[out] rMaxError The maximum absolute error
+//! @returns False if the expression or the approximation is not finite at some point
+bool TabulatedExpression::verifySegments(VariableStorage &rSampleStorage, double &rMaxError) const
+{
+    const size_t numPoints = 2*(mDegree+1);
+    const double width = (mUpper-mLower)/double(mNumSegments);
+    rMaxError = 0;
+    for (size_t s=0; s<mNumSegments; ++s)
+    {
+        for (size_t i=0; i<=numPoints; ++i)
+        {
+            const double x = std::min(mLower + width*(double(s) + double(i)/double(numPoints)), mUpper);
+            bool ok;
+            const double exact = exactValue(x, rSampleStorage, ok);
+            const double error = std::fabs(approximate(x) - exact);
+            if (!ok || error-error != 0)
+            {
+                return false;
+            }
+            rMaxError = std::max(rMaxError, error);
+        }
+    }
+    return true;
+}
+
+//! @brief Check if the other named values in the expression still have the values they had when tabulating
+bool TabulatedExpression::hasTabulatedParameters(const VariableStorage &variableStorage) const
+{
+    for (size_t i=0; i<mParameterNames.size(); ++i)
+    {
+        bool found;
+        if (variableStorage.value(mParameterNames[i], found) != mParameterValues[i] || !found)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+//! @brief Evaluate the expression with the variable set in the sample storage
+double TabulatedExpression::exactValue(double x, VariableStorage &rSampleStorage, bool &rEvalOK) const
+{
+    bool external;
+    rSampleStorage.setVariable(mVariableName, x, external);
+    return mExpression.evaluate(rSampleStorage, rEvalOK);
+}
+
+}
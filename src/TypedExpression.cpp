@@ -0,0 +1,493 @@
+#include "numhop/TypedExpression.h"
+#include "numhop/Script.h"
+#include "numhop/Helpfunctions.h"
+#include <cmath>
+#include <algorithm>
+#include <sstream>
+#include <locale>
+
+namespace numhop {
+
+namespace {
+
+template <typename ValueT>
+inline ValueT boolify(const ValueT v)
+{
+    if (v>0.5) {return 1;} return 0;
+}
+
+template <typename ValueT>
+ValueT typedMin(ValueT a, ValueT b)
+{
+    return std::min(a,b);
+}
+
+template <typename ValueT>
+ValueT typedMax(ValueT a, ValueT b)
+{
+    return std::max(a,b);
+}
+
+template <typename ValueT>
+ValueT reduceScalar(ValueT v)
+{
+    return v;
+}
+
+//! @brief Parse a numeric constant in the value type, independent of the current locale
+//! @details Parsing again avoids double rounding, a long double constant gets the full precision of the literal
+template <typename ValueT>
+ValueT constantValue(const Expression &expr)
+{
+    std::istringstream stream(expr.exprString());
+    stream.imbue(std::locale::classic());
+    ValueT value;
+    if ((stream >> value) && stream.peek() == std::char_traits<char>::eof())
+    {
+        return value;
+    }
+    return static_cast<ValueT>(expr.numericConstantValue());
+}
+
+//! @brief For double the constant from the shared parser is used as is, so results are identical to Expression::evaluate
+template <>
+double constantValue<double>(const Expression &expr)
+{
+    return expr.numericConstantValue();
+}
+
+//! @brief Get the <cmath> overload of a built-in single argument function for the value type
+template <typename ValueT>
+ValueT (*oneArgFunction(const std::string &name))(ValueT)
+{
+    typedef ValueT (*FunctionT)(ValueT);
+    if (name == "cos")   { return static_cast<FunctionT>(&std::cos); }
+    if (name == "sin")   { return static_cast<FunctionT>(&std::sin); }
+    if (name == "tan")   { return static_cast<FunctionT>(&std::tan); }
+    if (name == "acos")  { return static_cast<FunctionT>(&std::acos); }
+    if (name == "asin")  { return static_cast<FunctionT>(&std::asin); }
+    if (name == "atan")  { return static_cast<FunctionT>(&std::atan); }
+    if (name == "cosh")  { return static_cast<FunctionT>(&std::cosh); }
+    if (name == "sinh")  { return static_cast<FunctionT>(&std::sinh); }
+    if (name == "tanh")  { return static_cast<FunctionT>(&std::tanh); }
+    if (name == "exp")   { return static_cast<FunctionT>(&std::exp); }
+    if (name == "log")   { return static_cast<FunctionT>(&std::log); }
+    if (name == "log10") { return static_cast<FunctionT>(&std::log10); }
+    if (name == "sqrt")  { return static_cast<FunctionT>(&std::sqrt); }
+    if (name == "ceil")  { return static_cast<FunctionT>(&std::ceil); }
+    if (name == "floor") { return static_cast<FunctionT>(&std::floor); }
+    if (name == "abs")   { return static_cast<FunctionT>(&std::fabs); }
+    if (name == "sum" || name == "mean" || name == "min" || name == "max") { return &reduceScalar<ValueT>; }
+    return 0;
+}
+
+//! @brief Get the <cmath> overload of a built-in two argument function for the value type
+template <typename ValueT>
+ValueT (*twoArgFunction(const std::string &name))(ValueT, ValueT)
+{
+    typedef ValueT (*FunctionT)(ValueT, ValueT);
+    if (name == "atan2") { return static_cast<FunctionT>(&std::atan2); }
+    if (name == "pow")   { return static_cast<FunctionT>(&std::pow); }
+    if (name == "fmod")  { return static_cast<FunctionT>(&std::fmod); }
+    if (name == "min")   { return &typedMin<ValueT>; }
+    if (name == "max")   { return &typedMax<ValueT>; }
+    return 0;
+}
+
+}
+
+//! @brief Default constructor
+template <typename ValueT>
+TypedVariableStorage<ValueT>::TypedVariableStorage()
+{
+    mpExternalStorage = 0;
+    mpParentStorage = 0;
+}
+
+//! @brief Reserve a value name, making it constant and impossible to change
+//! @param[in] name The name of the value
+//! @param[in] value The constant value
+//! @returns True if the name could be reserved, false if it was already reserved
+template <typename ValueT>
+bool TypedVariableStorage<ValueT>::reserveNamedValue(const std::string &name, ValueT value)
+{
+    return mReservedNameValueMap.insert(std::pair<std::string, ValueT>(name, value)).second;
+}
+
+//! @brief Set a variable value
+//! @details Values reserved in this storage or in a parent storage can not be set
+//! @param[in] name The name of the variable
+//! @param[in] value The value
+//! @param[out] rDidSetExternally Indicates if the variable was an external variable
+//! @returns True if the variable was set, false otherwise
+template <typename ValueT>
+bool TypedVariableStorage<ValueT>::setVariable(const std::string &name, ValueT value, bool &rDidSetExternally)
+{
+    rDidSetExternally = false;
+    if (isReservedName(name))
+    {
+        return false;
+    }
+    if (mpExternalStorage)
+    {
+        rDidSetExternally = mpExternalStorage->setExternalValue(name, value);
+    }
+    if (!rDidSetExternally && isNameInternalValid(name))
+    {
+        mVariableMap[name] = value;
+        return true;
+    }
+    return rDidSetExternally;
+}
+
+//! @brief Check if a given name is a valid internal storage name, based on given disallowed characters
+//! @param[in] name The name to check
+//! @returns True if the name is valid, else false
+template <typename ValueT>
+bool TypedVariableStorage<ValueT>::isNameInternalValid(const std::string &name) const
+{
+    return !containsAnyof(name, mDisallowedInternalNameChars);
+}
+
+//! @brief Set disallowed characters in internal names
+//! @param[in] disallowed A string containing disallowed characters
+template <typename ValueT>
+void TypedVariableStorage<ValueT>::setDisallowedInternalNameCharacters(const std::string &disallowed)
+{
+    mDisallowedInternalNameChars = disallowed;
+}
+
+//! @brief Check if a name is reserved in this storage or in a parent storage
+template <typename ValueT>
+bool TypedVariableStorage<ValueT>::isReservedName(const std::string &name) const
+{
+    for (const TypedVariableStorage<ValueT> *pStorage = this; pStorage; pStorage = pStorage->mpParentStorage)
+    {
+        if (pStorage->mReservedNameValueMap.find(name) != pStorage->mReservedNameValueMap.end())
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+//! @brief Get the value of a variable or reserved constant value
+//! @details Names not found in this storage or its external storage are looked up in the parent storage
+//! @param[in] name The name of the variable
+//! @param[out] rFound Indicates if the variable was found
+//! @returns The value of the variable (if it was found, else a dummy value)
+template <typename ValueT>
+ValueT TypedVariableStorage<ValueT>::value(const std::string &name, bool &rFound) const
+{
+    rFound = true;
+    typename std::map<std::string, ValueT>::const_iterator it = mReservedNameValueMap.find(name);
+    if (it != mReservedNameValueMap.end())
+    {
+        return it->second;
+    }
+    it = mVariableMap.find(name);
+    if (it != mVariableMap.end())
+    {
+        return it->second;
+    }
+    rFound = false;
+    if (mpExternalStorage)
+    {
+        ValueT value = mpExternalStorage->externalValue(name, rFound);
+        if (rFound)
+        {
+            return value;
+        }
+    }
+    if (mpParentStorage)
+    {
+        return mpParentStorage->value(name, rFound);
+    }
+    return 0;
+}
+
+//! @brief Check if a variable or reserved value exists
+template <typename ValueT>
+bool TypedVariableStorage<ValueT>::hasVariableName(const std::string &name) const
+{
+    bool found;
+    value(name, found);
+    return found;
+}
+
+//! @brief Set the external variable storage
+template <typename ValueT>
+void TypedVariableStorage<ValueT>::setExternalStorage(TypedExternalVariableStorage<ValueT> *pExternalStorage)
+{
+    mpExternalStorage = pExternalStorage;
+}
+
+//! @brief Set the parent storage, used for names that are not found in this storage
+//! @details Variables are always set in this storage (or its external storage), the parent storage is only read
+//! @param[in] pParentStorage A pointer to the parent storage, or 0 for none
+template <typename ValueT>
+void TypedVariableStorage<ValueT>::setParentStorage(TypedVariableStorage<ValueT> *pParentStorage)
+{
+    mpParentStorage = pParentStorage;
+}
+
+//! @brief Remove all internal variables, reserved values are kept
+template <typename ValueT>
+void TypedVariableStorage<ValueT>::clearInternalVariables()
+{
+    mVariableMap.clear();
+}
+
+//! @brief Default constructor
+template <typename ValueT>
+TypedExpression<ValueT>::TypedExpression()
+{
+    mIsPrepared = false;
+}
+
+//! @brief Prepare an interpreted expression for evaluation in the value type
+//! @param[in] expr The expression to prepare
+//! @returns True if the expression is valid and only uses built-in functions
+template <typename ValueT>
+bool TypedExpression<ValueT>::prepare(const Expression &expr)
+{
+    clear();
+    size_t index;
+    mIsPrepared = expr.isValid() && addNode(expr, index);
+    if (!mIsPrepared)
+    {
+        clear();
+        return false;
+    }
+    mStatements.push_back(index);
+    return true;
+}
+
+//! @brief Prepare all statements in a script for evaluation in order
+//! @param[in] script The interpreted script
+//! @returns True if all statements could be prepared
+template <typename ValueT>
+bool TypedExpression<ValueT>::prepare(const Script &script)
+{
+    clear();
+    mIsPrepared = true;
+    for (size_t i=0; i<script.numStatements() && mIsPrepared; ++i)
+    {
+        const ScriptStatement &statement = script.statement(i);
+        size_t index;
+        mIsPrepared = statement.isValid && statement.expression.isValid() && addNode(statement.expression, index);
+        mStatements.push_back(index);
+    }
+    if (!mIsPrepared)
+    {
+        clear();
+    }
+    return mIsPrepared;
+}
+
+//! @brief Release the prepared expression
+template <typename ValueT>
+void TypedExpression<ValueT>::clear()
+{
+    mNodes.clear();
+    mStatements.clear();
+    mIsPrepared = false;
+}
+
+//! @brief Check if the expression was prepared successfully
+template <typename ValueT>
+bool TypedExpression<ValueT>::isPrepared() const
+{
+    return mIsPrepared;
+}
+
+//! @brief Evaluate the expression, or all statements of the script
+//! @details With double as value type the result is identical to Expression::evaluate without strength reduction
+//! @param[in,out] rVariableStorage The variable storage to use for setting or getting variables or named values
+//! @param[out] rEvalOK Indicates whether evaluation was successful or not
+//! @return The value of the expression, or the last statement
+template <typename ValueT>
+ValueT TypedExpression<ValueT>::evaluate(TypedVariableStorage<ValueT> &rVariableStorage, bool &rEvalOK) const
+{
+    ValueT value = 0;
+    rEvalOK = mIsPrepared;
+    for (size_t i=0; i<mStatements.size() && rEvalOK; ++i)
+    {
+        value = evaluateNode(mStatements[i], rVariableStorage, rEvalOK);
+    }
+    return value;
+}
+
+template <typename ValueT>
+bool TypedExpression<ValueT>::addNode(const Expression &expr, size_t &rIndex)
+{
+    Node node;
+    node.operatorType = expr.operatorType();
+    node.isNumericConstant = expr.isNumericConstant();
+    node.isNamedValue = expr.isNamedValue();
+    node.constant = node.isNumericConstant ? constantValue<ValueT>(expr) : ValueT(0);
+    node.name = node.isNamedValue ? expr.exprString() : expr.leftExprString();
+    node.pOneArgFunction = 0;
+    node.pTwoArgFunction = 0;
+    if (node.operatorType == FunctionCallT)
+    {
+        const size_t numArgs = expr.rightChildExpressions().size();
+        node.pOneArgFunction = (numArgs == 1) ? oneArgFunction<ValueT>(node.name) : 0;
+        node.pTwoArgFunction = (numArgs == 2) ? twoArgFunction<ValueT>(node.name) : 0;
+        if (!node.pOneArgFunction && !node.pTwoArgFunction)
+        {
+            return false;
+        }
+    }
+
+    if (!node.isNumericConstant && !node.isNamedValue)
+    {
+        std::list<Expression>::const_iterator it;
+        size_t child;
+        for (it=expr.leftChildExpressions().begin(); it!=expr.leftChildExpressions().end(); ++it)
+        {
+            if (!addNode(*it, child))
+            {
+                return false;
+            }
+            node.leftChildren.push_back(child);
+        }
+        for (it=expr.rightChildExpressions().begin(); it!=expr.rightChildExpressions().end(); ++it)
+        {
+            if (!addNode(*it, child))
+            {
+                return false;
+            }
+            node.rightChildren.push_back(child);
+        }
+    }
+
+    rIndex = mNodes.size();
+    mNodes.push_back(node);
+    return true;
+}
+
+template <typename ValueT>
+ValueT TypedExpression<ValueT>::evaluateNode(size_t index, TypedVariableStorage<ValueT> &rVariableStorage, bool &rEvalOK) const
+{
+    const Node &node = mNodes[index];
+    const std::vector<size_t> &lhs = node.leftChildren;
+    const std::vector<size_t> &rhs = node.rightChildren;
+    bool lhsOK=false, rhsOK=false;
+    ValueT value = 0;
+
+    if (node.isNumericConstant)
+    {
+        rEvalOK = true;
+        return node.constant;
+    }
+    else if (node.isNamedValue)
+    {
+        lhsOK = true;
+        value = rVariableStorage.value(node.name, rhsOK);
+    }
+    else if (node.operatorType == AssignmentT)
+    {
+        bool dummy;
+        value = evaluateNode(rhs.front(), rVariableStorage, rhsOK);
+        if (rhsOK)
+        {
+            lhsOK = rVariableStorage.setVariable(node.name, value, dummy);
+        }
+    }
+    else if (node.operatorType == PowerT)
+    {
+        ValueT base = evaluateNode(lhs.front(), rVariableStorage, lhsOK);
+        ValueT exp = evaluateNode(rhs.front(), rVariableStorage, rhsOK);
+        value = std::pow(base, exp);
+    }
+    else if (node.operatorType == LessThenT || node.operatorType == GreaterThenT)
+    {
+        ValueT l = evaluateNode(lhs.front(), rVariableStorage, lhsOK);
+        ValueT r = evaluateNode(rhs.front(), rVariableStorage, rhsOK);
+        value = ValueT((node.operatorType == LessThenT) ? (l<r) : (l>r));
+    }
+    else if (node.operatorType == ConditionalT)
+    {
+        ValueT condition = evaluateNode(rhs[0], rVariableStorage, lhsOK);
+        if (lhsOK)
+        {
+            value = evaluateNode((boolify(condition) < 0.5) ? rhs[2] : rhs[1], rVariableStorage, rhsOK);
+        }
+    }
+    else if (node.operatorType == FunctionCallT)
+    {
+        lhsOK = true;
+        if (node.pOneArgFunction)
+        {
+            value = node.pOneArgFunction(evaluateNode(rhs.front(), rVariableStorage, rhsOK));
+        }
+        else
+        {
+            bool ok1, ok2;
+            ValueT arg1 = evaluateNode(rhs[0], rVariableStorage, ok1);
+            ValueT arg2 = evaluateNode(rhs[1], rVariableStorage, ok2);
+            rhsOK = ok1 && ok2;
+            value = node.pTwoArgFunction(arg1, arg2);
+        }
+    }
+    else
+    {
+        lhsOK = true;
+        for (size_t i=0; i<rhs.size(); ++i)
+        {
+            const ExpressionOperatorT optype = mNodes[rhs[i]].operatorType;
+            ValueT newValue = evaluateNode(rhs[i], rVariableStorage, rhsOK);
+            if (optype == AdditionT)
+            {
+                value += newValue;
+            }
+            else if (optype == SubtractionT)
+            {
+                value -= newValue;
+            }
+            else if (optype == MultiplicationT)
+            {
+                value *= newValue;
+            }
+            else if (optype == DivisionT)
+            {
+                value /= newValue;
+            }
+            else if (optype == OrT)
+            {
+                value = boolify(ValueT(boolify(value)+boolify(newValue)));
+            }
+            else if (optype == AndT)
+            {
+                value = boolify(value)*boolify(newValue);
+            }
+            else if (optype != UndefinedT)
+            {
+                value = newValue;
+            }
+            else
+            {
+                rEvalOK = false;
+                return value;
+            }
+            if (!rhsOK)
+            {
+                rEvalOK = false;
+                return value;
+            }
+        }
+    }
+
+    rEvalOK = (lhsOK && rhsOK);
+    return value;
+}
+
+template class TypedVariableStorage<float>;
+template class TypedVariableStorage<double>;
+template class TypedVariableStorage<long double>;
+template class TypedExpression<float>;
+template class TypedExpression<double>;
+template class TypedExpression<long double>;
+
+}
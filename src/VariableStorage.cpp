@@ -8,6 +8,7 @@ VariableStorage::VariableStorage()
 {
     mpExternalStorage = 0;
     mpParentStorage = 0;
+    mIsFastMath = false;
 }
 
 //! @brief Reserve a value name, making it constant and impossible to change
@@ -50,6 +51,12 @@ bool VariableStorage::setVariable(const std::string &name, double value, bool &r
     // If we could not set externally, then set it internally
     if (!rDidSetExternally && isNameInternalValid(name))
     {
+        // A scalar replaces an internal array with the same name
+        if (!mArrayMap.empty())
+        {
+            mArrayMap.erase(name);
+        }
+
         std::map<std::string,double>::iterator it = mVariableMap.find(name);
         if (it == mVariableMap.end())
         {
@@ -117,6 +124,121 @@ double VariableStorage::value(const std::string &name, bool &rFound) const
     return 0;
 }
 
+//! @brief Get a pointer to the value of a variable or reserved constant value, for direct access
+//! @details The same lookup order as in value() is used. Internal pointers remain valid until clearInternalVariables() is called.
+//! @param[in] name The name of the variable
+//! @returns A pointer to the value, or 0 if not found (or if the external storage does not support direct access)
+const double *VariableStorage::valuePointer(const std::string &name) const
+{
+    std::map<std::string,double>::const_iterator it = mReservedNameVauleMap.find(name);
+    if (it != mReservedNameVauleMap.end())
+    {
+        return &it->second;
+    }
+
+    it = mVariableMap.find(name);
+    if (it != mVariableMap.end())
+    {
+        return &it->second;
+    }
+
+    if (mpExternalStorage)
+    {
+        return mpExternalStorage->externalValuePointer(name);
+    }
+    return 0;
+}
+
+//! @brief Get a pointer to a variable value for direct assignment
+//! @details The same rules as in setVariable() are used. Internal variables are created (with value 0) if they do not exist.
+//! Internal pointers remain valid until clearInternalVariables() is called.
+//! @param[in] name The name of the variable
+//! @returns A pointer to the value, or 0 if the variable can not be set (or if the external storage does not support direct access)
+double *VariableStorage::variablePointer(const std::string &name)
+{
+    // Reserved values can not be changed
+    if (mReservedNameVauleMap.find(name) != mReservedNameVauleMap.end())
+    {
+        return 0;
+    }
+
+    // External variables have precedence when setting
+    if (mpExternalStorage)
+    {
+        bool foundExternally = false;
+        mpExternalStorage->externalValue(name, foundExternally);
+        if (foundExternally)
+        {
+            return mpExternalStorage->externalValuePointer(name);
+        }
+    }
+
+    if (isNameInternalValid(name))
+    {
+        std::map<std::string,double>::iterator it = mVariableMap.find(name);
+        if (it == mVariableMap.end())
+        {
+            it = mVariableMap.insert(std::pair<std::string,double>(name, 0.)).first;
+        }
+        return &it->second;
+    }
+    return 0;
+}
+
+//! @brief Set an array variable, used in element-wise evaluation
+//! @details An internal array replaces an internal scalar variable with the same name, invalidating pointers to it
+//! @param[in] name The name of the array
+//! @param[in] values The values
+//! @param[out] rDidSetExternally Indicates if the array was an external array
+//! @returns True if the array was set, false otherwise
+bool VariableStorage::setArray(const std::string &name, const std::vector<double> &values, bool &rDidSetExternally)
+{
+    rDidSetExternally = false;
+
+    // Reserved names can not be changed
+    if (mReservedNameVauleMap.find(name) != mReservedNameVauleMap.end())
+    {
+        return false;
+    }
+
+    if (mpExternalStorage)
+    {
+        rDidSetExternally = mpExternalStorage->setExternalArray(name, values);
+    }
+
+    if (!rDidSetExternally && isNameInternalValid(name))
+    {
+        mVariableMap.erase(name);
+        mArrayMap[name] = values;
+        return true;
+    }
+    return rDidSetExternally;
+}
+
+//! @brief Get an array variable
+//! @details Internal arrays are searched before external arrays. Internal pointers remain valid until the array is set again.
+//! @param[in] name The name of the array
+//! @param[out] rSize The number of elements
+//! @returns A pointer to the first element, or 0 if there is no such array
+const double *VariableStorage::array(const std::string &name, size_t &rSize) const
+{
+    std::map<std::string, std::vector<double> >::const_iterator it = mArrayMap.find(name);
+    if (it != mArrayMap.end())
+    {
+        // Empty arrays still need a valid pointer
+        static const double emptyArray = 0.;
+        rSize = it->second.size();
+        return it->second.empty() ? &emptyArray : &it->second[0];
+    }
+
+    rSize = 0;
+    if (mpExternalStorage)
+    {
+        return mpExternalStorage->externalArray(name, rSize);
+    }
+    return 0;
+}
+
 //! @brief Check if a given name is an existing variable (not reserved value)
 //! @param[in] name The variable name to look for
 //! @return true if found else false
@@ -154,10 +276,39 @@ void VariableStorage::setParentStorage(VariableStorage *pParentStorage)
 void VariableStorage::clearInternalVariables()
 {
     mVariableMap.clear();
+    mArrayMap.clear();
+}
+
+//! @brief Use approximations of the built-in functions when evaluating with this storage
+//! @details The fast functions are used by the interpreter, prepared and compiled expressions and element-wise evaluation.
+//! Prepared and compiled expressions select the functions when prepared. See FastMath.h for the error bounds.
+//! @param[in] fastMath True to use the fast functions, false (the default) to use the C library
+void VariableStorage::setFastMath(bool fastMath)
+{
+    mIsFastMath = fastMath;
+}
+
+//! @brief Check if approximations of the built-in functions are used when evaluating with this storage
+bool VariableStorage::isFastMath() const
+{
+    return mIsFastMath;
 }
 
 ExternalVariableStorage::~ExternalVariableStorage() {
 
 }
 
+double *ExternalVariableStorage::externalValuePointer(const std::string &/*name*/) {
+    return 0;
+}
+
+const double *ExternalVariableStorage::externalArray(const std::string &/*name*/, size_t &rSize) const {
+    rSize = 0;
+    return 0;
+}
+
+bool ExternalVariableStorage::setExternalArray(const std::string &/*name*/, const std::vector<double> &/*values*/) {
+    return false;
+}
+
 }
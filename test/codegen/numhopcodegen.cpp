@@ -0,0 +1,81 @@
+// Generates C functions from the scripts in a text file, one script per line, for testing the generated code
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "numhop.h"
+
+std::string escaped(const std::string &str)
+{
+    std::string result;
+    for (size_t i=0; i<str.size(); ++i)
+    {
+        if (str[i] == '"' || str[i] == '\\')
+        {
+            result += '\\';
+        }
+        result += str[i];
+    }
+    return result;
+}
+
+std::string nameArray(const std::string &arrayName, const std::vector<std::string> &names)
+{
+    std::string code = "static const char* const "+arrayName+"[] = {";
+    for (size_t i=0; i<names.size(); ++i)
+    {
+        code += "\""+escaped(names[i])+"\", ";
+    }
+    return code+"0};\n";
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3)
+    {
+        std::fprintf(stderr, "Usage: numhopcodegen scripts.txt output.h\n");
+        return 1;
+    }
+
+    std::ifstream input(argv[1]);
+    std::string line, code, table;
+    size_t numScripts = 0;
+    code += "// Generated by numhopcodegen from "+std::string(argv[1])+", do not edit\n";
+    code += numhop::CCodeEmitter::includes();
+    while (std::getline(input, line))
+    {
+        if (line.empty() || line[0] == '#')
+        {
+            continue;
+        }
+
+        numhop::Script script;
+        if (!script.interpret(line, '#'))
+        {
+            std::fprintf(stderr, "Could not interpret: %s\n", line.c_str());
+            return 1;
+        }
+
+        char name[64];
+        std::sprintf(name, "numhop_generated_%lu", (unsigned long)numScripts++);
+        numhop::CCodeEmitter emitter;
+        emitter.reserveNamedValue("pi", 3.14159265358979323846);
+        if (!emitter.emitFunction(name, script, code))
+        {
+            std::fprintf(stderr, "Could not generate code for: %s\n", line.c_str());
+            return 1;
+        }
+        code += nameArray(std::string(name)+"_inputs", emitter.inputNames());
+        code += nameArray(std::string(name)+"_outputs", emitter.outputNames());
+        code += "\n";
+        table += "    {\""+escaped(line)+"\", "+name+", "+name+"_inputs, "+name+"_outputs},\n";
+    }
+
+    code += "struct GeneratedScript\n{\n    const char *script;\n    double (*function)(const double*, double*);\n";
+    code += "    const char* const *inputNames;\n    const char* const *outputNames;\n};\n";
+    code += "static const GeneratedScript gGeneratedScripts[] = {\n"+table+"};\n";
+
+    std::ofstream output(argv[2]);
+    output << code;
+    return output.good() ? 0 : 1;
+}
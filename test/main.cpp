@@ -4,12 +4,115 @@
 #include <vector>
 #include <map>
 #include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <clocale>
+#include <ctime>
+#include <cmath>
+#include <new>
+#include <algorithm>
+#include <limits>
+#include <set>
+#if defined(__unix__) || defined(__APPLE__)
+#include <pthread.h>
+#endif
 
 #include "numhop.h"
+#include "generated_scripts.h"
 
 #define CATCH_CONFIG_MAIN
 #include "catch.hpp"
 
+// Count all heap allocations, to verify allocation free evaluation
+// All forms of new and delete are replaced, so every allocation is counted and released with the matching function
+#if __cplusplus >= 201103L
+#define TEST_NOEXCEPT noexcept
+#define TEST_THROW_BAD_ALLOC
+#else
+#define TEST_NOEXCEPT throw()
+#define TEST_THROW_BAD_ALLOC throw(std::bad_alloc)
+#endif
+// Not inlined into the replaced operators, the compiler would warn about free() of memory from operator new
+#if defined(_MSC_VER)
+#define TEST_NOINLINE __declspec(noinline)
+#else
+#define TEST_NOINLINE __attribute__((noinline))
+#endif
+
+static size_t gNumAllocations = 0;
+
+TEST_NOINLINE void* countedAllocation(std::size_t size)
+{
+  ++gNumAllocations;
+  return std::malloc(size ? size : 1);
+}
+
+TEST_NOINLINE void countedRelease(void *p)
+{
+  std::free(p);
+}
+
+void* operator new(std::size_t size) TEST_THROW_BAD_ALLOC
+{
+  void *p = countedAllocation(size);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void* operator new[](std::size_t size) TEST_THROW_BAD_ALLOC
+{
+  void *p = countedAllocation(size);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) TEST_NOEXCEPT
+{
+  return countedAllocation(size);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) TEST_NOEXCEPT
+{
+  return countedAllocation(size);
+}
+
+void operator delete(void *p) TEST_NOEXCEPT
+{
+  countedRelease(p);
+}
+
+void operator delete[](void *p) TEST_NOEXCEPT
+{
+  countedRelease(p);
+}
+
+void operator delete(void *p, const std::nothrow_t&) TEST_NOEXCEPT
+{
+  countedRelease(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t&) TEST_NOEXCEPT
+{
+  countedRelease(p);
+}
+
+#if defined(__cpp_sized_deallocation)
+void operator delete(void *p, std::size_t) TEST_NOEXCEPT
+{
+  countedRelease(p);
+}
+
+void operator delete[](void *p, std::size_t) TEST_NOEXCEPT
+{
+  countedRelease(p);
+}
+#endif
+
 template <typename ContainerT>
 std::string printContainer(const ContainerT& values) {
     std::stringstream ss;
@@ -72,6 +175,36 @@ public:
     }
     return false;
   }
+
+  double* externalValuePointer(const std::string &name)
+  {
+    std::map<std::string, double>::iterator it = mVars.find(name);
+    if (it != mVars.end()) {
+      return &it->second;
+    }
+    return 0;
+  }
+
+  const double* externalArray(const std::string &name, size_t &rSize) const
+  {
+    std::map<std::string, std::vector<double> >::const_iterator it = mArrays.find(name);
+    if (it != mArrays.end() && !it->second.empty()) {
+      rSize = it->second.size();
+      return &it->second[0];
+    }
+    rSize = 0;
+    return 0;
+  }
+
+  bool setExternalArray(const std::string &name, const std::vector<double> &values)
+  {
+    std::map<std::string, std::vector<double> >::iterator it = mArrays.find(name);
+    if (it != mArrays.end()) {
+      it->second = values;
+      return true;
+    }
+    return false;
+  }
   // -----
 
 
@@ -85,6 +218,8 @@ public:
       return mVars[name];
   }
 
+  std::map<std::string, std::vector<double> > mArrays;
+
 private:
   std::map<std::string, double> mVars;
 };
@@ -231,6 +366,255 @@ TEST_CASE("Expression Parsing") {
   test_allok(expr, 8, vs);
 }
 
+TEST_CASE("Script Reader") {
+  numhop::VariableStorage vs;
+  const std::string script = " \t #   \n    a=5;\n #   a=8\n a+1; \r\n a+2 \r a+3 \r\n #Some comment ";
+
+  std::list<std::string> exprlist;
+  numhop::extractExpressionRows(script, '#', exprlist);
+
+  // Statements are given as spans into the original buffer, in the same order as extractExpressionRows
+  numhop::ScriptReader reader(script.data(), script.size(), '#');
+  numhop::StatementSpan span;
+  std::list<std::string>::iterator it = exprlist.begin();
+  size_t numStatements = 0;
+  double value = 0;
+  while (reader.nextStatement(span)) {
+    REQUIRE(it != exprlist.end());
+    REQUIRE(reader.statementBegin(span) == script.data()+span.offset);
+    REQUIRE(reader.statementString(span) == *it);
+    ++it;
+    ++numStatements;
+
+    numhop::Expression e;
+    REQUIRE(numhop::interpretExpressionStringRecursive(reader.statementBegin(span), span.length, e) == true);
+    bool evalOK;
+    value = e.evaluate(vs, evalOK);
+    REQUIRE(evalOK == true);
+  }
+  REQUIRE(numStatements == 4);
+  REQUIRE(value == Approx(8));
+
+  reader.rewind();
+  REQUIRE(reader.nextStatement(span) == true);
+  REQUIRE(reader.statementString(span) == "a=5");
+
+  // Read a memory mapped file
+  const char* fileName = "numhop_test_script.txt";
+  std::FILE* pFile = std::fopen(fileName, "wb");
+  REQUIRE(pFile != 0);
+  std::fputs("b = 2 # comment; c=3\r\nb*b", pFile);
+  std::fclose(pFile);
+  REQUIRE(reader.mapFile(fileName) == true);
+  REQUIRE(reader.nextStatement(span) == true);
+  REQUIRE(reader.statementString(span) == "b = 2");
+  REQUIRE(reader.nextStatement(span) == true);
+  REQUIRE(reader.statementString(span) == "b*b");
+  REQUIRE(reader.nextStatement(span) == false);
+  reader.close();
+  std::remove(fileName);
+  REQUIRE(reader.mapFile(fileName) == false);
+}
+
+TEST_CASE("Parallel Script Interpretation") {
+  // Generate a large script, with some invalid statements
+  std::stringstream ss;
+  const int numLines = 20000;
+  ss << "# Generated script\n";
+  for (int i=0; i<numLines; ++i) {
+    if (i % 5000 == 4999) {
+      ss << "x" << i << " = 1+*2\r\n";
+    }
+    else {
+      ss << "x" << i << " = " << i << "*2 + cos(0); y" << i << " = x" << i << "/2\r\n";
+    }
+  }
+  ss << "z = x0 + x1";
+
+  numhop::Script parallelScript, serialScript;
+  REQUIRE(parallelScript.interpret(ss.str(), '#') == false);
+  REQUIRE(serialScript.interpret(ss.str(), '#', 1) == false);
+  REQUIRE(parallelScript.numStatements() == serialScript.numStatements());
+  REQUIRE(parallelScript.numStatements() == size_t(numLines*2 - 4 + 1));
+
+  // Statements must be in source order, with line numbers and validity per statement
+  size_t numInvalid = 0;
+  for (size_t i=0; i<parallelScript.numStatements(); ++i) {
+    const numhop::ScriptStatement &statement = parallelScript.statement(i);
+    REQUIRE(statement.isValid == serialScript.statement(i).isValid);
+    REQUIRE(statement.lineNumber == serialScript.statement(i).lineNumber);
+    REQUIRE(parallelScript.statementString(i) == serialScript.statementString(i));
+    if (!statement.isValid) {
+      ++numInvalid;
+      REQUIRE(parallelScript.statementString(i).find("1+*2") != std::string::npos);
+      REQUIRE((statement.lineNumber-1) % 5000 == 0);
+    }
+  }
+  REQUIRE(numInvalid == 4);
+  REQUIRE(parallelScript.statement(0).lineNumber == 2);
+  REQUIRE(parallelScript.statementString(1) == "y0 = x0/2");
+  REQUIRE(parallelScript.statement(parallelScript.numStatements()-1).lineNumber == size_t(numLines+2));
+
+  numhop::VariableStorage vs;
+  bool evalOK;
+  numhop::Script script;
+  REQUIRE(script.interpret("a=2; b=a*3\n c=if(b>5, b, 0) # comment\n c+1", '#') == true);
+  REQUIRE(script.evaluate(vs, evalOK) == Approx(7));
+  REQUIRE(evalOK == true);
+  REQUIRE(numhop::maxNumInterpretThreads() >= 1);
+}
+
+TEST_CASE("Binary Script Serialization") {
+  const std::string text = "a=2; b=(a*3)\n c=if(b>5, atan2(b,1), max(a,b)) # comment\n d=cos(c)+-1e-3*(c^2); e=unknown(1); c+d+a";
+  numhop::Script script;
+  REQUIRE(script.interpret(text, '#') == false);
+
+  std::vector<char> buffer;
+  script.save(buffer);
+  REQUIRE(buffer.size() > 8);
+
+  numhop::Script loaded;
+  REQUIRE(loaded.load(&buffer[0], buffer.size()) == true);
+  REQUIRE(loaded.scriptString() == text);
+  REQUIRE(loaded.isValid() == false);
+  REQUIRE(loaded.numStatements() == script.numStatements());
+  for (size_t i=0; i<script.numStatements(); ++i) {
+    INFO("Statement: " << script.statementString(i))
+    REQUIRE(loaded.statementString(i) == script.statementString(i));
+    REQUIRE(loaded.statement(i).lineNumber == script.statement(i).lineNumber);
+    REQUIRE(loaded.statement(i).isValid == script.statement(i).isValid);
+    numhop::Expression original = script.statement(i).expression;
+    numhop::Expression copy = loaded.statement(i).expression;
+    REQUIRE(copy.print() == original.print());
+    REQUIRE(copy.isNumericConstant() == original.isNumericConstant());
+    REQUIRE(copy.isNamedValue() == original.isNamedValue());
+
+    numhop::VariableStorage vs1, vs2;
+    bool ok1, ok2;
+    script.evaluate(vs1, ok1);
+    loaded.evaluate(vs2, ok2);
+    REQUIRE(ok1 == ok2);
+  }
+
+  // Evaluate the valid part of the script
+  numhop::Script valid;
+  REQUIRE(valid.interpret("a=2; b=(a*3)\n c=if(b>5, atan2(b,1), max(a,b))\n d=cos(c)+-1e-3*(c^2); c+d+a", '#') == true);
+  valid.save(buffer);
+  REQUIRE(loaded.load(&buffer[0], buffer.size()) == true);
+  numhop::VariableStorage vs1, vs2;
+  bool ok1, ok2;
+  const double expected = valid.evaluate(vs1, ok1);
+  REQUIRE(ok1 == true);
+  REQUIRE(loaded.evaluate(vs2, ok2) == expected);
+  REQUIRE(ok2 == true);
+
+  // Rewrites made after interpretation are kept
+  numhop::Script rewritten;
+  REQUIRE(rewritten.interpret("y = x^3+x^(-1)*x^0.5+x/4; y", '#') == true);
+  rewritten.reduceStrength(true);
+  rewritten.save(buffer);
+  REQUIRE(loaded.load(&buffer[0], buffer.size()) == true);
+  for (size_t i=0; i<rewritten.numStatements(); ++i) {
+    REQUIRE(loaded.statement(i).expression.structuralHash() == rewritten.statement(i).expression.structuralHash());
+  }
+  vs1.setVariable("x", 1.7, ok1);
+  vs2.setVariable("x", 1.7, ok2);
+  REQUIRE(loaded.evaluate(vs2, ok2) == rewritten.evaluate(vs1, ok1));
+  REQUIRE(rewritten.interpret("a = sin(x)*cos(x)+1; x = 2; b = sin(x)*cos(x)+a; sin(x)*cos(x)", '#') == true);
+  REQUIRE(rewritten.eliminateCommonSubexpressions() > 0);
+  rewritten.save(buffer);
+  REQUIRE(loaded.load(&buffer[0], buffer.size()) == true);
+  for (size_t i=0; i<rewritten.numStatements(); ++i) {
+    REQUIRE(loaded.statement(i).expression.structuralHash() == rewritten.statement(i).expression.structuralHash());
+  }
+  REQUIRE(loaded.evaluate(vs2, ok2) == rewritten.evaluate(vs1, ok1));
+  REQUIRE(vs2.value("b", ok2) == vs1.value("b", ok1));
+  std::vector<char> saved;
+  loaded.save(saved);
+  REQUIRE(saved == buffer);
+  REQUIRE(rewritten.interpret("y = 1e100+1-1e100+1e-3-(2+1e-3)+3", '#') == true);
+  REQUIRE(rewritten.reassociateChains(numhop::CompensatedChainT, 2) == 2);
+  rewritten.save(saved);
+  REQUIRE(loaded.load(&saved[0], saved.size()) == true);
+  REQUIRE(loaded.statement(0).expression.structuralHash() == rewritten.statement(0).expression.structuralHash());
+  REQUIRE(loaded.evaluate(vs2, ok2) == 2.);
+
+  // Invalid, truncated or other versions of data must be rejected
+  std::vector<char> corrupt = buffer;
+  corrupt[4] = 99;
+  REQUIRE(loaded.load(&corrupt[0], corrupt.size()) == false);
+  REQUIRE(loaded.numStatements() == 0);
+  for (size_t size=0; size<buffer.size(); size+=7) {
+    REQUIRE(loaded.load(&buffer[0], size) == false);
+  }
+}
+
+double twice(double x);
+
+TEST_CASE("Script Cache") {
+  const std::string text = "x=3; y=x^2+sin(x)\n y*2";
+  numhop::Script script;
+  script.setCacheDirectory(".");
+  const std::string cacheFile = script.cacheFilePath(text, '#');
+  std::remove(cacheFile.c_str());
+
+  // First time the script is interpreted and the cache file is written
+  REQUIRE(script.interpret(text, '#') == true);
+  REQUIRE(script.wasLoadedFromCache() == false);
+  std::FILE *pFile = std::fopen(cacheFile.c_str(), "rb");
+  REQUIRE(pFile != 0);
+  std::fclose(pFile);
+
+  // Second time it is loaded from the cache
+  numhop::Script cached;
+  cached.setCacheDirectory("./");
+  REQUIRE(cached.cacheFilePath(text, '#') == cacheFile);
+  REQUIRE(cached.interpret(text, '#') == true);
+  REQUIRE(cached.wasLoadedFromCache() == true);
+  numhop::VariableStorage vs;
+  bool evalOK;
+  REQUIRE(cached.evaluate(vs, evalOK) == Approx(2*(9+std::sin(3.))));
+  REQUIRE(evalOK == true);
+
+  // Other scripts or comment characters must not hit the same cache entry
+  REQUIRE(cached.cacheFilePath(text, '%') != cacheFile);
+  REQUIRE(cached.interpret(text+" ", '#') == true);
+  REQUIRE(cached.wasLoadedFromCache() == false);
+  std::remove(cached.cacheFilePath(text+" ", '#').c_str());
+  std::remove(cacheFile.c_str());
+
+  // Calls to functions registered after the script was cached are resolved by interpreting the script again
+  const std::string callsLater = "y = cachedLater(3)";
+  REQUIRE(cached.interpret(callsLater, '#') == false);
+  REQUIRE(numhop::registerFunction("cachedLater", &twice) >= 0);
+  REQUIRE(cached.interpret(callsLater, '#') == true);
+  REQUIRE(cached.wasLoadedFromCache() == false);
+  REQUIRE(cached.evaluate(vs, evalOK) == 6);
+  REQUIRE(cached.interpret(callsLater, '#') == true);
+  REQUIRE(cached.wasLoadedFromCache() == true);
+  std::remove(cached.cacheFilePath(callsLater, '#').c_str());
+}
+
+TEST_CASE("Long Lines") {
+  // White space handling must be linear in the line length
+  std::string line;
+  for (int i=0; i<200000; ++i) {
+    line += "  1 \t+";
+  }
+  line += "  1  ";
+  std::string stripped = line;
+  numhop::stripLeadingTrailingWhitespaces(stripped);
+  REQUIRE(stripped.size() == line.size()-4);
+  numhop::removeAllWhitespaces(stripped);
+  REQUIRE(stripped.size() == 400001);
+  REQUIRE(stripped.find_first_of(" \t") == std::string::npos);
+
+  std::list<std::string> exprlist;
+  numhop::extractExpressionRows(line+";\n"+line, '#', exprlist);
+  REQUIRE(exprlist.size() == 2);
+  REQUIRE(exprlist.front().size() == line.size()-4);
+}
+
 TEST_CASE("Various Math") {
   numhop::VariableStorage vs;
 
@@ -286,6 +670,122 @@ TEST_CASE("Exponential Notation") {
   test_allok("1e2+1E2", 200, vs);
 }
 
+// Simple deterministic pseudo random number generator for the tests (xorshift64)
+unsigned long long nextRandom(unsigned long long &rState)
+{
+    rState ^= rState << 13;
+    rState ^= rState >> 7;
+    rState ^= rState << 17;
+    return rState;
+}
+
+void test_parse_same_as_strtod(const std::string &number)
+{
+    INFO("Number: " << number)
+    double expected, actual;
+    char *pExpectedEnd;
+    expected = strtod(number.c_str(), &pExpectedEnd);
+    const char *pActualEnd = numhop::parseDecimalNumber(number.data(), number.data()+number.size(), actual);
+    REQUIRE((pActualEnd - number.data()) == (pExpectedEnd - number.c_str()));
+    if (expected == expected) {
+        REQUIRE(std::memcmp(&expected, &actual, sizeof(double)) == 0);
+    }
+    else {
+        REQUIRE(actual != actual);
+    }
+}
+
+TEST_CASE("Number Parsing") {
+  const char* numbers[] = {"0", "-0", "1", "1.5", "+2.25", ".5", "5.", "007", "0.001", "1e5", "1E-5", "2e+2", "1e", "1e+", "1.5e-",
+                           "0.1", "0.2", "0.3", "3.141592653589793", "2.718281828459045235360287",
+                           "9007199254740993", "9007199254740992.5", "18014398509481985", "1.7976931348623157e308",
+                           "1.7976931348623159e308", "1e309", "2.2250738585072014e-308", "2.2250738585072011e-308",
+                           "4.9e-324", "2.4703282292062327e-324", "1e-400", "123456789012345678901234567890",
+                           "0.000000000000000000000000000000000000001", "1234567890123456789e-20", "12345678901234567890",
+                           "7.0e-10", "1e22", "1e23", "8.98846567431158e307", "5e-324", "inf", "-Infinity", "nan", "infinit",
+                           "1.2.3", "1e5e5", "", "-", ".", "e5", "abc", "1x"};
+  for (size_t i=0; i<sizeof(numbers)/sizeof(numbers[0]); ++i) {
+    test_parse_same_as_strtod(numbers[i]);
+  }
+
+  // Round trip random doubles and random digit sequences
+  unsigned long long state = 88172645463325252ULL;
+  char buffer[512];
+  for (int i=0; i<20000; ++i) {
+    unsigned long long bits = nextRandom(state);
+    double value;
+    std::memcpy(&value, &bits, sizeof(double));
+    const char* formats[] = {"%.17g", "%.15g", "%.6e", "%.3f"};
+    for (size_t f=0; f<4; ++f) {
+      std::sprintf(buffer, formats[f], value);
+      test_parse_same_as_strtod(buffer);
+    }
+
+    std::string digits;
+    const int numDigits = 1 + int(nextRandom(state) % 30);
+    for (int d=0; d<numDigits; ++d) {
+      digits.push_back(char('0' + nextRandom(state) % 10));
+    }
+    digits.insert(nextRandom(state) % (digits.size()+1), 1, '.');
+    std::sprintf(buffer, "e%d", int(nextRandom(state) % 700) - 350);
+    test_parse_same_as_strtod(digits+buffer);
+  }
+}
+
+TEST_CASE("Number Parsing Locale Independence") {
+  numhop::VariableStorage vs;
+  const char* locales[] = {"de_DE.UTF-8", "de_DE.utf8", "de_DE", "German_Germany", "sv_SE.UTF-8"};
+  bool localeChanged = false;
+  for (size_t i=0; i<sizeof(locales)/sizeof(locales[0]) && !localeChanged; ++i) {
+    localeChanged = (std::setlocale(LC_NUMERIC, locales[i]) != 0);
+  }
+  if (!localeChanged) {
+    WARN("No locale with , decimal separator available, testing in the C locale only");
+  }
+
+  test_allok("1.5+1", 2.5, vs);
+  test_allok("1.25e1*2", 25, vs);
+  // Long literals use the slow path
+  double value;
+  const std::string number = "0.1000000000000000055511151231257827021181583404541015625000001";
+  numhop::parseDecimalNumber(number.data(), number.data()+number.size(), value);
+  REQUIRE(value == 0.1);
+
+  std::setlocale(LC_NUMERIC, "C");
+}
+
+TEST_CASE("Number Parsing Benchmark", "[.benchmark]") {
+  std::vector<std::string> numbers;
+  unsigned long long state = 2463534242ULL;
+  char buffer[512];
+  for (int i=0; i<1000000; ++i) {
+    const int type = int(nextRandom(state) % 3);
+    if (type == 0) {
+      std::sprintf(buffer, "%d", int(nextRandom(state) % 100000));
+    } else if (type == 1) {
+      std::sprintf(buffer, "%.4f", double(nextRandom(state) % 1000000)/1000.);
+    } else {
+      std::sprintf(buffer, "%.17g", double(nextRandom(state) >> 11)*1e-10);
+    }
+    numbers.push_back(buffer);
+  }
+
+  double sumStrtod=0, sumNumhop=0, value;
+  std::clock_t start = std::clock();
+  for (size_t i=0; i<numbers.size(); ++i) {
+    sumStrtod += strtod(numbers[i].c_str(), 0);
+  }
+  const double strtodTime = double(std::clock()-start)/CLOCKS_PER_SEC;
+  start = std::clock();
+  for (size_t i=0; i<numbers.size(); ++i) {
+    numhop::parseDecimalNumber(numbers[i].data(), numbers[i].data()+numbers[i].size(), value);
+    sumNumhop += value;
+  }
+  const double numhopTime = double(std::clock()-start)/CLOCKS_PER_SEC;
+  REQUIRE(sumStrtod == sumNumhop);
+  WARN("Parsed " << numbers.size() << " numbers, strtod: " << strtodTime << " s, parseDecimalNumber: " << numhopTime << " s");
+}
+
 TEST_CASE("Boolean Expressions") {
   numhop::VariableStorage vs;
 
@@ -421,6 +921,1695 @@ TEST_CASE("Math functions") {
 
 }
 
+TEST_CASE("Conditional Expressions") {
+  numhop::VariableStorage vs;
+
+  test_allok("if(1, 2, 3)", 2, vs);
+  test_allok("if(0, 2, 3)", 3, vs);
+  test_allok("x=2.5; if(x>2, x*2, x/2)", 5, vs);
+  test_allok("x=1.5; if(x>2, x*2, x/2)", 0.75, vs);
+  test_allok("x=3.6; if(x>2&x<3, 1, if(x>3&x<4, 2, 0))", 2, vs);
+  test_allok("x=1; 1+if(x<2, max(x,4), min(x,(2)))*2", 9, vs);
+
+  // Only the taken branch may be evaluated
+  test_allok("x=-1; y=if(x>0, log(x), 0); y", 0, vs);
+  test_allok("if(1, a=2, b=3)", 2, vs);
+  REQUIRE(vs.hasVariableName("a") == true);
+  REQUIRE(vs.hasVariableName("b") == false);
+
+  // All branches are included when extracting named values
+  std::list<std::string> expectedNamedValues;
+  expectedNamedValues.push_back("y");
+  expectedNamedValues.push_back("c");
+  expectedNamedValues.push_back("t");
+  expectedNamedValues.push_back("f");
+  test_extract_variablenames("y = if(c, t, f*2)", vs, expectedNamedValues, std::list<std::string>(1, "y"));
+
+  numhop::Expression e;
+  REQUIRE(numhop::interpretExpressionStringRecursive("y=if(c>1,t,f*2)", e) == true);
+  REQUIRE(e.print() == "y=if(c>1,t,f*2)");
+
+  test_interpret_fail("if(1,2)");
+  test_interpret_fail("if(1,2,3,4)");
+}
+
+std::string randomExpression(unsigned long long &rState, int depth)
+{
+  const char* leafs[] = {"x", "y", "dog", "2.5", "0.5", "(-3)", "1e-3", "7"};
+  const char* operators[] = {"+", "-", "*", "/", "^", "<", ">", "|", "&"};
+  const char* functions[] = {"cos", "sin", "exp", "abs", "floor", "sqrt"};
+  unsigned long long r = nextRandom(rState);
+  if (depth <= 0 || r%5 == 0)
+  {
+    return leafs[(r>>8)%8];
+  }
+  switch ((r>>8)%5)
+  {
+  case 0:
+    return std::string(functions[(r>>16)%6]) + "(" + randomExpression(rState, depth-1) + ")";
+  case 1:
+    return "if(" + randomExpression(rState, depth-1) + "," + randomExpression(rState, depth-1) + "," + randomExpression(rState, depth-1) + ")";
+  case 2:
+    return "max(" + randomExpression(rState, depth-1) + "," + randomExpression(rState, depth-1) + ")";
+  default:
+    return "(" + randomExpression(rState, depth-1) + operators[(r>>16)%9] + randomExpression(rState, depth-1) + ")";
+  }
+}
+
+bool sameResult(double a, double b)
+{
+  if (a != a && b != b)
+  {
+    return true;
+  }
+  return std::memcmp(&a, &b, sizeof(double)) == 0;
+}
+
+void test_jit_same_as_interpreter(const std::string &exprString, numhop::VariableStorage &rVariableStorage, bool reduceStrength=false)
+{
+  INFO("Full expression: " << exprString);
+  numhop::Expression e;
+  REQUIRE(numhop::interpretExpressionStringRecursive(exprString, e) == true);
+  if (reduceStrength) {
+    e.reduceStrength(true);
+  }
+
+  numhop::JitExpression jit;
+  bool compiled = jit.compile(e, rVariableStorage);
+  if (numhop::JitExpression::isSupported())
+  {
+    REQUIRE(compiled == true);
+  }
+  REQUIRE(jit.isCompiled() == compiled);
+
+  numhop::PreparedExpression prepared;
+  REQUIRE(prepared.prepare(e, rVariableStorage) == true);
+
+  numhop::VariableStorage interpretedStorage = rVariableStorage;
+  bool interpretedOK, jitOK, preparedOK;
+  double interpreted = e.evaluate(interpretedStorage, interpretedOK);
+  double native = jit.evaluate(rVariableStorage, jitOK);
+  REQUIRE(interpretedOK == true);
+  REQUIRE(jitOK == true);
+  REQUIRE(sameResult(interpreted, native));
+  if (reduceStrength) {
+    // Prepared expressions do not use the reductions
+    return;
+  }
+  REQUIRE(sameResult(interpreted, prepared.evaluate(preparedOK)));
+  REQUIRE(preparedOK == true);
+
+  // Preparing directly from the string must give the same program result
+  REQUIRE(prepared.prepare(exprString, rVariableStorage) == true);
+  REQUIRE(sameResult(interpreted, prepared.evaluate(preparedOK)));
+  REQUIRE(preparedOK == true);
+}
+
+TEST_CASE("JIT Compilation") {
+  numhop::VariableStorage vs;
+  ApplicationVariables av;
+  av.addVariable("dog", 4);
+  vs.setExternalStorage(&av);
+  bool ok;
+  vs.setVariable("x", 0.3, ok);
+  vs.setVariable("y", -1.7, ok);
+
+  test_jit_same_as_interpreter("1-(-2-3-(-dog-5.1))", vs);
+  test_jit_same_as_interpreter("x<y | y<x & 1", vs);
+  test_jit_same_as_interpreter("2^0.5*atan2(x,y)/3", vs);
+  test_jit_same_as_interpreter("if(x>0.2, log(x), 1/0)", vs);
+  test_jit_same_as_interpreter("-x-y*(-dog)", vs);
+
+  // Powers and divisions reduced by reduceStrength() are compiled to the reduced form
+  const char *reduced[] = {"x^3", "x^5", "x/3", "y^(-2)", "x^(-7)/dog", "pow(y, 6)*x", "x^0.5", "x^(-0.5)", "x^0+x^1-y/0.1", "(x+y)^(-3)/7"};
+  const double specialValues[] = {0., -0., 1e-200, 1e200, HUGE_VAL, -HUGE_VAL, std::numeric_limits<double>::quiet_NaN()};
+  unsigned long long reducedState = 2463534242ULL;
+  for (int i=0; i<50+int(sizeof(specialValues)/sizeof(specialValues[0])); ++i) {
+    const double x = (i < 50) ? double(int(nextRandom(reducedState)%20001)-10000)/997. : specialValues[i-50];
+    vs.setVariable("x", x, ok);
+    vs.setVariable("y", -x/3, ok);
+    for (size_t j=0; j<sizeof(reduced)/sizeof(reduced[0]); ++j) {
+      test_jit_same_as_interpreter(reduced[j], vs, true);
+    }
+  }
+  vs.setVariable("x", 0.3, ok);
+  vs.setVariable("y", -1.7, ok);
+
+  // Assignment, variables are bound to their storage
+  numhop::Expression e;
+  REQUIRE(numhop::interpretExpressionStringRecursive("z = dog*x + 1", e) == true);
+  numhop::JitExpression jit;
+  bool compiled = jit.compile(e, vs);
+  vs.setVariable("x", 2, ok);
+  REQUIRE(jit.evaluate(vs, ok) == Approx(9));
+  REQUIRE(ok == true);
+  REQUIRE(vs.value("z", ok) == Approx(9));
+  av["dog"] = 10;
+  REQUIRE(jit.evaluate(vs, ok) == Approx(21));
+  REQUIRE(jit.isCompiled() == compiled);
+  REQUIRE(numhop::interpretExpressionStringRecursive("dog = -x", e) == true);
+  jit.compile(e, vs);
+  jit.evaluate(vs, ok);
+  REQUIRE(av["dog"] == Approx(-2));
+
+  // Undefined variables can not be bound, the interpreter reports the error
+  REQUIRE(numhop::interpretExpressionStringRecursive("undefined*2", e) == true);
+  REQUIRE(jit.compile(e, vs) == false);
+  jit.evaluate(vs, ok);
+  REQUIRE(ok == false);
+
+  // Random expressions must give bit identical results
+  unsigned long long state = 88172645463325252ULL;
+  for (int i=0; i<2000; ++i)
+  {
+    vs.setVariable("x", double(int(nextRandom(state)%2001)-1000)/100., ok);
+    vs.setVariable("y", double(int(nextRandom(state)%2001)-1000)/100., ok);
+    av["dog"] = double(int(nextRandom(state)%21)-10);
+    test_jit_same_as_interpreter(randomExpression(state, 5), vs);
+  }
+}
+
+TEST_CASE("C Code Generation") {
+  numhop::Expression e;
+  REQUIRE(numhop::interpretExpressionStringRecursive("y = 2^x - pi*z", e) == true);
+  numhop::CCodeEmitter emitter;
+  REQUIRE(emitter.reserveNamedValue("pi", 3.14159265358979323846) == true);
+  std::string code;
+  REQUIRE(emitter.emitFunction("eval", e, code) == true);
+  REQUIRE(code.find("double eval(const double *in, double *out)") == 0);
+  REQUIRE(code.find("pow(2.0, v0)") != std::string::npos);
+  REQUIRE(code.find("3.1415926535897931") != std::string::npos);
+  REQUIRE(emitter.inputNames().size() == 2);
+  REQUIRE(emitter.inputNames()[0] == "x");
+  REQUIRE(emitter.inputNames()[1] == "z");
+  REQUIRE(emitter.outputNames().size() == 1);
+  REQUIRE(emitter.outputNames()[0] == "y");
+
+  // Reserved values can not be assigned
+  REQUIRE(numhop::interpretExpressionStringRecursive("pi = 3", e) == true);
+  REQUIRE(emitter.emitFunction("eval", e, code) == false);
+
+  // The functions generated from test/codegen/scripts.txt must give bit identical results
+  unsigned long long state = 88172645463325252ULL;
+  const size_t numScripts = sizeof(gGeneratedScripts)/sizeof(gGeneratedScripts[0]);
+  for (size_t s=0; s<numScripts; ++s)
+  {
+    const GeneratedScript &generated = gGeneratedScripts[s];
+    INFO("Script: " << generated.script);
+    numhop::Script script;
+    REQUIRE(script.interpret(generated.script, '#') == true);
+    for (int i=0; i<100; ++i)
+    {
+      numhop::VariableStorage vs;
+      vs.reserveNamedValue("pi", 3.14159265358979323846);
+      double in[16], out[16];
+      bool ok;
+      for (size_t j=0; generated.inputNames[j]; ++j)
+      {
+        in[j] = double(int(nextRandom(state)%2001)-1000)/100.;
+        vs.setVariable(generated.inputNames[j], in[j], ok);
+      }
+      double interpreted = script.evaluate(vs, ok);
+      REQUIRE(ok == true);
+      REQUIRE(sameResult(interpreted, generated.function(in, out)));
+      for (size_t j=0; generated.outputNames[j]; ++j)
+      {
+        REQUIRE(sameResult(vs.value(generated.outputNames[j], ok), out[j]));
+      }
+    }
+  }
+}
+
+void test_gradient(const std::string &exprString, double x, double y, double expectedDx, double expectedDy)
+{
+  INFO("Full expression: " << exprString);
+  numhop::Expression e;
+  REQUIRE(numhop::interpretExpressionStringRecursive(exprString, e) == true);
+  std::vector<std::string> names;
+  names.push_back("x");
+  names.push_back("y");
+
+  numhop::VariableStorage vs;
+  bool ok;
+  vs.setVariable("x", x, ok);
+  vs.setVariable("y", y, ok);
+  const double value = e.evaluate(vs, ok);
+  REQUIRE(ok == true);
+
+  const numhop::DifferentiationModeT modes[] = {numhop::ForwardMode, numhop::ReverseMode};
+  for (int m=0; m<2; ++m)
+  {
+    vs.setVariable("x", x, ok);
+    vs.setVariable("y", y, ok);
+    std::vector<double> gradient;
+    REQUIRE(sameResult(numhop::evaluateWithGradient(e, vs, names, gradient, ok, modes[m]), value));
+    REQUIRE(ok == true);
+    REQUIRE(gradient.size() == 2);
+    CHECK(gradient[0] == Approx(expectedDx));
+    CHECK(gradient[1] == Approx(expectedDy));
+
+    // Compare with central finite differences
+    const double h = 1e-6;
+    double fd[2];
+    for (int v=0; v<2; ++v)
+    {
+      vs.setVariable("x", x+(v==0 ? h : 0), ok);
+      vs.setVariable("y", y+(v==1 ? h : 0), ok);
+      const double fp = e.evaluate(vs, ok);
+      vs.setVariable("x", x-(v==0 ? h : 0), ok);
+      vs.setVariable("y", y-(v==1 ? h : 0), ok);
+      const double fm = e.evaluate(vs, ok);
+      fd[v] = (fp-fm)/(2*h);
+    }
+    CHECK(gradient[0] == Approx(fd[0]).epsilon(1e-5).margin(1e-6));
+    CHECK(gradient[1] == Approx(fd[1]).epsilon(1e-5).margin(1e-6));
+  }
+}
+
+TEST_CASE("Automatic Differentiation") {
+  const double x = 0.3, y = 1.7;
+  test_gradient("x+y-2*x", x, y, -1, 1);
+  test_gradient("x*y/(x+1)", x, y, y/((x+1)*(x+1)), x/(x+1));
+  test_gradient("-x^3*y", x, y, -3*x*x*y, -x*x*x);
+  test_gradient("y^x", x, y, std::pow(y,x)*std::log(y), x*std::pow(y,x-1));
+  test_gradient("(x<y)+(x>y)+(x|y)+(x&y)+x", x, y, 1, 0);
+  test_gradient("if(x<y, x*y, x+y)", x, y, y, x);
+  test_gradient("if(x>y, x*y, x+y)", x, y, 1, 1);
+  test_gradient("cos(x)+sin(y)+tan(x)", x, y, -std::sin(x)+1/(std::cos(x)*std::cos(x)), std::cos(y));
+  test_gradient("acos(x)+asin(x)*atan(y)", x, y, -1/std::sqrt(1-x*x)+std::atan(y)/std::sqrt(1-x*x), std::asin(x)/(1+y*y));
+  test_gradient("cosh(x)+sinh(y)+tanh(x*y)", x, y, std::sinh(x)+y*(1-std::pow(std::tanh(x*y),2)), std::cosh(y)+x*(1-std::pow(std::tanh(x*y),2)));
+  test_gradient("exp(x)*log(y)+log10(y)+sqrt(y)", x, y, std::exp(x)*std::log(y), std::exp(x)/y+1/(y*std::log(10.))+0.5/std::sqrt(y));
+  test_gradient("ceil(x)+floor(y)+abs(x-y)", x, y, -1, 1);
+  test_gradient("atan2(x,y)+pow(y,x)", x, y, y/(x*x+y*y)+std::pow(y,x)*std::log(y), -x/(x*x+y*y)+x*std::pow(y,x-1));
+  test_gradient("fmod(y,x)+min(x,y)+max(x,y)*2", x, y, -5+1, 1+2);
+
+  // Variables that are not selected are constants, unselected gradients are zero
+  numhop::Script script;
+  REQUIRE(script.interpret("a = x*z\nb = a^2+y; b*3", '#') == true);
+  numhop::VariableStorage vs;
+  bool ok;
+  vs.setVariable("x", 2, ok);
+  vs.setVariable("y", 1, ok);
+  vs.setVariable("z", 5, ok);
+  std::vector<std::string> names;
+  names.push_back("z");
+  names.push_back("x");
+  names.push_back("w");
+  std::vector<double> forward, reverse;
+  REQUIRE(numhop::evaluateWithGradient(script, vs, names, forward, ok, numhop::ForwardMode) == Approx(303));
+  REQUIRE(ok == true);
+  REQUIRE(numhop::evaluateWithGradient(script, vs, names, reverse, ok, numhop::ReverseMode) == Approx(303));
+  REQUIRE(ok == true);
+  REQUIRE(forward.size() == 3);
+  REQUIRE(forward[0] == Approx(6*10*2));
+  REQUIRE(forward[1] == Approx(6*10*5));
+  REQUIRE(forward[2] == 0);
+  REQUIRE(forward == reverse);
+  REQUIRE(vs.value("b", ok) == Approx(101));
+
+  // Undefined variables fail like the interpreter
+  numhop::Expression e;
+  REQUIRE(numhop::interpretExpressionStringRecursive("undefined*x", e) == true);
+  numhop::evaluateWithGradient(e, vs, names, forward, ok);
+  REQUIRE(ok == false);
+}
+
+double test_reduced(const std::string &exprString, double x, bool allowRoundingChanges)
+{
+  INFO("Full expression: " << exprString);
+  numhop::Expression e;
+  REQUIRE(numhop::interpretExpressionStringRecursive(exprString, e) == true);
+  e.reduceStrength(allowRoundingChanges);
+  REQUIRE(e.print() == exprString);
+  numhop::VariableStorage vs;
+  bool ok;
+  vs.setVariable("x", x, ok);
+  double value = e.evaluate(vs, ok);
+  REQUIRE(ok == true);
+  return value;
+}
+
+TEST_CASE("Strength Reduction") {
+  unsigned long long state = 88172645463325252ULL;
+  for (int i=0; i<10000; ++i)
+  {
+    double x = double(int64_t(nextRandom(state)))/double(nextRandom(state)%100000+1);
+    REQUIRE(sameResult(test_reduced("x^0", x, false), 1.));
+    REQUIRE(sameResult(test_reduced("x^1", x, false), x));
+    REQUIRE(sameResult(test_reduced("x^2", x, false), x*x));
+    REQUIRE(sameResult(test_reduced("x^(-1)", x, false), 1./x));
+    REQUIRE(sameResult(test_reduced("x^0.5", x, false), std::sqrt(x)));
+    REQUIRE(sameResult(test_reduced("pow(x,2)", x, false), x*x));
+    REQUIRE(sameResult(test_reduced("pow(x,1-2)", x, false), 1./x));
+    REQUIRE(sameResult(test_reduced("2+x/4", x, false), 2.+x/4.));
+    REQUIRE(sameResult(test_reduced("x/(2*4)/0.5", x, false), x/8./0.5));
+
+    // Rewrites that change rounding are opt-in
+    REQUIRE(sameResult(test_reduced("x^3", x, false), std::pow(x, 3.)));
+    REQUIRE(sameResult(test_reduced("x/3", x, false), x/3.));
+    REQUIRE(sameResult(test_reduced("x^3", x, true), x*(x*x)));
+    REQUIRE(sameResult(test_reduced("pow(x,-5)", x, true), 1./(x*((x*x)*(x*x)))));
+    REQUIRE(sameResult(test_reduced("x^(-0.5)", x, true), 1./std::sqrt(x)));
+    REQUIRE(sameResult(test_reduced("x/3", x, true), x*(1./3.)));
+    REQUIRE(test_reduced("x^7", x, true) == Approx(std::pow(x, 7.)));
+  }
+
+  // Special values are handled like pow()
+  const double specials[] = {0., -0., HUGE_VAL, -HUGE_VAL, -1.};
+  for (size_t i=0; i<sizeof(specials)/sizeof(specials[0]); ++i)
+  {
+    const double x = specials[i];
+    REQUIRE(sameResult(test_reduced("x^0.5", x, false), std::pow(x, 0.5)));
+    REQUIRE(sameResult(test_reduced("x^(-0.5)", x, true), std::pow(x, -0.5)));
+    REQUIRE(sameResult(test_reduced("x^2", x, false), std::pow(x, 2.)));
+    REQUIRE(sameResult(test_reduced("x^(-1)", x, false), std::pow(x, -1.)));
+    REQUIRE(sameResult(test_reduced("x^(-4)", x, true), std::pow(x, -4.)));
+  }
+
+  // Non-constant exponents and divisors are not reduced, the base is still evaluated
+  REQUIRE(test_reduced("x^(x-1)", 3, false) == Approx(9));
+  REQUIRE(test_reduced("2/x", 4, true) == Approx(0.5));
+  numhop::Script script;
+  REQUIRE(script.interpret("y = (a=x)^2/2; y+a", '#') == true);
+  script.reduceStrength(true);
+  numhop::VariableStorage vs;
+  bool ok;
+  vs.setVariable("x", 3, ok);
+  REQUIRE(script.evaluate(vs, ok) == Approx(7.5));
+  REQUIRE(ok == true);
+}
+
+class CountingVariables : public numhop::ExternalVariableStorage
+{
+public:
+  CountingVariables() : numLookups(0), value(1.5) {}
+
+  double externalValue(std::string name, bool &rFound) const
+  {
+    rFound = (name == "ext");
+    if (rFound) {
+      ++numLookups;
+    }
+    return value;
+  }
+
+  bool setExternalValue(std::string name, double newValue)
+  {
+    if (name == "ext") {
+      value = newValue;
+      return true;
+    }
+    return false;
+  }
+
+  mutable int numLookups;
+  double value;
+};
+
+TEST_CASE("Common Subexpression Elimination") {
+  numhop::Expression e1, e2, e3;
+  REQUIRE(numhop::interpretExpressionStringRecursive("sqrt(x^2+y^2)", e1) == true);
+  REQUIRE(numhop::interpretExpressionStringRecursive("sqrt( (x^2) + y^2 )", e2) == true);
+  REQUIRE(numhop::interpretExpressionStringRecursive("sqrt(x^2-y^2)", e3) == true);
+  REQUIRE(e1.isStructurallyEqual(e2) == true);
+  REQUIRE(e1.structuralHash() == e2.structuralHash());
+  REQUIRE(e1.isStructurallyEqual(e3) == false);
+  REQUIRE(e1.structuralHash() != e3.structuralHash());
+  REQUIRE(e1.isPure() == true);
+  REQUIRE(numhop::interpretExpressionStringRecursive("y = sqrt(x)", e3) == true);
+  REQUIRE(e3.isPure() == false);
+
+  // Shared subexpressions are only evaluated once
+  numhop::Script script;
+  REQUIRE(script.interpret("a = sqrt(ext^2+y^2)*2\nb = 1+sqrt(ext^2+y^2)\nc = cos(sqrt(ext^2+y^2))\na+b+c", '#') == true);
+  numhop::VariableStorage vs;
+  CountingVariables counter;
+  vs.setExternalStorage(&counter);
+  bool ok;
+  vs.setVariable("y", 2, ok);
+  const double expected = script.evaluate(vs, ok);
+  REQUIRE(ok == true);
+  REQUIRE(counter.numLookups == 3);
+  REQUIRE(script.eliminateCommonSubexpressions() > 0);
+  counter.numLookups = 0;
+  REQUIRE(sameResult(script.evaluate(vs, ok), expected));
+  REQUIRE(ok == true);
+  REQUIRE(counter.numLookups == 1);
+
+  // Values are not kept between evaluations
+  counter.value = 3;
+  vs.setVariable("y", 4, ok);
+  REQUIRE(script.evaluate(vs, ok) == Approx(5*2+1+5+std::cos(5.)));
+
+  // Assignments invalidate shared subexpressions depending on the variable
+  REQUIRE(script.interpret("r1 = sqrt(x^2+y^2); x = x+1; r2 = sqrt(x^2+y^2)+(y*2); if(r1>4, y=0, 1); r3 = sqrt(x^2+y^2)+(y*2); r1+r2+r3", '#') == true);
+  REQUIRE(script.eliminateCommonSubexpressions() >= 2);
+  for (int i=0; i<2; ++i)
+  {
+    vs.setVariable("x", 3+i, ok);
+    vs.setVariable("y", 4, ok);
+    const double x0 = 3+i, x1 = x0+1, r1 = std::sqrt(x0*x0+16), r2 = std::sqrt(x1*x1+16)+8;
+    const double y = (r1 > 4) ? 0 : 4;
+    REQUIRE(script.evaluate(vs, ok) == Approx(r1+r2+std::sqrt(x1*x1+y*y)+y*2));
+    REQUIRE(ok == true);
+  }
+
+  // Random scripts with shared subexpressions must give bit identical results
+  unsigned long long state = 88172645463325252ULL;
+  for (int i=0; i<200; ++i)
+  {
+    std::string pool[4];
+    for (int p=0; p<4; ++p)
+    {
+      pool[p] = randomExpression(state, 3);
+    }
+    std::string source;
+    for (int st=0; st<6; ++st)
+    {
+      const unsigned long long r = nextRandom(state);
+      const char* variables[] = {"x", "y", "v"};
+      source += std::string(variables[r%3]) + " = (" + pool[(r>>8)%4] + ")*(" + pool[(r>>16)%4] + ")-(" + pool[(r>>24)%4] + ")\n";
+    }
+    source += "x+y+v";
+    numhop::Script plain, shared;
+    REQUIRE(plain.interpret(source, '#') == true);
+    REQUIRE(shared.interpret(source, '#') == true);
+    shared.eliminateCommonSubexpressions();
+    numhop::VariableStorage plainStorage, sharedStorage;
+    ApplicationVariables av1, av2;
+    av1.addVariable("dog", 3);
+    av2.addVariable("dog", 3);
+    plainStorage.setExternalStorage(&av1);
+    sharedStorage.setExternalStorage(&av2);
+    for (int k=0; k<3; ++k)
+    {
+      const char* variables[] = {"x", "y", "v"};
+      const double value = double(int(nextRandom(state)%2001)-1000)/100.;
+      plainStorage.setVariable(variables[k], value, ok);
+      sharedStorage.setVariable(variables[k], value, ok);
+    }
+    INFO("Script: " << source);
+    bool plainOK, sharedOK;
+    const double plainValue = plain.evaluate(plainStorage, plainOK);
+    REQUIRE(sameResult(shared.evaluate(sharedStorage, sharedOK), plainValue));
+    REQUIRE(sharedOK == plainOK);
+  }
+}
+
+TEST_CASE("Real-time Evaluation") {
+  numhop::VariableStorage vs;
+  ApplicationVariables av;
+  av.addVariable("dog", 4);
+  vs.setExternalStorage(&av);
+  bool ok;
+  vs.setVariable("x", 0.3, ok);
+  vs.setVariable("y", -1.7, ok);
+
+  numhop::Script script;
+  REQUIRE(script.interpret("z = dog*x + 1\nw = if(z>2, log(z), atan2(x,y)) - max(x,y)^2\ndog = -dog\nz*w + (x<y | y<x & 1)", '#') == true);
+  numhop::PreparedExpression prepared;
+  REQUIRE(prepared.prepare(script, vs) == true);
+  REQUIRE(prepared.isPrepared() == true);
+
+  numhop::VariableStorage interpretedStorage = vs;
+  ApplicationVariables interpretedAv;
+  interpretedAv.addVariable("dog", 4);
+  interpretedStorage.setExternalStorage(&interpretedAv);
+  for (int i=0; i<4; ++i)
+  {
+    bool interpretedOK;
+    const double interpreted = script.evaluate(interpretedStorage, interpretedOK);
+    REQUIRE(sameResult(prepared.evaluate(ok), interpreted));
+    REQUIRE(ok == true);
+    REQUIRE(sameResult(vs.value("w", ok), interpretedStorage.value("w", ok)));
+    REQUIRE(av["dog"] == interpretedAv["dog"]);
+  }
+
+  // No allocations during a million evaluations
+  numhop::Expression e;
+  REQUIRE(numhop::interpretExpressionStringRecursive("y = if(x>0.5, sin(x)*dog, cos(x)/dog) + pow(x,2) - (x<1)", e) == true);
+  REQUIRE(prepared.prepare(e, vs) == true);
+  double sum = 0;
+  const size_t numAllocationsBefore = gNumAllocations;
+  for (int i=0; i<1000000; ++i)
+  {
+    vs.setVariable("x", double(i%1000)/1000., ok);
+    sum += prepared.evaluate(ok);
+  }
+  REQUIRE(gNumAllocations == numAllocationsBefore);
+  REQUIRE(sum != 0);
+
+  // Undefined variables and reserved names fail when preparing
+  vs.reserveNamedValue("pi", 3.14);
+  REQUIRE(numhop::interpretExpressionStringRecursive("undefined*2", e) == true);
+  REQUIRE(prepared.prepare(e, vs) == false);
+  REQUIRE(numhop::interpretExpressionStringRecursive("pi = 3", e) == true);
+  REQUIRE(prepared.prepare(e, vs) == false);
+  prepared.evaluate(ok);
+  REQUIRE(ok == false);
+}
+
+double twice(double x)
+{
+  return 2*x;
+}
+
+double hypotenuse(double a, double b)
+{
+  return std::sqrt(a*a+b*b);
+}
+
+double countedClamp(const double *pArgs, size_t numArgs, void *pContext)
+{
+  ++*static_cast<int*>(pContext);
+  REQUIRE(numArgs == 3);
+  return std::min(std::max(pArgs[0], pArgs[1]), pArgs[2]);
+}
+
+class WeightedSum : public numhop::NativeFunction
+{
+public:
+  double call(const double *pArgs, size_t numArgs)
+  {
+    double sum = 0;
+    for (size_t i=0; i<numArgs; ++i) {
+      sum += double(i+1)*pArgs[i];
+    }
+    return sum;
+  }
+};
+
+TEST_CASE("Function Registration") {
+  numhop::VariableStorage vs;
+  bool ok;
+  vs.setVariable("x", 3, ok);
+  vs.setVariable("y", 4, ok);
+
+  int numCalls = 0;
+  WeightedSum weightedSum;
+  REQUIRE(numhop::registerFunction("twice", &twice) >= 0);
+  REQUIRE(numhop::registerFunction("hyp", &hypotenuse) >= 0);
+  REQUIRE(numhop::registerFunction("clamp", 3, &countedClamp, &numCalls) >= 0);
+  REQUIRE(numhop::registerFunction("wsum4", 4, &weightedSum) >= 0);
+
+  test_allok("twice(x)+hyp(x,y)", 11, vs);
+  test_allok("clamp(x*10, 0, y+1)", 5, vs);
+  REQUIRE(numCalls > 0);
+  test_allok("wsum4(1, x, clamp(0,1,2), twice(y))", 1+6+3+32, vs);
+  test_interpret_fail("clamp(1,2)");
+  test_interpret_fail("wsum4(1,2,3,4,5)");
+
+  // Invalid names and number of arguments
+  REQUIRE(numhop::registerFunction("if", 3, &countedClamp) == -1);
+  REQUIRE(numhop::registerFunction("2x", &twice) == -1);
+  REQUIRE(numhop::registerFunction("a_b", &twice) == -1);
+  REQUIRE(numhop::registerFunction("none", 0, &countedClamp) == -1);
+  REQUIRE(numhop::registerFunction("many", numhop::maxFunctionArguments+1, &weightedSum) == -1);
+
+  // Built-in functions can not be replaced, rewrites and compilers recognize them by name
+  REQUIRE(numhop::registerFunction("pow", &hypotenuse) == -1);
+  REQUIRE(numhop::registerFunction("sin", &twice) == -1);
+  REQUIRE(numhop::registerFunction("sum", 3, &countedClamp) == -1);
+  test_allok("pow(x,2)+sin(0)", 9, vs);
+
+  // Each name is listed once
+  std::vector<std::string> names = numhop::getRegisteredFunctionNames();
+  REQUIRE(std::count(names.begin(), names.end(), "clamp") == 1);
+  REQUIRE(std::count(names.begin(), names.end(), "min") == 1);
+
+  // User functions may have side effects, they are not shared
+  numhop::Script script;
+  REQUIRE(script.interpret("a = clamp(x,0,1) + clamp(x,0,1)", '#') == true);
+  script.eliminateCommonSubexpressions();
+  numCalls = 0;
+  script.evaluate(vs, ok);
+  REQUIRE(numCalls == 2);
+
+  // Single and two argument functions can be compiled
+  test_jit_same_as_interpreter("twice(x)-hyp(y,x)*2", vs);
+
+  // Registering again replaces the function, also in interpreted expressions
+  numhop::Expression e;
+  REQUIRE(numhop::interpretExpressionStringRecursive("twice(y)", e) == true);
+  REQUIRE(numhop::registerFunction("twice", static_cast<numhop::OneArgFunctionT>(&std::sqrt)) == numhop::getFunctionId("twice", 1));
+  REQUIRE(e.evaluate(vs, ok) == 2);
+
+  // The same name can be used with another number of arguments
+  REQUIRE(numhop::registerFunction("twice", &hypotenuse) >= 0);
+  test_allok("twice(x,y)+twice(y)", 7, vs);
+  numhop::registerFunction("twice", &twice);
+}
+
+TEST_CASE("Array Variables") {
+  numhop::VariableStorage vs;
+  ApplicationVariables av;
+  vs.setExternalStorage(&av);
+  bool ok, external;
+  const size_t n = 3000;
+  std::vector<double> p(n), q(n), values;
+  unsigned long long state = 88172645463325252ULL;
+  for (size_t i=0; i<n; ++i) {
+    p[i] = double(int(nextRandom(state)%2001)-1000)/1000.;
+    q[i] = double(int(nextRandom(state)%2001))/100.;
+  }
+  REQUIRE(vs.setArray("p", p, external) == true);
+  REQUIRE(external == false);
+  av.mArrays["q"] = q;
+  vs.setVariable("x", 0.3, ok);
+
+  // Every element gives the same result as scalar evaluation
+  numhop::Expression e;
+  const char* elementWise[] = {"sin(p)*2 + x", "if(p>0.5, p, -q)", "(p^2) < x | q > 10", "max(p, x)/atan2(q, p)", "-p-(q*x)"};
+  for (size_t k=0; k<sizeof(elementWise)/sizeof(elementWise[0]); ++k) {
+    INFO("Full expression: " << elementWise[k]);
+    REQUIRE(numhop::interpretExpressionStringRecursive(elementWise[k], e) == true);
+    numhop::evaluateElementWise(e, vs, values, ok);
+    REQUIRE(ok == true);
+    REQUIRE(values.size() == n);
+    numhop::VariableStorage scalarStorage;
+    scalarStorage.setVariable("x", 0.3, ok);
+    for (size_t i=0; i<n; ++i) {
+      scalarStorage.setVariable("p", p[i], ok);
+      scalarStorage.setVariable("q", q[i], ok);
+      REQUIRE(sameResult(values[i], e.evaluate(scalarStorage, ok)));
+    }
+  }
+
+  // Reductions
+  double sum = 0, minimum = p[0], maximum = p[0];
+  for (size_t i=0; i<n; ++i) {
+    sum += p[i]*q[i];
+    minimum = std::min(minimum, p[i]);
+    maximum = std::max(maximum, p[i]);
+  }
+  REQUIRE(numhop::interpretExpressionStringRecursive("p_mean = mean(p*q)/1e5", e) == true);
+  numhop::evaluateElementWise(e, vs, values, ok);
+  REQUIRE(ok == true);
+  REQUIRE(values.size() == 1);
+  REQUIRE(values[0] == Approx(sum/n/1e5));
+  REQUIRE(vs.value("p_mean", ok) == values[0]);
+  REQUIRE(numhop::interpretExpressionStringRecursive("min(p) + 10*max(p) + sum(p*q) - sum(3)", e) == true);
+  numhop::evaluateElementWise(e, vs, values, ok);
+  REQUIRE(values[0] == Approx(minimum + 10*maximum + sum - 3));
+
+  // Reductions of scalars are the scalars themselves
+  REQUIRE(numhop::interpretExpressionStringRecursive("sum(x)+mean(2)+min(x)+max(x,1)", e) == true);
+  REQUIRE(e.evaluate(vs, ok) == Approx(0.3+2+0.3+1));
+
+  // Assigned arrays, in scripts
+  numhop::Script script;
+  REQUIRE(script.interpret("pq = p*q\n centered = pq - mean(pq)\n q = q*2\n sum(centered)", '#') == true);
+  numhop::evaluateElementWise(script, vs, values, ok);
+  REQUIRE(ok == true);
+  REQUIRE(std::fabs(values[0]) < 1e-9);
+  size_t size;
+  const double *pCentered = vs.array("centered", size);
+  REQUIRE(pCentered != 0);
+  REQUIRE(size == n);
+  REQUIRE(pCentered[7] == Approx(p[7]*q[7] - sum/n));
+  REQUIRE(av.mArrays["q"][7] == 2*q[7]);
+  REQUIRE(vs.value("pq", ok) == 0);
+  REQUIRE(ok == false);
+
+  // Scalars and arrays with the same name replace each other
+  REQUIRE(numhop::interpretExpressionStringRecursive("pq = mean(pq)", e) == true);
+  numhop::evaluateElementWise(e, vs, values, ok);
+  REQUIRE(vs.value("pq", ok) == Approx(sum/n));
+  REQUIRE(vs.array("pq", size) == 0);
+
+  // Arrays of different size can not be combined
+  REQUIRE(vs.setArray("short", std::vector<double>(10, 1.), external) == true);
+  REQUIRE(numhop::interpretExpressionStringRecursive("p+short", e) == true);
+  numhop::evaluateElementWise(e, vs, values, ok);
+  REQUIRE(ok == false);
+  REQUIRE(numhop::interpretExpressionStringRecursive("mean(p)+short", e) == true);
+  numhop::evaluateElementWise(e, vs, values, ok);
+  REQUIRE(ok == true);
+  REQUIRE(values.size() == 10);
+
+  // Scalar subexpressions, and the assignments in them, are evaluated once per statement
+  vs.setVariable("k", 0, ok);
+  REQUIRE(numhop::interpretExpressionStringRecursive("z = p + (k = k + 1)", e) == true);
+  numhop::evaluateElementWise(e, vs, values, ok);
+  REQUIRE(ok == true);
+  REQUIRE(values.size() == n);
+  REQUIRE(vs.value("k", ok) == 1);
+  REQUIRE(values[0] == p[0]+1);
+  REQUIRE(values[n-1] == p[n-1]+1);
+  REQUIRE(numhop::interpretExpressionStringRecursive("sum(p*0 + (k = k + 1)) + k", e) == true);
+  numhop::evaluateElementWise(e, vs, values, ok);
+  REQUIRE(ok == true);
+  REQUIRE(vs.value("k", ok) == 2);
+  REQUIRE(values[0] == 2*n+2);
+
+  // Large signals are reduced in one call
+  std::vector<double> signal(10000000, 2e5);
+  REQUIRE(vs.setArray("p", signal, external) == true);
+  av.mArrays["q"] = std::vector<double>(signal.size(), 0.5);
+  REQUIRE(numhop::interpretExpressionStringRecursive("p_mean = mean(p*q)/1e5", e) == true);
+  numhop::evaluateElementWise(e, vs, values, ok);
+  REQUIRE(ok == true);
+  REQUIRE(vs.value("p_mean", ok) == 1);
+}
+
+class FloatApplicationVariables : public numhop::TypedExternalVariableStorage<float>
+{
+public:
+  float externalValue(const std::string &name, bool &rFound) const
+  {
+    rFound = (name == "f");
+    return rFound ? mValue : 0.f;
+  }
+
+  bool setExternalValue(const std::string &name, float value)
+  {
+    if (name == "f") {
+      mValue = value;
+      return true;
+    }
+    return false;
+  }
+
+  float mValue;
+};
+
+TEST_CASE("Typed Evaluation") {
+  numhop::Expression e;
+  bool ok;
+
+  // Double evaluation is identical to the expression tree evaluation
+  numhop::VariableStorage vs;
+  numhop::TypedVariableStorage<double> dvs;
+  numhop::TypedExpression<double> dexpr;
+  unsigned long long state = 88172645463325252ULL;
+  for (int i=0; i<2000; ++i)
+  {
+    const double x = double(int(nextRandom(state)%2001)-1000)/100.;
+    const double y = double(int(nextRandom(state)%2001)-1000)/100.;
+    const double dog = double(int(nextRandom(state)%21)-10);
+    vs.setVariable("x", x, ok); vs.setVariable("y", y, ok); vs.setVariable("dog", dog, ok);
+    dvs.setVariable("x", x, ok); dvs.setVariable("y", y, ok); dvs.setVariable("dog", dog, ok);
+    const std::string exprString = randomExpression(state, 5);
+    INFO("Full expression: " << exprString);
+    REQUIRE(numhop::interpretExpressionStringRecursive(exprString, e) == true);
+    REQUIRE(dexpr.prepare(e) == true);
+    bool typedOK;
+    const double interpreted = e.evaluate(vs, ok);
+    REQUIRE(sameResult(interpreted, dexpr.evaluate(dvs, typedOK)));
+    REQUIRE(typedOK == ok);
+  }
+
+  // Float evaluation uses float functions and constants
+  numhop::FloatVariableStorage fvs;
+  numhop::FloatExpression fexpr;
+  fvs.setVariable("x", 0.3f, ok);
+  REQUIRE(numhop::interpretExpressionStringRecursive("y = sin(x)*0.1 + max(x,2)^2", e) == true);
+  REQUIRE(fexpr.prepare(e) == true);
+  float fvalue = fexpr.evaluate(fvs, ok);
+  REQUIRE(ok == true);
+  REQUIRE(fvalue == std::sin(0.3f)*0.1f + std::pow(2.f, 2.f));
+  REQUIRE(fvs.value("y", ok) == fvalue);
+
+  // External float variables
+  FloatApplicationVariables fav;
+  fav.mValue = 1.5f;
+  fvs.setExternalStorage(&fav);
+  REQUIRE(numhop::interpretExpressionStringRecursive("f = f*2", e) == true);
+  REQUIRE(fexpr.prepare(e) == true);
+  fexpr.evaluate(fvs, ok);
+  REQUIRE(ok == true);
+  REQUIRE(fav.mValue == 3.f);
+
+  // Name validation and parent storage lookup, as in VariableStorage
+  numhop::FloatVariableStorage parent, child;
+  bool didSetExternally;
+  parent.reserveNamedValue("g", 9.81f);
+  parent.setVariable("p", 2.f, didSetExternally);
+  child.setParentStorage(&parent);
+  child.setDisallowedInternalNameCharacters(".");
+  REQUIRE(child.setVariable("a.b", 1.f, didSetExternally) == false);
+  REQUIRE(child.hasVariableName("a.b") == false);
+  REQUIRE(child.setVariable("g", 1.f, didSetExternally) == false);
+  REQUIRE(child.value("g", ok) == 9.81f);
+  REQUIRE(ok == true);
+  REQUIRE(numhop::interpretExpressionStringRecursive("q = p*g", e) == true);
+  REQUIRE(fexpr.prepare(e) == true);
+  REQUIRE(fexpr.evaluate(child, ok) == 2.f*9.81f);
+  REQUIRE(ok == true);
+  REQUIRE(child.value("q", ok) == 2.f*9.81f);
+  REQUIRE(parent.hasVariableName("q") == false);
+
+  // Long double keeps the full precision of constants in accumulations
+  numhop::Script script;
+  REQUIRE(script.interpret("s = 0\ns = s+0.1\ns = s+0.1\ns = s+0.1\ns-0.3", '#') == true);
+  numhop::LongDoubleVariableStorage lvs;
+  numhop::LongDoubleExpression lexpr;
+  REQUIRE(lexpr.prepare(script) == true);
+  long double lvalue = lexpr.evaluate(lvs, ok);
+  REQUIRE(ok == true);
+  REQUIRE(lvalue == 0.1L+0.1L+0.1L-0.3L);
+  REQUIRE(lvs.value("s", ok) == 0.1L+0.1L+0.1L);
+  lvs.reserveNamedValue("third", 1.L/3.L);
+  REQUIRE(numhop::interpretExpressionStringRecursive("exp(third)", e) == true);
+  REQUIRE(lexpr.prepare(e) == true);
+  REQUIRE(lexpr.evaluate(lvs, ok) == std::exp(1.L/3.L));
+
+  // Undefined variables fail when evaluating, invalid expressions when preparing
+  REQUIRE(numhop::interpretExpressionStringRecursive("undefined*2", e) == true);
+  REQUIRE(lexpr.prepare(e) == true);
+  lexpr.evaluate(lvs, ok);
+  REQUIRE(ok == false);
+  REQUIRE(numhop::interpretExpressionStringRecursive("flooor(6.7)", e) == false);
+  REQUIRE(lexpr.prepare(e) == false);
+  lexpr.evaluate(lvs, ok);
+  REQUIRE(ok == false);
+}
+
+std::string repeatString(const std::string &s, size_t n)
+{
+  std::string result;
+  result.reserve(s.size()*n);
+  for (size_t i=0; i<n; ++i) {
+    result += s;
+  }
+  return result;
+}
+
+// A mix of operators, functions and conditionals nested n times around x
+std::string mixedNesting(size_t n)
+{
+  const char *opening[] = {"1+(", "2*(", "sin(", "if(x>0, ", "x^(", "max(x, ", "-("};
+  const char *closing[] = {")", ")", ")", ", 0)", "-2)", ")", ")"};
+  std::string s;
+  for (size_t i=0; i<n; ++i) {
+    s += opening[i%7];
+  }
+  s += "x";
+  for (size_t i=n; i>0; --i) {
+    s += closing[(i-1)%7];
+  }
+  return s;
+}
+
+size_t treeDepth(const numhop::Expression &e)
+{
+  size_t depth = 0;
+  std::list<numhop::Expression>::const_iterator it;
+  for (it=e.leftChildExpressions().begin(); it!=e.leftChildExpressions().end(); ++it) {
+    depth = std::max(depth, treeDepth(*it));
+  }
+  for (it=e.rightChildExpressions().begin(); it!=e.rightChildExpressions().end(); ++it) {
+    depth = std::max(depth, treeDepth(*it));
+  }
+  return depth+1;
+}
+
+// Runs every pass over an expression tree, on a thread with a small stack, the results are checked afterwards
+struct TreePassesRun
+{
+  std::string script;
+  double value;
+  std::vector<int> failedPasses;
+};
+
+void* runTreePasses(void *pData)
+{
+  TreePassesRun &run = *static_cast<TreePassesRun*>(pData);
+  numhop::VariableStorage vs;
+  bool ok;
+  vs.setVariable("x", 0.5, ok);
+  std::vector<bool> passed;
+
+  numhop::Script script;
+  passed.push_back(script.interpret(run.script, '#'));
+  numhop::Expression e = script.statement(0).expression;
+  run.value = e.evaluate(vs, ok);
+  passed.push_back(ok && !e.print().empty());
+
+  std::vector<char> buffer;
+  script.save(buffer);
+  numhop::Script loaded;
+  passed.push_back(loaded.load(&buffer[0], buffer.size()) && loaded.evaluate(vs, ok) == run.value && ok);
+
+  numhop::Expression copy(e);
+  passed.push_back(copy.isStructurallyEqual(e) && copy.structuralHash() == e.structuralHash());
+  copy.reduceStrength(true);
+  copy.rewritePolynomials();
+  copy.reassociateChains(numhop::CompensatedChainT, 2);
+  passed.push_back(copy.evaluate(vs, ok) == Approx(run.value) && ok);
+  std::set<std::string> names;
+  e.extractNamedValues(names);
+  passed.push_back(!e.isPure() && !e.isConstant() && names.count("x") == 1);
+
+  numhop::Script eliminated;
+  eliminated.interpret(run.script, '#');
+  eliminated.eliminateCommonSubexpressions();
+  passed.push_back(eliminated.evaluate(vs, ok) == run.value && ok);
+  passed.push_back(script.requiredStatements(std::vector<std::string>(1, "y")).size() == 1);
+
+  numhop::TypedVariableStorage<double> typedStorage;
+  typedStorage.setVariable("x", 0.5, ok);
+  numhop::TypedExpression<double> typed;
+  passed.push_back(typed.prepare(e) && typed.evaluate(typedStorage, ok) == run.value && ok);
+  numhop::PreparedExpression prepared;
+  passed.push_back(prepared.prepare(e, vs) && prepared.evaluate(ok) == run.value && ok);
+  numhop::JitExpression jit;
+  passed.push_back(jit.compile(e, vs) == numhop::JitExpression::isSupported() &&
+                   (!numhop::JitExpression::isSupported() || (jit.evaluate(vs, ok) == Approx(run.value) && ok)));
+  numhop::CCodeEmitter emitter;
+  std::string code;
+  passed.push_back(emitter.emitFunction("deep", e, code));
+
+  std::vector<double> gradient;
+  passed.push_back(numhop::evaluateWithGradient(e, vs, std::vector<std::string>(1, "x"), gradient, ok) == Approx(run.value) && ok);
+  passed.push_back(numhop::evaluateWithGradient(e, vs, std::vector<std::string>(1, "x"), gradient, ok, numhop::ForwardMode) == Approx(run.value) && ok);
+  std::vector<double> values;
+  numhop::evaluateElementWise(e, vs, values, ok);
+  passed.push_back(ok && values.size() == 1 && values[0] == Approx(run.value));
+
+  for (size_t i=0; i<passed.size(); ++i) {
+    if (!passed[i]) {
+      run.failedPasses.push_back(int(i));
+    }
+  }
+  return 0;
+}
+
+TEST_CASE("Deep Nesting") {
+  numhop::VariableStorage vs;
+  bool ok;
+  vs.setVariable("x", 0.25, ok);
+  numhop::PreparedExpression prepared;
+  const size_t depth = 100000;
+
+  REQUIRE(prepared.prepare(repeatString("(", depth)+"x"+repeatString(")", depth), vs) == true);
+  REQUIRE(prepared.evaluate(ok) == 0.25);
+  REQUIRE(ok == true);
+
+  REQUIRE(prepared.prepare(repeatString("1+(", depth)+"x"+repeatString(")", depth), vs) == true);
+  REQUIRE(prepared.evaluate(ok) == Approx(depth+0.25));
+
+  REQUIRE(prepared.prepare(repeatString("-(", depth+1)+"x"+repeatString(")", depth+1), vs) == true);
+  REQUIRE(prepared.evaluate(ok) == -0.25);
+
+  REQUIRE(prepared.prepare(repeatString("sin(", depth)+"x"+repeatString(")", depth), vs) == true);
+  double expected = 0.25;
+  for (size_t i=0; i<depth; ++i) {
+    expected = std::sin(expected);
+  }
+  REQUIRE(prepared.evaluate(ok) == expected);
+
+  REQUIRE(prepared.prepare(repeatString("if(x<1, ", depth)+"x"+repeatString(", 0)", depth), vs) == true);
+  REQUIRE(prepared.evaluate(ok) == 0.25);
+  vs.setVariable("x", 2, ok);
+  REQUIRE(prepared.evaluate(ok) == 0);
+
+  REQUIRE(prepared.prepare("y = "+repeatString("(", depth)+"x"+repeatString("*2)", depth/1000), vs) == false);
+  REQUIRE(prepared.prepare("y = "+repeatString("(", depth/1000)+"x"+repeatString("*2)", depth/1000), vs) == true);
+  REQUIRE(prepared.evaluate(ok) == std::ldexp(2., int(depth/1000)));
+  REQUIRE(vs.value("y", ok) == std::ldexp(2., int(depth/1000)));
+
+  // Parsing time scales linearly with the nesting depth
+  clock_t start = std::clock();
+  REQUIRE(prepared.prepare(repeatString("1*(", depth/10)+"x"+repeatString(")", depth/10), vs) == true);
+  clock_t shallow = std::clock()-start;
+  start = std::clock();
+  REQUIRE(prepared.prepare(repeatString("1*(", depth)+"x"+repeatString(")", depth), vs) == true);
+  clock_t deep = std::clock()-start;
+  REQUIRE(deep < 50*(shallow+1));
+
+  // Syntax errors are reported
+  REQUIRE(prepared.prepare(repeatString("(", depth)+"x"+repeatString(")", depth-1), vs) == false);
+  REQUIRE(prepared.prepare(repeatString("(", depth-1)+"x"+repeatString(")", depth), vs) == false);
+  REQUIRE(prepared.prepare("2*-2", vs) == false);
+  REQUIRE(prepared.prepare("x^2^2", vs) == false);
+  REQUIRE(prepared.prepare("floor(6,7)", vs) == false);
+  REQUIRE(prepared.prepare("if(x,1)", vs) == false);
+  REQUIRE(prepared.prepare("1+", vs) == false);
+  REQUIRE(prepared.prepare("()", vs) == false);
+  REQUIRE(prepared.prepare("undefined", vs) == false);
+
+  // Expression trees are limited in depth, all passes over a tree at the limit fit in a 512 kB stack
+  numhop::Expression e;
+  size_t nesting = 0;
+  while (numhop::interpretExpressionStringRecursive("y = "+mixedNesting(nesting+1), e)) {
+    ++nesting;
+  }
+  REQUIRE(numhop::interpretExpressionStringRecursive("y = "+mixedNesting(nesting), e) == true);
+  REQUIRE(treeDepth(e) == numhop::maxExpressionTreeDepth);
+  REQUIRE(numhop::interpretExpressionStringRecursive(repeatString("1+(", numhop::maxExpressionTreeDepth)+"x"+repeatString(")", numhop::maxExpressionTreeDepth), e) == false);
+  numhop::Script script;
+  REQUIRE(script.interpret("y = "+mixedNesting(nesting+1)+"\ny*2\n", '#') == false);
+  // Prepared expressions are not limited
+  REQUIRE(prepared.prepare("y = "+mixedNesting(nesting+1), vs) == true);
+  prepared.evaluate(ok);
+  REQUIRE(ok == true);
+
+  TreePassesRun run;
+  run.script = "y = "+mixedNesting(nesting);
+#if defined(__unix__) || defined(__APPLE__)
+  pthread_attr_t attributes;
+  pthread_attr_init(&attributes);
+  pthread_attr_setstacksize(&attributes, 512*1024);
+  pthread_t thread;
+  REQUIRE(pthread_create(&thread, &attributes, runTreePasses, &run) == 0);
+  pthread_join(thread, 0);
+  pthread_attr_destroy(&attributes);
+#else
+  runTreePasses(&run);
+#endif
+  REQUIRE(run.failedPasses.empty());
+  REQUIRE(run.value == run.value);
+
+  // Deeper than 64 levels expression trees are evaluated on an explicit stack, with the same results as recursively
+  const size_t mixedDepth = 80;
+  const std::string mixedExprs[] = {repeatString("sin(", mixedDepth)+"x"+repeatString(")", mixedDepth),
+                                    repeatString("if(x>1, 1+", mixedDepth)+"x"+repeatString(", 0)", mixedDepth),
+                                    repeatString("max(x, 0.5*", mixedDepth)+"x"+repeatString(")", mixedDepth),
+                                    repeatString("x^2-x/4+(", mixedDepth)+"x"+repeatString(")/3", mixedDepth),
+                                    repeatString("x+x-1+(", mixedDepth)+"x"+repeatString(")", mixedDepth)};
+  for (size_t i=0; i<sizeof(mixedExprs)/sizeof(mixedExprs[0]); ++i) {
+    REQUIRE(numhop::interpretExpressionStringRecursive(mixedExprs[i], e) == true);
+    REQUIRE(prepared.prepare(mixedExprs[i], vs) == true);
+    REQUIRE(e.evaluate(vs, ok) == Approx(prepared.evaluate(ok)));
+    REQUIRE(ok == true);
+    e.reassociateChains(numhop::CompensatedChainT, 2);
+    REQUIRE(e.evaluate(vs, ok) == Approx(prepared.evaluate(ok)));
+    REQUIRE(ok == true);
+  }
+  REQUIRE(numhop::interpretExpressionStringRecursive(repeatString("1+(", mixedDepth)+"undefined"+repeatString(")", mixedDepth), e) == true);
+  e.evaluate(vs, ok);
+  REQUIRE(ok == false);
+}
+
+TEST_CASE("Script Functions") {
+  numhop::VariableStorage vs;
+  bool ok;
+  vs.setVariable("x", 2, ok);
+
+  // Definitions are inlined and not kept as statements
+  numhop::Script script;
+  REQUIRE(script.interpret("f(a, b) = a*b + 1\n"
+                           "g(t) = f(t,t) - 2  # uses f\n"
+                           "y = g(x+1)*f(2,x)\n"
+                           "y", '#') == true);
+  REQUIRE(script.numStatements() == 2);
+  REQUIRE(script.statement(0).lineNumber == 3);
+  REQUIRE(script.evaluate(vs, ok) == 8*5);
+  REQUIRE(ok == true);
+
+  // Same result as the hand written expression, operator precedence is kept
+  numhop::Expression e;
+  REQUIRE(numhop::interpretExpressionStringRecursive("(-x)^2 - 2*((x+1)^2)", e) == true);
+  REQUIRE(script.interpret("sq(p) = p^2\nsq(-x) - 2*sq(x+1)", '#') == true);
+  REQUIRE(script.evaluate(vs, ok) == e.evaluate(vs, ok));
+
+  // Script functions shadow built-in functions with the same number of arguments
+  REQUIRE(script.interpret("sin(a) = a*2\nsin(x) + cos(0) + max(x,sin(3))", '#') == true);
+  REQUIRE(script.evaluate(vs, ok) == 4+1+6);
+
+  // Variables used in a called function are not captured by the parameters of the caller
+  REQUIRE(script.interpret("g(y) = y+x\nf(x) = g(x*2)\nx = 100\nr = f(5)", '#') == true);
+  REQUIRE(script.evaluate(vs, ok) == 110);
+  REQUIRE(ok == true);
+  REQUIRE(script.interpret("h(a, b) = a-b\nk(b, a) = h(b, a)*10 + h(a, b)\nk(1, 3)", '#') == true);
+  REQUIRE(script.evaluate(vs, ok) == -20+2);
+
+  // Invalid definitions and calls
+  REQUIRE(script.interpret("f(a,a) = a\n1", '#') == false);
+  REQUIRE(script.statement(0).isValid == false);
+  REQUIRE(script.statement(1).isValid == true);
+  REQUIRE(script.interpret("f(1) = 2", '#') == false);
+  REQUIRE(script.interpret("f(a) = a+1\nf(1,2)", '#') == false);
+  REQUIRE(script.interpret("f(a) = f(a)+1\nf(1)", '#') == false);
+  REQUIRE(script.interpret("g(2)\ng(a) = a", '#') == false);
+  REQUIRE(script.interpret("f(a) = $0\nf(1)", '#') == false);
+}
+
+TEST_CASE("Lookup Tables") {
+  numhop::VariableStorage vs;
+  bool ok, external;
+
+  // Uniform and non-uniform breakpoints, clamped outside of the range
+  numhop::LookupTable uniform, curve;
+  const double uniformBreakpoints[] = {0, 0.5, 1, 1.5, 2};
+  const double uniformValues[] = {0, 1, 4, 9, 16};
+  REQUIRE(uniform.setData(std::vector<double>(uniformBreakpoints, uniformBreakpoints+5), std::vector<double>(uniformValues, uniformValues+5)) == true);
+  REQUIRE(uniform.isUniform(0) == true);
+  REQUIRE(uniform.lookup(0.25) == 0.5);
+  REQUIRE(uniform.lookup(1.5) == 9);
+  REQUIRE(uniform.lookup(1.75) == 12.5);
+  REQUIRE(uniform.lookup(-3) == 0);
+  REQUIRE(uniform.lookup(7) == 16);
+
+  const char csv[] = "# pump curve\n"
+                     "0, 10\n"
+                     "1, 8\r\n"
+                     "4; 2\n"
+                     "\n"
+                     "5.5, 0\n";
+  REQUIRE(curve.loadFromCsv(csv, sizeof(csv)-1) == true);
+  REQUIRE(curve.numDimensions() == 1);
+  REQUIRE(curve.isUniform(0) == false);
+  REQUIRE(curve.lookup(2.5) == 5);
+  REQUIRE(curve.lookup(4.75) == 1);
+  size_t segment = 2;
+  REQUIRE(curve.lookup(0.5, segment) == 9);
+  REQUIRE(segment == 0);
+
+  // Two dimensional tables interpolate bilinearly
+  numhop::LookupTable valve;
+  const char csv2[] = " , 0, 10, 20\n"
+                      "0, 0, 1, 2\n"
+                      "1, 10, 11, 12\n";
+  REQUIRE(valve.loadFromCsv(csv2, sizeof(csv2)-1) == true);
+  REQUIRE(valve.numDimensions() == 2);
+  REQUIRE(valve.lookup(0.5, 15) == Approx(6.5));
+
+  // Called from expressions as registered functions, also element-wise
+  REQUIRE(uniform.registerAs("square") >= 0);
+  REQUIRE(curve.registerAs("pump") >= 0);
+  REQUIRE(valve.registerAs("valve") >= 0);
+  vs.setVariable("x", 1.75, ok);
+  test_allok("square(x) + pump(4.75)*valve(x-1.25, 15)", 12.5+6.5, vs);
+  numhop::Expression e;
+  REQUIRE(numhop::interpretExpressionStringRecursive("pump(p) + valve(0.5, p*4)", e) == true);
+  std::vector<double> p, values;
+  for (size_t i=0; i<3000; ++i) {
+    p.push_back(double(i%700)/100.);
+  }
+  REQUIRE(vs.setArray("p", p, external) == true);
+  numhop::evaluateElementWise(e, vs, values, ok);
+  REQUIRE(ok == true);
+  REQUIRE(values.size() == p.size());
+  for (size_t i=0; i<p.size(); ++i) {
+    REQUIRE(values[i] == curve.lookup(p[i]) + valve.lookup(0.5, p[i]*4));
+  }
+
+  // Invalid data
+  const double decreasing[] = {0, 2, 1};
+  REQUIRE(curve.setData(std::vector<double>(decreasing, decreasing+3), std::vector<double>(3, 1.)) == false);
+  REQUIRE(curve.numDimensions() == 0);
+  REQUIRE(curve.setData(std::vector<double>(uniformBreakpoints, uniformBreakpoints+5), std::vector<double>(4, 1.)) == false);
+  REQUIRE(curve.loadFromCsv("0, 1\n1, x\n", 10) == false);
+  REQUIRE(curve.loadFromCsv("0, 1, 2\n", 8) == false);
+  REQUIRE(curve.loadFromCsvFile("no_such_table.csv") == false);
+  REQUIRE(curve.registerAs("empty") == -1);
+
+  // The tables go out of scope, replace the registered functions
+  numhop::registerFunction("square", &twice);
+  numhop::registerFunction("pump", &twice);
+  numhop::registerFunction("valve", &hypotenuse);
+}
+
+TEST_CASE("Tabulation") {
+  numhop::VariableStorage vs;
+  bool ok;
+  vs.setVariable("k", 0.5, ok);
+
+  // The approximation is within the error bound in the whole range
+  numhop::Expression e;
+  REQUIRE(numhop::interpretExpressionStringRecursive("exp(-k*T)*log(1+T^2) + pow(T, 1.5)/(1+sqrt(T))", e) == true);
+  numhop::TabulatedExpression table;
+  REQUIRE(table.tabulate(e, "T", 0.1, 5, 1e-9, vs) == true);
+  REQUIRE(table.isTabulated() == true);
+  REQUIRE(table.numSegments() > 1);
+  REQUIRE(table.maxObservedError() <= 1e-9);
+  REQUIRE(vs.hasVariableName("T") == false);
+  for (int i=0; i<=1000; ++i) {
+    const double T = 0.1 + 4.9*i/1000.;
+    vs.setVariable("T", T, ok);
+    const double exact = e.evaluate(vs, ok);
+    REQUIRE(std::fabs(table.approximate(T) - exact) <= 1e-8);
+    REQUIRE(std::fabs(table.evaluate(vs, ok) - exact) <= 1e-8);
+    REQUIRE(ok == true);
+  }
+
+  // Outside of the range the expression is evaluated
+  vs.setVariable("T", 7, ok);
+  REQUIRE(table.evaluate(vs, ok) == e.evaluate(vs, ok));
+
+  // The expression is evaluated while another variable differs from when tabulating
+  vs.setVariable("T", 2.5, ok);
+  vs.setVariable("k", 0.7, ok);
+  REQUIRE(table.evaluate(vs, ok) == e.evaluate(vs, ok));
+  REQUIRE(ok == true);
+  vs.setVariable("k", 0.5, ok);
+  REQUIRE(table.evaluate(vs, ok) == table.approximate(2.5));
+  REQUIRE(ok == true);
+  REQUIRE(table.measureSpeedup(vs, 1000) > 0);
+
+  // A polynomial of at most the segment degree is exact with one segment
+  REQUIRE(numhop::interpretExpressionStringRecursive("3*x^2-x+1", e) == true);
+  REQUIRE(table.tabulate(e, "x", -2, 2, 1e-12, vs, 2) == true);
+  REQUIRE(table.numSegments() == 1);
+  REQUIRE(table.approximate(1) == Approx(3));
+
+  // Expressions that can not be tabulated
+  REQUIRE(numhop::interpretExpressionStringRecursive("sqrt(x)", e) == true);
+  REQUIRE(table.tabulate(e, "x", -1, 1, 1e-6, vs) == false);
+  REQUIRE(table.isTabulated() == false);
+  REQUIRE(table.evaluate(vs, ok) == 0);
+  REQUIRE(ok == false);
+  REQUIRE(numhop::interpretExpressionStringRecursive("y = x*2", e) == true);
+  REQUIRE(table.tabulate(e, "x", 0, 1, 1e-6, vs) == false);
+  REQUIRE(numhop::interpretExpressionStringRecursive("x*undefined", e) == true);
+  REQUIRE(table.tabulate(e, "x", 0, 1, 1e-6, vs) == false);
+  REQUIRE(numhop::interpretExpressionStringRecursive("x*2", e) == true);
+  REQUIRE(table.tabulate(e, "x", 1, 0, 1e-6, vs) == false);
+  REQUIRE(table.tabulate(e, "x", 0, 1, 0, vs) == false);
+}
+
+//! @brief The error of an approximation in units in the last place of the reference value
+double ulpError(double value, long double reference)
+{
+  const double rounded = double(reference);
+  if (value == rounded || (value != value && rounded != rounded)) {
+    return 0;
+  }
+  int exponent;
+  std::frexp(rounded, &exponent);
+  return double(std::fabs((long double)(value) - reference) / std::ldexp(1.0L, std::max(exponent-53, -1074)));
+}
+
+TEST_CASE("Fast Math") {
+  // Error bounds, measured against long double on random values
+  struct FastFunction {
+    const char *name;
+    double (*pFast)(double);
+    long double (*pReference)(long double);
+    double lower, upper, maxUlp;
+  };
+  const FastFunction functions[] = {
+    {"exp", &numhop::fastExp, &std::exp, -745, 709, 1.5},
+    {"log", &numhop::fastLog, &std::log, 1e-300, 1e300, 2},
+    {"log", &numhop::fastLog, &std::log, 0.5, 2, 2},
+    {"log10", &numhop::fastLog10, &std::log10, 1e-10, 1e10, 3},
+    {"sin", &numhop::fastSin, &std::sin, -100, 100, 2},
+    {"sin", &numhop::fastSin, &std::sin, -1e5, 1e5, 3},
+    {"cos", &numhop::fastCos, &std::cos, -100, 100, 2},
+    {"cos", &numhop::fastCos, &std::cos, -1e5, 1e5, 3},
+    {"tanh", &numhop::fastTanh, &std::tanh, -25, 25, 4},
+    {"atan", &numhop::fastAtan, &std::atan, -50, 50, 3}};
+  unsigned long long state = 88172645463325252ULL;
+  for (size_t f=0; f<sizeof(functions)/sizeof(functions[0]); ++f) {
+    const FastFunction &function = functions[f];
+    INFO("Function: " << function.name << " [" << function.lower << ", " << function.upper << "]");
+    double maxError = 0;
+    for (int i=0; i<20000; ++i) {
+      const double position = double(nextRandom(state) >> 11)/9007199254740992.;
+      // Wide positive ranges are sampled uniformly in the exponent
+      const double x = (function.lower > 0) ? function.lower*std::pow(function.upper/function.lower, position)
+                                            : function.lower + (function.upper-function.lower)*position;
+      maxError = std::max(maxError, ulpError(function.pFast(x), function.pReference(x)));
+    }
+    REQUIRE(maxError <= function.maxUlp);
+  }
+  double maxError = 0;
+  for (int i=0; i<20000; ++i) {
+    const double y = double(nextRandom(state)%20001)/1000.-10;
+    const double x = double(nextRandom(state)%20001)/1000.-10;
+    maxError = std::max(maxError, ulpError(numhop::fastAtan2(y, x), std::atan2((long double)(y), (long double)(x))));
+  }
+  REQUIRE(maxError <= 4);
+  REQUIRE(numhop::fastExp(-1000) == 0);
+  REQUIRE(numhop::fastExp(1000) == std::numeric_limits<double>::infinity());
+  REQUIRE(numhop::fastLog(0) == -std::numeric_limits<double>::infinity());
+  REQUIRE(numhop::fastLog(-1) != numhop::fastLog(-1));
+  REQUIRE(numhop::fastSin(1e10) == std::sin(1e10));
+  REQUIRE(numhop::fastAtan2(0, -1) == std::atan2(0., -1.));
+
+  // Selected per variable storage, in all evaluation paths
+  numhop::VariableStorage accurate, fast;
+  bool ok, external;
+  fast.setFastMath(true);
+  REQUIRE(accurate.isFastMath() == false);
+  accurate.setVariable("x", 0.7, ok);
+  fast.setVariable("x", 0.7, ok);
+  numhop::Expression e;
+  REQUIRE(numhop::interpretExpressionStringRecursive("exp(x)*sin(x) + atan2(x, 2) - sqrt(x)", e) == true);
+  const double fastValue = numhop::fastExp(0.7)*numhop::fastSin(0.7) + numhop::fastAtan2(0.7, 2) - std::sqrt(0.7);
+  REQUIRE(e.evaluate(accurate, ok) == std::exp(0.7)*std::sin(0.7) + std::atan2(0.7, 2) - std::sqrt(0.7));
+  REQUIRE(e.evaluate(fast, ok) == fastValue);
+  numhop::PreparedExpression prepared;
+  REQUIRE(prepared.prepare(e, fast) == true);
+  REQUIRE(prepared.evaluate(ok) == fastValue);
+
+  std::vector<double> p, values;
+  for (int i=0; i<3000; ++i) {
+    p.push_back(double(i)/100.-15.);
+  }
+  REQUIRE(fast.setArray("p", p, external) == true);
+  REQUIRE(numhop::interpretExpressionStringRecursive("cos(p) + log(tanh(p)+2)", e) == true);
+  numhop::evaluateElementWise(e, fast, values, ok);
+  REQUIRE(ok == true);
+  for (size_t i=0; i<p.size(); ++i) {
+    REQUIRE(values[i] == numhop::fastCos(p[i]) + numhop::fastLog(numhop::fastTanh(p[i])+2));
+  }
+}
+
+TEST_CASE("CPU Dispatch") {
+  const numhop::SimdLevelT original = numhop::simdLevel();
+  const numhop::SimdLevelT detected = numhop::detectedSimdLevel();
+  REQUIRE(original <= detected);
+  REQUIRE(std::string(numhop::simdLevelName(numhop::GenericSimdT)) == "generic");
+  REQUIRE(std::string(numhop::simdLevelName(numhop::AVX512SimdT)) == "avx512");
+  if (detected < numhop::AVX512SimdT) {
+    REQUIRE(numhop::setSimdLevel(numhop::AVX512SimdT) == false);
+    REQUIRE(numhop::simdLevel() == original);
+  }
+
+  numhop::VariableStorage vs;
+  bool ok, external;
+  vs.setFastMath(true);
+  vs.setVariable("x", 0.3, ok);
+  std::vector<double> p, q, values;
+  for (int i=0; i<2500; ++i) {
+    p.push_back(double(i)/10.-125.);
+    q.push_back((i%7 == 0) ? 2e5 + i : double(i%31)/3.);
+  }
+  REQUIRE(vs.setArray("p", p, external) == true);
+  REQUIRE(vs.setArray("q", q, external) == true);
+
+  // Every level gives the same result as scalar evaluation
+  const char* elementWise[] = {"p+q-x", "x-p", "x/p+p/q", "p*x*q", "exp(p/10)+log(q)-log10(q+1)", "sin(q)*cos(p)", "tanh(p)+atan(q)"};
+  numhop::Expression e;
+  for (int level=numhop::GenericSimdT; level<=int(detected); ++level) {
+    INFO("Level: " << numhop::simdLevelName(numhop::SimdLevelT(level)));
+    REQUIRE(numhop::setSimdLevel(numhop::SimdLevelT(level)) == true);
+    REQUIRE(numhop::simdLevel() == numhop::SimdLevelT(level));
+    for (size_t k=0; k<sizeof(elementWise)/sizeof(elementWise[0]); ++k) {
+      INFO("Full expression: " << elementWise[k]);
+      REQUIRE(numhop::interpretExpressionStringRecursive(elementWise[k], e) == true);
+      numhop::evaluateElementWise(e, vs, values, ok);
+      REQUIRE(ok == true);
+      REQUIRE(values.size() == p.size());
+      numhop::VariableStorage scalarStorage;
+      scalarStorage.setFastMath(true);
+      scalarStorage.setVariable("x", 0.3, ok);
+      for (size_t i=0; i<p.size(); ++i) {
+        scalarStorage.setVariable("p", p[i], ok);
+        scalarStorage.setVariable("q", q[i], ok);
+        REQUIRE(sameResult(values[i], e.evaluate(scalarStorage, ok)));
+      }
+    }
+    numhop::fastSinArray(&q[0], q.size(), &values[0]);
+    for (size_t i=0; i<q.size(); ++i) {
+      REQUIRE(sameResult(values[i], numhop::fastSin(q[i])));
+    }
+  }
+  REQUIRE(numhop::setSimdLevel(original) == true);
+}
+
+TEST_CASE("Polynomial Rewriting") {
+  numhop::Expression e;
+  struct Rewrite {
+    const char *original, *rewritten;
+  };
+  Rewrite rewrites[] = {{"1+2*x+3*x^2+4*x^3", "1+x*(2+x*(3+x*4))"},
+                        {"y=2*(a+x*b-x^2)", "y=2*(a+x*(b-x))"},
+                        {"1-x^2/2+x^4/24", "1+x^2*(-1/2+x^2*1/24)"},
+                        {"sin(a)*x^3+x^5+cos(x)", "x^3*(sin(a)+x^2)+cos(x)"},
+                        {"1+x+x^2+x^3+x^4+x^5+x^6+x^7+x^8", "1+x+x^2*(1+x)+x^4*(1+x+x^2*(1+x))+x^8"}};
+  for (size_t k=0; k<sizeof(rewrites)/sizeof(rewrites[0]); ++k) {
+    INFO("Full expression: " << rewrites[k].original);
+    REQUIRE(numhop::interpretExpressionStringRecursive(rewrites[k].original, e) == true);
+    REQUIRE(e.rewritePolynomials() == 1);
+    REQUIRE(e.print() == rewrites[k].rewritten);
+    REQUIRE(e.rewritePolynomials() == 0);
+  }
+
+  // Not worth rewriting
+  const char* unchanged[] = {"a0+a1*x", "1+x^2", "x^2+y^2", "x^2/x+x", "1+x*(2+x*3)", "x^0.5+x^2"};
+  for (size_t k=0; k<sizeof(unchanged)/sizeof(unchanged[0]); ++k) {
+    INFO("Full expression: " << unchanged[k]);
+    REQUIRE(numhop::interpretExpressionStringRecursive(unchanged[k], e) == true);
+    const std::string printed = e.print();
+    REQUIRE(e.rewritePolynomials() == 0);
+    REQUIRE(e.print() == printed);
+  }
+
+  // Invalid expressions stay invalid
+  REQUIRE(numhop::interpretExpressionStringRecursive("2-x^2*-3+x^3", e) == false);
+  REQUIRE(e.rewritePolynomials() == 0);
+  REQUIRE(e.isValid() == false);
+
+  // Terms with side effects keep their order
+  const char* impure[] = {"(x=3)+x^2+x", "x^2+(x=3)+x", "x^2+if(x>0,(x=5),0)+x", "(a=2)*x^3+a*x^2+1"};
+  for (size_t k=0; k<sizeof(impure)/sizeof(impure[0]); ++k) {
+    INFO("Full expression: " << impure[k]);
+    REQUIRE(numhop::interpretExpressionStringRecursive(impure[k], e) == true);
+    const std::string printed = e.print();
+    REQUIRE(e.rewritePolynomials() == 0);
+    REQUIRE(e.print() == printed);
+  }
+
+  // The values differ by rounding only
+  numhop::VariableStorage vs;
+  bool ok;
+  vs.setVariable("a", 0.25, ok);
+  vs.setVariable("b", -1.5, ok);
+  numhop::Script original, rewritten;
+  const char* polynomials = "p1 = 0.5-a*x+x^2*b-3.25*x^3\n"
+                            "p2 = 1+x+x^2/2+x^3/6+x^4/24+x^5/120+x^6/720+x^7/5040+x^8/40320+x^9/362880\n"
+                            "p3 = p1*p2-(x^4-2*x^2+1)";
+  REQUIRE(original.interpret(polynomials, '#') == true);
+  REQUIRE(rewritten.interpret(polynomials, '#') == true);
+  REQUIRE(rewritten.rewritePolynomials() == 3);
+  numhop::Expression p3 = rewritten.statement(2).expression;
+  REQUIRE(p3.print() == "p3=p1*p2-(1+x^2*(-2+x^2))");
+  rewritten.reduceStrength();
+  for (double x=-3.; x<=3.; x+=0.125) {
+    vs.setVariable("x", x, ok);
+    const double expected = original.evaluate(vs, ok);
+    const double p1 = vs.value("p1", ok), p2 = vs.value("p2", ok);
+    REQUIRE(rewritten.evaluate(vs, ok) == Approx(expected).epsilon(1e-12).margin(1e-12));
+    REQUIRE(ok == true);
+    REQUIRE(vs.value("p1", ok) == Approx(p1).epsilon(1e-12).margin(1e-12));
+    REQUIRE(vs.value("p2", ok) == Approx(p2).epsilon(1e-12));
+  }
+}
+
+TEST_CASE("Chain Reassociation") {
+  numhop::VariableStorage vs;
+  bool ok;
+  std::string sum, product;
+  for (int i=0; i<200; ++i) {
+    char name[16];
+    std::sprintf(name, "v%d", i);
+    vs.setVariable(name, std::sin(double(i))*100., ok);
+    sum += (i%3 == 2) ? "-" : "+";
+    sum += name;
+    product += (i == 0) ? "" : "*";
+    product += (i%2) ? "(1+" + std::string(name) + "/1000)" : "1.001";
+  }
+  numhop::Expression e;
+  const char* chains[] = {sum.c_str(), product.c_str()};
+  for (size_t k=0; k<2; ++k) {
+    REQUIRE(numhop::interpretExpressionStringRecursive(chains[k], e) == true);
+    const double sequential = e.evaluate(vs, ok);
+    REQUIRE(e.reassociateChains(numhop::ReassociatedChainT) == 1);
+    const double reassociated = e.evaluate(vs, ok);
+    REQUIRE(reassociated == Approx(sequential).epsilon(1e-12));
+    REQUIRE(ok == true);
+    numhop::JitExpression jit;
+    REQUIRE(jit.compile(e, vs) == numhop::JitExpression::isSupported());
+    REQUIRE(jit.evaluate(vs, ok) == reassociated);
+    REQUIRE(e.reassociateChains(numhop::CompensatedChainT) == 1);
+    REQUIRE(e.evaluate(vs, ok) == Approx(sequential).epsilon(1e-12));
+    jit.compile(e, vs);
+    REQUIRE(jit.evaluate(vs, ok) == e.evaluate(vs, ok));
+    REQUIRE(e.reassociateChains(numhop::SequentialChainT) == 0);
+    REQUIRE(e.evaluate(vs, ok) == sequential);
+  }
+
+  // Short chains, and chains mixing operators, are evaluated from left to right
+  REQUIRE(numhop::interpretExpressionStringRecursive("a+b+c", e) == true);
+  REQUIRE(e.reassociateChains(numhop::ReassociatedChainT) == 0);
+  REQUIRE(numhop::interpretExpressionStringRecursive("v1*v2*v3/v4*v5*v6*v7*v8*v9", e) == true);
+  REQUIRE(e.reassociateChains(numhop::ReassociatedChainT, 2) == 0);
+
+  // Compensated summation keeps terms that cancel
+  REQUIRE(numhop::interpretExpressionStringRecursive("y = 1e100+1-1e100+1e-3-(2+1e-3)+3", e) == true);
+  REQUIRE(e.evaluate(vs, ok) == 1.);
+  REQUIRE(e.reassociateChains(numhop::CompensatedChainT, 2) == 2);
+  REQUIRE(e.evaluate(vs, ok) == 2.);
+  REQUIRE(vs.value("y", ok) == 2.);
+
+  // Infinite sums stay infinite, also when nested deeper than the recursive evaluation
+  std::string infinite = "1e308+1e308+1-2";
+  for (int i=0; i<2; ++i) {
+    REQUIRE(numhop::interpretExpressionStringRecursive(infinite, e) == true);
+    REQUIRE(e.reassociateChains(numhop::CompensatedChainT, 2) > 0);
+    REQUIRE(e.evaluate(vs, ok) == std::numeric_limits<double>::infinity());
+    REQUIRE(ok == true);
+    for (int j=0; j<100; ++j) {
+      infinite = "1+(" + infinite + ")";
+    }
+  }
+
+  // Failing terms are reported
+  REQUIRE(numhop::interpretExpressionStringRecursive("v1+v2+undefined+v3", e) == true);
+  REQUIRE(e.reassociateChains(numhop::ReassociatedChainT, 2) == 1);
+  e.evaluate(vs, ok);
+  REQUIRE(ok == false);
+
+  numhop::Script script;
+  REQUIRE(script.interpret("s = " + sum + "\np = " + product + "\ns+p", '#') == true);
+  const double sequential = script.evaluate(vs, ok);
+  REQUIRE(script.reassociateChains(numhop::CompensatedChainT) == 2);
+  REQUIRE(script.evaluate(vs, ok) == Approx(sequential).epsilon(1e-12));
+}
+
+TEST_CASE("Dead Statement Elimination") {
+  numhop::Script script;
+  REQUIRE(script.interpret("t1 = x*2\n"
+                           "t2 = t1+1\n"
+                           "unused = t2*100\n"
+                           "a = t2*3\n"
+                           "b = (c=x+1)^2\n"
+                           "t1 = 5\n"
+                           "d = c+t1\n"
+                           "x+1000", '#') == true);
+  std::vector<std::string> outputs;
+  outputs.push_back("a");
+  std::vector<size_t> required = script.requiredStatements(outputs);
+  REQUIRE(required.size() == 3);
+  REQUIRE(required[0] == 0);
+  REQUIRE(required[1] == 1);
+  REQUIRE(required[2] == 3);
+
+  numhop::VariableStorage vs;
+  bool ok;
+  vs.setVariable("x", 2, ok);
+  REQUIRE(script.evaluateOutputs(outputs, vs, ok) == Approx(15));
+  REQUIRE(ok == true);
+  REQUIRE(vs.value("a", ok) == Approx(15));
+  vs.value("unused", ok);
+  REQUIRE(ok == false);
+
+  // The nested assignment of c is needed by d, the later assignment of t1 hides the first one
+  outputs.push_back("d");
+  required = script.requiredStatements(outputs);
+  REQUIRE(required.size() == 6);
+  REQUIRE(required[4] == 5);
+  REQUIRE(required[5] == 6);
+  REQUIRE(script.evaluateOutputs(outputs, vs, ok) == Approx(8));
+  REQUIRE(ok == true);
+  REQUIRE(script.requiredStatements(std::vector<std::string>()).empty());
+
+  // Invalid statements are kept so that evaluation fails as with evaluate
+  REQUIRE(script.interpret("a = x*2\nb = 1+\nc = 3", '#') == false);
+  outputs.assign(1, "a");
+  required = script.requiredStatements(outputs);
+  REQUIRE(required.size() == 2);
+  script.evaluateOutputs(outputs, vs, ok);
+  REQUIRE(ok == false);
+}
+
+TEST_CASE("Lazy Parsing") {
+  const std::string text = "sq(v) = v*v\n"
+                           "t = sq(x)+1\n"
+                           "unused = t*100 # disabled subsystem\n"
+                           "a = t*3\n"
+                           "b = 2*x+1e-3\n"
+                           "a+b";
+  numhop::Script eager, lazy;
+  REQUIRE(eager.interpret(text, '#') == true);
+  REQUIRE(lazy.interpretLazily(text, '#') == true);
+  REQUIRE(lazy.numStatements() == 5);
+  REQUIRE(lazy.numParsedStatements() == 0);
+
+  numhop::VariableStorage vs;
+  bool ok;
+  vs.setVariable("x", 2, ok);
+  std::vector<std::string> outputs(1, "b");
+  REQUIRE(lazy.evaluateOutputs(outputs, vs, ok) == Approx(4.001));
+  REQUIRE(ok == true);
+  REQUIRE(lazy.numParsedStatements() == 1);
+  REQUIRE(lazy.statement(1).isValid == true);
+  REQUIRE(lazy.numParsedStatements() == 2);
+  REQUIRE(lazy.evaluate(vs, ok) == eager.evaluate(vs, ok));
+  REQUIRE(ok == true);
+  REQUIRE(lazy.numParsedStatements() == 5);
+
+  // Some errors are found when splitting, the rest when parsed
+  REQUIRE(lazy.interpretLazily("a = x+1\nb = 2*", '#') == false);
+  REQUIRE(lazy.numParsedStatements() == 0);
+  REQUIRE(lazy.statement(1).isValid == false);
+  REQUIRE(lazy.interpretLazily("a = x+1\nb = 2*/x", '#') == true);
+  REQUIRE(lazy.parseStatements() == false);
+  REQUIRE(lazy.isValid() == false);
+  REQUIRE(lazy.statement(0).isValid == true);
+  REQUIRE(lazy.statement(1).isValid == false);
+  REQUIRE(lazy.interpretLazily("a = x+1\nb = 2*/x", '#') == true);
+  lazy.evaluate(vs, ok);
+  REQUIRE(ok == false);
+  REQUIRE(lazy.isValid() == false);
+}
+
+TEST_CASE("Incremental Update") {
+  const std::string text = "a = x*2\n"
+                           "b = a+1 # comment\n"
+                           "c = b*b\n"
+                           "c+a";
+  numhop::Script script, fresh;
+  numhop::VariableStorage vs;
+  bool ok;
+  vs.setVariable("x", 3, ok);
+  REQUIRE(script.interpret(text, '#') == true);
+  REQUIRE(script.update(text) == true);
+  REQUIRE(script.numReusedStatements() == 4);
+
+  // Only the edited line is parsed again, the statements after it are moved
+  std::string edited = "a = x*2\n"
+                       "b = a+2 # comment\n"
+                       "c = b*b\n"
+                       "c+a";
+  REQUIRE(script.update(edited) == true);
+  REQUIRE(script.numReusedStatements() == 3);
+  REQUIRE(fresh.interpret(edited, '#') == true);
+  REQUIRE(script.evaluate(vs, ok) == fresh.evaluate(vs, ok));
+
+  // Inserted and removed lines, and edited comments
+  edited = "a = x*2\n"
+           "  # new comment\n"
+           "d = a-1\n"
+           "b = a+2 # edited comment\n"
+           "c = b*b\n"
+           "c+a+d";
+  REQUIRE(script.update(edited) == true);
+  REQUIRE(script.numReusedStatements() == 3);
+  REQUIRE(fresh.interpret(edited, '#') == true);
+  REQUIRE(script.numStatements() == fresh.numStatements());
+  for (size_t i=0; i<script.numStatements(); ++i) {
+    REQUIRE(script.statementString(i) == fresh.statementString(i));
+    REQUIRE(script.statement(i).lineNumber == fresh.statement(i).lineNumber);
+  }
+  REQUIRE(script.evaluate(vs, ok) == fresh.evaluate(vs, ok));
+  REQUIRE(script.update("a = x*2\nc+a") == true);
+  REQUIRE(script.numReusedStatements() == 1);
+  REQUIRE(script.numStatements() == 2);
+  REQUIRE(script.evaluate(vs, ok) == Approx(64+6));
+  REQUIRE(script.update("a = x*2\nc+") == false);
+  REQUIRE(script.statement(1).isValid == false);
+
+  // Editing a script function parses the statements calling it again
+  const std::string functions = "f(v) = v*2\n"
+                                "a = f(x)\n"
+                                "b = x+1";
+  REQUIRE(script.interpret(functions, '#') == true);
+  REQUIRE(script.update("f(v) = v*3\na = f(x)\nb = x+1") == true);
+  REQUIRE(script.numReusedStatements() == 1);
+  REQUIRE(script.evaluate(vs, ok) == Approx(4));
+  REQUIRE(vs.value("a", ok) == Approx(9));
+
+  // A lazily interpreted script stays lazy
+  REQUIRE(script.interpretLazily(text, '#') == true);
+  REQUIRE(script.update(text + "\nd = 1") == true);
+  REQUIRE(script.numParsedStatements() == 0);
+}
+
 TEST_CASE("Expressions that should fail") {
   numhop::VariableStorage vs;
 